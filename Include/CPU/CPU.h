@@ -8,6 +8,9 @@
 #ifndef CPU_H
 #define CPU_H
 
+// Line size on every x86_64 part we run on; the unit false sharing works in
+#define CACHE_LINE_SIZE 64
+
 namespace CPU {
 	void CPUDetect();
 		void IntelHandler();
@@ -12,4 +12,5 @@ namespace CPU {
 	char *Model();
 }
 
-#define cpuid(in, a, b, c, d) __asm__ __volatile__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(in));
\ No newline at end of file
+#define cpuid(in, a, b, c, d) __asm__ __volatile__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(in));
+#define cpuid_count(in, sub, a, b, c, d) __asm__ __volatile__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(in), "2"(sub));
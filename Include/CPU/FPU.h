@@ -0,0 +1,48 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: FPU.h
+// Purpose: x87/SSE/AVX state management for kernel SIMD sections
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+// How many kernel_fpu_begin() sections may be live at once, e.g. a
+// section interrupted by an IRQ handler that opens its own
+#define FPU_MAX_NESTING 4
+
+// Largest XSAVE image we keep room for. Components that would need more
+// (AMX tile data) are left disabled in XCR0.
+#define FPU_MAX_STATE_SIZE 4096
+
+namespace FPU {
+	// Sets CR0/CR4 (and XCR0 when XSAVE is there) so SSE/AVX can be used,
+	// and sizes the save area from CPUID leaf 0xD
+	bool Initialize();
+	bool IsInitialized();
+
+	// Gives an AP the control register and XCR0 setup the BSP picked
+	void InitializeAP();
+
+	// Size of one saved extended state image in bytes
+	uint32_t GetStateSize();
+
+	// XCR0 feature mask being saved/restored, x87|SSE when XSAVE is missing
+	uint64_t GetEnabledFeatures();
+	bool HasXSAVE();
+	bool HasAVX();
+	bool HasAVX512();
+}
+
+// Brackets kernel code that touches x87/SSE/AVX registers. Whatever state
+// was live is saved on begin and restored on end, so sections can nest
+// (up to FPU_MAX_NESTING deep per CPU) and may be used from interrupt
+// handlers. Sections use per-CPU save areas and hold off preemption.
+// Only code in translation units built with SIMD flags (*_SSE42.cpp,
+// *_AVX2.cpp) may run inside a section; everything else is compiled with
+// -mgeneral-regs-only and never touches these registers.
+void kernel_fpu_begin();
+void kernel_fpu_end();
@@ -0,0 +1,78 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Features.hpp
+// Purpose: CPU feature bits and topology, read once from CPUID
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+#define CPU_MAX_CACHES          8
+
+namespace CPU {
+	// Bit numbers in the set DetectFeatures fills in, not CPUID's own
+	enum class Feature : uint32_t {
+		ERMS,           // rep movsb/stosb are fast
+		FSRM,           // ... from the first byte
+		AVX,
+		AVX2,
+		AVX512F,
+		X2APIC,
+		PCID,
+		INVPCID,
+		TSCDeadline,    // the APIC timer takes a TSC deadline
+		InvariantTSC,   // TSC rate doesn't change with P- or C-states
+		Pages1G,
+		Monitor,        // MONITOR/MWAIT
+		ARAT,           // APIC timer keeps running in deep C-states
+		XSAVE,
+		Hypervisor,
+		Count
+	};
+
+	static_assert((uint32_t)Feature::Count <= 64, "CPU features outgrew the bitset");
+
+	typedef struct {
+		uint8_t level;
+		char type;                  // 'D'ata, 'I'nstruction or 'U'nified
+		uint16_t lineSize;
+		uint32_t ways;
+		uint32_t size;              // bytes
+		uint32_t shareShift;        // CPUs whose APIC IDs agree above this share it
+	} CacheInfo;
+
+	// How the boot CPU splits an APIC ID: the SMT thread in the low
+	// smtShift bits, the core above that up to packageShift, the package
+	// above that. Every CPU in the system splits it the same way.
+	typedef struct {
+		uint32_t smtShift;
+		uint32_t packageShift;
+		const char* source;         // leaf the shifts came from
+		uint32_t cacheCount;
+		CacheInfo caches[CPU_MAX_CACHES];
+	} Topology;
+
+	// Reads the feature bits, topology leaves and caches on the boot CPU.
+	// First thing in CPUDetect, before anything asks.
+	void DetectFeatures();
+
+	uint64_t GetFeatures();
+
+	static inline bool Has(Feature feature) {
+		return GetFeatures() & (1ULL << (uint32_t)feature);
+	}
+
+	const Topology* GetTopology();
+
+	// Splits an APIC ID along GetTopology's shifts
+	void Locate(uint32_t apicId, uint32_t* package, uint32_t* core, uint32_t* thread);
+
+	// Size of the data or unified cache at `level`, 0 if CPUID doesn't say
+	uint32_t GetCacheSize(uint32_t level);
+
+	void PrintFeatures();
+	void PrintTopology();
+}
@@ -21,8 +21,10 @@
 			unsigned char base, access, granularity, baseHigh;
 		} __attribute__((packed));
 
+		// User data sits below user code, SYSRET loads SS and CS from
+		// consecutive slots in that order
 		struct Table {
-			GDT::Entry null, code, data, userspaceCode, userspaceData;
+			GDT::Entry null, code, data, userspaceData, userspaceCode;
 		} __attribute__((packed))
 		__attribute((aligned(0x1000)));
 	}
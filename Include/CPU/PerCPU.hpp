@@ -0,0 +1,130 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: PerCPU.hpp
+// Purpose: Per-CPU data areas reached through GS
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Interrupts/Syscall.hpp>
+
+// Each CPU's area is mapped here, one after another with an unmapped page
+// in between
+#define PERCPU_BASE           0x60000000000ULL
+
+// Room for PerCPU::Area in front of each copy of .percpu. A multiple of
+// 64 so the copies keep the alignment the variables were linked with, and
+// the same as the gap in front of _PerCPUStart in linker.ld.
+#define PERCPU_HEADER_SIZE    128
+
+// Variables defined this way are a template: the linked copy is never
+// used directly, every CPU gets its own through this_cpu_ptr() and friends
+#define DEFINE_PER_CPU(type, name) __attribute__((section(".percpu"))) type name
+#define DECLARE_PER_CPU(type, name) extern type name
+
+extern "C" char _PerCPUBoot[], _PerCPUStart[], _PerCPUEnd[];
+
+namespace Scheduler {
+	struct Thread;
+}
+
+namespace PerCPU {
+	// Start of every area, GS_BASE points here while in the kernel
+	typedef struct Area {
+		SyscallCPU syscall;     // gs:0, SyscallEntry.s hardcodes these offsets
+		struct Area* self;      // lets this_cpu() turn GS into a pointer
+		uint64_t offset;        // add to a .percpu symbol's address for this CPU's copy
+		uint32_t index;         // same as the SMP CPU table index
+		volatile uint32_t preemptCount;
+		volatile uint32_t needResched;
+		volatile uint32_t idlePolling;      // asleep watching needResched, see Sched/Idle.hpp
+		Scheduler::Thread* current;
+		volatile uint32_t irqDepth;         // interrupt handlers running
+		volatile uint32_t inSoftirq;
+		volatile uint32_t softirqPending;   // bit per softirq, only this CPU touches it
+		volatile uint64_t rcuQs;            // quiescent states passed, see Sync/RCU.hpp
+	} Area;
+
+	// Points GS at the template itself, with its header room in front, so
+	// preempt_disable() and spinlocks work from the start of boot. Per-CPU
+	// variables written before Initialize end up in every CPU's copy.
+	void EarlyInitialize();
+
+	// Moves the boot CPU onto its own area and points GS at it. Needs paging.
+	bool Initialize();
+
+	// Maps and fills the area for CPU `index`, for SMP before it starts an AP
+	Area* Allocate(uint32_t index);
+
+	// Points GS_BASE at CPU `index`'s area, KERNEL_GS_BASE at the user's
+	// (nothing yet). Loading a segment selector into GS clears the base, so
+	// this comes after every LoadGDT.
+	void Load(uint32_t index);
+
+	bool IsInitialized();
+
+	// One past the highest CPU index with an area; Get is null for holes
+	uint32_t GetCount();
+	Area* Get(uint32_t index);
+
+	// Has every online CPU count an IPI into its own copy, then times
+	// per-CPU increments against locked ones
+	bool SelfTest();
+}
+
+static_assert(sizeof(PerCPU::Area) <= PERCPU_HEADER_SIZE, "PerCPU::Area outgrew PERCPU_HEADER_SIZE");
+
+static inline PerCPU::Area* this_cpu() {
+	PerCPU::Area* area;
+	asm volatile("mov %%gs:%c1, %0" : "=r"(area) : "i"(__builtin_offsetof(PerCPU::Area, self)));
+	return area;
+}
+
+static inline uint32_t this_cpu_id() {
+	uint32_t index;
+	asm volatile("movl %%gs:%c1, %0" : "=r"(index) : "i"(__builtin_offsetof(PerCPU::Area, index)));
+	return index;
+}
+
+template<typename T> static inline T* this_cpu_ptr(T* var) {
+	uint64_t offset;
+	asm volatile("mov %%gs:%c1, %0" : "=r"(offset) : "i"(__builtin_offsetof(PerCPU::Area, offset)));
+	return (T*)((uint8_t*)var + offset);
+}
+
+template<typename T> static inline T* per_cpu_ptr(T* var, uint32_t cpu) {
+	return (T*)((uint8_t*)var + PerCPU::Get(cpu)->offset);
+}
+
+// Where a .percpu variable sits relative to GS
+static inline uint64_t PerCPUDisplacement(const void* var) {
+	return PERCPU_HEADER_SIZE + (uint64_t)((const char*)var - _PerCPUStart);
+}
+
+// Counters: one gs-relative read-modify-write instruction, so an interrupt
+// can't split it and no other CPU touches the copy. No lock prefix, no cli.
+static inline void this_cpu_add(uint64_t& var, uint64_t value) {
+	asm volatile("addq %1, %%gs:(%0)" :: "r"(PerCPUDisplacement(&var)), "r"(value) : "memory", "cc");
+}
+
+static inline void this_cpu_inc(uint64_t& var) {
+	asm volatile("incq %%gs:(%0)" :: "r"(PerCPUDisplacement(&var)) : "memory", "cc");
+}
+
+static inline uint64_t this_cpu_read(uint64_t& var) {
+	uint64_t value;
+	asm volatile("movq %%gs:(%1), %0" : "=r"(value) : "r"(PerCPUDisplacement(&var)) : "memory");
+	return value;
+}
+
+// Totals every CPU's copy. Not a snapshot, the others keep counting.
+static inline uint64_t per_cpu_sum(uint64_t& var) {
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < PerCPU::GetCount(); i++) {
+		if (PerCPU::Get(i)) sum += *(volatile uint64_t*)per_cpu_ptr(&var, i);
+	}
+	return sum;
+}
@@ -0,0 +1,53 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: SMP.hpp
+// Purpose: Application processor bring-up and the CPU table
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+#define SMP_MAX_CPUS          64
+
+// Where the AP startup code is copied, must match Trampoline.s. Page
+// aligned, below 1MB and inside the low memory Memory never hands out.
+#define SMP_TRAMPOLINE_BASE   0x8000
+
+// Per-AP kernel stacks, mapped below an unmapped guard page each
+#define SMP_STACK_BASE        0x50000000000ULL
+#define SMP_STACK_SIZE        0x4000
+
+namespace SMP {
+	typedef struct {
+		uint32_t index;             // position in the CPU table, BSP is 0
+		uint32_t apicId;
+		uint32_t acpiId;
+		bool bsp;
+		volatile bool online;
+		uint64_t stackTop;
+
+		// From the APIC ID, see CPU/Features.hpp
+		uint32_t package;
+		uint32_t core;              // within the package
+		uint32_t thread;            // within the core
+		uint64_t siblings;          // bit per index: other threads of this core
+		uint64_t cacheMask;         // bit per index: CPUs sharing the last-level cache, this one too
+	} CPUInfo;
+
+	// Reads the enabled processors from the MADT and starts every AP with
+	// INIT-SIPI-SIPI, one at a time. Needs the final GDT, the IDT, the
+	// local APIC and a clocksource for the delays.
+	bool Initialize();
+
+	uint32_t GetCPUCount();
+	uint32_t GetOnlineCount();
+	CPUInfo* GetCPU(uint32_t index);
+
+	// Table entry for the CPU this runs on, through its per-CPU area
+	CPUInfo* Current();
+
+	void PrintCPUs();
+}
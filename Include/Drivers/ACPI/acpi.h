@@ -145,6 +145,78 @@ namespace ACPI {
         uint8_t page_protection;
     } __attribute__((packed));
 
+    // Multiple APIC Description Table ("APIC"), a list of variable length
+    // entries follows the fixed part
+    #define MADT_LOCAL_APIC             0
+    #define MADT_IO_APIC                1
+    #define MADT_INTERRUPT_OVERRIDE     2
+    #define MADT_NMI_SOURCE             3
+    #define MADT_LOCAL_APIC_NMI         4
+    #define MADT_LOCAL_APIC_OVERRIDE    5
+    #define MADT_LOCAL_X2APIC           9
+
+    // MPS INTI flags on overrides and NMI sources
+    #define MADT_POLARITY_MASK          0x3
+    #define MADT_POLARITY_HIGH          0x1
+    #define MADT_POLARITY_LOW           0x3
+    #define MADT_TRIGGER_MASK           0xC
+    #define MADT_TRIGGER_EDGE           0x4
+    #define MADT_TRIGGER_LEVEL          0xC
+
+    struct MADT {
+        ACPISDTHeader header;
+        uint32_t LocalAPICAddress;
+        uint32_t Flags;             // bit 0: 8259 PICs present
+    } __attribute__((packed));
+
+    struct MADTEntry {
+        uint8_t Type;
+        uint8_t Length;
+    } __attribute__((packed));
+
+    struct MADTLocalAPIC {
+        MADTEntry header;
+        uint8_t ProcessorID;
+        uint8_t APICID;
+        uint32_t Flags;             // bit 0: enabled, bit 1: online capable
+    } __attribute__((packed));
+
+    struct MADTIOAPIC {
+        MADTEntry header;
+        uint8_t IOAPICID;
+        uint8_t Reserved;
+        uint32_t Address;
+        uint32_t GSIBase;
+    } __attribute__((packed));
+
+    struct MADTInterruptOverride {
+        MADTEntry header;
+        uint8_t Bus;                // always 0, ISA
+        uint8_t Source;             // ISA IRQ
+        uint32_t GSI;
+        uint16_t Flags;
+    } __attribute__((packed));
+
+    struct MADTNMISource {
+        MADTEntry header;
+        uint16_t Flags;
+        uint32_t GSI;
+    } __attribute__((packed));
+
+    struct MADTLocalAPICOverride {
+        MADTEntry header;
+        uint16_t Reserved;
+        uint64_t Address;
+    } __attribute__((packed));
+
+    struct MADTLocalX2APIC {
+        MADTEntry header;
+        uint16_t Reserved;
+        uint32_t X2APICID;
+        uint32_t Flags;
+        uint32_t ProcessorUID;
+    } __attribute__((packed));
+
     // Add function to find ACPI tables by signature
     void* FindTable(const char* signature);
 }
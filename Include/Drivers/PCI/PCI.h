@@ -24,6 +24,9 @@ namespace PCI {
 	// EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL
 
 	uint16_t read_word(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset);
+	uint32_t read_dword(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset);
+	void write_word(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset, uint16_t value);
+	void write_dword(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset, uint32_t value);
 
 	uint16_t get_vendor_id(uint16_t bus, uint16_t dev, uint16_t func);
 	uint16_t get_device_id(uint16_t bus, uint16_t dev, uint16_t func);
@@ -54,4 +57,60 @@ namespace PCI {
 	#define PCI_NUM_DRIVERS (sizeof(drivers) / sizeof(struct pci_driver *))
 
 	void load_pci_drivers(PCI::pci_device_t* pci_device);
+
+	// Capability IDs
+	#define PCI_CAP_MSI          0x05
+	#define PCI_CAP_PCIE         0x10
+	#define PCI_CAP_MSIX         0x11
+
+	// Offset of the first capability with `cap_id` after `start` (0 to
+	// search from the head of the list), 0 if the device has none
+	uint8_t find_capability(uint16_t bus, uint16_t dev, uint16_t func, uint8_t cap_id, uint8_t start = 0);
+
+	// Vectors one device can hold, MSI tops out at 32 anyway
+	#define PCI_MAX_IRQ_VECTORS  32
+
+	// Which mechanisms alloc_irq_vectors may use, tried MSI-X first
+	#define PCI_IRQ_INTX         (1 << 0)
+	#define PCI_IRQ_MSI          (1 << 1)
+	#define PCI_IRQ_MSIX         (1 << 2)
+	#define PCI_IRQ_ALL          (PCI_IRQ_INTX | PCI_IRQ_MSI | PCI_IRQ_MSIX)
+
+	enum class irq_type : uint8_t {
+		none,
+		intx,
+		msi,
+		msix
+	};
+
+	typedef struct {
+		uint16_t bus, dev, func;
+		irq_type type;
+		uint8_t cap;                    // MSI/MSI-X capability offset
+		uint16_t count;
+		uint8_t vectors[PCI_MAX_IRQ_VECTORS];
+		uint32_t gsi;                   // INTx only
+		volatile uint32_t* msix_table;
+	} pci_irq_vectors_t;
+
+	// Gives the device between `min` and `max` interrupt vectors, all aimed
+	// at the calling CPU, or the first one with an APIC ID below 256 if
+	// it's beyond that, and returns how many (negative on failure). Vector
+	// i is out->vectors[i]; register handlers on them with Interrupts. INTx
+	// gives a single, possibly shared, vector.
+	int alloc_irq_vectors(uint16_t bus, uint16_t dev, uint16_t func, uint16_t min, uint16_t max,
+		uint32_t flags, pci_irq_vectors_t* out);
+	void free_irq_vectors(pci_irq_vectors_t* irqs);
+
+	// Retargets vector `index` at another CPU. MSI has one address for all
+	// its vectors, so there this moves every one of them. Fails for APIC
+	// IDs above 255.
+	bool set_irq_affinity(pci_irq_vectors_t* irqs, uint16_t index, uint32_t apic_id);
+
+	// Per-vector masking, MSI-X only
+	void mask_irq(pci_irq_vectors_t* irqs, uint16_t index);
+	void unmask_irq(pci_irq_vectors_t* irqs, uint16_t index);
+
+	// Lists every device with its MSI/MSI-X capabilities
+	void print_irq_capabilities();
 }
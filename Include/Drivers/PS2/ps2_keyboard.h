@@ -2,6 +2,9 @@
 #define DRIVERS_PS2_PS2_KEYBOARD_H
 
 namespace PS2 {
+	// Scancodes by IRQ 1 from here on; readKey sleeps for one instead of
+	// polling the controller
+	bool enableKeyboardIRQ();
 	uint8_t readKey();
 }
 
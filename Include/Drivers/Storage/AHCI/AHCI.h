@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Inferno/stdint.h>
+#include <Sched/Async.hpp>
 
 // Filesystem type definitions
 #define FS_TYPE_UNKNOWN 0
@@ -397,6 +398,19 @@ int ahci_port_init(int port_num);
 int ahci_identify_device(int port_num);
 int ahci_read_sectors(int port_num, uint64_t start, uint32_t count, void* buffer);
 int ahci_write_sectors(int port_num, uint64_t start, uint32_t count, const void* buffer);
+
+// Called once a submitted command is done, with 0 or an error code like
+// ahci_read_sectors returns. Usually from the completion tasklet.
+typedef void (*ahci_callback_t)(void* context, int status);
+
+// Returns without waiting and calls back when the read is done. Nonzero
+// if it couldn't be submitted, and then there's no callback. The buffer
+// has to stay put until then. No timeout yet: a command the HBA never
+// finishes never calls back.
+int ahci_submit_read(int port_num, uint64_t start, uint32_t count, void* buffer, ahci_callback_t callback, void* context);
+
+// The same awaited from a task, for the status
+Async::Task<int> ahci_read_sectors_async(int port_num, uint64_t start, uint32_t count, void* buffer);
 ahci_device_t* ahci_get_device_info(int port_num);
 int ahci_check_port_type(volatile ahci_hba_memory_t* hba, int port_num);
 int ahci_port_start_cmd(volatile ahci_hba_memory_t* hba, int port_num);
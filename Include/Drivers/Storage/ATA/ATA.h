@@ -69,6 +69,10 @@
 #define ATA_STATUS_ERR 0x01		// Error
 #define ATA_STATUS_DF 0x20		// Device fault
 
+// Drives may stay busy for up to 30s while spinning up after a reset
+#define ATA_BUSY_TIMEOUT_NS (30 * 1000000000ULL)
+#define ATA_READY_TIMEOUT_NS (1 * 1000000000ULL)
+
 #define ATA_FLOATING_BUS 0xFF
 
 typedef struct {
@@ -487,11 +491,12 @@ typedef struct {
 
 uint8_t readStatus(void);
 
-void waitNotBusy(void);
-void waitReady(void);
+bool waitNotBusy(void);
+bool waitReady(void);
 
 void selectDev(uint8_t dev);
 int identDev(AtaIDDeviceData* devInfo);
+bool setupDriveReadWrite(uint8_t dev, uint32_t lba, uint8_t sectorCnt);
 
 void initDisk(void);
 
@@ -13,6 +13,9 @@
 void initFB(Framebuffer* fb);
 
 void InitializeSerialDevice();
+// Input by interrupt from here on, readers sleep instead of polling. Needs
+// the I/O APIC.
+bool EnableSerialInterrupts();
 char AwaitSerialResponse();
 void kputchar(char a);
 int kprintf(const char* fmt, ...);
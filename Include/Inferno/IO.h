@@ -42,7 +42,7 @@ unsigned int inl_p(unsigned short port);
 
 void outb(unsigned short port, unsigned char value);
 void outb_p(unsigned char value, unsigned short port);
-void outw(unsigned short value, unsigned short port);
+void outw(unsigned short port, unsigned short value);
 void outw_p(unsigned short value, unsigned short port);
 void outl(unsigned short port, unsigned int value);
 void outl_p(unsigned int value, unsigned short port);
@@ -0,0 +1,12 @@
+#pragma once
+#include <Inferno/stdint.h>
+
+namespace StringBench {
+    // Fuzzes the word-at-a-time string routines and memcmp against
+    // byte-wise reference versions, including strings that end right at a
+    // page boundary
+    bool Verify();
+
+    // Times the word-at-a-time routines against the byte-wise ones
+    void Run();
+}
@@ -0,0 +1,113 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: coroutine.h
+// Purpose: The parts of <coroutine> the compiler needs, freestanding
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stddef.h>
+
+// g++ looks these up in std when it lowers co_await and co_return, and
+// the hosted header isn't there for a kernel. Same layout and builtins
+// as libstdc++; build with -fcoroutines.
+namespace std {
+	template<typename Result, typename = void>
+	struct __coroutine_traits_impl {};
+
+	template<typename Result>
+	struct __coroutine_traits_impl<Result, decltype((void)sizeof(typename Result::promise_type))> {
+		using promise_type = typename Result::promise_type;
+	};
+
+	template<typename Result, typename... Args>
+	struct coroutine_traits : __coroutine_traits_impl<Result> {};
+
+	template<typename Promise = void>
+	struct coroutine_handle;
+
+	template<>
+	struct coroutine_handle<void> {
+		constexpr coroutine_handle() noexcept : frame(nullptr) {}
+		constexpr coroutine_handle(decltype(nullptr)) noexcept : frame(nullptr) {}
+
+		constexpr void* address() const noexcept { return frame; }
+		static constexpr coroutine_handle from_address(void* address) noexcept {
+			coroutine_handle handle;
+			handle.frame = address;
+			return handle;
+		}
+
+		constexpr explicit operator bool() const noexcept { return frame != nullptr; }
+		bool done() const noexcept { return __builtin_coro_done(frame); }
+		void operator()() const { resume(); }
+		void resume() const { __builtin_coro_resume(frame); }
+		void destroy() const { __builtin_coro_destroy(frame); }
+
+	protected:
+		void* frame;
+	};
+
+	template<typename Promise>
+	struct coroutine_handle : coroutine_handle<void> {
+		constexpr coroutine_handle() noexcept {}
+		constexpr coroutine_handle(decltype(nullptr)) noexcept {}
+
+		static coroutine_handle from_promise(Promise& promise) {
+			coroutine_handle handle;
+			handle.frame = __builtin_coro_promise((char*)&promise, __alignof(Promise), true);
+			return handle;
+		}
+		static constexpr coroutine_handle from_address(void* address) noexcept {
+			coroutine_handle handle;
+			handle.frame = address;
+			return handle;
+		}
+
+		Promise& promise() const {
+			return *(Promise*)__builtin_coro_promise(frame, __alignof(Promise), false);
+		}
+	};
+
+	// A frame whose resume and destroy do nothing, for handing control
+	// back to whoever resumed a coroutine from its final suspend
+	struct noop_coroutine_promise {};
+
+	template<>
+	struct coroutine_handle<noop_coroutine_promise> : coroutine_handle<void> {
+		struct Frame {
+			static void Nothing() {}
+			void (*resume)() = Nothing;
+			void (*destroy)() = Nothing;
+			noop_coroutine_promise promise;
+		};
+		static Frame noopFrame;
+
+		coroutine_handle() noexcept { frame = &noopFrame; }
+		constexpr bool done() const noexcept { return false; }
+		void resume() const noexcept {}
+		void destroy() const noexcept {}
+	};
+
+	using noop_coroutine_handle = coroutine_handle<noop_coroutine_promise>;
+
+	inline noop_coroutine_handle::Frame noop_coroutine_handle::noopFrame{};
+
+	inline noop_coroutine_handle noop_coroutine() noexcept {
+		return noop_coroutine_handle();
+	}
+
+	struct suspend_always {
+		constexpr bool await_ready() const noexcept { return false; }
+		constexpr void await_suspend(coroutine_handle<>) const noexcept {}
+		constexpr void await_resume() const noexcept {}
+	};
+
+	struct suspend_never {
+		constexpr bool await_ready() const noexcept { return true; }
+		constexpr void await_suspend(coroutine_handle<>) const noexcept {}
+		constexpr void await_resume() const noexcept {}
+	};
+}
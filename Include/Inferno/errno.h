@@ -35,6 +35,8 @@
 #define EDOM 33		 // Math argument out of domain of func
 #define ERANGE 34	   // Math result not representable
 #define ENAMETOOLONG 36 // Name too long
+#define ENOSYS 38	   // Function not implemented
 #define ELOOP 40		// Too many symbolic links
 #define EOVERFLOW 75	// Value too large for defined data type
+#define ETIMEDOUT 110   // Connection timed out
 #define ENOTIMPL 999	// Not implemented
@@ -7,6 +7,7 @@ size_t strlen(const char* str);
 int strcmp(const char* str1, const char* str2);
 int strncmp(const char* str1, const char* str2, size_t n);
 char* strtok(char* str, const char* delimiters);
+char* strtok_r(char* str, const char* delimiters, char** saveptr);
 char* strcpy(char* dest, const char* src);
 char* strchr(const char* str, int c);
 char* strrchr(const char* str, int c);
@@ -2,8 +2,20 @@
 
 #include <Drivers/ACPI/acpi.h>
 
+// Interrupt command register: delivery mode, level and destination shorthand
+#define APIC_ICR_FIXED          (0 << 8)
+#define APIC_ICR_INIT           (5 << 8)
+#define APIC_ICR_STARTUP        (6 << 8)
+#define APIC_ICR_ASSERT         (1 << 14)
+#define APIC_ICR_LEVEL          (1 << 15)
+#define APIC_ICR_SELF           (1 << 18)
+#define APIC_ICR_ALL            (2 << 18)
+#define APIC_ICR_ALL_BUT_SELF   (3 << 18)
+
 namespace APIC {
 	bool Capable();
+	bool X2APICCapable();
+	bool IsX2APIC();
 	void SetBase(unsigned int base);
 	unsigned int GetBase();
 	void Write(unsigned int reg, unsigned int value);
@@ -15,6 +27,7 @@ namespace APIC {
 	
 	// APIC Initialization
 	bool Initialize();
+	void InitializeAP();
 	void SetupLocalAPIC();
 	void ConfigureSpuriousInterrupts();
 	
@@ -23,9 +36,20 @@ namespace APIC {
 	void SetTimerCount(uint32_t count);
 	
 	// IRQ routing
-	void MapIRQ(uint8_t irq, uint8_t vector);
+	bool MapIRQ(uint8_t irq, uint8_t vector);
+	void EOI();
+
+	// Inter-processor interrupts. SendICR takes the low ICR word, delivery
+	// mode and shorthand included; the destination is ignored with a shorthand.
+	void SendICR(uint32_t apicId, uint32_t command);
+	void SendIPI(uint32_t apicId, uint8_t vector);
+	void BroadcastIPI(uint8_t vector, bool includeSelf);
+
+	// Times self IPIs through the ICR
+	bool SelfTest();
 	
 	// Status checks
 	bool IsEnabled();
+	uint32_t GetID();
 	uint32_t GetVersion();
 }
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Inferno/stdint.h>
+
+#define APIC_TIMER_VECTOR 0x20
+
+namespace APICTimer {
+    enum class Mode {
+        OneShot,
+        Periodic,
+        TSCDeadline
+    };
+
+    // Calibrates the timer against the HPET (or CPUID leaf 0x15 when there
+    // is no HPET) and hooks it up to `vector`. The timer is left stopped.
+    bool Initialize(uint8_t vector = APIC_TIMER_VECTOR);
+    bool IsInitialized();
+
+    // Timer input frequency after the divider, and the TSC frequency
+    // measured in the same calibration window
+    uint64_t GetFrequency();
+    uint64_t GetTSCFrequency();
+    bool HasTSCDeadline();
+
+    // Fires every `ns` nanoseconds until stopped
+    void StartPeriodic(uint64_t ns);
+
+    // Fires once, `ns` nanoseconds from now. Uses TSC-deadline mode when the
+    // CPU has it, one-shot otherwise; replaces any event already pending.
+    void ProgramNextEvent(uint64_t ns);
+
+    void Stop();
+    Mode GetMode();
+
+    // Number of timer interrupts taken since Initialize
+    uint64_t GetTickCount();
+
+    // Checks one-shot and periodic expiry against the HPET
+    bool SelfTest();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Inferno/stdint.h>
+
+// ns = ((counter - base) * mult) >> CLOCK_SHIFT
+#define CLOCK_SHIFT 32
+
+namespace Clock {
+    enum class Source {
+        None,
+        HPET,
+        TSC
+    };
+
+    // Picks the invariant TSC when there is one, calibrated against the HPET
+    // (or CPUID leaves 0x15/0x16), and the HPET counter otherwise
+    bool Initialize();
+    Source GetSource();
+    const char* GetSourceName();
+
+    // Frequency of the selected counter in Hz
+    uint64_t GetFrequency();
+    bool HasInvariantTSC();
+
+    // Counter value at 0ns and the multiplier, for exporting the clock
+    void GetScale(uint64_t* base, uint64_t* mult);
+
+    // Wall clock as ns since the epoch, seeded from the RTC at boot.
+    // Setting it also refreshes the user-visible time page.
+    void SetRealtime(uint64_t ns);
+    int64_t GetRealtimeOffset();
+
+    // Measures call cost and checks the clock against the HPET
+    bool SelfTest();
+}
+
+// Nanoseconds since Clock::Initialize, never goes backwards. Costs an
+// rdtsc and a multiply on the TSC path; 0 before initialization.
+uint64_t ClockMonotonicNs();
+uint64_t ClockRealtimeNs();
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Inferno/IO.h>
+#include <Interrupts/Clock.hpp>
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC  1000000000ULL
+
+// Busy-waits for at least the given time. Built on ClockMonotonicNs(); before
+// a clocksource exists each microsecond is an io_wait() instead.
+void ndelay(uint64_t ns);
+void udelay(uint64_t us);
+void mdelay(uint64_t ms);
+
+// Polls `cond` until it returns true or `timeout_ns` has passed and returns
+// whether it became true. The condition gets one last look after the
+// deadline, so being descheduled during the final poll isn't a timeout.
+template<typename Cond>
+inline bool WaitUntil(Cond cond, uint64_t timeout_ns) {
+    if (cond()) return true;
+
+    if (Clock::GetSource() != Clock::Source::None) {
+        uint64_t deadline = ClockMonotonicNs() + timeout_ns;
+        while (ClockMonotonicNs() < deadline) {
+            if (cond()) return true;
+            asm volatile("pause");
+        }
+    } else {
+        for (uint64_t waited = 0; waited < timeout_ns; waited += NSEC_PER_USEC) {
+            if (cond()) return true;
+            io_wait();
+        }
+    }
+    return cond();
+}
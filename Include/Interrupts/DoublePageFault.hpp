@@ -8,4 +8,6 @@
 
 #pragma once
 
-__attribute__((interrupt)) void DoublePageFault(void*);
\ No newline at end of file
+#include <Interrupts/Interrupts.hpp>
+
+bool DoublePageFault(Interrupts::Frame* frame, void* context);
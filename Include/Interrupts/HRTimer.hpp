@@ -0,0 +1,82 @@
+#pragma once
+
+#include <Inferno/stdint.h>
+
+// Wheel resolution, coarse timers fire on a 1ms tick at the earliest
+#define HRTIMER_TICK_NS         1000000ULL
+
+// 6 levels of 64 buckets, each level 8x coarser than the one below,
+// cover about 35 minutes. Later expiries are clamped to the last level.
+#define HRTIMER_LEVELS          6
+#define HRTIMER_LEVEL_BITS      6
+#define HRTIMER_LEVEL_SIZE      (1 << HRTIMER_LEVEL_BITS)
+#define HRTIMER_LEVEL_SHIFT     3
+
+// Precise timers that can be pending at once
+#define HRTIMER_MAX_PRECISE     256
+
+namespace HRTimer {
+    typedef void (*Callback)(void* context);
+
+    enum class Queue : uint8_t {
+        None,
+        Wheel,
+        Heap
+    };
+
+    // Owned by the caller, usually embedded in the object being timed.
+    // Only the first three fields are meant to be read outside HRTimer.
+    struct Timer {
+        uint64_t expires;           // ClockMonotonicNs() deadline
+        Callback callback;
+        void* context;
+
+        bool precise;
+        Queue queue;
+        uint32_t slot;              // heap position or wheel bucket
+        Timer* next;
+        Timer* prev;
+    };
+
+    // Hooks the one-shot APIC timer. Needs Clock and APICTimer up first.
+    bool Initialize();
+    bool IsInitialized();
+
+    // Precise timers go on a min-heap and fire within the timer interrupt
+    // latency. Everything else goes on the wheel, O(1) to add and cancel,
+    // and may fire up to 1/8th of its delay late.
+    void InitTimer(Timer* timer, Callback callback, void* context, bool precise = false);
+
+    // Arms an idle timer for the absolute time `expires`
+    void AddTimer(Timer* timer, uint64_t expires);
+
+    // Moves a timer to `expires`, arming it if it wasn't. Returns whether it
+    // was pending. Safe to call on the timer from its own callback.
+    bool ModTimer(Timer* timer, uint64_t expires);
+
+    // Returns whether the timer was pending
+    bool CancelTimer(Timer* timer);
+
+    // Also waits out the callback if it's running on another CPU, and
+    // cancels again if the callback re-armed it. Not from the timer's own
+    // callback.
+    bool CancelTimerSync(Timer* timer);
+    bool IsPending(Timer* timer);
+
+    // Runs expired timers without waiting for the interrupt, then re-arms
+    // the hardware. Callbacks run with interrupts disabled either way. The
+    // hardware is the APIC timer of the CPU that called Initialize; timers
+    // armed elsewhere are handed to it with an IPI.
+    void Poll();
+
+    // Re-arms the APIC timer after something else has used it
+    void Reprogram();
+
+    uint32_t GetPendingCount();
+
+    // The CPU whose APIC timer runs both queues
+    uint32_t GetCPU();
+
+    // Checks ordering and lateness of precise, wheel and modified timers
+    bool SelfTest();
+}
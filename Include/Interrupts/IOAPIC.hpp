@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Inferno/stdint.h>
+
+#define IOAPIC_MAX_CONTROLLERS  8
+#define IOAPIC_ISA_IRQS         16
+
+namespace IOAPIC {
+    enum class Trigger : uint8_t {
+        Edge,
+        Level
+    };
+
+    enum class Polarity : uint8_t {
+        High,
+        Low
+    };
+
+    // Finds the I/O APICs and ISA overrides in the MADT and masks every
+    // input. Needs ACPI up; nothing is routed until a driver asks.
+    bool Initialize();
+    bool IsInitialized();
+    uint32_t GetControllerCount();
+
+    // Points a global system interrupt at `vector` on the local APIC with
+    // ID `apicId`, fixed delivery, physical destination
+    bool Route(uint32_t gsi, uint8_t vector, uint32_t apicId, Trigger trigger, Polarity polarity);
+
+    // ISA IRQ 0-15, going through the MADT overrides for its GSI and
+    // polarity/trigger. Un-overridden lines are edge, active high.
+    bool RouteISA(uint8_t irq, uint8_t vector, uint32_t apicId);
+
+    // PCI INTx as routed by the firmware (the config space interrupt
+    // line), shareable so level triggered, active low unless a MADT
+    // override on the GSI says otherwise
+    bool RoutePCI(uint32_t gsi, uint8_t vector, uint32_t apicId);
+
+    // Moves an already routed GSI to another CPU. Fails for APIC IDs
+    // above 255, as Route does.
+    bool SetAffinity(uint32_t gsi, uint32_t apicId);
+
+    void Mask(uint32_t gsi);
+    void Unmask(uint32_t gsi);
+
+    uint32_t ISAToGSI(uint8_t irq);
+
+    // Lists every unmasked redirection entry
+    void PrintRoutes();
+}
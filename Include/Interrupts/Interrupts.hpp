@@ -8,6 +8,20 @@
 
 #pragma once
 
+#include <Inferno/stdint.h>
+
+// Handlers that can be registered across all vectors, shared vectors
+// take one per device
+#define INTERRUPT_MAX_ACTIONS 128
+
+#define INTERRUPT_SYSCALL_VECTOR  0x80
+#define INTERRUPT_SPURIOUS_VECTOR 0xFF
+
+// Vectors handed out to devices by AllocateVectors, below 0x30 are the
+// exceptions and fixed timer vectors, above 0xEF is kept for IPIs
+#define INTERRUPT_DYNAMIC_FIRST   0x30
+#define INTERRUPT_DYNAMIC_LAST    0xEF
+
 namespace Interrupts {
 	typedef struct {
 		unsigned short isrLow, cs;
@@ -21,7 +35,47 @@ namespace Interrupts {
 		unsigned long long base;
 	} __attribute__((packed)) Table;
 
+	// Register state saved by the entry stubs (Stubs.s), lowest address
+	// first. Changes made by a handler are restored on return.
+	typedef struct {
+		uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+		uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+		uint64_t vector, error;
+		uint64_t rip, cs, rflags, rsp, ss;
+	} __attribute__((packed)) Frame;
+
+	// Returns true if the interrupt was for this handler. Every handler on
+	// a shared vector runs; the vector counts as unhandled if none claim it.
+	typedef bool (*Handler)(Frame* frame, void* context);
+
 	void CreateIDT(), LoadIDT();
 	void CreateISR(unsigned char index, void* handler);
 	void Enable(), Disable();
-}
\ No newline at end of file
+
+	bool RegisterHandler(uint8_t vector, Handler handler, void* context);
+	// Waits for other CPUs to leave the handlers they're running before the
+	// slot is reused, so not from an interrupt handler
+	bool UnregisterHandler(uint8_t vector, Handler handler, void* context);
+
+	// Called after the handlers for hardware vectors, i.e. everything from
+	// 32 up except the syscall gate and the APIC spurious vector
+	void SetEndOfInterrupt(void (*eoi)(uint8_t vector));
+
+	// Runs last on every interrupt, after the EOI and the softirqs the
+	// handlers raised, with interrupts off again. The scheduler preempts
+	// from here.
+	void SetExitHook(void (*hook)(Frame* frame));
+
+	// Reserves `count` consecutive free vectors, aligned to `count` rounded up
+	// to a power of two as multi-message MSI needs. Returns the first or -1.
+	int AllocateVectors(uint8_t count);
+	void FreeVectors(uint8_t first, uint8_t count);
+
+	// Lets ring 3 raise the vector with int n
+	void SetGatePrivilege(uint8_t vector, uint8_t dpl);
+
+	uint64_t GetCount(uint8_t vector);
+	uint64_t GetUnhandledCount(uint8_t vector);
+	uint64_t GetCycles(uint8_t vector);
+	void PrintStats();
+}
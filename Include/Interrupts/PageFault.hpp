@@ -8,4 +8,6 @@
 
 #pragma once
 
-__attribute__((interrupt)) void PageFault(void*);
\ No newline at end of file
+#include <Interrupts/Interrupts.hpp>
+
+bool PageFault(Interrupts::Frame* frame, void* context);
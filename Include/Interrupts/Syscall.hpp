@@ -8,6 +8,7 @@
 
 #pragma once
 #include <Inferno/stdint.h>
+#include <Interrupts/Interrupts.hpp>
 
 // Linux syscall numbers for x86_64
 #define SYS_READ      0
@@ -23,9 +24,36 @@
 #define SYS_MPROTECT  10
 #define SYS_MUNMAP    11
 #define SYS_BRK       12
+#define SYS_FUTEX     202
+
+// Only honoured while Syscall::SelfTest has code running in ring 3
+#define SYSCALL_TEST_EXIT 0xFFFFFFFF
+
+// Kernel CS/SS for SYSCALL, SYSRET adds 8 and 16 to the user base for
+// SS and CS (see the GDT layout in main.cpp)
+#define SYSCALL_KERNEL_CS 0x08
+#define SYSCALL_USER_BASE 0x10
+
+// What SyscallEntry.s finds through GS after swapgs, at the start of each
+// PerCPU::Area. The offsets are hardcoded in the stub. It belongs to the
+// running thread, the scheduler saves and loads it on every switch.
+typedef struct {
+    uint64_t kernelStack;   // where SYSCALL lands, below SyscallEnterUser's frame
+    uint64_t userStack;     // scratch for the user rsp on entry
+    uint64_t resumeStack;   // kernel rsp SyscallEnterUser returns to
+    uint64_t leaveUser;     // set to make the next syscall exit resume there
+} SyscallCPU;
 
 typedef uint64_t (*syscall_handler_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
-extern "C" {
-    void SyscallHandler(void*);
-}
\ No newline at end of file
+// int 0x80 entry, registered on INTERRUPT_SYSCALL_VECTOR
+bool SyscallHandler(Interrupts::Frame* frame, void* context);
+
+namespace Syscall {
+    // Enables SYSCALL/SYSRET on this CPU. Needs the final GDT loaded and
+    // GS on this CPU's per-CPU area.
+    bool Initialize();
+
+    // Runs a loop of syscalls from ring 3 and times the round trip
+    bool SelfTest();
+}
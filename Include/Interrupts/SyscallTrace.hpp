@@ -0,0 +1,51 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: SyscallTrace.hpp
+// Purpose: Opt-in syscall counters, latency histograms and call log
+// Maintainer: FiReLScar
+//
+//===================================================================//
+
+#pragma once
+#include <Inferno/stdint.h>
+
+// Syscall numbers with their own counters, anything higher shares one
+#define SYSCALL_TRACE_MAX      512
+
+// log2 latency buckets, bucket n counts calls of [2^n, 2^(n+1)) cycles
+#define SYSCALL_TRACE_BUCKETS  32
+
+// Recent calls kept when the call log is on
+#define SYSCALL_TRACE_RING     256
+
+#define SYSCALL_TRACE_STATS    (1 << 0)
+#define SYSCALL_TRACE_LOG      (1 << 1)
+
+namespace SyscallTrace {
+	typedef struct {
+		volatile uint64_t sequence;     // 0 while being written
+		uint64_t number;
+		uint64_t args[6];
+		uint64_t result;
+		uint64_t cycles;
+	} Call;
+
+	// SYSCALL_TRACE_* flags, 0 turns tracing off. Off by default, the
+	// only cost then is one flag test per syscall.
+	void SetMode(uint32_t mode);
+	uint32_t GetMode();
+
+	static inline uint64_t Now() {
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		return ((uint64_t)high << 32) | low;
+	}
+
+	void Record(uint64_t number, const uint64_t args[6], uint64_t result, uint64_t cycles);
+
+	// Per-syscall counts, average/max cycles and the histogram
+	void PrintStats();
+	// The last `count` calls, oldest first
+	void PrintLog(uint32_t count);
+	void Reset();
+}
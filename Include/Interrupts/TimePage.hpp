@@ -0,0 +1,75 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: TimePage.hpp
+// Purpose: Clock parameters published to ring 3
+// Maintainer: FiReLScar
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+// Read-only to ring 3, at the same address in every address space
+#define TIMEPAGE_ADDRESS        0x7FFFFFFFE000ULL
+
+#define CLOCK_REALTIME          0
+#define CLOCK_MONOTONIC         1
+
+// Shared with userspace, only ever append fields. Writers bump `sequence`
+// to odd before touching the rest and back to even after.
+struct TimePageData {
+    volatile uint32_t sequence;
+    uint32_t tscUsable;         // 0: the clocksource isn't the TSC, make the syscall
+    uint64_t tscBase;
+    uint64_t mult;              // ns = ((tsc - tscBase) * mult) >> shift
+    uint32_t shift;
+    uint32_t reserved;
+    int64_t realtimeOffset;     // CLOCK_REALTIME - CLOCK_MONOTONIC in ns
+};
+
+namespace TimePage {
+    // Maps the page at TIMEPAGE_ADDRESS and fills it. Needs Clock up.
+    bool Initialize();
+
+    // Republishes the clock parameters, e.g. after the wall clock was set
+    void Update();
+
+    // Reads the clocks back through the user mapping and compares them
+    // against the kernel's
+    bool SelfTest();
+}
+
+// The userspace side: no syscall, no kernel symbols, just rdtsc and the
+// page. Returns false if the caller has to fall back to the syscall.
+static inline bool TimePageGetTime(const TimePageData* page, int clock, uint64_t* ns) {
+    uint32_t sequence;
+    uint64_t tsc, base, mult;
+    uint32_t shift;
+    int64_t offset;
+
+    do {
+        sequence = page->sequence;
+        if (sequence & 1) {
+            asm volatile("pause");
+            continue;
+        }
+        asm volatile("" ::: "memory");
+        if (!page->tscUsable) return false;
+        base = page->tscBase;
+        mult = page->mult;
+        shift = page->shift;
+        offset = page->realtimeOffset;
+
+        // lfence keeps rdtsc from running ahead of the loads above
+        uint32_t low, high;
+        asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high) :: "memory");
+        tsc = ((uint64_t)high << 32) | low;
+    } while ((sequence & 1) || page->sequence != sequence);
+
+    uint64_t monotonic = (uint64_t)(((unsigned __int128)(tsc - base) * mult) >> shift);
+    if (clock == CLOCK_MONOTONIC) *ns = monotonic;
+    else if (clock == CLOCK_REALTIME) *ns = monotonic + offset;
+    else return false;
+    return true;
+}
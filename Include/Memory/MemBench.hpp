@@ -0,0 +1,11 @@
+#pragma once
+#include <Inferno/stdint.h>
+
+namespace MemBench {
+    // Checks memcpy/memmove/memset against a byte-wise reference for every
+    // size/alignment combination up to a few hundred bytes
+    bool Verify();
+
+    // Times every copy/fill strategy by size and alignment
+    void Run();
+}
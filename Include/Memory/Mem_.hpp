@@ -10,5 +10,30 @@
 
 void* memset(void* destptr, int value, unsigned long int size);
 void* memcpy(void* destptr, void const* srcptr, unsigned long int size);
+void* memmove(void* destptr, void const* srcptr, unsigned long int size);
 
-int memcmp(const void* ptr1, const void* ptr2, unsigned long int size);
\ No newline at end of file
+int memcmp(const void* ptr1, const void* ptr2, unsigned long int size);
+
+namespace Mem {
+	// Copy strategies, picked once at boot from CPUID
+	enum class Strategy {
+		Qword,      // rep movsq/stosq plus an unrolled tail
+		ERMS,       // rep movsb/stosb (Enhanced REP MOVSB/STOSB)
+		NonTemporal // movnti, bypasses the cache for huge buffers
+	};
+
+	// Probes CPUID and selects the string op paths, call after CPU::CPUDetect.
+	// Before this runs everything goes through the Qword path.
+	void Initialize();
+
+	// Copies/fills at or above this size use non-temporal stores
+	unsigned long int GetNonTemporalThreshold();
+	void SetNonTemporalThreshold(unsigned long int size);
+
+	bool HasERMS();
+	bool HasFSRM();
+
+	// Forced-strategy entry points, used by the benchmarks
+	void* CopyWith(Strategy strategy, void* destptr, void const* srcptr, unsigned long int size);
+	void* SetWith(Strategy strategy, void* destptr, int value, unsigned long int size);
+}
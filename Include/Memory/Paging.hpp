@@ -10,6 +10,8 @@ namespace Paging {
 	void Enable();
 	bool IsEnabled();
 	void MapPage(uint64_t virtual_addr, uint64_t physical_addr);
+	// Reachable from ring 3, read-only unless `writable`
+	void MapUserPage(uint64_t virtual_addr, uint64_t physical_addr, bool writable);
 	void UnmapPage(uint64_t virtual_addr);
 	uint64_t GetPhysicalAddress(uint64_t virtual_addr);
 }
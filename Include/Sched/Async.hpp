@@ -0,0 +1,299 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Async.hpp
+// Purpose: Coroutine tasks, per-CPU executors and awaitable I/O
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Inferno/coroutine.h>
+#include <Interrupts/HRTimer.hpp>
+#include <Memory/Heap.hpp>
+#include <Sync/Completion.hpp>
+
+// Code that waits on I/O without a thread of its own. A Task is a
+// coroutine that starts when it's awaited or handed to an executor, and
+// suspends whenever it awaits something not done yet. What it awaited
+// queues it back on an executor once it is, which may be from an
+// interrupt handler. Each CPU has an executor thread resuming the tasks
+// queued on it, one at a time, so tasks never block: they await.
+//
+// No exceptions and no allocation failures thrown: a task whose frame
+// couldn't be allocated awaits as done, with a default result.
+namespace Async {
+	// What an executor queue holds: something to resume
+	struct Node {
+		Node* next;
+		std::coroutine_handle<> handle;
+	};
+
+	// Queues `node` on `cpu`'s executor, or another one if that CPU has
+	// none. Safe from interrupt handlers.
+	void Post(Node* node, uint32_t cpu);
+
+	// This CPU, for resuming something where it was started
+	uint32_t CurrentCPU();
+
+	struct PromiseBase {
+		std::coroutine_handle<> continuation;   // the awaiter, resumed at the end
+		Node node = {};                         // for Spawn
+		bool detached = false;                  // nobody awaits it, it frees itself
+
+		static void* operator new(size_t size) noexcept { return Heap::Allocate(size); }
+		static void operator delete(void* frame) noexcept { Heap::Free(frame); }
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+
+		// Straight on to whoever awaited it, without going back through
+		// the executor or growing the stack
+		struct FinalAwaiter {
+			bool await_ready() noexcept { return false; }
+			template<typename Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+				PromiseBase& promise = handle.promise();
+				std::coroutine_handle<> next = promise.continuation;
+				if (promise.detached) handle.destroy();
+				if (next) return next;
+				return std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+		FinalAwaiter final_suspend() noexcept { return {}; }
+
+		void unhandled_exception() {}
+	};
+
+	template<typename T>
+	struct PromiseResult {
+		T value = T();
+		void return_value(T result) { value = result; }
+		T Result() { return value; }
+	};
+
+	template<>
+	struct PromiseResult<void> {
+		void return_void() {}
+		void Result() {}
+	};
+
+	template<typename T = void>
+	class [[nodiscard]] Task {
+	public:
+		struct promise_type : PromiseBase, PromiseResult<T> {
+			Task get_return_object() {
+				return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			static Task get_return_object_on_allocation_failure() { return Task(); }
+		};
+		typedef std::coroutine_handle<promise_type> Handle;
+
+		Task() : handle(nullptr) {}
+		explicit Task(Handle frame) : handle(frame) {}
+		Task(Task&& other) : handle(other.handle) { other.handle = nullptr; }
+		Task& operator=(Task&& other) {
+			if (this != &other) {
+				if (handle) handle.destroy();
+				handle = other.handle;
+				other.handle = nullptr;
+			}
+			return *this;
+		}
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+		~Task() {
+			if (handle) handle.destroy();
+		}
+
+		bool Valid() const { return (bool)handle; }
+
+		// Gives the frame up, it runs detached and frees itself
+		Handle Release() {
+			Handle frame = handle;
+			handle = nullptr;
+			if (frame) frame.promise().detached = true;
+			return frame;
+		}
+
+		// Awaiting starts it and carries on when it returns
+		bool await_ready() const { return !handle || handle.done(); }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+			handle.promise().continuation = awaiter;
+			return handle;
+		}
+		T await_resume() {
+			if (!handle) return T();
+			return handle.promise().Result();
+		}
+
+	private:
+		Handle handle;
+	};
+
+	// Runs the task detached on `cpu`'s executor
+	template<typename T>
+	static inline bool Spawn(Task<T>&& task, uint32_t cpu) {
+		auto handle = task.Release();
+		if (!handle) return false;
+		PromiseBase& promise = handle.promise();
+		promise.node.handle = handle;
+		Post(&promise.node, cpu);
+		return true;
+	}
+
+	template<typename T>
+	static inline bool Spawn(Task<T>&& task) {
+		return Spawn(static_cast<Task<T>&&>(task), CurrentCPU());
+	}
+
+	// Runs the task detached right here until it first suspends, so
+	// whatever it submits is in flight when this returns
+	template<typename T>
+	static inline bool Start(Task<T>&& task) {
+		auto handle = task.Release();
+		if (!handle) return false;
+		handle.resume();
+		return true;
+	}
+
+	// The bridge from a driver's completion to a suspended task: hand
+	// Complete and the request to the driver, then co_await the request
+	// for the status. Complete may run before the await, on any CPU, from
+	// an interrupt handler. The task resumes on the executor of the CPU it
+	// suspended on.
+	class IoRequest {
+	public:
+		static void Complete(void* request, int status);
+
+		bool await_ready() const { return __atomic_load_n(&state, __ATOMIC_ACQUIRE) == Done; }
+		bool await_suspend(std::coroutine_handle<> awaiter) {
+			node.handle = awaiter;
+			cpu = CurrentCPU();
+			uint32_t expected = Pending;
+			return __atomic_compare_exchange_n(&state, &expected, Waiting, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		}
+		int await_resume() const { return status; }
+
+	private:
+		enum : uint32_t { Pending, Waiting, Done };
+
+		Node node = {};
+		volatile uint32_t state = Pending;
+		int status = 0;
+		uint32_t cpu = 0;
+	};
+
+	// Resumes once `ns` have passed, from the HRTimer interrupt
+	class Sleep {
+	public:
+		explicit Sleep(uint64_t ns) : ns(ns) {}
+		bool await_ready() const { return ns == 0 || !HRTimer::IsInitialized(); }
+		bool await_suspend(std::coroutine_handle<> awaiter);
+		void await_resume() {}
+
+	private:
+		static void Expired(void* sleep);
+
+		uint64_t ns;
+		HRTimer::Timer timer;
+		IoRequest request;
+	};
+
+	// Counts children down; the last one to finish queues the parent
+	class Join {
+	public:
+		explicit Join(uint32_t children) : remaining(children + 1) {}
+
+		void Finished() {
+			if (__atomic_sub_fetch(&remaining, 1, __ATOMIC_ACQ_REL) == 0) Post(&node, cpu);
+		}
+
+		// The parent's own count goes when it suspends, so children that
+		// are already done don't queue it
+		bool await_ready() const { return false; }
+		bool await_suspend(std::coroutine_handle<> awaiter) {
+			node.handle = awaiter;
+			cpu = CurrentCPU();
+			return __atomic_sub_fetch(&remaining, 1, __ATOMIC_ACQ_REL) != 0;
+		}
+		void await_resume() {}
+
+	private:
+		volatile uint32_t remaining;
+		Node node = {};
+		uint32_t cpu = 0;
+	};
+
+	template<typename T>
+	static Task<> JoinOne(Task<T>& task, T* result, Join* join) {
+		T value = co_await task;
+		if (result) *result = value;
+		join->Finished();
+	}
+
+	static inline Task<> JoinOne(Task<>& task, void*, Join* join) {
+		co_await task;
+		join->Finished();
+	}
+
+	// Starts every task at once, and returns when all of them have,
+	// their results in `results` if they have one
+	template<typename T>
+	static Task<> WhenAll(Task<T>* tasks, uint32_t count, T* results = nullptr) {
+		Join join(count);
+		for (uint32_t i = 0; i < count; i++) {
+			if (!Start(JoinOne(tasks[i], results ? &results[i] : nullptr, &join))) join.Finished();
+		}
+		co_await join;
+	}
+
+	template<typename T>
+	static Task<> SignalWhenDone(Task<T>& task, T* result, completion_t* done) {
+		*result = co_await task;
+		complete(done);
+	}
+
+	static inline Task<> SignalWhenDone(Task<>& task, void*, completion_t* done) {
+		co_await task;
+		complete(done);
+	}
+
+	// Runs a task to the end on this CPU's executor while the calling
+	// thread sleeps. For threads that can block and aren't an executor.
+	// `done` lives in this frame: the waiter only gets the count once
+	// complete() has let go of the lock and is done with it, and
+	// SignalWhenDone touches nothing of ours after that.
+	template<typename T>
+	static inline T RunSync(Task<T>&& task) {
+		completion_t done;
+		init_completion(&done);
+		if constexpr (__is_same(T, void)) {
+			if (!Spawn(SignalWhenDone(task, nullptr, &done))) return;
+			wait_for_completion(&done);
+		} else {
+			T result = T();
+			if (!Spawn(SignalWhenDone(task, &result, &done))) return result;
+			wait_for_completion(&done);
+			return result;
+		}
+	}
+
+	// An executor thread pinned to each online CPU. After SMP::Initialize
+	// so every CPU gets one. Until then Post resumes tasks where it's
+	// called.
+	bool Initialize();
+	bool IsInitialized();
+
+	// True on an executor thread, where RunSync would wait on itself
+	bool OnExecutor();
+
+	// Tasks resumed per CPU, and how many of those wakeups came from
+	// interrupt context
+	void PrintStats();
+
+	// Awaits nested tasks, fans timer sleeps out across a WhenAll and
+	// checks they overlap, and resumes tasks from another CPU's interrupts
+	bool SelfTest();
+}
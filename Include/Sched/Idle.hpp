@@ -0,0 +1,47 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Idle.hpp
+// Purpose: What a CPU does when it has nothing to run
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+// C-states MWAIT hints can name, C0 to C7
+#define IDLE_MAX_CSTATES        8
+
+namespace Idle {
+	enum class Method : uint8_t {
+		Halt,
+		Mwait
+	};
+
+	// Looks for MONITOR/MWAIT and the C-states it offers. On the boot CPU
+	// before the APs start, every CPU goes by what it finds.
+	void Initialize();
+
+	Method GetMethod();
+	const char* GetMethodName();
+
+	// False when MWAIT isn't there to switch to
+	bool SetMethod(Method method);
+
+	// Sleeps until an interrupt, or under MWAIT until something stores to
+	// this CPU's needResched. Called with interrupts off, once the caller
+	// has checked there's nothing to do; returns with them on.
+	void Wait();
+
+	// For whoever just set `cpu`'s needResched: true if it's asleep
+	// watching it, so the store already woke it and no IPI is needed
+	bool WokenByStore(uint32_t cpu);
+
+	// Time spent in each C-state and how CPUs were woken
+	void PrintStats();
+
+	// Wakes a thread parked on an idle CPU over and over, under HLT and
+	// MWAIT if there is one, checks no wakeup goes missing and times them
+	bool SelfTest();
+}
@@ -0,0 +1,57 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Preempt.hpp
+// Purpose: Per-CPU preemption control
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <CPU/PerCPU.hpp>
+
+namespace Scheduler {
+	// Switches away if this CPU was asked to reschedule and nothing is
+	// holding it off: preemption enabled, interrupts on
+	void PreemptIfNeeded();
+}
+
+// Sections between these stay on this CPU and aren't switched away from,
+// interrupts still come in. They nest.
+static inline void preempt_disable() {
+	asm volatile("incl %%gs:%c0" :: "i"(__builtin_offsetof(PerCPU::Area, preemptCount)) : "memory", "cc");
+}
+
+static inline void preempt_enable() {
+	asm volatile("decl %%gs:%c0" :: "i"(__builtin_offsetof(PerCPU::Area, preemptCount)) : "memory", "cc");
+	if (this_cpu()->needResched) Scheduler::PreemptIfNeeded();
+}
+
+// Leaves the count alone when a reschedule can wait for the next chance
+static inline void preempt_enable_no_resched() {
+	asm volatile("decl %%gs:%c0" :: "i"(__builtin_offsetof(PerCPU::Area, preemptCount)) : "memory", "cc");
+}
+
+static inline uint32_t preempt_count() {
+	uint32_t count;
+	asm volatile("movl %%gs:%c1, %0" : "=r"(count) : "i"(__builtin_offsetof(PerCPU::Area, preemptCount)));
+	return count;
+}
+
+// Interrupt context: inside an interrupt handler, or running the softirqs
+// it left on the way out. Neither may block.
+static inline bool in_irq() {
+	uint32_t depth;
+	asm volatile("movl %%gs:%c1, %0" : "=r"(depth) : "i"(__builtin_offsetof(PerCPU::Area, irqDepth)));
+	return depth != 0;
+}
+
+static inline bool in_softirq() {
+	uint32_t active;
+	asm volatile("movl %%gs:%c1, %0" : "=r"(active) : "i"(__builtin_offsetof(PerCPU::Area, inSoftirq)));
+	return active != 0;
+}
+
+static inline bool in_interrupt() {
+	return in_irq() || in_softirq();
+}
@@ -0,0 +1,130 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Scheduler.hpp
+// Purpose: Kernel threads, per-CPU run queues and preemption
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Interrupts/HRTimer.hpp>
+#include <Interrupts/Syscall.hpp>
+#include <Sched/Preempt.hpp>
+
+// Strict priorities, the highest non-empty queue always runs first and
+// threads of equal priority take turns
+#define SCHED_PRIORITIES        8
+#define SCHED_PRIORITY_LOW      1
+#define SCHED_PRIORITY_NORMAL   4
+#define SCHED_PRIORITY_HIGH     6
+#define SCHED_PRIORITY_MAX      (SCHED_PRIORITIES - 1)
+
+// The boot CPU's tick, other CPUs get it forwarded as an IPI while they
+// have something to preempt
+#define SCHED_TICK_NS           4000000ULL
+#define SCHED_TIMESLICE_NS      10000000ULL
+
+#define SCHED_MAX_THREADS       256
+#define SCHED_AFFINITY_ALL      0xFFFFFFFFFFFFFFFFULL
+
+// Thread stacks, one slot per thread below an unmapped guard page. Slots
+// stay mapped once used and are handed to the next thread, so freeing one
+// never needs a TLB shootdown.
+#define SCHED_STACK_BASE        0x70000000000ULL
+#define SCHED_STACK_SIZE        0x4000
+
+namespace Scheduler {
+	typedef void (*Entry)(void* arg);
+
+	enum class State : uint8_t {
+		Ready,
+		Running,
+		Blocked,
+		Dead
+	};
+
+	struct Thread {
+		uint64_t rsp;               // saved by SchedSwitch while off the CPU
+		uint32_t id;
+		char name[16];
+		volatile State state;
+		uint8_t priority;
+		bool queued;                // on a run queue, under that queue's lock
+		volatile bool onCPU;        // hasn't finished switching out yet
+		uint32_t cpu;               // run queue it's on, or the CPU it last ran on
+		uint32_t slot;              // stack slot, -1 for a CPU's boot stack
+		uint64_t affinity;          // CPUs it may run on, bit per CPU index
+		SyscallCPU syscall;         // its GS block for SyscallEntry.s while off the CPU
+
+		Entry entry;
+		void* arg;
+
+		uint64_t sliceStart;        // ClockMonotonicNs() when it got the CPU
+		uint64_t runtime;           // ns spent on a CPU
+		uint64_t switches;
+
+		HRTimer::Timer sleepTimer;
+		Thread* next;               // run queue links
+		Thread* prev;
+		Thread* listNext;           // every thread, for PrintThreads
+		Thread* listPrev;
+	};
+
+	// Turns the boot flow into the "init" thread, kept on CPU 0 where the
+	// shell's self-tests expect the boot CPU's APIC timer, gives CPU 0 an
+	// idle thread and starts the tick. Before SMP::Initialize.
+	bool Initialize();
+	bool IsInitialized();
+
+	// An AP's boot flow becomes its idle thread and starts taking work
+	[[noreturn]] void StartAP();
+
+	// Bit per CPU whose run queue takes threads. Waits a little for CPUs
+	// SMP has started that haven't got to StartAP yet.
+	uint64_t OnlineMask();
+
+	// The thread is queued right away and may run before this returns
+	Thread* Create(const char* name, Entry entry, void* arg, uint8_t priority = SCHED_PRIORITY_NORMAL,
+		uint64_t affinity = SCHED_AFFINITY_ALL);
+
+	Thread* Current();
+	void Yield();
+	[[noreturn]] void Exit();
+	void Sleep(uint64_t ns);
+
+	// Blocking in two steps so a wakeup can't slip between checking the
+	// condition and going to sleep: PrepareToBlock, check, then Block. A
+	// Wake in between makes Block return straight away, and so does being
+	// preempted in between, so callers check again after Block.
+	void PrepareToBlock();
+	void Block();
+
+	// Block, but give up after `ns`. False when the time ran out, the
+	// caller checks its condition either way.
+	bool BlockTimeout(uint64_t ns);
+
+	// Backs out of PrepareToBlock when the condition turned out true
+	void AbortBlock();
+
+	// A thread with preemption and interrupts on, outside interrupt
+	// context. Anything else has to poll.
+	bool CanBlock();
+
+	// Returns false if the thread wasn't blocked
+	bool Wake(Thread* thread);
+
+	void SetPriority(Thread* thread, uint8_t priority);
+
+	// Fails when no online CPU is in the mask. A thread running somewhere
+	// it may no longer be moves at its next switch.
+	bool SetAffinity(Thread* thread, uint64_t mask);
+
+	void PrintThreads();
+	void PrintRunQueues();
+
+	// Spreads busy threads over the CPUs, checks affinity, wakeup
+	// preemption and sleep accuracy, and times a context switch
+	bool SelfTest();
+}
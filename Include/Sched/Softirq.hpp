@@ -0,0 +1,75 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Softirq.hpp
+// Purpose: Softirqs and tasklets, the bottom half of interrupt handling
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Preempt.hpp>
+
+// An interrupt handler only acknowledges the device and queues what's
+// left as a softirq, which runs on the way out of the interrupt with
+// interrupts back on. Lower numbers run first.
+enum {
+	SOFTIRQ_HI,             // tasklet_hi_schedule
+	SOFTIRQ_TASKLET,        // tasklet_schedule
+	NR_SOFTIRQS
+};
+
+// How long one interrupt exit keeps at it before the rest goes to this
+// CPU's ksoftirqd, which runs at normal priority and takes turns
+#define SOFTIRQ_MAX_RESTART     10
+#define SOFTIRQ_MAX_NS          2000000ULL
+
+typedef void (*softirq_action_t)();
+
+// Actions run with interrupts on and preemption off, on the CPU that
+// raised them, and never nest on one CPU. Locks they share with thread
+// context have to be taken with spin_lock_irqsave there: a softirq can
+// run on top of any code that has interrupts on.
+void open_softirq(uint32_t nr, softirq_action_t action);
+
+// Marks `nr` pending on this CPU. From an interrupt handler it runs on the
+// way out; elsewhere right away if interrupts are on, else in ksoftirqd.
+void raise_softirq(uint32_t nr);
+
+#define TASKLET_STATE_SCHED     (1 << 0)    // queued on some CPU
+#define TASKLET_STATE_RUN       (1 << 1)    // running on some CPU
+
+// A function run once from softirq context however many times it was
+// scheduled before it got to run, and never on two CPUs at once
+struct tasklet_struct {
+	struct tasklet_struct* next;
+	volatile uint32_t state;
+	void (*func)(void* data);
+	void* data;
+};
+
+void tasklet_init(tasklet_struct* tasklet, void (*func)(void* data), void* data);
+
+// Queues it on this CPU unless it's queued already
+void tasklet_schedule(tasklet_struct* tasklet);
+void tasklet_hi_schedule(tasklet_struct* tasklet);
+
+// Waits until it's neither queued nor running. Thread context only, and
+// whatever schedules it has to have stopped.
+void tasklet_kill(tasklet_struct* tasklet);
+
+namespace Softirq {
+	// Starts a ksoftirqd on every CPU that takes threads. Softirqs work
+	// before this, only what an interrupt exit leaves over has to wait.
+	bool Initialize();
+
+	// From InterruptDispatch after the handlers, interrupts still off
+	void InterruptExit(uint64_t rflags);
+
+	void PrintStats();
+
+	// Schedules a tasklet from a hard interrupt and checks where and how
+	// it ran, that repeats coalesce, and times the handoff
+	bool SelfTest();
+}
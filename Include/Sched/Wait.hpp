@@ -0,0 +1,154 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Wait.hpp
+// Purpose: Wait queues, sleeping until a condition holds
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Interrupts/Clock.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sync/Spinlock.hpp>
+
+#define WAIT_FOREVER            0xFFFFFFFFFFFFFFFFULL
+
+// One sleeping thread, on the waiter's stack for as long as it waits.
+// Wakers take it off the queue, so a queue only holds threads nobody has
+// woken yet.
+struct wait_queue_entry {
+	Scheduler::Thread* thread;
+	const void* key;                // what wake_up_key matches, anything if null
+	wait_queue_entry* next;
+	wait_queue_entry* prev;
+	bool exclusive;                 // woken one at a time, after the others
+	bool queued;                    // under the queue's lock
+	volatile bool woken;
+};
+
+// Waiters in the order they came. Wakers may be interrupt handlers.
+typedef struct {
+	spinlock_t lock;
+	wait_queue_entry* head;
+	wait_queue_entry* tail;
+} wait_queue_head_t;
+
+#define WAIT_QUEUE_HEAD_INIT { SPINLOCK_INIT, nullptr, nullptr }
+#define WAIT_QUEUE_HEAD_INIT_CLASS(cls) { SPINLOCK_INIT_CLASS(cls), nullptr, nullptr }
+
+static inline void init_waitqueue_head(wait_queue_head_t* wq, lock_class_t* cls = nullptr) {
+	spin_lock_init(&wq->lock, cls);
+	wq->head = wq->tail = nullptr;
+}
+
+static inline void init_wait_entry(wait_queue_entry* entry, bool exclusive, const void* key = nullptr) {
+	entry->thread = Scheduler::Current();
+	entry->key = key;
+	entry->next = entry->prev = nullptr;
+	entry->exclusive = exclusive;
+	entry->queued = false;
+	entry->woken = false;
+}
+
+// Racy, for deciding whether a wakeup is worth the lock
+static inline bool waitqueue_active(wait_queue_head_t* wq) {
+	return __atomic_load_n(&wq->head, __ATOMIC_RELAXED) != nullptr;
+}
+
+// Caller holds wq->lock
+void __add_wait_queue(wait_queue_head_t* wq, wait_queue_entry* entry);
+void __remove_wait_queue(wait_queue_head_t* wq, wait_queue_entry* entry);
+
+// Wakes every waiter that isn't exclusive and `exclusive` of those that
+// are, oldest first, only those waiting on `key` unless it's null.
+// Returns how many were woken. Caller holds wq->lock.
+uint32_t __wake_up_locked(wait_queue_head_t* wq, const void* key, uint32_t exclusive);
+
+// Queues the entry unless a waker took it off, and marks this thread
+// blocked. The caller checks its condition next and either blocks or
+// calls finish_wait, as with Scheduler::PrepareToBlock.
+void prepare_to_wait(wait_queue_head_t* wq, wait_queue_entry* entry);
+
+// Off the queue, and running again if the thread never blocked. True if
+// a waker got to the entry first.
+bool finish_wait(wait_queue_head_t* wq, wait_queue_entry* entry);
+
+uint32_t wake_up_nr(wait_queue_head_t* wq, uint32_t exclusive);
+uint32_t wake_up_key(wait_queue_head_t* wq, const void* key, uint32_t exclusive);
+
+static inline uint32_t wake_up(wait_queue_head_t* wq) {
+	return wake_up_nr(wq, 1);
+}
+
+static inline uint32_t wake_up_all(wait_queue_head_t* wq) {
+	return wake_up_nr(wq, 0xFFFFFFFF);
+}
+
+// Sleeps on `wq` until `condition()` is true or `ns` ran out, and returns
+// the condition's last value. The condition is checked after queueing,
+// so a waker only has to make it true before calling wake_up. It may
+// take what it's waiting for, a count or a lock, as long as it only
+// returns true when it did.
+//
+// An exclusive waiter woken for nothing, because the time ran out or
+// another thread took what it was woken for, hands the wakeup to the
+// next one. Callers that can't block spin on the condition instead.
+template<typename Condition>
+static inline bool wait_event_common(wait_queue_head_t* wq, Condition condition, uint64_t ns, bool exclusive) {
+	if (condition()) return true;
+	uint64_t deadline = ns == WAIT_FOREVER ? WAIT_FOREVER : ClockMonotonicNs() + ns;
+
+	if (!Scheduler::CanBlock()) {
+		while (!condition()) {
+			if (deadline != WAIT_FOREVER && ClockMonotonicNs() >= deadline) return condition();
+			asm volatile("pause");
+		}
+		return true;
+	}
+
+	wait_queue_entry entry;
+	init_wait_entry(&entry, exclusive);
+	bool met = false;
+	while (true) {
+		prepare_to_wait(wq, &entry);
+		if (condition()) {
+			met = true;
+			break;
+		}
+		if (deadline == WAIT_FOREVER) {
+			Scheduler::Block();
+			continue;
+		}
+		uint64_t now = ClockMonotonicNs();
+		if (now >= deadline) break;
+		Scheduler::BlockTimeout(deadline - now);
+	}
+	bool woken = finish_wait(wq, &entry);
+	if (!met) met = condition();
+	if (!met && woken && exclusive) wake_up(wq);
+	return met;
+}
+
+template<typename Condition>
+static inline void wait_event(wait_queue_head_t* wq, Condition condition) {
+	wait_event_common(wq, condition, WAIT_FOREVER, false);
+}
+
+template<typename Condition>
+static inline bool wait_event_timeout(wait_queue_head_t* wq, Condition condition, uint64_t ns) {
+	return wait_event_common(wq, condition, ns, false);
+}
+
+// For waiters where one wakeup is enough for one of them, a freed lock or
+// a posted count. wake_up leaves the rest asleep.
+template<typename Condition>
+static inline void wait_event_exclusive(wait_queue_head_t* wq, Condition condition) {
+	wait_event_common(wq, condition, WAIT_FOREVER, true);
+}
+
+template<typename Condition>
+static inline bool wait_event_exclusive_timeout(wait_queue_head_t* wq, Condition condition, uint64_t ns) {
+	return wait_event_common(wq, condition, ns, true);
+}
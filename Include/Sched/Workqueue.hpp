@@ -0,0 +1,63 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Workqueue.hpp
+// Purpose: Per-CPU worker threads for deferred work that may block
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Scheduler.hpp>
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct* work);
+
+// Embed one in whatever the function needs and get back to it from the
+// pointer it's handed
+struct work_struct {
+	struct work_struct* next;
+	work_func_t func;
+	volatile uint32_t pending;      // queued and not started yet
+};
+
+struct workqueue_struct;
+
+// The kernel's shared queue, "events"
+extern workqueue_struct* system_wq;
+
+static inline void init_work(work_struct* work, work_func_t func) {
+	work->next = nullptr;
+	work->func = func;
+	work->pending = 0;
+}
+
+// One worker thread per CPU taking threads, pinned there at `priority`.
+// A worker wakes once for everything queued while it slept and runs it
+// as one batch, in order.
+workqueue_struct* alloc_workqueue(const char* name, uint8_t priority = SCHED_PRIORITY_NORMAL);
+
+// Queues on this CPU's worker, or another CPU's. Safe from interrupt
+// handlers. False if the work is still pending from an earlier call.
+bool queue_work(workqueue_struct* wq, work_struct* work);
+bool queue_work_on(uint32_t cpu, workqueue_struct* wq, work_struct* work);
+
+static inline bool schedule_work(work_struct* work) {
+	return queue_work(system_wq, work);
+}
+
+// Returns once everything queued before the call has run. Not from one
+// of the queue's own workers.
+void flush_workqueue(workqueue_struct* wq);
+
+namespace Workqueue {
+	// Makes system_wq. After SMP::Initialize so every CPU gets a worker.
+	bool Initialize();
+
+	void PrintStats();
+
+	// Queues work on every CPU and checks it ran there, in order, batched
+	// and only once per queueing, and times queue-to-run latency
+	bool SelfTest();
+}
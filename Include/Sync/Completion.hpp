@@ -0,0 +1,79 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Completion.hpp
+// Purpose: Waiting for something another thread or an interrupt finishes
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Wait.hpp>
+
+// complete lets one waiter through, or the next one to come if nobody is
+// waiting yet; complete_all lets every waiter through until
+// reinit_completion. Both are safe from interrupt handlers.
+#define COMPLETION_ALL          0xFFFFFFFFU
+
+typedef struct {
+	volatile uint32_t done;
+	wait_queue_head_t wait;
+} completion_t;
+
+#define COMPLETION_INIT { 0, WAIT_QUEUE_HEAD_INIT }
+
+static inline void init_completion(completion_t* completion) {
+	completion->done = 0;
+	init_waitqueue_head(&completion->wait);
+}
+
+static inline void reinit_completion(completion_t* completion) {
+	__atomic_store_n(&completion->done, 0, __ATOMIC_RELAXED);
+}
+
+// Takes one completion without waiting, if there is one. Under the
+// lock: complete() holds it until it's finished with the completion, so
+// once this succeeds the caller may let it go out of scope.
+static inline bool try_wait_for_completion(completion_t* completion) {
+	if (!__atomic_load_n(&completion->done, __ATOMIC_ACQUIRE)) return false;
+	uint64_t flags = spin_lock_irqsave(&completion->wait.lock);
+	uint32_t done = completion->done;
+	if (done && done != COMPLETION_ALL) completion->done = done - 1;
+	spin_unlock_irqrestore(&completion->wait.lock, flags);
+	return done != 0;
+}
+
+static inline void wait_for_completion(completion_t* completion) {
+	wait_event_exclusive(&completion->wait, [completion] { return try_wait_for_completion(completion); });
+}
+
+// False if it didn't complete within `ns`
+static inline bool wait_for_completion_timeout(completion_t* completion, uint64_t ns) {
+	return wait_event_exclusive_timeout(&completion->wait,
+		[completion] { return try_wait_for_completion(completion); }, ns);
+}
+
+// The count and the wakeup under one hold of the lock, the waiter can't
+// see one without the other being done
+static inline void complete(completion_t* completion) {
+	uint64_t flags = spin_lock_irqsave(&completion->wait.lock);
+	if (completion->done < COMPLETION_ALL - 1) completion->done++;
+	__wake_up_locked(&completion->wait, nullptr, 1);
+	spin_unlock_irqrestore(&completion->wait.lock, flags);
+}
+
+static inline void complete_all(completion_t* completion) {
+	uint64_t flags = spin_lock_irqsave(&completion->wait.lock);
+	completion->done = COMPLETION_ALL;
+	__wake_up_locked(&completion->wait, nullptr, COMPLETION_ALL);
+	spin_unlock_irqrestore(&completion->wait.lock, flags);
+}
+
+// True once it's safe to let the completion go, complete() included
+static inline bool completion_done(completion_t* completion) {
+	if (!__atomic_load_n(&completion->done, __ATOMIC_ACQUIRE)) return false;
+	uint64_t flags = spin_lock_irqsave(&completion->wait.lock);
+	spin_unlock_irqrestore(&completion->wait.lock, flags);
+	return true;
+}
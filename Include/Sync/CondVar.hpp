@@ -0,0 +1,55 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: CondVar.hpp
+// Purpose: Condition variables over a mutex
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Wait.hpp>
+#include <Sync/Mutex.hpp>
+
+// Each signal or broadcast bumps `sequence`. A waiter notes it while it
+// still holds the mutex and sleeps until it moves, so a signal between
+// the unlock and the sleep isn't lost. Waiters may wake without a signal
+// and check their predicate again, as with any condition variable.
+typedef struct {
+	volatile uint32_t sequence;
+	wait_queue_head_t wait;
+} condvar_t;
+
+#define CONDVAR_INIT { 0, WAIT_QUEUE_HEAD_INIT }
+
+static inline void cond_init(condvar_t* cond) {
+	cond->sequence = 0;
+	init_waitqueue_head(&cond->wait);
+}
+
+// Caller holds `mutex`, and holds it again when this returns. False if
+// `ns` ran out first.
+static inline bool cond_wait_timeout(condvar_t* cond, mutex_t* mutex, uint64_t ns) {
+	uint32_t sequence = __atomic_load_n(&cond->sequence, __ATOMIC_RELAXED);
+	mutex_unlock(mutex);
+	bool signalled = wait_event_exclusive_timeout(&cond->wait,
+		[cond, sequence] { return __atomic_load_n(&cond->sequence, __ATOMIC_ACQUIRE) != sequence; }, ns);
+	mutex_lock(mutex);
+	return signalled;
+}
+
+static inline void cond_wait(condvar_t* cond, mutex_t* mutex) {
+	cond_wait_timeout(cond, mutex, WAIT_FOREVER);
+}
+
+// Wakes one waiter
+static inline void cond_signal(condvar_t* cond) {
+	__atomic_fetch_add(&cond->sequence, 1, __ATOMIC_RELEASE);
+	wake_up(&cond->wait);
+}
+
+static inline void cond_broadcast(condvar_t* cond) {
+	__atomic_fetch_add(&cond->sequence, 1, __ATOMIC_RELEASE);
+	wake_up_all(&cond->wait);
+}
@@ -0,0 +1,42 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Futex.hpp
+// Purpose: Sleeping on a word in memory, for userland locks
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Wait.hpp>
+
+// futex(2) operations, the flags are accepted and ignored: every futex
+// is private to the one address space, and timeouts are relative
+#define FUTEX_WAIT              0
+#define FUTEX_WAKE              1
+#define FUTEX_PRIVATE_FLAG      128
+#define FUTEX_CLOCK_REALTIME    256
+#define FUTEX_CMD_MASK          (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+#define FUTEX_HASH_BUCKETS      64
+
+namespace Futex {
+	// Sleeps until a Wake on the same word, as long as it still holds
+	// `value` when checked under the bucket lock. 0 once woken, -EAGAIN if
+	// the value had moved on, -ETIMEDOUT, or -EFAULT if it isn't mapped.
+	// Callers that can't block poll the word instead.
+	int64_t Wait(volatile uint32_t* addr, uint32_t value, uint64_t ns = WAIT_FOREVER);
+
+	// Wakes up to `count` threads waiting on the word, oldest first, and
+	// returns how many
+	int64_t Wake(volatile uint32_t* addr, uint32_t count);
+
+	// SYS_FUTEX: FUTEX_WAIT and FUTEX_WAKE, a FUTEX_WAIT timeout being a
+	// struct timespec. Errors come back negated, as on Linux.
+	uint64_t Syscall(uint64_t uaddr, uint64_t op, uint64_t value, uint64_t timeout, uint64_t, uint64_t);
+
+	// Waits and wakes so far, and how many threads are asleep in each
+	// busy bucket
+	void PrintStats();
+}
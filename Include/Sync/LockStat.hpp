@@ -0,0 +1,58 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: LockStat.hpp
+// Purpose: Per-class lock contention statistics
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+// Every lock that shares a class adds to the same counters, so all 16 run
+// queue locks show up as one "runqueue" line. Times are in TSC cycles.
+struct lock_class_t {
+	const char* name;
+	lock_class_t* next;
+	volatile uint32_t registered;
+
+	volatile uint64_t acquisitions;
+	volatile uint64_t contentions;  // had to wait for it
+	volatile uint64_t waitCycles;
+	volatile uint64_t maxWait;
+	volatile uint64_t holdCycles;
+	volatile uint64_t maxHold;
+};
+
+#define LOCK_CLASS_INIT(name) { name, nullptr, 0, 0, 0, 0, 0, 0, 0 }
+#define DEFINE_LOCK_CLASS(var, name) lock_class_t var = LOCK_CLASS_INIT(name)
+
+namespace LockStat {
+	// Off by default. Locks only check this and their class pointer while
+	// it's off, so it costs a load and a branch per acquisition.
+	extern volatile bool enabled;
+
+	static inline uint64_t Now() {
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		return ((uint64_t)high << 32) | low;
+	}
+
+	// `waitStart` is Now() from before the first attempt. Returns the time
+	// to hand to Released, never 0, so a lock can keep 0 for "not timed".
+	uint64_t Acquired(lock_class_t* cls, bool contended, uint64_t waitStart);
+	void Released(lock_class_t* cls, uint64_t acquiredAt);
+
+	void SetEnabled(bool on);
+	bool IsEnabled();
+	void Reset();
+
+	// Every class seen so far, most contended first
+	void Print();
+
+	// Contends a ticket, an MCS and a reader-writer lock from a thread on
+	// every CPU, checks nobody got in together and that lockstat saw every
+	// acquisition, and times each
+	bool SelfTest();
+}
@@ -0,0 +1,103 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: MCSLock.hpp
+// Purpose: Queued spinlocks where each waiter spins on its own node
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sync/Spinlock.hpp>
+
+// Waiters queue up behind `tail` and each spins on the `locked` flag of
+// its own node, so a release touches one other CPU's cache line instead
+// of every waiter's. Worth it over a ticket lock once more than a few
+// CPUs wait at a time. The node is the caller's, usually on the stack,
+// and has to stay put until the matching unlock.
+typedef struct mcs_node {
+	struct mcs_node* volatile next;
+	volatile uint32_t locked;       // set by the previous holder
+} mcs_node_t;
+
+typedef struct {
+	mcs_node_t* volatile tail;
+	lock_class_t* lockClass;
+	uint64_t acquiredAt;
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT { nullptr, nullptr, 0 }
+#define MCS_LOCK_INIT_CLASS(cls) { nullptr, &(cls), 0 }
+
+static inline void mcs_lock_init(mcs_lock_t* lock, lock_class_t* cls = nullptr) {
+	lock->tail = nullptr;
+	lock->lockClass = cls;
+	lock->acquiredAt = 0;
+}
+
+static inline void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+	preempt_disable();
+	bool timed = LockStat::enabled && lock->lockClass;
+	uint64_t waitStart = timed ? LockStat::Now() : 0;
+
+	node->next = nullptr;
+	node->locked = 0;
+	mcs_node_t* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (prev) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) asm volatile("pause");
+	}
+	if (timed) lock->acquiredAt = LockStat::Acquired(lock->lockClass, prev != nullptr, waitStart);
+}
+
+static inline bool mcs_trylock(mcs_lock_t* lock, mcs_node_t* node) {
+	preempt_disable();
+	node->next = nullptr;
+	node->locked = 0;
+	mcs_node_t* expected = nullptr;
+	if (__atomic_compare_exchange_n(&lock->tail, &expected, node, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		if (LockStat::enabled && lock->lockClass)
+			lock->acquiredAt = LockStat::Acquired(lock->lockClass, false, 0);
+		return true;
+	}
+	preempt_enable_no_resched();
+	return false;
+}
+
+static inline void mcs_release(mcs_lock_t* lock, mcs_node_t* node) {
+	if (lock->acquiredAt) {
+		LockStat::Released(lock->lockClass, lock->acquiredAt);
+		lock->acquiredAt = 0;
+	}
+
+	mcs_node_t* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (!next) {
+		mcs_node_t* expected = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, nullptr, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		// Someone swapped in behind us and hasn't linked itself yet
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) asm volatile("pause");
+	}
+	__atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
+
+static inline void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+	mcs_release(lock, node);
+	preempt_enable();
+}
+
+static inline bool mcs_is_locked(mcs_lock_t* lock) {
+	return __atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != nullptr;
+}
+
+static inline uint64_t mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node) {
+	uint64_t flags = local_irq_save();
+	mcs_lock(lock, node);
+	return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, uint64_t flags) {
+	mcs_release(lock, node);
+	local_irq_restore_resched(flags);
+}
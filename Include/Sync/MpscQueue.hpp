@@ -0,0 +1,117 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: MpscQueue.hpp
+// Purpose: Lock-free intrusive queue for many producers and one consumer
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <CPU/CPU.h>
+
+// Unbounded and intrusive: items carry their own link, the member `Next`
+// points at (`next` unless told otherwise), so pushing never allocates and
+// never fails. Producers push onto a stack with one cmpxchg and never wait
+// on each other or the consumer, so interrupt handlers can push too. The
+// consumer takes the whole stack with one xchg and reverses it into a
+// private list it pops from, so items come out in the order the pushes
+// landed. Taking everything at once leaves no window for ABA.
+//
+// An item belongs to the queue from its push until it's popped. All
+// zeroes is an empty queue.
+template<typename T, T* T::*Next = &T::next>
+class MpscQueue {
+public:
+	void Reset() {
+		stack = nullptr;
+		pending = nullptr;
+	}
+
+	// Any number of producers at once. True if the queue looked empty
+	// before, for deciding whether the consumer needs a wakeup.
+	bool Push(T* item) {
+		return PushChain(item, item);
+	}
+
+	// Pushes `count` items as one: they come out in array order with
+	// nothing from other producers in between
+	bool PushBatch(T* const* items, uint32_t count) {
+		if (!count) return false;
+		// The stack is newest first, so link the batch backwards
+		for (uint32_t i = count - 1; i > 0; i--) items[i]->*Next = items[i - 1];
+		return PushChain(items[count - 1], items[0]);
+	}
+
+	// Consumer only. Null when empty.
+	T* Pop() {
+		if (!pending && !Refill()) return nullptr;
+		T* item = pending;
+		pending = item->*Next;
+		return item;
+	}
+
+	// Consumer only. Up to `max` items, oldest first.
+	uint32_t PopBatch(T** items, uint32_t max) {
+		uint32_t count = 0;
+		while (count < max) {
+			if (!pending && !Refill()) break;
+			while (pending && count < max) {
+				items[count++] = pending;
+				pending = pending->*Next;
+			}
+		}
+		return count;
+	}
+
+	// Consumer only. Everything queued, oldest first, linked through Next
+	// and ending in null.
+	T* PopAll() {
+		T* fresh = Reverse(__atomic_exchange_n(&stack, nullptr, __ATOMIC_ACQUIRE));
+		T* list = pending;
+		pending = nullptr;
+		if (!list) return fresh;
+		T* last = list;
+		while (last->*Next) last = last->*Next;
+		last->*Next = fresh;
+		return list;
+	}
+
+	// Exact for the consumer, a snapshot for anyone else
+	bool Empty() const {
+		return !pending && !__atomic_load_n(&stack, __ATOMIC_RELAXED);
+	}
+
+private:
+	// `first` is the newest, `last` the oldest, already linked between them
+	bool PushChain(T* first, T* last) {
+		T* top = __atomic_load_n(&stack, __ATOMIC_RELAXED);
+		do {
+			last->*Next = top;
+		} while (!__atomic_compare_exchange_n(&stack, &top, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return top == nullptr;
+	}
+
+	bool Refill() {
+		if (!__atomic_load_n(&stack, __ATOMIC_RELAXED)) return false;
+		// Acquire pairs with the producers' release, for the items' contents
+		pending = Reverse(__atomic_exchange_n(&stack, nullptr, __ATOMIC_ACQUIRE));
+		return pending != nullptr;
+	}
+
+	static T* Reverse(T* list) {
+		T* reversed = nullptr;
+		while (list) {
+			T* next = list->*Next;
+			list->*Next = reversed;
+			reversed = list;
+			list = next;
+		}
+		return reversed;
+	}
+
+	// Producers hammer this line, the consumer's list stays off it
+	alignas(CACHE_LINE_SIZE) T* volatile stack;
+	alignas(CACHE_LINE_SIZE) T* pending;
+};
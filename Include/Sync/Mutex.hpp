@@ -0,0 +1,83 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Mutex.hpp
+// Purpose: Sleeping locks for threads
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Wait.hpp>
+#include <Sync/LockStat.hpp>
+
+// A lock whose waiters sleep, for holders that may block or run long.
+// One atomic operation each way while nobody waits. Only threads that can
+// block may wait on one; code that can't spins on it instead.
+#define MUTEX_UNLOCKED          0
+#define MUTEX_LOCKED            1
+#define MUTEX_CONTENDED         2       // locked, and someone may be asleep on it
+
+typedef struct {
+	volatile uint32_t state;
+	Scheduler::Thread* owner;
+	wait_queue_head_t wait;
+	lock_class_t* lockClass;
+	uint64_t acquiredAt;
+} mutex_t;
+
+#define MUTEX_INIT { MUTEX_UNLOCKED, nullptr, WAIT_QUEUE_HEAD_INIT, nullptr, 0 }
+#define MUTEX_INIT_CLASS(cls) { MUTEX_UNLOCKED, nullptr, WAIT_QUEUE_HEAD_INIT, &(cls), 0 }
+
+static inline void mutex_init(mutex_t* mutex, lock_class_t* cls = nullptr) {
+	mutex->state = MUTEX_UNLOCKED;
+	mutex->owner = nullptr;
+	init_waitqueue_head(&mutex->wait);
+	mutex->lockClass = cls;
+	mutex->acquiredAt = 0;
+}
+
+void mutex_lock_slow(mutex_t* mutex);
+bool mutex_lock_timeout_slow(mutex_t* mutex, uint64_t ns);
+void mutex_wake(mutex_t* mutex);
+
+static inline void mutex_acquired(mutex_t* mutex) {
+	mutex->owner = Scheduler::Current();
+	if (LockStat::enabled && mutex->lockClass) mutex->acquiredAt = LockStat::Acquired(mutex->lockClass, false, 0);
+}
+
+static inline bool mutex_trylock(mutex_t* mutex) {
+	uint32_t expected = MUTEX_UNLOCKED;
+	if (!__atomic_compare_exchange_n(&mutex->state, &expected, MUTEX_LOCKED, false,
+	                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+	mutex_acquired(mutex);
+	return true;
+}
+
+static inline void mutex_lock(mutex_t* mutex) {
+	if (!mutex_trylock(mutex)) mutex_lock_slow(mutex);
+}
+
+// False if it was still held after `ns`
+static inline bool mutex_lock_timeout(mutex_t* mutex, uint64_t ns) {
+	return mutex_trylock(mutex) || mutex_lock_timeout_slow(mutex, ns);
+}
+
+static inline void mutex_unlock(mutex_t* mutex) {
+	if (mutex->acquiredAt) {
+		LockStat::Released(mutex->lockClass, mutex->acquiredAt);
+		mutex->acquiredAt = 0;
+	}
+	mutex->owner = nullptr;
+	if (__atomic_exchange_n(&mutex->state, MUTEX_UNLOCKED, __ATOMIC_RELEASE) == MUTEX_CONTENDED) mutex_wake(mutex);
+}
+
+static inline bool mutex_is_locked(mutex_t* mutex) {
+	return __atomic_load_n(&mutex->state, __ATOMIC_RELAXED) != MUTEX_UNLOCKED;
+}
+
+// Held by the calling thread, for asserting on
+static inline bool mutex_is_owner(mutex_t* mutex) {
+	return mutex->owner == Scheduler::Current();
+}
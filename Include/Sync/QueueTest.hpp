@@ -0,0 +1,23 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: QueueTest.hpp
+// Purpose: Stress tests and benchmarks for SpscRing and MpscQueue
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+namespace QueueTest {
+	// Runs the edge cases on one CPU, then streams sequence numbers through
+	// both queues across CPUs in uneven batches and checks every item
+	// arrives once and in order
+	bool SelfTest();
+
+	// Items per second across CPUs: the ring one at a time and batched,
+	// the MPSC queue one at a time and batched, and a spinlocked list doing
+	// the same job
+	void Benchmark();
+}
@@ -0,0 +1,81 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: RCU.hpp
+// Purpose: Read-copy-update for read-mostly data
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Preempt.hpp>
+
+// Readers take no lock and write nothing shared: a read-side section only
+// holds off preemption on its own CPU. Writers publish a new version with
+// rcu_assign_pointer and free the old one once every CPU has passed a
+// quiescent state (a context switch, user mode, or an interrupt landing
+// outside any read-side section) since it was unlinked. By then no reader
+// can still hold it.
+//
+// Read-side sections nest, may be entered from interrupt handlers, and
+// must not block.
+static inline void rcu_read_lock() {
+	preempt_disable();
+}
+
+static inline void rcu_read_unlock() {
+	preempt_enable();
+}
+
+// A pointer read once, for use in a read-side section. Dependent loads
+// through it are ordered on x86, the compiler just mustn't re-read it.
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+
+// Publishes `v` after everything written to it so far
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// For pointers readers can't see yet, or setting nullptr
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+// Whoever frees through call_rcu embeds one of these
+struct rcu_head;
+typedef void (*rcu_callback_t)(struct rcu_head* head);
+
+struct rcu_head {
+	struct rcu_head* next;
+	rcu_callback_t func;
+	uint64_t gp;                    // grace period that has to end first
+};
+
+// This CPU passed a quiescent state. Locked so the grace period thread
+// can't see it before this CPU's earlier reads are done, or before later
+// ones start.
+static inline void rcu_note_qs() {
+	asm volatile("lock incq %%gs:%c0" :: "i"(__builtin_offsetof(PerCPU::Area, rcuQs)) : "memory", "cc");
+}
+
+// Runs `func` once every read-side section that might still see the
+// object has ended. From any context, including interrupt handlers.
+// Callbacks run in the grace period thread and must not block.
+void call_rcu(rcu_head* head, rcu_callback_t func);
+
+// Waits out a full grace period. Thread context, outside any read-side
+// section.
+void synchronize_rcu();
+
+// Waits until every callback queued so far has run
+void rcu_barrier();
+
+namespace Rcu {
+	// Starts the grace period thread. Before it runs nothing else takes
+	// threads, so synchronize_rcu returns straight away.
+	bool Initialize();
+
+	void PrintStats();
+
+	// Replaces an object readers on every CPU keep checking while
+	// synchronize_rcu decides when to poison the old one, checks call_rcu
+	// waits for a reader already inside, and times both sides
+	bool SelfTest();
+}
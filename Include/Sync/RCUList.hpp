@@ -0,0 +1,121 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: RCUList.hpp
+// Purpose: Intrusive lists readers can walk under rcu_read_lock
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sync/RCU.hpp>
+
+#define container_of(ptr, type, member) ((type*)((char*)(ptr) - __builtin_offsetof(type, member)))
+
+// Circular doubly linked list. Writers serialize among themselves with a
+// lock of their own; readers only ever follow `next`, so an entry is
+// linked in fully before it's published and keeps its `next` after it's
+// taken out, until a grace period has passed.
+struct list_head {
+	struct list_head* next;
+	struct list_head* prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+static inline void INIT_LIST_HEAD(list_head* list) {
+	list->next = list;
+	list->prev = list;
+}
+
+static inline bool list_empty(const list_head* list) {
+	return __atomic_load_n(&list->next, __ATOMIC_RELAXED) == list;
+}
+
+static inline void list_insert_rcu(list_head* entry, list_head* prev, list_head* next) {
+	entry->next = next;
+	entry->prev = prev;
+	rcu_assign_pointer(prev->next, entry);
+	next->prev = entry;
+}
+
+static inline void list_add_rcu(list_head* entry, list_head* head) {
+	list_insert_rcu(entry, head, head->next);
+}
+
+static inline void list_add_tail_rcu(list_head* entry, list_head* head) {
+	list_insert_rcu(entry, head->prev, head);
+}
+
+// Readers may still be on it: only free it after a grace period
+static inline void list_del_rcu(list_head* entry) {
+	entry->next->prev = entry->prev;
+	__atomic_store_n(&entry->prev->next, entry->next, __ATOMIC_RELAXED);
+	entry->prev = nullptr;
+}
+
+static inline void list_replace_rcu(list_head* old, list_head* entry) {
+	entry->next = old->next;
+	entry->prev = old->prev;
+	rcu_assign_pointer(entry->prev->next, entry);
+	entry->next->prev = entry;
+	old->prev = nullptr;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+// Under rcu_read_lock, or the writers' lock
+#define list_for_each_entry_rcu(pos, head, type, member)                                \
+	for (pos = list_entry(rcu_dereference((head)->next), type, member);                 \
+	     &pos->member != (head);                                                        \
+	     pos = list_entry(rcu_dereference(pos->member.next), type, member))
+
+// Writers only, `pos` may be unlinked inside
+#define list_for_each_entry_safe(pos, tmp, head, type, member)                          \
+	for (pos = list_entry((head)->next, type, member),                                  \
+	     tmp = list_entry(pos->member.next, type, member);                              \
+	     &pos->member != (head);                                                        \
+	     pos = tmp, tmp = list_entry(tmp->member.next, type, member))
+
+// Hash bucket lists: a one-pointer head that is empty when zeroed, so a
+// static table needs no initialization
+struct hlist_node {
+	struct hlist_node* next;
+	struct hlist_node** pprev;
+};
+
+struct hlist_head {
+	struct hlist_node* first;
+};
+
+static inline bool hlist_unhashed(const hlist_node* node) {
+	return !node->pprev;
+}
+
+static inline void hlist_add_head_rcu(hlist_node* node, hlist_head* head) {
+	hlist_node* first = head->first;
+	node->next = first;
+	node->pprev = &head->first;
+	if (first) first->pprev = &node->next;
+	rcu_assign_pointer(head->first, node);
+}
+
+static inline void hlist_del_rcu(hlist_node* node) {
+	hlist_node* next = node->next;
+	__atomic_store_n(node->pprev, next, __ATOMIC_RELAXED);
+	if (next) next->pprev = node->pprev;
+	node->pprev = nullptr;
+}
+
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define hlist_for_each_entry_rcu(pos, head, type, member)                               \
+	for (hlist_node* __node = rcu_dereference((head)->first);                           \
+	     __node && ((pos = hlist_entry(__node, type, member)), true);                   \
+	     __node = rcu_dereference(__node->next))
+
+#define hlist_for_each_entry_safe(pos, head, type, member)                              \
+	for (hlist_node* __node = (head)->first, *__next = __node ? __node->next : nullptr; \
+	     __node && ((pos = hlist_entry(__node, type, member)), true);                   \
+	     __node = __next, __next = __node ? __node->next : nullptr)
@@ -0,0 +1,142 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: RWLock.hpp
+// Purpose: Reader-writer spinlocks
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sync/Spinlock.hpp>
+
+// Any number of readers or one writer. A waiting writer holds off new
+// readers so a steady stream of them can't starve it, except readers in
+// interrupt context: one may have interrupted a reader on this CPU that
+// the writer is waiting for. A thread taking the read side twice can
+// deadlock against a writer that came in between.
+#define RWLOCK_WRITER           0x80000000U
+#define RWLOCK_WAITING          0x40000000U     // a writer is spinning
+#define RWLOCK_READERS          0x3FFFFFFFU
+
+typedef struct {
+	volatile uint32_t value;
+	lock_class_t* lockClass;
+	uint64_t acquiredAt;            // write holds only, readers overlap
+} rwlock_t;
+
+#define RWLOCK_INIT { 0, nullptr, 0 }
+#define RWLOCK_INIT_CLASS(cls) { 0, &(cls), 0 }
+
+static inline void rwlock_init(rwlock_t* lock, lock_class_t* cls = nullptr) {
+	lock->value = 0;
+	lock->lockClass = cls;
+	lock->acquiredAt = 0;
+}
+
+static inline bool read_trylock_raw(rwlock_t* lock) {
+	uint32_t blocked = in_interrupt() ? RWLOCK_WRITER : RWLOCK_WRITER | RWLOCK_WAITING;
+	uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+	return !(value & blocked) &&
+	       __atomic_compare_exchange_n(&lock->value, &value, value + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void read_lock(rwlock_t* lock) {
+	preempt_disable();
+	bool timed = LockStat::enabled && lock->lockClass;
+	uint64_t waitStart = timed ? LockStat::Now() : 0;
+
+	bool contended = false;
+	while (!read_trylock_raw(lock)) {
+		contended = true;
+		asm volatile("pause");
+	}
+	// Hold times overlap between readers, only the acquisition is counted
+	if (timed) LockStat::Acquired(lock->lockClass, contended, waitStart);
+}
+
+static inline bool read_trylock(rwlock_t* lock) {
+	preempt_disable();
+	if (read_trylock_raw(lock)) {
+		if (LockStat::enabled && lock->lockClass) LockStat::Acquired(lock->lockClass, false, 0);
+		return true;
+	}
+	preempt_enable_no_resched();
+	return false;
+}
+
+static inline void read_unlock(rwlock_t* lock) {
+	__atomic_fetch_sub(&lock->value, 1, __ATOMIC_RELEASE);
+	preempt_enable();
+}
+
+static inline void write_lock(rwlock_t* lock) {
+	preempt_disable();
+	bool timed = LockStat::enabled && lock->lockClass;
+	uint64_t waitStart = timed ? LockStat::Now() : 0;
+
+	bool contended = false;
+	while (true) {
+		uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+		// Taking it clears WAITING, other writers still spinning set it again
+		if (!(value & (RWLOCK_WRITER | RWLOCK_READERS))) {
+			if (__atomic_compare_exchange_n(&lock->value, &value, RWLOCK_WRITER, false,
+			                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+			continue;
+		}
+		if (!(value & RWLOCK_WAITING)) __atomic_fetch_or(&lock->value, RWLOCK_WAITING, __ATOMIC_RELAXED);
+		contended = true;
+		asm volatile("pause");
+	}
+	if (timed) lock->acquiredAt = LockStat::Acquired(lock->lockClass, contended, waitStart);
+}
+
+static inline bool write_trylock(rwlock_t* lock) {
+	preempt_disable();
+	uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+	if (!(value & (RWLOCK_WRITER | RWLOCK_READERS)) &&
+	    __atomic_compare_exchange_n(&lock->value, &value, RWLOCK_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		if (LockStat::enabled && lock->lockClass)
+			lock->acquiredAt = LockStat::Acquired(lock->lockClass, false, 0);
+		return true;
+	}
+	preempt_enable_no_resched();
+	return false;
+}
+
+static inline void write_release(rwlock_t* lock) {
+	if (lock->acquiredAt) {
+		LockStat::Released(lock->lockClass, lock->acquiredAt);
+		lock->acquiredAt = 0;
+	}
+	// Leaves WAITING for whichever writer set it
+	__atomic_fetch_and(&lock->value, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+static inline void write_unlock(rwlock_t* lock) {
+	write_release(lock);
+	preempt_enable();
+}
+
+static inline uint64_t read_lock_irqsave(rwlock_t* lock) {
+	uint64_t flags = local_irq_save();
+	read_lock(lock);
+	return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t* lock, uint64_t flags) {
+	__atomic_fetch_sub(&lock->value, 1, __ATOMIC_RELEASE);
+	local_irq_restore_resched(flags);
+}
+
+static inline uint64_t write_lock_irqsave(rwlock_t* lock) {
+	uint64_t flags = local_irq_save();
+	write_lock(lock);
+	return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t* lock, uint64_t flags) {
+	write_release(lock);
+	local_irq_restore_resched(flags);
+}
@@ -0,0 +1,92 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: RWSem.hpp
+// Purpose: Sleeping reader-writer locks
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Wait.hpp>
+#include <Sync/LockStat.hpp>
+
+// Any number of readers or one writer, and both sides sleep while they
+// wait, so holders may block or go to disk. A waiting writer holds off
+// new readers, so as with rwlock_t a thread taking the read side twice
+// can deadlock against a writer that came in between. Code that can't
+// block spins on it instead.
+#define RWSEM_WRITER            -1
+
+typedef struct {
+	volatile int32_t count;         // readers holding it, RWSEM_WRITER while a writer does
+	volatile uint32_t writers;      // writers waiting
+	wait_queue_head_t wait;
+	lock_class_t* lockClass;
+	uint64_t acquiredAt;            // write holds only, readers overlap
+} rw_semaphore;
+
+#define RWSEM_INIT { 0, 0, WAIT_QUEUE_HEAD_INIT, nullptr, 0 }
+#define RWSEM_INIT_CLASS(cls) { 0, 0, WAIT_QUEUE_HEAD_INIT, &(cls), 0 }
+
+static inline void init_rwsem(rw_semaphore* sem, lock_class_t* cls = nullptr) {
+	sem->count = 0;
+	sem->writers = 0;
+	init_waitqueue_head(&sem->wait);
+	sem->lockClass = cls;
+	sem->acquiredAt = 0;
+}
+
+static inline bool down_read_trylock(rw_semaphore* sem) {
+	if (__atomic_load_n(&sem->writers, __ATOMIC_RELAXED)) return false;
+	int32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while (count >= 0) {
+		if (__atomic_compare_exchange_n(&sem->count, &count, count + 1, true,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+	}
+	return false;
+}
+
+static inline bool down_write_trylock(rw_semaphore* sem) {
+	int32_t expected = 0;
+	return __atomic_compare_exchange_n(&sem->count, &expected, RWSEM_WRITER, false,
+	                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void down_read(rw_semaphore* sem) {
+	bool timed = LockStat::enabled && sem->lockClass;
+	uint64_t waitStart = timed ? LockStat::Now() : 0;
+	bool contended = !down_read_trylock(sem);
+	if (contended) wait_event(&sem->wait, [sem] { return down_read_trylock(sem); });
+	// Hold times overlap between readers, only the acquisition is counted
+	if (timed) LockStat::Acquired(sem->lockClass, contended, waitStart);
+}
+
+// The last reader out lets a waiting writer in
+static inline void up_read(rw_semaphore* sem) {
+	if (__atomic_sub_fetch(&sem->count, 1, __ATOMIC_RELEASE) == 0) wake_up_all(&sem->wait);
+}
+
+static inline void down_write(rw_semaphore* sem) {
+	bool timed = LockStat::enabled && sem->lockClass;
+	uint64_t waitStart = timed ? LockStat::Now() : 0;
+	bool contended = !down_write_trylock(sem);
+	if (contended) {
+		__atomic_fetch_add(&sem->writers, 1, __ATOMIC_RELAXED);
+		wait_event(&sem->wait, [sem] { return down_write_trylock(sem); });
+		__atomic_fetch_sub(&sem->writers, 1, __ATOMIC_RELAXED);
+	}
+	if (timed) sem->acquiredAt = LockStat::Acquired(sem->lockClass, contended, waitStart);
+}
+
+// Readers held off by waiting writers and the writers themselves all
+// look again
+static inline void up_write(rw_semaphore* sem) {
+	if (sem->acquiredAt) {
+		LockStat::Released(sem->lockClass, sem->acquiredAt);
+		sem->acquiredAt = 0;
+	}
+	__atomic_store_n(&sem->count, 0, __ATOMIC_RELEASE);
+	wake_up_all(&sem->wait);
+}
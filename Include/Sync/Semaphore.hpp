@@ -0,0 +1,50 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Semaphore.hpp
+// Purpose: Counting semaphores
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Wait.hpp>
+
+// A count taken by down and given back by up, which may come from an
+// interrupt handler. Each up wakes at most one sleeper.
+typedef struct {
+	volatile int32_t count;
+	wait_queue_head_t wait;
+} semaphore_t;
+
+#define SEMAPHORE_INIT(count) { (count), WAIT_QUEUE_HEAD_INIT }
+
+static inline void sema_init(semaphore_t* sem, int32_t count) {
+	sem->count = count;
+	init_waitqueue_head(&sem->wait);
+}
+
+// True if there was one to take
+static inline bool down_trylock(semaphore_t* sem) {
+	int32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&sem->count, &count, count - 1, true,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+	}
+	return false;
+}
+
+static inline void down(semaphore_t* sem) {
+	wait_event_exclusive(&sem->wait, [sem] { return down_trylock(sem); });
+}
+
+// False if nothing came up within `ns`
+static inline bool down_timeout(semaphore_t* sem, uint64_t ns) {
+	return wait_event_exclusive_timeout(&sem->wait, [sem] { return down_trylock(sem); }, ns);
+}
+
+static inline void up(semaphore_t* sem) {
+	__atomic_fetch_add(&sem->count, 1, __ATOMIC_RELEASE);
+	wake_up(&sem->wait);
+}
@@ -0,0 +1,136 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Spinlock.hpp
+// Purpose: Busy-waiting locks for SMP
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <Sched/Preempt.hpp>
+#include <Sync/LockStat.hpp>
+
+// Ticket lock: waiters take a number from `next` and get the lock in that
+// order when `owner` reaches it, so no CPU starves under contention. For
+// locks many CPUs hammer at once see MCSLock.hpp, for read-mostly data
+// RWLock.hpp.
+typedef struct {
+	union {
+		volatile uint32_t tickets;
+		struct {
+			volatile uint16_t owner;
+			volatile uint16_t next;
+		};
+	};
+	lock_class_t* lockClass;        // nullptr: not counted by lockstat
+	uint64_t acquiredAt;            // 0 unless lockstat timed this hold
+} spinlock_t;
+
+#define SPINLOCK_TICKET         (1U << 16)
+
+#define SPINLOCK_INIT { { 0 }, nullptr, 0 }
+#define SPINLOCK_INIT_CLASS(cls) { { 0 }, &(cls), 0 }
+
+static inline void spin_lock_init(spinlock_t* lock, lock_class_t* cls = nullptr) {
+	lock->tickets = 0;
+	lock->lockClass = cls;
+	lock->acquiredAt = 0;
+}
+
+// Holders can't be switched away from, so a waiter on the same CPU never
+// spins on a lock whose owner isn't running
+static inline void spin_lock(spinlock_t* lock) {
+	preempt_disable();
+	bool timed = LockStat::enabled && lock->lockClass;
+	uint64_t waitStart = timed ? LockStat::Now() : 0;
+
+	uint32_t tickets = __atomic_fetch_add(&lock->tickets, SPINLOCK_TICKET, __ATOMIC_ACQUIRE);
+	uint16_t ticket = tickets >> 16;
+	bool contended = (uint16_t)tickets != ticket;
+	if (contended) {
+		// Only the owner half changes hands, so the line stays shared
+		// between waiters until the holder writes it
+		while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) asm volatile("pause");
+	}
+	if (timed) lock->acquiredAt = LockStat::Acquired(lock->lockClass, contended, waitStart);
+}
+
+static inline bool spin_trylock(spinlock_t* lock) {
+	preempt_disable();
+	uint32_t tickets = __atomic_load_n(&lock->tickets, __ATOMIC_RELAXED);
+	if ((uint16_t)tickets == (uint16_t)(tickets >> 16) &&
+	    __atomic_compare_exchange_n(&lock->tickets, &tickets, tickets + SPINLOCK_TICKET, false,
+	                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		if (LockStat::enabled && lock->lockClass)
+			lock->acquiredAt = LockStat::Acquired(lock->lockClass, false, 0);
+		return true;
+	}
+	preempt_enable_no_resched();
+	return false;
+}
+
+// Hands the lock to the next ticket, preemption stays as it was
+static inline void spin_release(spinlock_t* lock) {
+	if (lock->acquiredAt) {
+		LockStat::Released(lock->lockClass, lock->acquiredAt);
+		lock->acquiredAt = 0;
+	}
+	// Only the holder writes `owner`
+	__atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+	spin_release(lock);
+	preempt_enable();
+}
+
+static inline bool spin_is_locked(spinlock_t* lock) {
+	uint32_t tickets = __atomic_load_n(&lock->tickets, __ATOMIC_RELAXED);
+	return (uint16_t)tickets != (uint16_t)(tickets >> 16);
+}
+
+// CPUs waiting behind the holder, for spotting a lock that's in demand
+static inline uint32_t spin_waiters(spinlock_t* lock) {
+	uint32_t tickets = __atomic_load_n(&lock->tickets, __ATOMIC_RELAXED);
+	uint16_t queued = (uint16_t)((tickets >> 16) - (uint16_t)tickets);
+	return queued ? queued - 1 : 0;
+}
+
+// Interrupts off with the flags they had, for the IRQ-saving variants
+static inline uint64_t local_irq_save() {
+	uint64_t flags;
+	asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+	return flags;
+}
+
+// Turns interrupts back on if they were, and takes the reschedule the
+// critical section held back
+static inline void local_irq_restore_resched(uint64_t flags) {
+	preempt_enable_no_resched();
+	if (flags & 0x200) {
+		asm volatile("sti" ::: "memory");
+		if (this_cpu()->needResched) Scheduler::PreemptIfNeeded();
+	}
+}
+
+// For locks also taken from interrupt handlers. Returns the flags to hand
+// back to spin_unlock_irqrestore.
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+	uint64_t flags = local_irq_save();
+	spin_lock(lock);
+	return flags;
+}
+
+static inline bool spin_trylock_irqsave(spinlock_t* lock, uint64_t* flags) {
+	*flags = local_irq_save();
+	if (spin_trylock(lock)) return true;
+	if (*flags & 0x200) asm volatile("sti" ::: "memory");
+	return false;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+	spin_release(lock);
+	local_irq_restore_resched(flags);
+}
@@ -0,0 +1,100 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: SpscRing.hpp
+// Purpose: Lock-free ring for one producer and one consumer
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+#include <CPU/CPU.h>
+
+// N slots of T, N a power of two. Only the producer writes `tail` and only
+// the consumer writes `head`, each on its own cache line next to a stale
+// copy of the other index, so a call only touches the other side's line
+// when the copy says the ring is full (or empty). Nothing is locked or
+// read-modify-written: the release store of an index hands over every slot
+// behind it. T is copied in and out, so keep it to a few words.
+//
+// All zeroes is an empty ring, so a static one needs no setup. Indices run
+// freely and wrap at 2^32, which N dividing 2^32 keeps harmless. Which
+// thread is the producer and which the consumer can change, as long as
+// the handover is ordered, for example by a lock or a thread switch.
+template<typename T, uint32_t N>
+class SpscRing {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing size has to be a power of two");
+
+public:
+	static constexpr uint32_t Capacity() { return N; }
+
+	void Reset() {
+		head = tailCache = tail = headCache = 0;
+	}
+
+	// Producer side. Copies in as many of `values` as fit, in order, and
+	// returns how many that was.
+	uint32_t PushBatch(const T* values, uint32_t count) {
+		uint32_t position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		uint32_t free = N - (position - headCache);
+		if (free < count) {
+			// Acquire: the consumer is done copying out of what it freed
+			headCache = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+			free = N - (position - headCache);
+		}
+		if (count > free) count = free;
+		if (!count) return 0;
+
+		for (uint32_t i = 0; i < count; i++) slots[(position + i) & (N - 1)] = values[i];
+		__atomic_store_n(&tail, position + count, __ATOMIC_RELEASE);
+		return count;
+	}
+
+	bool Push(const T& value) {
+		return PushBatch(&value, 1) == 1;
+	}
+
+	// Consumer side. Copies out up to `max` values, oldest first, and
+	// returns how many there were.
+	uint32_t PopBatch(T* values, uint32_t max) {
+		uint32_t position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		uint32_t available = tailCache - position;
+		if (available < max) {
+			// Acquire: the slots behind the producer's tail are filled in
+			tailCache = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+			available = tailCache - position;
+		}
+		if (max > available) max = available;
+		if (!max) return 0;
+
+		for (uint32_t i = 0; i < max; i++) values[i] = slots[(position + i) & (N - 1)];
+		__atomic_store_n(&head, position + max, __ATOMIC_RELEASE);
+		return max;
+	}
+
+	bool Pop(T& value) {
+		return PopBatch(&value, 1) == 1;
+	}
+
+	// From either side, or anyone else for a rough figure
+	uint32_t Size() const {
+		uint32_t consumed = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - consumed;
+	}
+
+	bool Empty() const {
+		return Size() == 0;
+	}
+
+private:
+	// The consumer's line
+	alignas(CACHE_LINE_SIZE) volatile uint32_t head;
+	uint32_t tailCache;
+
+	// The producer's line
+	alignas(CACHE_LINE_SIZE) volatile uint32_t tail;
+	uint32_t headCache;
+
+	alignas(CACHE_LINE_SIZE) T slots[N];
+};
@@ -0,0 +1,19 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: WaitTest.hpp
+// Purpose: Tests for wait queues and the sleeping locks built on them
+// Maintainer: atl
+//
+//===================================================================//
+
+#pragma once
+
+#include <Inferno/stdint.h>
+
+namespace WaitTest {
+	// Contends a mutex from every CPU, streams items through a pair of
+	// semaphores, releases completion, condition variable and futex
+	// waiters one and then all at a time, and checks sleepers use no CPU
+	// and timeouts end on time
+	bool SelfTest();
+}
@@ -2,6 +2,7 @@
 #define _EXT2_H_
 
 #include <stdint.h>
+#include <Sched/Async.hpp>
 
 namespace FS {
 namespace EXT2 {
@@ -145,6 +146,7 @@ uint32_t FindDirectoryInode(int port_num, const char* path);
 bool GetDirectoryInode(int port_num, const char* path, uint32_t* out_inode);
 uint32_t FindFileInode(int port_num, const char* path);
 bool ReadFileContents(int port_num, uint32_t inode_num, char* buffer, uint32_t buffer_size, uint32_t* bytes_read);
+Async::Task<bool> ReadFileContentsAsync(int port_num, uint32_t inode_num, char* buffer, uint32_t buffer_size, uint32_t* bytes_read);
 char* GetFileType(uint8_t type);
 
 } // namespace EXT2
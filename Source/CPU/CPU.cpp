@@ -8,10 +8,12 @@
 #include <Inferno/Log.h>
 #include <CPU/CPU.h>
 #include <CPU/CPUID.h>
+#include <CPU/Features.hpp>
 #include <CPU/VendorID.h>
 
 namespace CPU {
 	void CPUDetect() {
+		DetectFeatures();
 		const char *vendor = VendorID();
 		if (vendor == CPUID_VENDOR_INTEL) {
 			IntelHandler();
@@ -0,0 +1,225 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: FPU.cpp
+// Purpose: x87/SSE/AVX state management for kernel SIMD sections
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <CPU/FPU.h>
+#include <CPU/CPUID.h>
+#include <CPU/PerCPU.hpp>
+#include <Sched/Preempt.hpp>
+#include <Inferno/Log.h>
+
+#define CR0_MP (1UL << 1)
+#define CR0_EM (1UL << 2)
+#define CR0_TS (1UL << 3)
+#define CR0_NE (1UL << 5)
+
+#define CR4_OSFXSR     (1UL << 9)
+#define CR4_OSXMMEXCPT (1UL << 10)
+#define CR4_OSXSAVE    (1UL << 18)
+
+// XCR0 state components
+#define XFEATURE_X87       (1UL << 0)
+#define XFEATURE_SSE       (1UL << 1)
+#define XFEATURE_AVX       (1UL << 2)
+#define XFEATURE_OPMASK    (1UL << 5)
+#define XFEATURE_ZMM_HI256 (1UL << 6)
+#define XFEATURE_HI16_ZMM  (1UL << 7)
+#define XFEATURE_AVX512    (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
+#define MXCSR_DEFAULT 0x1F80
+
+namespace FPU {
+	static bool initialized = false;
+	static bool xsave = false;
+	static bool xsaveopt = false;
+	static uint64_t features = XFEATURE_X87 | XFEATURE_SSE;
+	static uint32_t stateSize = 512;
+
+	// One image per nesting level on each CPU, XSAVE wants 64-byte alignment
+	typedef uint8_t SaveArea[FPU_MAX_STATE_SIZE];
+	static DEFINE_PER_CPU(SaveArea, saveAreas[FPU_MAX_NESTING]) __attribute__((aligned(64)));
+	static DEFINE_PER_CPU(uint32_t, depth);
+
+	static inline uint64_t ReadCR0() {
+		uint64_t value;
+		asm volatile("mov %%cr0, %0" : "=r"(value));
+		return value;
+	}
+
+	static inline void WriteCR0(uint64_t value) {
+		asm volatile("mov %0, %%cr0" :: "r"(value) : "memory");
+	}
+
+	static inline uint64_t ReadCR4() {
+		uint64_t value;
+		asm volatile("mov %%cr4, %0" : "=r"(value));
+		return value;
+	}
+
+	static inline void WriteCR4(uint64_t value) {
+		asm volatile("mov %0, %%cr4" :: "r"(value) : "memory");
+	}
+
+	static inline void WriteXCR0(uint64_t value) {
+		asm volatile("xsetbv" :: "c"(0), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+	}
+
+	// Puts x87 and SSE control state back to the power-on defaults
+	static inline void ResetControlState() {
+		uint32_t mxcsr = MXCSR_DEFAULT;
+		asm volatile("fninit");
+		asm volatile("ldmxcsr %0" :: "m"(mxcsr));
+	}
+
+	static inline void Save(uint8_t* area) {
+		uint32_t low = (uint32_t)features;
+		uint32_t high = (uint32_t)(features >> 32);
+		if (xsaveopt) asm volatile("xsaveopt64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+		else if (xsave) asm volatile("xsave64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+		else asm volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+	}
+
+	static inline void Restore(uint8_t* area) {
+		uint32_t low = (uint32_t)features;
+		uint32_t high = (uint32_t)(features >> 32);
+		if (xsave) asm volatile("xrstor64 (%0)" :: "r"(area), "a"(low), "d"(high) : "memory");
+		else asm volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+	}
+
+	// Size of the XSAVE image for whatever is enabled in XCR0 right now
+	static inline uint32_t EnabledStateSize() {
+		unsigned int eax, ebx, ecx, edx;
+		cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+		return ebx;
+	}
+
+	bool Initialize() {
+		unsigned int maxLeaf, eax, ebx, ecx, edx;
+		cpuid(0, maxLeaf, ebx, ecx, edx);
+		cpuid(1, eax, ebx, ecx, edx);
+		unsigned int features1 = ecx;
+
+		if (!(edx & (1 << 24)) || !(edx & (1 << 25))) {
+			prErr("fpu", "CPU lacks FXSR/SSE, kernel SIMD sections disabled");
+			return false;
+		}
+
+		// Native x87 error reporting, no emulation, no lazy switching traps
+		uint64_t cr0 = ReadCR0();
+		cr0 &= ~(CR0_EM | CR0_TS);
+		cr0 |= CR0_MP | CR0_NE;
+		WriteCR0(cr0);
+
+		uint64_t cr4 = ReadCR4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+		xsave = (features1 >> 26) & 1;
+		if (xsave) cr4 |= CR4_OSXSAVE;
+		WriteCR4(cr4);
+
+		if (xsave && maxLeaf >= 0xD) {
+			cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+			uint64_t supported = eax | ((uint64_t)edx << 32);
+
+			uint64_t wanted = XFEATURE_X87 | XFEATURE_SSE;
+			if (((features1 >> 28) & 1) && (supported & XFEATURE_AVX)) {
+				wanted |= XFEATURE_AVX;
+
+				cpuid_count(7, 0, eax, ebx, ecx, edx);
+				bool avx512f = maxLeaf >= 7 && ((ebx >> 16) & 1);
+				if (avx512f && (supported & XFEATURE_AVX512) == XFEATURE_AVX512) {
+					wanted |= XFEATURE_AVX512;
+				}
+			}
+
+			WriteXCR0(wanted);
+			stateSize = EnabledStateSize();
+			if (stateSize > FPU_MAX_STATE_SIZE) {
+				wanted &= ~XFEATURE_AVX512;
+				WriteXCR0(wanted);
+				stateSize = EnabledStateSize();
+			}
+			features = wanted;
+
+			cpuid_count(0xD, 1, eax, ebx, ecx, edx);
+			xsaveopt = eax & 1;
+		} else {
+			xsave = false;
+			WriteCR4(cr4 & ~CR4_OSXSAVE);
+		}
+
+		ResetControlState();
+		initialized = true;
+
+		prInfo("fpu", "%s, XCR0=0x%x, %d byte state%s%s",
+			xsaveopt ? "XSAVEOPT" : (xsave ? "XSAVE" : "FXSAVE"), (unsigned int)features, stateSize,
+			(features & XFEATURE_AVX) ? ", AVX" : "", (features & XFEATURE_AVX512) ? ", AVX-512" : "");
+		return true;
+	}
+
+	void InitializeAP() {
+		if (!initialized) return;
+
+		uint64_t cr0 = ReadCR0();
+		cr0 &= ~(CR0_EM | CR0_TS);
+		WriteCR0(cr0 | CR0_MP | CR0_NE);
+		WriteCR4(ReadCR4() | CR4_OSFXSR | CR4_OSXMMEXCPT | (xsave ? CR4_OSXSAVE : 0));
+		if (xsave) WriteXCR0(features);
+		ResetControlState();
+	}
+
+	bool IsInitialized() {
+		return initialized;
+	}
+
+	uint32_t GetStateSize() {
+		return stateSize;
+	}
+
+	uint64_t GetEnabledFeatures() {
+		return features;
+	}
+
+	bool HasXSAVE() {
+		return xsave;
+	}
+
+	bool HasAVX() {
+		return (features & XFEATURE_AVX) != 0;
+	}
+
+	bool HasAVX512() {
+		return (features & XFEATURE_AVX512) == XFEATURE_AVX512;
+	}
+}
+
+void kernel_fpu_begin() {
+	if (!FPU::initialized) return;
+
+	// The save areas are this CPU's, so stay on it until kernel_fpu_end
+	preempt_disable();
+
+	// Claim a level before saving. An interrupt landing in between opens
+	// its section one level up and puts the registers back before we save.
+	uint32_t* depth = this_cpu_ptr(&FPU::depth);
+	uint32_t level = __atomic_fetch_add(depth, 1, __ATOMIC_RELAXED);
+	if (level >= FPU_MAX_NESTING) {
+		prErr("fpu", "kernel_fpu_begin nested more than %d deep", FPU_MAX_NESTING);
+		while (true) asm("cli; hlt");
+	}
+
+	FPU::Save(this_cpu_ptr(FPU::saveAreas)[level]);
+	FPU::ResetControlState();
+}
+
+void kernel_fpu_end() {
+	if (!FPU::initialized) return;
+
+	uint32_t* depth = this_cpu_ptr(&FPU::depth);
+	uint32_t level = __atomic_load_n(depth, __ATOMIC_RELAXED) - 1;
+	FPU::Restore(this_cpu_ptr(FPU::saveAreas)[level]);
+	__atomic_fetch_sub(depth, 1, __ATOMIC_RELAXED);
+	preempt_enable();
+}
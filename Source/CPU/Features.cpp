@@ -0,0 +1,211 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Features.cpp
+// Purpose: CPU feature bits and topology, read once from CPUID
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <CPU/Features.hpp>
+#include <CPU/CPUID.h>
+#include <CPU/SMP.hpp>
+#include <Inferno/Log.h>
+
+// Level types in leaves 0xB and 0x1F
+#define TOPOLOGY_LEVEL_SMT      1
+
+namespace CPU {
+	static uint64_t features = 0;
+	static Topology topology = { 0, 0, "none", 0, {} };
+
+	static const char* featureNames[(uint32_t)Feature::Count] = {
+		"erms", "fsrm", "avx", "avx2", "avx512f", "x2apic", "pcid", "invpcid",
+		"tsc-deadline", "invariant-tsc", "1g-pages", "mwait", "arat", "xsave", "hypervisor"
+	};
+
+	static inline void Set(Feature feature, bool present) {
+		if (present) features |= 1ULL << (uint32_t)feature;
+	}
+
+	// Bits needed to number `count` things
+	static inline uint32_t CountBits(uint32_t count) {
+		return count > 1 ? 32 - __builtin_clz(count - 1) : 0;
+	}
+
+	// Leaf 0x1F where it's there, it knows about dies and modules; 0xB
+	// otherwise. The last level's shift moves past everything in a package.
+	static bool ReadExtendedTopology(uint32_t leaf) {
+		unsigned int eax, ebx, ecx, edx;
+		cpuid_count(leaf, 0, eax, ebx, ecx, edx);
+		if (!ebx) return false;
+
+		bool found = false;
+		for (uint32_t subleaf = 0; subleaf < 8; subleaf++) {
+			cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+			uint32_t type = (ecx >> 8) & 0xFF;
+			if (!type) break;
+			uint32_t shift = eax & 0x1F;
+			if (type == TOPOLOGY_LEVEL_SMT) topology.smtShift = shift;
+			topology.packageShift = shift;
+			found = true;
+		}
+		if (found) topology.source = leaf == 0x1F ? "leaf 0x1f" : "leaf 0xb";
+		return found;
+	}
+
+	// Leaf 4 on Intel, 0x8000001D on AMD, same layout
+	static void ReadCaches(uint32_t leaf) {
+		for (uint32_t subleaf = 0; subleaf < 16 && topology.cacheCount < CPU_MAX_CACHES; subleaf++) {
+			unsigned int eax, ebx, ecx, edx;
+			cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+			uint32_t type = eax & 0x1F;
+			if (!type) break;
+
+			CacheInfo* cache = &topology.caches[topology.cacheCount++];
+			cache->level = (eax >> 5) & 7;
+			cache->type = type == 1 ? 'D' : (type == 2 ? 'I' : 'U');
+			cache->lineSize = (ebx & 0xFFF) + 1;
+			cache->ways = ((ebx >> 22) & 0x3FF) + 1;
+			uint32_t partitions = ((ebx >> 12) & 0x3FF) + 1;
+			cache->size = cache->ways * partitions * cache->lineSize * (ecx + 1);
+			cache->shareShift = CountBits(((eax >> 14) & 0xFFF) + 1);
+		}
+	}
+
+	void DetectFeatures() {
+		unsigned int maxLeaf, maxExtLeaf, eax, ebx, ecx, edx;
+		unsigned int vendor;
+		cpuid(0, maxLeaf, vendor, ecx, edx);
+		cpuid(0x80000000, maxExtLeaf, ebx, ecx, edx);
+		bool amd = vendor == 0x68747541;
+
+		cpuid(1, eax, ebx, ecx, edx);
+		uint32_t leaf1Ebx = ebx;
+		bool htt = edx & (1 << 28);
+		Set(Feature::Monitor, ecx & (1 << 3));
+		Set(Feature::PCID, ecx & (1 << 17));
+		Set(Feature::X2APIC, ecx & (1 << 21));
+		Set(Feature::TSCDeadline, ecx & (1 << 24));
+		Set(Feature::XSAVE, ecx & (1 << 26));
+		Set(Feature::AVX, ecx & (1 << 28));
+		Set(Feature::Hypervisor, ecx & (1U << 31));
+
+		if (maxLeaf >= 6) {
+			cpuid(6, eax, ebx, ecx, edx);
+			Set(Feature::ARAT, eax & (1 << 2));
+		}
+		if (maxLeaf >= 7) {
+			cpuid_count(7, 0, eax, ebx, ecx, edx);
+			Set(Feature::AVX2, ebx & (1 << 5));
+			Set(Feature::ERMS, ebx & (1 << 9));
+			Set(Feature::INVPCID, ebx & (1 << 10));
+			Set(Feature::AVX512F, ebx & (1 << 16));
+			Set(Feature::FSRM, edx & (1 << 4));
+		}
+
+		bool topologyExtensions = false;
+		if (maxExtLeaf >= 0x80000001) {
+			cpuid(0x80000001, eax, ebx, ecx, edx);
+			Set(Feature::Pages1G, edx & (1 << 26));
+			topologyExtensions = ecx & (1 << 22);
+		}
+		if (maxExtLeaf >= 0x80000007) {
+			cpuid(0x80000007, eax, ebx, ecx, edx);
+			Set(Feature::InvariantTSC, edx & (1 << 8));
+		}
+
+		bool found = (maxLeaf >= 0x1F && ReadExtendedTopology(0x1F)) || (maxLeaf >= 0xB && ReadExtendedTopology(0xB));
+		if (!found && amd && topologyExtensions && maxExtLeaf >= 0x8000001E) {
+			// Threads per core from 0x8000001E, the APIC ID bits per package
+			// from 0x80000008
+			cpuid(0x8000001E, eax, ebx, ecx, edx);
+			topology.smtShift = CountBits(((ebx >> 8) & 0xFF) + 1);
+			cpuid(0x80000008, eax, ebx, ecx, edx);
+			uint32_t coreBits = (ecx >> 12) & 0xF;
+			topology.packageShift = coreBits ? coreBits : CountBits((ecx & 0xFF) + 1);
+			topology.source = "leaf 0x8000001e";
+			found = true;
+		}
+		if (!found && htt) {
+			// Logical CPUs per package from leaf 1, cores per package from 4
+			topology.packageShift = CountBits((leaf1Ebx >> 16) & 0xFF);
+			uint32_t coreBits = 0;
+			if (!amd && maxLeaf >= 4) {
+				cpuid_count(4, 0, eax, ebx, ecx, edx);
+				coreBits = CountBits(((eax >> 26) & 0x3F) + 1);
+			}
+			topology.smtShift = topology.packageShift > coreBits ? topology.packageShift - coreBits : 0;
+			topology.source = "leaf 1";
+		}
+
+		if (amd && topologyExtensions && maxExtLeaf >= 0x8000001D) ReadCaches(0x8000001D);
+		else if (!amd && maxLeaf >= 4) ReadCaches(4);
+
+		uint32_t present = 0;
+		for (uint64_t bits = features; bits; bits &= bits - 1) present++;
+		prInfo("cpu", "%d of %d features, SMT/package APIC ID bits %d/%d from %s, %d caches", present,
+			(uint32_t)Feature::Count, topology.smtShift, topology.packageShift, topology.source, topology.cacheCount);
+	}
+
+	uint64_t GetFeatures() {
+		return features;
+	}
+
+	const Topology* GetTopology() {
+		return &topology;
+	}
+
+	void Locate(uint32_t apicId, uint32_t* package, uint32_t* core, uint32_t* thread) {
+		*thread = apicId & ((1U << topology.smtShift) - 1);
+		*core = (apicId & ((1U << topology.packageShift) - 1)) >> topology.smtShift;
+		*package = apicId >> topology.packageShift;
+	}
+
+	uint32_t GetCacheSize(uint32_t level) {
+		for (uint32_t i = 0; i < topology.cacheCount; i++) {
+			CacheInfo* cache = &topology.caches[i];
+			if (cache->level == level && cache->type != 'I') return cache->size;
+		}
+		return 0;
+	}
+
+	void PrintFeatures() {
+		kprintf("  features:");
+		for (uint32_t i = 0; i < (uint32_t)Feature::Count; i++) {
+			if (features & (1ULL << i)) kprintf(" %s", featureNames[i]);
+		}
+		kprintf("\n  missing: ");
+		for (uint32_t i = 0; i < (uint32_t)Feature::Count; i++) {
+			if (!(features & (1ULL << i))) kprintf(" %s", featureNames[i]);
+		}
+		kprintf("\n");
+	}
+
+	void PrintTopology() {
+		// Distinct packages and cores among the CPUs the MADT listed
+		uint32_t packages = 0, cores = 0;
+		uint32_t count = SMP::GetCPUCount();
+		for (uint32_t i = 0; i < count; i++) {
+			SMP::CPUInfo* cpu = SMP::GetCPU(i);
+			if (!cpu) continue;
+			bool newPackage = true, newCore = true;
+			for (uint32_t j = 0; j < i; j++) {
+				SMP::CPUInfo* other = SMP::GetCPU(j);
+				if (other->package != cpu->package) continue;
+				newPackage = false;
+				if (other->core == cpu->core) newCore = false;
+			}
+			packages += newPackage;
+			cores += newCore;
+		}
+		if (!SMP::GetCPU(0)) packages = cores = 1;
+		kprintf("  %d package(s), %d core(s), %d thread(s); APIC ID bits: SMT %d, package %d (%s)\n",
+			packages, cores, count, topology.smtShift, topology.packageShift, topology.source);
+
+		for (uint32_t i = 0; i < topology.cacheCount; i++) {
+			CacheInfo* cache = &topology.caches[i];
+			kprintf("  L%d%c %-6d KiB %d-way, %dB lines, shared by up to %d\n", cache->level, cache->type,
+				cache->size / 1024, cache->ways, cache->lineSize, 1U << cache->shareShift);
+		}
+	}
+}
@@ -0,0 +1,169 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: PerCPU.cpp
+// Purpose: Per-CPU data areas reached through GS
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <CPU/PerCPU.hpp>
+#include <CPU/MSR.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Delay.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Memory/Memory.hpp>
+#include <Memory/Paging.hpp>
+#include <Memory/Mem_.hpp>
+#include <Sched/Preempt.hpp>
+#include <Inferno/Log.h>
+
+#define MSR_GS_BASE           0xC0000101
+#define MSR_KERNEL_GS_BASE    0xC0000102
+
+#define PERCPU_TEST_ROUNDS    100000
+
+namespace PerCPU {
+	static Area* areas[SMP_MAX_CPUS];
+	static uint32_t count = 0;
+	static uint64_t areaSize = 0;
+
+	static DEFINE_PER_CPU(uint64_t, testHits);
+	static uint64_t sharedHits = 0;
+
+	Area* Allocate(uint32_t index) {
+		if (index >= SMP_MAX_CPUS) return nullptr;
+		if (areas[index]) return areas[index];
+
+		// Single physical pages behind a contiguous virtual range, the page
+		// after each area is left unmapped
+		uint64_t base = PERCPU_BASE + (uint64_t)index * (areaSize + 0x1000);
+		for (uint64_t offset = 0; offset < areaSize; offset += 0x1000) {
+			void* page = Memory::RequestPage();
+			if (!page) {
+				prErr("percpu", "No memory for CPU %d's area", index);
+				return nullptr;
+			}
+			Paging::MapPage(base + offset, (uint64_t)page);
+		}
+
+		Area* area = (Area*)base;
+		memset(area, 0, PERCPU_HEADER_SIZE);
+		memcpy((uint8_t*)area + PERCPU_HEADER_SIZE, _PerCPUStart, _PerCPUEnd - _PerCPUStart);
+		area->self = area;
+		area->offset = base + PERCPU_HEADER_SIZE - (uint64_t)_PerCPUStart;
+		area->index = index;
+
+		areas[index] = area;
+		if (index >= count) count = index + 1;
+		return area;
+	}
+
+	void EarlyInitialize() {
+		Area* area = (Area*)_PerCPUBoot;
+		memset(area, 0, PERCPU_HEADER_SIZE);
+		area->self = area;
+		CPU::WriteMSR(MSR_GS_BASE, (uint64_t)area);
+		CPU::WriteMSR(MSR_KERNEL_GS_BASE, 0);
+	}
+
+	void Load(uint32_t index) {
+		CPU::WriteMSR(MSR_GS_BASE, (uint64_t)areas[index]);
+		CPU::WriteMSR(MSR_KERNEL_GS_BASE, 0);
+	}
+
+	bool Initialize() {
+		uint64_t size = PERCPU_HEADER_SIZE + (_PerCPUEnd - _PerCPUStart);
+		areaSize = (size + 0xFFF) & ~0xFFFULL;
+
+		// Carries over anything the boot CPU has in its header so far
+		uint32_t preemptCount = this_cpu()->preemptCount;
+		if (!Allocate(0)) return false;
+		areas[0]->preemptCount = preemptCount;
+		Load(0);
+		prInfo("percpu", "%d byte areas at %p, GS on the boot CPU's", (unsigned int)size, (void*)PERCPU_BASE);
+		return true;
+	}
+
+	bool IsInitialized() {
+		return count != 0;
+	}
+
+	uint32_t GetCount() {
+		return count;
+	}
+
+	Area* Get(uint32_t index) {
+		return index < count ? areas[index] : nullptr;
+	}
+
+	static bool SelfTestIPI(Interrupts::Frame*, void*) {
+		this_cpu_inc(testHits);
+		return true;
+	}
+
+	// Every online CPU takes one IPI and must count it in its own copy
+	static bool CheckCopies() {
+		int vector = Interrupts::AllocateVectors(1);
+		if (vector < 0) return false;
+		Interrupts::RegisterHandler(vector, SelfTestIPI, nullptr);
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (areas[i]) *per_cpu_ptr(&testHits, i) = 0;
+		}
+		uint32_t online = SMP::GetOnlineCount();
+		APIC::BroadcastIPI(vector, true);
+		bool arrived = WaitUntil([online] { return per_cpu_sum(testHits) >= online; }, 100 * NSEC_PER_MSEC);
+
+		Interrupts::UnregisterHandler(vector, SelfTestIPI, nullptr);
+		Interrupts::FreeVectors(vector, 1);
+
+		bool passed = arrived;
+		if (!arrived) prErr("percpu", "%d of %d CPUs counted the IPI", (unsigned int)per_cpu_sum(testHits), online);
+		for (uint32_t i = 0; i < SMP::GetCPUCount(); i++) {
+			SMP::CPUInfo* cpu = SMP::GetCPU(i);
+			if (!cpu || !cpu->online || !areas[i]) continue;
+			uint64_t hits = *per_cpu_ptr(&testHits, i);
+			if (hits != 1) {
+				prErr("percpu", "CPU %d's copy counted %d", i, (unsigned int)hits);
+				passed = false;
+			}
+		}
+		return passed;
+	}
+
+	bool SelfTest() {
+		if (!count) {
+			prErr("percpu", "Per-CPU areas not set up");
+			return false;
+		}
+
+		bool passed = true;
+		preempt_disable();
+		if (this_cpu() != areas[this_cpu_id()]) {
+			prErr("percpu", "GS points at %p, not CPU %d's area", this_cpu(), this_cpu_id());
+			passed = false;
+		}
+		preempt_enable();
+		if (APIC::IsEnabled() && !CheckCopies()) passed = false;
+
+		// Both loops on one CPU
+		preempt_disable();
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		uint64_t start = ((uint64_t)high << 32) | low;
+		for (int i = 0; i < PERCPU_TEST_ROUNDS; i++) this_cpu_inc(testHits);
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		uint64_t local = (((uint64_t)high << 32) | low) - start;
+
+		start = ((uint64_t)high << 32) | low;
+		for (int i = 0; i < PERCPU_TEST_ROUNDS; i++) __atomic_fetch_add(&sharedHits, 1, __ATOMIC_RELAXED);
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		uint64_t shared = (((uint64_t)high << 32) | low) - start;
+		preempt_enable();
+
+		prInfo("percpu", "%d areas, increment: %d cycles per-CPU, %d cycles locked", count,
+			(unsigned int)(local / PERCPU_TEST_ROUNDS), (unsigned int)(shared / PERCPU_TEST_ROUNDS));
+		return passed;
+	}
+}
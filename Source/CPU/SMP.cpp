@@ -0,0 +1,228 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: SMP.cpp
+// Purpose: Application processor bring-up and the CPU table
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <CPU/SMP.hpp>
+#include <CPU/Features.hpp>
+#include <CPU/FPU.h>
+#include <CPU/GDT.h>
+#include <CPU/MSR.hpp>
+#include <CPU/PerCPU.hpp>
+#include <Drivers/ACPI/acpi.h>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Delay.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Interrupts/Syscall.hpp>
+#include <Memory/Memory.hpp>
+#include <Memory/Paging.hpp>
+#include <Memory/Mem_.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Inferno/Log.h>
+
+#define MSR_EFER              0xC0000080
+#define EFER_LMA              (1 << 10)
+
+#define AP_START_TIMEOUT_NS   (100 * NSEC_PER_MSEC)
+
+extern "C" char SmpTrampoline[], SmpTrampolineEnd[];
+extern "C" char SmpTrampolineCR3[], SmpTrampolineEFER[], SmpTrampolineStack[];
+extern "C" char SmpTrampolineEntry[], SmpTrampolineArg[];
+
+namespace SMP {
+	static CPUInfo cpus[SMP_MAX_CPUS];
+	static uint32_t cpuCount = 0;
+	static volatile uint32_t onlineCount = 0;
+
+	// What every AP loads once it's in long mode, taken from the BSP
+	static GDT::Descriptor gdtr;
+
+	// The BSP goes in before the MADT is read, its entry there only fills
+	// in the ACPI ID
+	static CPUInfo* AddCPU(uint32_t apicId, uint32_t acpiId) {
+		for (uint32_t i = 0; i < cpuCount; i++) {
+			if (cpus[i].apicId != apicId) continue;
+			cpus[i].acpiId = acpiId;
+			return &cpus[i];
+		}
+		if (cpuCount == SMP_MAX_CPUS) {
+			prWarn("smp", "Ignoring APIC ID %d, only %d CPUs supported", apicId, SMP_MAX_CPUS);
+			return nullptr;
+		}
+
+		CPUInfo* cpu = &cpus[cpuCount];
+		memset(cpu, 0, sizeof(*cpu));
+		cpu->index = cpuCount++;
+		cpu->apicId = apicId;
+		cpu->acpiId = acpiId;
+		CPU::Locate(apicId, &cpu->package, &cpu->core, &cpu->thread);
+		return cpu;
+	}
+
+	// Once the table is complete
+	static void LinkSiblings() {
+		const CPU::Topology* topology = CPU::GetTopology();
+		uint32_t llcShift = 0;
+		for (uint32_t i = 0; i < topology->cacheCount; i++) {
+			const CPU::CacheInfo* cache = &topology->caches[i];
+			if (cache->type != 'I' && cache->shareShift > llcShift) llcShift = cache->shareShift;
+		}
+
+		for (uint32_t i = 0; i < cpuCount; i++) {
+			CPUInfo* cpu = &cpus[i];
+			cpu->siblings = 0;
+			cpu->cacheMask = 0;
+			for (uint32_t j = 0; j < cpuCount; j++) {
+				CPUInfo* other = &cpus[j];
+				if (j != i && other->package == cpu->package && other->core == cpu->core) cpu->siblings |= 1ULL << j;
+				if ((other->apicId >> llcShift) == (cpu->apicId >> llcShift)) cpu->cacheMask |= 1ULL << j;
+			}
+		}
+	}
+
+	static void ParseMADT(ACPI::MADT* madt) {
+		uint8_t* entry = (uint8_t*)madt + sizeof(ACPI::MADT);
+		uint8_t* end = (uint8_t*)madt + madt->header.Length;
+		while (entry + sizeof(ACPI::MADTEntry) <= end) {
+			ACPI::MADTEntry* header = (ACPI::MADTEntry*)entry;
+			if (header->Length < sizeof(ACPI::MADTEntry)) break;
+
+			// Bit 0 enabled, bit 1 can be brought online later; we only take
+			// what's usable now
+			if (header->Type == MADT_LOCAL_APIC) {
+				ACPI::MADTLocalAPIC* lapic = (ACPI::MADTLocalAPIC*)entry;
+				if (lapic->Flags & 1) AddCPU(lapic->APICID, lapic->ProcessorID);
+			} else if (header->Type == MADT_LOCAL_X2APIC) {
+				ACPI::MADTLocalX2APIC* x2apic = (ACPI::MADTLocalX2APIC*)entry;
+				if (x2apic->Flags & 1) AddCPU(x2apic->X2APICID, x2apic->ProcessorUID);
+			}
+			entry += header->Length;
+		}
+	}
+
+	// Contiguous virtual stack over single physical pages, the page below
+	// is left unmapped so an overflow faults
+	static uint64_t MapStack(uint32_t index) {
+		uint64_t bottom = SMP_STACK_BASE + (uint64_t)index * (SMP_STACK_SIZE + 0x1000) + 0x1000;
+		for (uint64_t offset = 0; offset < SMP_STACK_SIZE; offset += 0x1000) {
+			void* page = Memory::RequestPage();
+			if (!page) return 0;
+			Paging::MapPage(bottom + offset, (uint64_t)page);
+		}
+		return bottom + SMP_STACK_SIZE;
+	}
+
+	// First C code on an AP, on its own stack with the trampoline's GDT
+	extern "C" [[noreturn]] void SmpApEntry(CPUInfo* cpu) {
+		LoadGDT(&gdtr);
+		PerCPU::Load(cpu->index);
+		Syscall::Initialize();
+		APIC::InitializeAP();
+		FPU::InitializeAP();
+		Interrupts::LoadIDT();
+
+		cpu->online = true;
+		__atomic_fetch_add(&onlineCount, 1, __ATOMIC_RELEASE);
+
+		Scheduler::StartAP();
+	}
+
+	static bool StartAP(CPUInfo* cpu) {
+		cpu->stackTop = MapStack(cpu->index);
+		if (!cpu->stackTop) {
+			prErr("smp", "No memory for CPU %d's stack", cpu->index);
+			return false;
+		}
+		if (!PerCPU::Allocate(cpu->index)) return false;
+
+		uint8_t* base = (uint8_t*)SMP_TRAMPOLINE_BASE;
+		*(uint64_t*)(base + (SmpTrampolineStack - SmpTrampoline)) = cpu->stackTop;
+		*(uint64_t*)(base + (SmpTrampolineArg - SmpTrampoline)) = (uint64_t)cpu;
+		asm volatile("mfence" ::: "memory");
+
+		// INIT, then up to two SIPIs as the MP spec asks, the second only if
+		// the first didn't take
+		APIC::SendICR(cpu->apicId, APIC_ICR_INIT | APIC_ICR_LEVEL | APIC_ICR_ASSERT);
+		mdelay(10);
+		for (int attempt = 0; attempt < 2; attempt++) {
+			APIC::SendICR(cpu->apicId, APIC_ICR_STARTUP | (SMP_TRAMPOLINE_BASE >> 12));
+			if (WaitUntil([cpu] { return cpu->online; }, attempt ? AP_START_TIMEOUT_NS : 200 * NSEC_PER_USEC)) {
+				return true;
+			}
+		}
+
+		prErr("smp", "CPU %d (APIC ID %d) didn't come up", cpu->index, cpu->apicId);
+		return false;
+	}
+
+	bool Initialize() {
+		uint32_t self = APIC::GetID();
+		CPUInfo* bsp = AddCPU(self, 0);
+		bsp->bsp = true;
+		bsp->online = true;
+		onlineCount = 1;
+
+		ACPI::MADT* madt = (ACPI::MADT*)ACPI::FindTable("APIC");
+		if (!madt) {
+			LinkSiblings();
+			prWarn("smp", "No MADT, running on the boot CPU only");
+			return false;
+		}
+		ParseMADT(madt);
+		LinkSiblings();
+		if (cpuCount == 1) {
+			prInfo("smp", "Single CPU system");
+			return true;
+		}
+
+		// Same address space and EFER (LME, NXE) as the BSP
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0" : "=r"(cr3));
+		if (cr3 >> 32) {
+			prErr("smp", "Page tables above 4GB, the trampoline can't load them");
+			return false;
+		}
+		asm volatile("sgdt %0" : "=m"(gdtr));
+
+		uint8_t* base = (uint8_t*)SMP_TRAMPOLINE_BASE;
+		memcpy(base, SmpTrampoline, SmpTrampolineEnd - SmpTrampoline);
+		*(uint64_t*)(base + (SmpTrampolineCR3 - SmpTrampoline)) = cr3;
+		*(uint64_t*)(base + (SmpTrampolineEFER - SmpTrampoline)) = CPU::ReadMSR(MSR_EFER) & ~EFER_LMA;
+		*(uint64_t*)(base + (SmpTrampolineEntry - SmpTrampoline)) = (uint64_t)SmpApEntry;
+
+		for (uint32_t i = 0; i < cpuCount; i++) {
+			if (!cpus[i].bsp) StartAP(&cpus[i]);
+		}
+
+		prInfo("smp", "%d of %d CPUs online", onlineCount, cpuCount);
+		return true;
+	}
+
+	uint32_t GetCPUCount() {
+		return cpuCount ? cpuCount : 1;
+	}
+
+	uint32_t GetOnlineCount() {
+		return onlineCount ? onlineCount : 1;
+	}
+
+	CPUInfo* GetCPU(uint32_t index) {
+		return index < cpuCount ? &cpus[index] : nullptr;
+	}
+
+	CPUInfo* Current() {
+		return GetCPU(this_cpu_id());
+	}
+
+	void PrintCPUs() {
+		kprintf("  cpu  apic  acpi  pkg  core thread  state\n");
+		for (uint32_t i = 0; i < cpuCount; i++) {
+			CPUInfo* cpu = &cpus[i];
+			kprintf("  %-4d %-5d %-5d %-4d %-4d %-7d %s%s\n", cpu->index, cpu->apicId, cpu->acpiId, cpu->package,
+				cpu->core, cpu->thread, cpu->online ? "online" : "offline", cpu->bsp ? ", boot CPU" : "");
+		}
+	}
+}
@@ -0,0 +1,90 @@
+; Application processor startup. SMP::Initialize copies everything from
+; SmpTrampoline to SmpTrampolineEnd down to SMP_TRAMPOLINE_BASE (below 1MB,
+; where a SIPI can point) and fills in the data block before each INIT-SIPI.
+; The AP arrives in real mode with CS = base >> 4 and IP = 0, switches
+; straight to long mode on the BSP's page tables and calls the C entry.
+; Addresses inside the copy are base + (label - SmpTrampoline), which is
+; why this has to match SMP_TRAMPOLINE_BASE in SMP.hpp.
+
+%define TRAMPOLINE_BASE 0x8000
+%define RELOC(label) (TRAMPOLINE_BASE + (label - SmpTrampoline))
+
+%define CR4_PAE   (1 << 5)
+%define EFER_MSR  0xC0000080
+%define CR0_PE    (1 << 0)
+%define CR0_PG    (1 << 31)
+
+section .identtext
+
+global SmpTrampoline
+global SmpTrampolineEnd
+global SmpTrampolineCR3
+global SmpTrampolineEFER
+global SmpTrampolineStack
+global SmpTrampolineEntry
+global SmpTrampolineArg
+
+[bits 16]
+SmpTrampoline:
+  cli
+  cld
+  mov ax, cs
+  mov ds, ax
+
+  ; ds-relative, so offsets from the start of the copy
+  o32 lgdt [SmpGDTR - SmpTrampoline]
+
+  mov eax, cr4
+  or eax, CR4_PAE
+  mov cr4, eax
+
+  mov eax, [SmpTrampolineCR3 - SmpTrampoline]
+  mov cr3, eax
+
+  ; The BSP's EFER, LME and NXE included
+  mov ecx, EFER_MSR
+  mov eax, [SmpTrampolineEFER - SmpTrampoline]
+  mov edx, [SmpTrampolineEFER - SmpTrampoline + 4]
+  wrmsr
+
+  ; Paging and protection on together lands in compatibility mode, the far
+  ; jump loads the 64-bit code segment
+  mov eax, cr0
+  or eax, CR0_PE | CR0_PG
+  mov cr0, eax
+  jmp dword 0x08:RELOC(SmpLongMode)
+
+[bits 64]
+SmpLongMode:
+  mov ax, 0x10
+  mov ds, ax
+  mov es, ax
+  mov ss, ax
+  xor ax, ax
+  mov fs, ax
+  mov gs, ax
+
+  mov rsp, [RELOC(SmpTrampolineStack)]
+  mov rdi, [RELOC(SmpTrampolineArg)]
+  mov rax, [RELOC(SmpTrampolineEntry)]
+  push qword 0 ; no return, keeps the entry's stack 16-byte aligned
+  jmp rax
+
+align 8
+SmpGDT:
+  dq 0
+  dq 0x00AF9A000000FFFF ; 0x08, 64-bit code
+  dq 0x00CF92000000FFFF ; 0x10, data
+SmpGDTR:
+  dw SmpGDTR - SmpGDT - 1
+  dd RELOC(SmpGDT)
+
+align 8
+SmpTrampolineCR3:   dq 0
+SmpTrampolineEFER:  dq 0
+SmpTrampolineStack: dq 0
+SmpTrampolineEntry: dq 0
+SmpTrampolineArg:   dq 0
+SmpTrampolineEnd:
+
+section .note.GNU-stack noalloc noexec nowrite progbits
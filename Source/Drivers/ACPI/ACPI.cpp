@@ -11,6 +11,7 @@
 #include <Inferno/Log.h>
 #include <Inferno/stdint.h>
 #include <Memory/Mem_.hpp>
+#include <Interrupts/Delay.hpp>
 
 namespace ACPI {
     // Global variables to store ACPI information
@@ -116,14 +117,10 @@ namespace ACPI {
         prInfo("acpi", "Writing ACPI_ENABLE to SMI_CMD");
         outb(facp->SMI_CMD, facp->ACPI_ENABLE);
         
-        // Wait for ACPI to become enabled
-        for (int i = 0; i < 100; i++) {
-            if (inw(facp->PM1a_CNT_BLK) & 1) {
-                prInfo("acpi", "ACPI enabled successfully");
-                return true;
-            }
-            // Small delay
-            for (volatile int j = 0; j < 1000000; j++);
+        // Wait for ACPI to become enabled, firmware gets up to 3 seconds
+        if (WaitUntil([&] { return inw(facp->PM1a_CNT_BLK) & 1; }, 3 * NSEC_PER_SEC)) {
+            prInfo("acpi", "ACPI enabled successfully");
+            return true;
         }
         
         prErr("acpi", "Failed to enable ACPI");
@@ -227,7 +224,7 @@ namespace ACPI {
         }
         
         // Wait a bit to see if shutdown worked
-        for (volatile int i = 0; i < 10000000; i++);
+        mdelay(1000);
         prInfo("acpi", "Standard ACPI shutdown failed");
     }
     
@@ -237,15 +234,15 @@ namespace ACPI {
         
         // Bochs/QEMU shutdown port
         outw(0x604, 0x2000);
-        for (volatile int i = 0; i < 1000000; i++);
+        mdelay(100);
         
         // QEMU newer versions shutdown port
         outw(0xB004, 0x2000);
-        for (volatile int i = 0; i < 1000000; i++);
+        mdelay(100);
         
         // Try QEMU system reset port with shutdown command
         outw(0x64, 0xFE);
-        for (volatile int i = 0; i < 1000000; i++);
+        mdelay(100);
         
         prInfo("acpi", "QEMU/Bochs shutdown failed");
     }
@@ -256,7 +253,7 @@ namespace ACPI {
         
         // APM shutdown
         outb(0xF4, 0x10);
-        for (volatile int i = 0; i < 1000000; i++);
+        mdelay(100);
         
         prInfo("acpi", "APM shutdown failed");
     }
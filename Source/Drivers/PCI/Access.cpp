@@ -40,6 +40,22 @@ uint32_t read_dword(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset)
 	return inl(0xCFC);
 }
 
+static inline void select(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset) {
+	outl(0xCF8, (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xfc) | 0x80000000));
+}
+
+// 16-bit write straight to the word, so neighbouring write-1-to-clear
+// status bits aren't written back
+void write_word(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset, uint16_t value) {
+	select(bus, slot, func, offset);
+	outw(0xCFC + (offset & 2), value);
+}
+
+void write_dword(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset, uint32_t value) {
+	select(bus, slot, func, offset);
+	outl(0xCFC, value);
+}
+
 // Read a BAR (Base Address Register) value
 uint32_t read_bar(uint16_t bus, uint16_t slot, uint16_t func, uint16_t bar_num) {
 	if (bar_num > 5) {
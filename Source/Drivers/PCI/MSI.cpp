@@ -0,0 +1,336 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: MSI.cpp
+// Purpose: PCI capability list walking and MSI/MSI-X vectors
+// Maintainer: aristonl
+//
+//===================================================================//
+
+#include <Drivers/PCI/PCI.h>
+#include <CPU/SMP.hpp>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/IOAPIC.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Inferno/Log.h>
+#include <Inferno/stdint.h>
+
+#define PCI_COMMAND              0x04
+#define PCI_STATUS               0x06
+#define PCI_HEADER_TYPE          0x0E
+#define PCI_CAPABILITY_LIST      0x34
+#define PCI_INTERRUPT_LINE       0x3C
+
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAP_LIST      (1 << 4)
+
+// MSI capability
+#define MSI_CONTROL              0x02
+#define MSI_ADDRESS_LOW          0x04
+#define MSI_ADDRESS_HIGH         0x08
+#define MSI_DATA_32              0x08
+#define MSI_DATA_64              0x0C
+#define MSI_CONTROL_ENABLE       (1 << 0)
+#define MSI_CONTROL_64BIT        (1 << 7)
+
+// MSI-X capability, the table lives in one of the device's BARs
+#define MSIX_CONTROL             0x02
+#define MSIX_TABLE               0x04
+#define MSIX_CONTROL_ENABLE      (1 << 15)
+#define MSIX_CONTROL_MASK_ALL    (1 << 14)
+#define MSIX_ENTRY_SIZE          16
+#define MSIX_VECTOR_MASKED       (1 << 0)
+
+// Messages land in the local APIC's window, fixed delivery, physical
+// destination, edge triggered
+#define MSI_ADDRESS_BASE         0xFEE00000
+#define MSI_ADDRESS_DEST_SHIFT   12
+#define MSI_MAX_APIC_ID          0xFF    // 8 destination bits without interrupt remapping
+
+namespace PCI {
+	uint8_t find_capability(uint16_t bus, uint16_t dev, uint16_t func, uint8_t cap_id, uint8_t start) {
+		uint8_t offset;
+		if (start) {
+			offset = read_word(bus, dev, func, start) >> 8;
+		} else {
+			if (!(read_word(bus, dev, func, PCI_STATUS) & PCI_STATUS_CAP_LIST)) return 0;
+			offset = read_word(bus, dev, func, PCI_CAPABILITY_LIST) & 0xFF;
+		}
+
+		// Bounded, a broken device could point the list back at itself
+		for (int i = 0; i < 48 && offset >= 0x40; i++) {
+			offset &= 0xFC;
+			uint16_t header = read_word(bus, dev, func, offset);
+			if ((header & 0xFF) == cap_id) return offset;
+			offset = header >> 8;
+		}
+		return 0;
+	}
+
+	// Callers keep apic_id within MSI_MAX_APIC_ID, anything wider would
+	// land on another CPU
+	static inline uint32_t msi_address(uint32_t apic_id) {
+		return MSI_ADDRESS_BASE | (apic_id << MSI_ADDRESS_DEST_SHIFT);
+	}
+
+	// The calling CPU if a message can reach it, otherwise the first
+	// online CPU one can
+	static bool reachable_apic_id(uint32_t* apic_id) {
+		*apic_id = APIC::GetID();
+		if (*apic_id <= MSI_MAX_APIC_ID) return true;
+		for (uint32_t i = 0; i < SMP::GetCPUCount(); i++) {
+			SMP::CPUInfo* cpu = SMP::GetCPU(i);
+			if (cpu && cpu->online && cpu->apicId <= MSI_MAX_APIC_ID) {
+				*apic_id = cpu->apicId;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void set_intx(pci_irq_vectors_t* irqs, bool enabled) {
+		uint16_t command = read_word(irqs->bus, irqs->dev, irqs->func, PCI_COMMAND);
+		if (enabled) command &= ~PCI_COMMAND_INTX_DISABLE;
+		else command |= PCI_COMMAND_INTX_DISABLE;
+		write_word(irqs->bus, irqs->dev, irqs->func, PCI_COMMAND, command);
+	}
+
+	static volatile uint32_t* msix_table(uint16_t bus, uint16_t dev, uint16_t func, uint8_t cap) {
+		uint32_t table = read_dword(bus, dev, func, cap + MSIX_TABLE);
+		uint8_t bir = table & 0x7;
+		if (bir > 5) return nullptr;
+
+		uint32_t bar = read_bar(bus, dev, func, bir);
+		if (bar & 1) return nullptr;    // I/O BAR, can't hold the table
+
+		uint64_t base = bar & 0xFFFFFFF0;
+		if ((bar & 0x6) == 0x4 && bir < 5) base |= (uint64_t)read_bar(bus, dev, func, bir + 1) << 32;
+		if (!base) return nullptr;
+		return (volatile uint32_t*)(base + (table & ~0x7));
+	}
+
+	static inline volatile uint32_t* msix_entry(pci_irq_vectors_t* irqs, uint16_t index) {
+		return irqs->msix_table + index * (MSIX_ENTRY_SIZE / 4);
+	}
+
+	static int alloc_msix(pci_irq_vectors_t* irqs, uint16_t min, uint16_t max, uint32_t apic_id) {
+		uint8_t cap = find_capability(irqs->bus, irqs->dev, irqs->func, PCI_CAP_MSIX);
+		if (!cap) return -1;
+
+		uint16_t control = read_word(irqs->bus, irqs->dev, irqs->func, cap + MSIX_CONTROL);
+		uint16_t size = (control & 0x7FF) + 1;
+		uint16_t count = size < max ? size : max;
+		if (count < min) return -1;
+
+		irqs->msix_table = msix_table(irqs->bus, irqs->dev, irqs->func, cap);
+		if (!irqs->msix_table) return -1;
+
+		// Each entry is its own vector, no need for a contiguous block
+		for (uint16_t i = 0; i < count; i++) {
+			int vector = Interrupts::AllocateVectors(1);
+			if (vector < 0) {
+				for (uint16_t j = 0; j < i; j++) Interrupts::FreeVectors(irqs->vectors[j], 1);
+				return -1;
+			}
+			irqs->vectors[i] = vector;
+		}
+
+		// Everything stays masked while the table is filled in
+		write_word(irqs->bus, irqs->dev, irqs->func, cap + MSIX_CONTROL,
+			control | MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK_ALL);
+		for (uint16_t i = 0; i < size; i++) {
+			volatile uint32_t* entry = msix_entry(irqs, i);
+			entry[3] |= MSIX_VECTOR_MASKED;
+			if (i >= count) continue;
+			entry[0] = msi_address(apic_id);
+			entry[1] = 0;
+			entry[2] = irqs->vectors[i];
+		}
+
+		set_intx(irqs, false);
+		write_word(irqs->bus, irqs->dev, irqs->func, cap + MSIX_CONTROL,
+			(control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_MASK_ALL);
+		for (uint16_t i = 0; i < count; i++) msix_entry(irqs, i)[3] &= ~MSIX_VECTOR_MASKED;
+
+		irqs->type = irq_type::msix;
+		irqs->cap = cap;
+		irqs->count = count;
+		return count;
+	}
+
+	static int alloc_msi(pci_irq_vectors_t* irqs, uint16_t min, uint16_t max, uint32_t apic_id) {
+		uint8_t cap = find_capability(irqs->bus, irqs->dev, irqs->func, PCI_CAP_MSI);
+		if (!cap) return -1;
+
+		// The device ORs the message number into the low data bits, so the
+		// count is a power of two and the block aligned to it
+		uint16_t control = read_word(irqs->bus, irqs->dev, irqs->func, cap + MSI_CONTROL);
+		uint8_t log2 = (control >> 1) & 0x7;
+		if (log2 > 5) log2 = 5;
+		while (log2 && (1 << log2) > max) log2--;
+		uint16_t count = 1 << log2;
+		if (count < min) return -1;
+
+		int first = Interrupts::AllocateVectors(count);
+		if (first < 0) return -1;
+		for (uint16_t i = 0; i < count; i++) irqs->vectors[i] = first + i;
+
+		write_word(irqs->bus, irqs->dev, irqs->func, cap + MSI_CONTROL, control & ~MSI_CONTROL_ENABLE);
+		write_dword(irqs->bus, irqs->dev, irqs->func, cap + MSI_ADDRESS_LOW, msi_address(apic_id));
+		if (control & MSI_CONTROL_64BIT) {
+			write_dword(irqs->bus, irqs->dev, irqs->func, cap + MSI_ADDRESS_HIGH, 0);
+			write_word(irqs->bus, irqs->dev, irqs->func, cap + MSI_DATA_64, first);
+		} else {
+			write_word(irqs->bus, irqs->dev, irqs->func, cap + MSI_DATA_32, first);
+		}
+
+		set_intx(irqs, false);
+		control = (control & ~(0x7 << 4)) | (log2 << 4) | MSI_CONTROL_ENABLE;
+		write_word(irqs->bus, irqs->dev, irqs->func, cap + MSI_CONTROL, control);
+
+		irqs->type = irq_type::msi;
+		irqs->cap = cap;
+		irqs->count = count;
+		return count;
+	}
+
+	static int alloc_intx(pci_irq_vectors_t* irqs, uint32_t apic_id) {
+		// The firmware's routing of the INTx pin, 0xFF when it didn't
+		uint8_t line = read_word(irqs->bus, irqs->dev, irqs->func, PCI_INTERRUPT_LINE) & 0xFF;
+		if (line == 0xFF || !IOAPIC::IsInitialized()) return -1;
+
+		int vector = Interrupts::AllocateVectors(1);
+		if (vector < 0) return -1;
+		if (!IOAPIC::RoutePCI(line, vector, apic_id)) {
+			Interrupts::FreeVectors(vector, 1);
+			return -1;
+		}
+
+		set_intx(irqs, true);
+		irqs->type = irq_type::intx;
+		irqs->gsi = line;
+		irqs->count = 1;
+		irqs->vectors[0] = vector;
+		return 1;
+	}
+
+	int alloc_irq_vectors(uint16_t bus, uint16_t dev, uint16_t func, uint16_t min, uint16_t max,
+		uint32_t flags, pci_irq_vectors_t* out) {
+		if (!out || !min || min > max) return -1;
+		if (max > PCI_MAX_IRQ_VECTORS) max = PCI_MAX_IRQ_VECTORS;
+
+		*out = {};
+		out->bus = bus;
+		out->dev = dev;
+		out->func = func;
+
+		uint32_t apic_id;
+		if (!reachable_apic_id(&apic_id)) {
+			prErr("pci", "No CPU with an APIC ID interrupts from %02x:%02x.%d can reach", bus, dev, func);
+			return -1;
+		}
+		int count = -1;
+		if (flags & PCI_IRQ_MSIX) count = alloc_msix(out, min, max, apic_id);
+		if (count < 0 && (flags & PCI_IRQ_MSI)) count = alloc_msi(out, min, max, apic_id);
+		if (count < 0 && (flags & PCI_IRQ_INTX) && min == 1) count = alloc_intx(out, apic_id);
+
+		if (count < 0) {
+			prErr("pci", "No interrupt vectors for %02x:%02x.%d (wanted %d-%d)", bus, dev, func, min, max);
+			return -1;
+		}
+		prDebug("pci", "%02x:%02x.%d: %d %s vector(s) from 0x%02x", bus, dev, func, count,
+			out->type == irq_type::msix ? "MSI-X" : out->type == irq_type::msi ? "MSI" : "INTx",
+			out->vectors[0]);
+		return count;
+	}
+
+	void free_irq_vectors(pci_irq_vectors_t* irqs) {
+		switch (irqs->type) {
+			case irq_type::msix: {
+				for (uint16_t i = 0; i < irqs->count; i++) msix_entry(irqs, i)[3] |= MSIX_VECTOR_MASKED;
+				uint16_t control = read_word(irqs->bus, irqs->dev, irqs->func, irqs->cap + MSIX_CONTROL);
+				write_word(irqs->bus, irqs->dev, irqs->func, irqs->cap + MSIX_CONTROL, control & ~MSIX_CONTROL_ENABLE);
+				for (uint16_t i = 0; i < irqs->count; i++) Interrupts::FreeVectors(irqs->vectors[i], 1);
+				break;
+			}
+			case irq_type::msi: {
+				uint16_t control = read_word(irqs->bus, irqs->dev, irqs->func, irqs->cap + MSI_CONTROL);
+				write_word(irqs->bus, irqs->dev, irqs->func, irqs->cap + MSI_CONTROL, control & ~MSI_CONTROL_ENABLE);
+				Interrupts::FreeVectors(irqs->vectors[0], irqs->count);
+				break;
+			}
+			case irq_type::intx:
+				IOAPIC::Mask(irqs->gsi);
+				Interrupts::FreeVectors(irqs->vectors[0], 1);
+				break;
+			default:
+				return;
+		}
+		set_intx(irqs, true);
+		irqs->type = irq_type::none;
+		irqs->count = 0;
+	}
+
+	bool set_irq_affinity(pci_irq_vectors_t* irqs, uint16_t index, uint32_t apic_id) {
+		if (index >= irqs->count) return false;
+		if (apic_id > MSI_MAX_APIC_ID) {
+			prErr("pci", "Can't target APIC ID %d, 8-bit destinations only", apic_id);
+			return false;
+		}
+
+		switch (irqs->type) {
+			case irq_type::msix: {
+				// Masked across the update so no message goes out half written
+				volatile uint32_t* entry = msix_entry(irqs, index);
+				uint32_t vector_control = entry[3];
+				entry[3] = vector_control | MSIX_VECTOR_MASKED;
+				entry[0] = msi_address(apic_id);
+				entry[3] = vector_control;
+				return true;
+			}
+			case irq_type::msi:
+				write_dword(irqs->bus, irqs->dev, irqs->func, irqs->cap + MSI_ADDRESS_LOW, msi_address(apic_id));
+				return true;
+			case irq_type::intx:
+				return IOAPIC::SetAffinity(irqs->gsi, apic_id);
+			default:
+				return false;
+		}
+	}
+
+	void mask_irq(pci_irq_vectors_t* irqs, uint16_t index) {
+		if (irqs->type == irq_type::msix && index < irqs->count) msix_entry(irqs, index)[3] |= MSIX_VECTOR_MASKED;
+	}
+
+	void unmask_irq(pci_irq_vectors_t* irqs, uint16_t index) {
+		if (irqs->type == irq_type::msix && index < irqs->count) msix_entry(irqs, index)[3] &= ~MSIX_VECTOR_MASKED;
+	}
+
+	static void print_function(uint16_t bus, uint16_t dev, uint16_t func) {
+		uint8_t msi = find_capability(bus, dev, func, PCI_CAP_MSI);
+		uint8_t msix = find_capability(bus, dev, func, PCI_CAP_MSIX);
+		uint8_t line = read_word(bus, dev, func, PCI_INTERRUPT_LINE) & 0xFF;
+
+		kprintf("  %02x:%02x.%d  %04x:%04x  ", bus, dev, func, get_vendor_id(bus, dev, func),
+			get_device_id(bus, dev, func));
+		if (msix) kprintf("MSI-X %-4d ", (read_word(bus, dev, func, msix + MSIX_CONTROL) & 0x7FF) + 1);
+		else kprintf("%-11s", "-");
+		if (msi) kprintf("MSI %-4d ", 1 << ((read_word(bus, dev, func, msi + MSI_CONTROL) >> 1) & 0x7));
+		else kprintf("%-9s", "-");
+		if (line != 0xFF) kprintf("INTx GSI %d\n", line);
+		else kprintf("-\n");
+	}
+
+	void print_irq_capabilities() {
+		kprintf("  device   id         msi-x      msi      intx\n");
+		for (uint16_t bus = 0; bus < 256; bus++) {
+			for (uint16_t dev = 0; dev < 32; dev++) {
+				if (get_vendor_id(bus, dev, 0) == 0xFFFF) continue;
+				bool multi = (read_word(bus, dev, 0, PCI_HEADER_TYPE) & 0xFF) & 0x80;
+				for (uint16_t func = 0; func < (multi ? 8 : 1); func++) {
+					if (get_vendor_id(bus, dev, func) == 0xFFFF) continue;
+					print_function(bus, dev, func);
+				}
+			}
+		}
+	}
+}
@@ -1,10 +1,11 @@
 #include <Inferno/IO.h>
 #include <Inferno/Log.h>
 #include <Inferno/stdint.h>
-#include <Interrupts/HPET.hpp>
+#include <Interrupts/Delay.hpp>
 
 #include <Drivers/ACPI/acpi.h>
 #include <Drivers/PS2/ps2.h>
+#include <Drivers/PS2/ps2_keyboard.h>
 
 #define PS2_STATUS 0x64
 #define PS2_COMMAND 0x64
@@ -18,7 +19,7 @@ namespace PS2 {
 		outb(PS2_COMMAND, 0xAD);
 		prDebug("ps2kb0", "sent disable first port cmd");
 
-		HPET::Wait(10);
+		udelay(10);
 
 		status = inb(PS2_STATUS);
 		prDebug("ps2kb0", "ps2 status reg: %x", status);
@@ -38,7 +39,7 @@ namespace PS2 {
 		prInfo("ps2kb0", "enabling ps/2 controller...");
 
 		outb(0x64, 0xFE);
-		HPET::Wait(200);
+		udelay(200);
 
 		prDebug("ps2kb0", "checking controller status");
 		uint8_t status = inb(0x64);
@@ -46,7 +47,9 @@ namespace PS2 {
 		if (status & 0x02) {
 			prDebug("ps2kb0", "sending command to enable...");
 			outb(0x64, 0xAE);
-			HPET::Wait(200);
+			// Give the controller up to 200ms to answer
+			WaitUntil([] { return inb(0x64) & 0x01; }, 200 * NSEC_PER_MSEC);
+			status = inb(0x64);
 		} else {
 			prErr("ps2kb0", "Error: PS/2 controller input buffer is full. Aborting.");
 			return;
@@ -71,27 +74,16 @@ namespace PS2 {
 		prInfo("ps2kb0", "enabling ps/2 keyboard...");
 
 		uint8_t status;
-		int tries = 0;
-		while (tries < 5) {
-			status = inb(0x64);
-			if (status & 0x62) {
-				prDebug("ps2kb0", "controller ready, status 0x%x", status);
-				break;
-			}
-			prDebug("ps2kb0", "waiting for controller to be ready. status 0x%x", status);
-			HPET::Wait(100);
-			tries++;
-		}
-
-		if (tries == 5) {
-			prErr("ps2kb0", "error: PS/2 controller not ready after 5 attempts.");
+		if (!WaitUntil([&] { status = inb(0x64); return status & 0x62; }, 500 * NSEC_PER_MSEC)) {
+			prErr("ps2kb0", "error: PS/2 controller not ready after 500ms, status 0x%x", status);
 			return;
 		} else {
+			prDebug("ps2kb0", "controller ready, status 0x%x", status);
 
 			prDebug("ps2kb0", "sending keyboard enable command...");
 			outb(0x64, 0xF6);
 			prDebug("ps2kb0", "waiting before getting response");
-			HPET::Wait(100);
+			WaitUntil([] { return inb(0x64) & 0x01; }, 100 * NSEC_PER_MSEC);
 			uint8_t response = inb(0x60);
 			prInfo("ps2kb0", "keyboard response: 0x%x", response);
 
@@ -111,6 +103,7 @@ namespace PS2 {
 			prInfo("ps2kb0", "PS/2 controller detected");
 			enablePS2Controller();
 			enablePS2Keyboard();
+			enableKeyboardIRQ();
 		} else {
 			prWarn("ps2kb0", "No PS/2 Controller detected, skipping initalization");
 		}
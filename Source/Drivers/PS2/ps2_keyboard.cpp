@@ -1,11 +1,90 @@
 #include <Inferno/IO.h>
 #include <Inferno/Log.h>
 #include <Inferno/stdint.h>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sched/Softirq.hpp>
+#include <Sched/Wait.hpp>
+#include <Sync/Spinlock.hpp>
 
 #include <Drivers/PS2/ps2.h>
 
+#define PS2_KEYBOARD_BUFFER 64
+
 namespace PS2 {
+	// With the IRQ on, the handler only takes the scancode off the
+	// controller; logging it and waking the reader happen in the tasklet
+	static DEFINE_LOCK_CLASS(keyClass, "ps2_keyboard");
+	static spinlock_t keyLock = SPINLOCK_INIT_CLASS(keyClass);
+	static uint8_t keyBuffer[PS2_KEYBOARD_BUFFER];
+	static uint32_t keyHead = 0, keyTail = 0, keyLogged = 0;
+	static wait_queue_head_t keyWait = WAIT_QUEUE_HEAD_INIT;
+	static tasklet_struct keyTasklet;
+	static bool keyIRQ = false;
+
+	static bool keyboardInterrupt(Interrupts::Frame*, void*) {
+		if (!(inb(0x64) & 0x01)) return false;
+		spin_lock(&keyLock);
+		while (inb(0x64) & 0x01) {
+			uint8_t scancode = inb(0x60);
+			if (keyHead - keyTail < PS2_KEYBOARD_BUFFER) keyBuffer[keyHead++ % PS2_KEYBOARD_BUFFER] = scancode;
+		}
+		spin_unlock(&keyLock);
+		tasklet_schedule(&keyTasklet);
+		return true;
+	}
+
+	static void keyboardTasklet(void*) {
+		uint64_t flags = spin_lock_irqsave(&keyLock);
+		if (keyHead - keyLogged > PS2_KEYBOARD_BUFFER) keyLogged = keyHead - PS2_KEYBOARD_BUFFER;
+		for (; keyLogged != keyHead; keyLogged++) {
+			prDebug("ps2kb0", "received scancode: 0x%x", keyBuffer[keyLogged % PS2_KEYBOARD_BUFFER]);
+		}
+		bool pending = keyHead != keyTail;
+		spin_unlock_irqrestore(&keyLock, flags);
+		if (pending) wake_up(&keyWait);
+	}
+
+	bool enableKeyboardIRQ() {
+		if (!APIC::IsEnabled()) return false;
+		int vector = Interrupts::AllocateVectors(1);
+		if (vector < 0) return false;
+
+		tasklet_init(&keyTasklet, keyboardTasklet, nullptr);
+		Interrupts::RegisterHandler(vector, keyboardInterrupt, nullptr);
+		if (!APIC::MapIRQ(1, vector)) {
+			Interrupts::UnregisterHandler(vector, keyboardInterrupt, nullptr);
+			Interrupts::FreeVectors(vector, 1);
+			return false;
+		}
+		keyIRQ = true;
+
+		// Controller configuration byte, bit 0 raises IRQ 1 for the first port
+		outb(0x64, 0x20);
+		uint8_t config = inb(0x60);
+		outb(0x64, 0x60);
+		outb(0x60, config | 0x01);
+		prInfo("ps2kb0", "keyboard on IRQ 1, vector 0x%x", vector);
+		return true;
+	}
+
 	uint8_t readKey() {
+		if (keyIRQ) {
+			uint8_t scancode = 0;
+			auto take = [&] {
+				uint64_t flags = spin_lock_irqsave(&keyLock);
+				bool got = keyHead != keyTail;
+				if (got) scancode = keyBuffer[keyTail++ % PS2_KEYBOARD_BUFFER];
+				spin_unlock_irqrestore(&keyLock, flags);
+				return got;
+			};
+			// Callers that can't sleep get 0 rather than a spin
+			if (Scheduler::CanBlock()) wait_event_exclusive(&keyWait, take);
+			else take();
+			return scancode;
+		}
+
 		if (isControllerReady()) {
 			uint8_t scancode = inb(0x60);
 
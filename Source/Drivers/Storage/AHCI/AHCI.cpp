@@ -8,6 +8,7 @@
 
 #include <Drivers/Storage/AHCI/AHCI.h>
 #include <Drivers/PCI/PCI.h>
+#include <Interrupts/APIC.hpp>
 #include <Drivers/TTY/COM.h>
 #include <Memory/Memory.hpp>
 #include <Memory/Heap.hpp>
@@ -16,6 +17,12 @@
 #include <Inferno/Log.h>
 #include <Inferno/IO.h>
 #include <Inferno/stdint.h>
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/Delay.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sched/Softirq.hpp>
+#include <Sync/Spinlock.hpp>
 
 // ATA commands
 #define ATA_CMD_READ_DMA_EXT  0x25
@@ -47,6 +54,143 @@ static ahci_cmd_header_t* cmd_list[AHCI_MAX_PORTS];
 static ahci_received_fis_t* received_fis[AHCI_MAX_PORTS];
 static ahci_cmd_table_t* cmd_tables[AHCI_MAX_PORTS][32]; // 32 command slots per port
 
+// Slots handed out but not issued yet. A slot only shows up in PxCI once
+// it's issued, so without these two CPUs could build commands in the
+// same one.
+static DEFINE_LOCK_CLASS(ahci_port_class, "ahci_port");
+static spinlock_t ahci_port_locks[AHCI_MAX_PORTS];
+static volatile uint32_t ahci_claimed_slots[AHCI_MAX_PORTS];
+
+// Completion interrupt. The handler only acknowledges the HBA and records
+// which ports fired; the tasklet works out which commands finished and
+// wakes the threads sleeping on them.
+static PCI::pci_irq_vectors_t ahci_irqs;
+static bool ahci_irq_enabled = false;
+static tasklet_struct ahci_tasklet;
+static volatile uint32_t ahci_irq_ports = 0;
+static volatile uint32_t ahci_irq_status[AHCI_MAX_PORTS];    // PxIS bits the handler cleared
+static Scheduler::Thread* volatile ahci_waiters[AHCI_MAX_PORTS][32];
+static uint64_t ahci_irq_completions = 0;
+
+// Commands nobody waits on, the tasklet calls back instead. A slot is
+// reserved from before it's built until its callback is claimed, so it
+// isn't handed out again in between; issued says PxCI can be trusted.
+static volatile uint32_t ahci_async_slots[AHCI_MAX_PORTS];
+static volatile uint32_t ahci_async_issued[AHCI_MAX_PORTS];
+static ahci_callback_t ahci_callbacks[AHCI_MAX_PORTS][32];
+static void* ahci_contexts[AHCI_MAX_PORTS][32];
+static uint64_t ahci_async_completions = 0;
+
+// PxIS including what the interrupt handler already acknowledged
+static inline uint32_t ahci_port_status(int port_num) {
+    return hba_memory->ports[port_num].is | ahci_irq_status[port_num];
+}
+
+static void ahci_issue(int port_num, int slot) {
+    __atomic_and_fetch(&ahci_irq_status[port_num], ~AHCI_PORT_INT_TFES, __ATOMIC_RELAXED);
+    hba_memory->ports[port_num].ci = 1 << slot;
+    // PxCI keeps it busy from here on
+    __atomic_and_fetch(&ahci_claimed_slots[port_num], ~(1U << slot), __ATOMIC_RELEASE);
+}
+
+static bool ahci_interrupt(Interrupts::Frame*, void*) {
+    uint32_t pending = hba_memory->is;
+    if (!pending) return false;
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (!(pending & (1U << i))) continue;
+        uint32_t status = hba_memory->ports[i].is;
+        hba_memory->ports[i].is = status;
+        __atomic_fetch_or(&ahci_irq_status[i], status, __ATOMIC_RELAXED);
+    }
+    hba_memory->is = pending;
+    __atomic_fetch_or(&ahci_irq_ports, pending, __ATOMIC_RELEASE);
+    tasklet_schedule(&ahci_tasklet);
+    return true;
+}
+
+static void ahci_complete(void*) {
+    uint32_t ports = __atomic_exchange_n(&ahci_irq_ports, 0, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (!(ports & (1U << i))) continue;
+        uint32_t running = hba_memory->ports[i].ci;
+        bool error = ahci_port_status(i) & AHCI_PORT_INT_TFES;
+        for (int slot = 0; slot < 32; slot++) {
+            if (!ahci_waiters[i][slot] || ((running & (1U << slot)) && !error)) continue;
+            Scheduler::Thread* waiter = __atomic_exchange_n(&ahci_waiters[i][slot], nullptr, __ATOMIC_ACQ_REL);
+            if (!waiter) continue;
+            Scheduler::Wake(waiter);
+            ahci_irq_completions++;
+        }
+
+        // Issued before PxCI is read, so a slot found here isn't one still
+        // on its way to the HBA
+        uint32_t issued = __atomic_load_n(&ahci_async_issued[i], __ATOMIC_ACQUIRE);
+        running = hba_memory->ports[i].ci;
+        for (int slot = 0; slot < 32; slot++) {
+            uint32_t bit = 1U << slot;
+            if (!(issued & bit) || ((running & bit) && !error)) continue;
+            if (!(__atomic_fetch_and(&ahci_async_issued[i], ~bit, __ATOMIC_ACQ_REL) & bit)) continue;
+            ahci_callback_t callback = ahci_callbacks[i][slot];
+            void* context = ahci_contexts[i][slot];
+            __atomic_and_fetch(&ahci_async_slots[i], ~bit, __ATOMIC_RELEASE);
+            ahci_async_completions++;
+            callback(context, ((running & bit) || error) ? 4096 : 0);
+        }
+    }
+}
+
+// Until a command finishes or fails. Sleeps until the completion
+// interrupt when the caller can, spins on the registers otherwise.
+static bool ahci_wait_slot(int port_num, int slot, uint64_t timeout) {
+    volatile ahci_hba_port_t* port = &hba_memory->ports[port_num];
+    auto done = [&] {
+        return !(port->ci & (1 << slot)) || (ahci_port_status(port_num) & AHCI_PORT_INT_TFES);
+    };
+    if (!ahci_irq_enabled || !Scheduler::CanBlock()) return WaitUntil(done, timeout);
+
+    uint64_t deadline = ClockMonotonicNs() + timeout;
+    bool finished = true;
+    while (!done()) {
+        uint64_t now = ClockMonotonicNs();
+        if (now >= deadline) {
+            finished = false;
+            break;
+        }
+        ahci_waiters[port_num][slot] = Scheduler::Current();
+        Scheduler::PrepareToBlock();
+        if (done()) {
+            Scheduler::AbortBlock();
+            break;
+        }
+        Scheduler::BlockTimeout(deadline - now);
+    }
+    ahci_waiters[port_num][slot] = nullptr;
+    return finished || done();
+}
+
+// MSI if the HBA has it, its INTx line otherwise. Polling stays in place
+// for anything that can't sleep.
+static bool ahci_enable_interrupts(uint16_t bus, uint16_t device, uint16_t function) {
+    if (!APIC::IsEnabled()) return false;
+    if (PCI::alloc_irq_vectors(bus, device, function, 1, 1, PCI_IRQ_MSI | PCI_IRQ_INTX, &ahci_irqs) < 1) return false;
+
+    tasklet_init(&ahci_tasklet, ahci_complete, nullptr);
+    Interrupts::RegisterHandler(ahci_irqs.vectors[0], ahci_interrupt, nullptr);
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (!ahci_devices[i].is_present) continue;
+        // Completions: D2H register FIS for non-queued commands, set device
+        // bits for queued ones, next to the error bits already on
+        hba_memory->ports[i].ie |= AHCI_PORT_INT_DHRS | AHCI_PORT_INT_SDBS | AHCI_PORT_INT_PSS |
+            AHCI_PORT_INT_TFES;
+        hba_memory->ports[i].is = 0xFFFFFFFF;
+    }
+    hba_memory->is = 0xFFFFFFFF;
+    ahci_irq_enabled = true;
+    hba_memory->ghc |= AHCI_HBA_GHC_IE;
+    prInfo("ahci", "Command completion by interrupt on vector 0x%x", ahci_irqs.vectors[0]);
+    return true;
+}
+
 // Filesystem type definitions moved to the header file
 
 // Convert a 16-bit word array to a string and trim leading/trailing spaces
@@ -139,17 +283,24 @@ int ahci_check_port_type(volatile ahci_hba_memory_t* hba, int port_num) {
     }
 }
 
-// Find a free command slot in the command list
+// Find a free command slot in the command list and claim it until it's issued
 int ahci_find_command_slot(volatile ahci_hba_memory_t* hba, int port_num) {
+    spinlock_t* lock = &ahci_port_locks[port_num];
+    uint64_t flags = spin_lock_irqsave(lock);
+
     // Get the slots that are free (not in use)
-    uint32_t slots = (hba->ports[port_num].sact | hba->ports[port_num].ci);
+    uint32_t slots = (hba->ports[port_num].sact | hba->ports[port_num].ci | ahci_claimed_slots[port_num] |
+        ahci_async_slots[port_num]);
     
     // There are 32 slots in total
     for (int i = 0; i < 32; i++) {
         if (!(slots & (1 << i))) {
+            ahci_claimed_slots[port_num] |= 1U << i;
+            spin_unlock_irqrestore(lock, flags);
             return i;
         }
     }
+    spin_unlock_irqrestore(lock, flags);
     
     // No free slots
     prErr("ahci", "Cannot find free command slot");
@@ -162,19 +313,12 @@ int ahci_port_stop_cmd(volatile ahci_hba_memory_t* hba, int port_num) {
     hba->ports[port_num].cmd &= ~AHCI_PORT_CMD_ST;
     hba->ports[port_num].cmd &= ~AHCI_PORT_CMD_FRE;
     
-    // Wait until FR and CR are cleared
-    uint64_t timeout = 5000000; // 5 seconds (increased from 500ms)
-    while (timeout--) {
-        if ((hba->ports[port_num].cmd & AHCI_PORT_CMD_FR) ||
-            (hba->ports[port_num].cmd & AHCI_PORT_CMD_CR)) {
-            // Small delay - increased for emulated environment
-            for (int i = 0; i < 10000; i++) { __asm__ volatile("nop"); }
-        } else {
-            break;
-        }
-    }
+    // Wait until FR and CR are cleared, the spec allows 500ms for each
+    bool stopped = WaitUntil([&] {
+        return !(hba->ports[port_num].cmd & (AHCI_PORT_CMD_FR | AHCI_PORT_CMD_CR));
+    }, 1 * NSEC_PER_SEC);
     
-    if (timeout == 0) {
+    if (!stopped) {
         prErr("ahci", "Port %d failed to stop commands", port_num);
         return -1;
     }
@@ -185,7 +329,10 @@ int ahci_port_stop_cmd(volatile ahci_hba_memory_t* hba, int port_num) {
 // Start command processing on a port
 int ahci_port_start_cmd(volatile ahci_hba_memory_t* hba, int port_num) {
     // Wait until CR is cleared
-    while (hba->ports[port_num].cmd & AHCI_PORT_CMD_CR);
+    if (!WaitUntil([&] { return !(hba->ports[port_num].cmd & AHCI_PORT_CMD_CR); }, 500 * NSEC_PER_MSEC)) {
+        prErr("ahci", "Port %d command list still running, can't start it", port_num);
+        return -1;
+    }
     
     // Set FRE and ST
     hba->ports[port_num].cmd |= AHCI_PORT_CMD_FRE;
@@ -196,6 +343,11 @@ int ahci_port_start_cmd(volatile ahci_hba_memory_t* hba, int port_num) {
 
 // Initialize and start a port
 void ahci_port_rebase(int port_num) {
+    spin_lock_init(&ahci_port_locks[port_num], &ahci_port_class);
+    ahci_claimed_slots[port_num] = 0;
+    ahci_async_slots[port_num] = 0;
+    ahci_async_issued[port_num] = 0;
+
     // Stop command processing
     ahci_port_stop_cmd(hba_memory, port_num);
     
@@ -313,34 +465,23 @@ int ahci_identify_device(int port_num) {
     // prInfo("ahci", "Issuing IDENTIFY command...");
     
     // Issue the command
-    port->ci = 1 << slot;
+    ahci_issue(port_num, slot);
     
     // prInfo("ahci", "Waiting for command completion...");
     
-    // Wait for completion
-    uint64_t timeout = 5000000; // Increase timeout to 5 seconds (was 500ms)
-    while (timeout--) {
-        if (!(port->ci & (1 << slot))) {
-            // Command completed
-            // prInfo("ahci", "IDENTIFY command completed successfully");
-            break;
-        }
-        
-        // Check for errors
-        if (port->is & AHCI_PORT_INT_TFES) {
-            prErr("ahci", "IDENTIFY command error on port %d (IS=0x%08x, TFD=0x%08x)", 
-                 port_num, port->is, port->tfd);
-            Heap::Free(identify_data);
-            return -1;
-        }
-        
-        // Small delay - increase delay for emulated environment
-        for (int i = 0; i < 10000; i++) { __asm__ volatile("nop"); }
+    // Wait for completion or a task file error
+    bool finished = ahci_wait_slot(port_num, slot, 5 * NSEC_PER_SEC);
+    
+    if (finished && (port->ci & (1 << slot))) {
+        prErr("ahci", "IDENTIFY command error on port %d (IS=0x%08x, TFD=0x%08x)", 
+             port_num, ahci_port_status(port_num), port->tfd);
+        Heap::Free(identify_data);
+        return -1;
     }
     
-    if (timeout == 0) {
+    if (!finished) {
         // prErr("ahci", "IDENTIFY command timeout on port %d (IS=0x%08x, TFD=0x%08x)", 
-            //  port_num, port->is, port->tfd);
+            //  port_num, ahci_port_status(port_num), port->tfd);
         Heap::Free(identify_data);
         return -1;
     }
@@ -436,20 +577,20 @@ int ahci_port_init(int port_num) {
     return result;
 }
 
-// Read sectors from a device
-int ahci_read_sectors(int port_num, uint64_t start, uint32_t count, void* buffer) {
-    if (port_num >= AHCI_MAX_PORTS || !hba_memory) {
+// Claims a slot and builds a read in it, ready to issue. The slot, or -1
+// if the read can't be done.
+static int ahci_build_read(int port_num, uint64_t start, uint32_t count, void* buffer) {
+    if (port_num < 0 || port_num >= AHCI_MAX_PORTS || !hba_memory) {
         prErr("ahci", "Invalid port number or HBA not initialized");
-        return 4096;  // Error code for invalid parameters
+        return -1;
     }
     
     // Check if device is present
     if (!ahci_devices[port_num].is_present) {
         prErr("ahci", "Device not present on port %d", port_num);
-        return 4096;  // Error code for device not present
+        return -1;
     }
     
-    volatile ahci_hba_port_t* port = &hba_memory->ports[port_num];
     uint32_t sector_size = ahci_devices[port_num].sector_size;
 
     // Validate sector size
@@ -468,7 +609,7 @@ int ahci_read_sectors(int port_num, uint64_t start, uint32_t count, void* buffer
     // Check if count is valid
     if (count == 0) {
         prErr("ahci", "Invalid read sector count: 0");
-        return 4096;  // Error code for invalid parameters
+        return -1;
     }
     
     if (start + count > ahci_devices[port_num].sector_count) {
@@ -483,7 +624,7 @@ int ahci_read_sectors(int port_num, uint64_t start, uint32_t count, void* buffer
     int slot = ahci_find_command_slot(hba_memory, port_num);
     if (slot < 0) {
         prErr("ahci", "No free command slots available");
-        return 4096;  // Error code for no command slots
+        return -1;
     }
     
     // Setup command header
@@ -547,41 +688,40 @@ int ahci_read_sectors(int port_num, uint64_t start, uint32_t count, void* buffer
     cmd_fis->countl = count & 0xFF;
     cmd_fis->counth = (count >> 8) & 0xFF;
     
+    return slot;
+}
+
+// Read sectors from a device
+int ahci_read_sectors(int port_num, uint64_t start, uint32_t count, void* buffer) {
+    int slot = ahci_build_read(port_num, start, count, buffer);
+    if (slot < 0) return 4096;
+    volatile ahci_hba_port_t* port = &hba_memory->ports[port_num];
+
     // Additional logging
     // prInfo("ahci", "Issuing read command: port=%d, sector=%lu, count=%u", 
         //    port_num, (unsigned long)start, count);
     
     // Issue the command
-    port->ci = 1 << slot;
+    ahci_issue(port_num, slot);
     
-    // Wait for completion
-    uint64_t timeout = 20000000; // 20 seconds timeout (increased from 10 seconds)
-    while (timeout--) {
-        if (!(port->ci & (1 << slot))) {
-            // Command completed
-            break;
-        }
-        
-        // Check for errors
-        if (port->is & AHCI_PORT_INT_TFES) {
-            prErr("ahci", "Read command error on port %d (IS=0x%08x, TFD=0x%08x)",
-                 port_num, port->is, port->tfd);
-            return 4096;  // Error code for command error
-        }
-        
-        // Small delay - increased for emulated environment
-        for (int i = 0; i < 10000; i++) { __asm__ volatile("nop"); }
+    // Wait for completion or a task file error
+    bool finished = ahci_wait_slot(port_num, slot, 20 * NSEC_PER_SEC);
+    
+    if (finished && (port->ci & (1 << slot))) {
+        prErr("ahci", "Read command error on port %d (IS=0x%08x, TFD=0x%08x)",
+             port_num, ahci_port_status(port_num), port->tfd);
+        return 4096;  // Error code for command error
     }
     
-    if (timeout == 0) {
+    if (!finished) {
         prErr("ahci", "Read command timeout on port %d after 20 seconds", port_num);
         return 4096;  // Error code for timeout
     }
     
     // Additional check for errors after command completion
-    if (port->is & AHCI_PORT_INT_TFES) {
+    if (ahci_port_status(port_num) & AHCI_PORT_INT_TFES) {
         prErr("ahci", "Read command completed with errors on port %d (IS=0x%08x, TFD=0x%08x)",
-              port_num, port->is, port->tfd);
+              port_num, ahci_port_status(port_num), port->tfd);
         return 4096;  // Error code for command error
     }
     
@@ -591,6 +731,39 @@ int ahci_read_sectors(int port_num, uint64_t start, uint32_t count, void* buffer
     return 0;  // Success
 }
 
+// Issues the read and returns, the callback comes from the completion
+// tasklet. Reads the old way when there's no interrupt to finish it.
+int ahci_submit_read(int port_num, uint64_t start, uint32_t count, void* buffer, ahci_callback_t callback,
+    void* context) {
+    if (!ahci_irq_enabled) {
+        int status = ahci_read_sectors(port_num, start, count, buffer);
+        if (status == 0) callback(context, 0);
+        return status;
+    }
+
+    int slot = ahci_build_read(port_num, start, count, buffer);
+    if (slot < 0) return 4096;
+    uint32_t bit = 1U << slot;
+    ahci_callbacks[port_num][slot] = callback;
+    ahci_contexts[port_num][slot] = context;
+    __atomic_or_fetch(&ahci_async_slots[port_num], bit, __ATOMIC_RELEASE);
+    ahci_issue(port_num, slot);
+    __atomic_or_fetch(&ahci_async_issued[port_num], bit, __ATOMIC_RELEASE);
+
+    // Its interrupt may have come before it was marked issued, have the
+    // tasklet look at the port once more
+    __atomic_fetch_or(&ahci_irq_ports, 1U << port_num, __ATOMIC_RELEASE);
+    tasklet_schedule(&ahci_tasklet);
+    return 0;
+}
+
+Async::Task<int> ahci_read_sectors_async(int port_num, uint64_t start, uint32_t count, void* buffer) {
+    Async::IoRequest request;
+    int status = ahci_submit_read(port_num, start, count, buffer, Async::IoRequest::Complete, &request);
+    if (status) co_return status;
+    co_return co_await request;
+}
+
 // Write sectors to a device
 int ahci_write_sectors(int port_num, uint64_t start, uint32_t count, const void* buffer) {
     if (port_num >= AHCI_MAX_PORTS || !hba_memory) {
@@ -680,28 +853,18 @@ int ahci_write_sectors(int port_num, uint64_t start, uint32_t count, const void*
     cmd_fis->counth = (count >> 8) & 0xFF;
     
     // Issue the command
-    port->ci = 1 << slot;
+    ahci_issue(port_num, slot);
     
-    // Wait for completion
-    uint64_t timeout = 10000000; // 10 seconds timeout (increased from 5 seconds)
-    while (timeout--) {
-        if (!(port->ci & (1 << slot))) {
-            // Command completed
-            break;
-        }
-        
-        // Check for errors
-        if (port->is & AHCI_PORT_INT_TFES) {
-            prErr("ahci", "Write command error on port %d (IS=0x%08x, TFD=0x%08x)",
-                 port_num, port->is, port->tfd);
-            return -1;
-        }
-        
-        // Small delay - increased for emulated environment
-        for (int i = 0; i < 10000; i++) { __asm__ volatile("nop"); }
+    // Wait for completion or a task file error
+    bool finished = ahci_wait_slot(port_num, slot, 10 * NSEC_PER_SEC);
+    
+    if (finished && (port->ci & (1 << slot))) {
+        prErr("ahci", "Write command error on port %d (IS=0x%08x, TFD=0x%08x)",
+             port_num, ahci_port_status(port_num), port->tfd);
+        return -1;
     }
     
-    if (timeout == 0) {
+    if (!finished) {
         prErr("ahci", "Write command timeout on port %d", port_num);
         return -1;
     }
@@ -921,17 +1084,11 @@ int ahci_init_impl(uint16_t vendor_id, uint16_t device_id, uint16_t bus, uint16_
         hba_memory->ghc |= AHCI_GHC_AHCI_ENABLE;
         
         // Wait for AHCI mode to be enabled
-        for (volatile int i = 0; i < (is_qemu ? 100000 : 10000); i++) {
-            if (hba_memory->ghc & AHCI_GHC_AHCI_ENABLE) {
-                prInfo("ahci", "AHCI mode enabled successfully");
-                break;
-            }
-            
-            if (i == (is_qemu ? 99999 : 9999)) {
-                prErr("ahci", "Failed to enable AHCI mode");
-                return -1; // Return failure
-            }
+        if (!WaitUntil([&] { return hba_memory->ghc & AHCI_GHC_AHCI_ENABLE; }, 100 * NSEC_PER_MSEC)) {
+            prErr("ahci", "Failed to enable AHCI mode");
+            return -1; // Return failure
         }
+        prInfo("ahci", "AHCI mode enabled successfully");
     }
     
     // For QEMU, we need to perform an HBA reset
@@ -941,14 +1098,9 @@ int ahci_init_impl(uint16_t vendor_id, uint16_t device_id, uint16_t bus, uint16_
         // Set the reset bit in GHC register
         hba_memory->ghc |= AHCI_HBA_GHC_HR;
         
-        // Wait for the reset to complete (HBA reset bit should be cleared)
-        bool reset_completed = false;
-        for (volatile int i = 0; i < 100000; i++) {
-            if (!(hba_memory->ghc & AHCI_HBA_GHC_HR)) {
-                reset_completed = true;
-                break;
-            }
-        }
+        // Wait for the reset to complete (HBA reset bit should be cleared),
+        // the spec gives the HBA up to a second
+        bool reset_completed = WaitUntil([&] { return !(hba_memory->ghc & AHCI_HBA_GHC_HR); }, 1 * NSEC_PER_SEC);
         
         if (!reset_completed) {
             prErr("ahci", "HBA reset did not complete, continuing anyway...");
@@ -958,13 +1110,7 @@ int ahci_init_impl(uint16_t vendor_id, uint16_t device_id, uint16_t bus, uint16_
         hba_memory->ghc |= AHCI_GHC_AHCI_ENABLE;
         
         // Verify AHCI mode is re-enabled
-        bool ahci_mode_reenabled = false;
-        for (volatile int i = 0; i < 100000; i++) {
-            if (hba_memory->ghc & AHCI_GHC_AHCI_ENABLE) {
-                ahci_mode_reenabled = true;
-                break;
-            }
-        }
+        bool ahci_mode_reenabled = WaitUntil([&] { return hba_memory->ghc & AHCI_GHC_AHCI_ENABLE; }, 100 * NSEC_PER_MSEC);
         
         if (!ahci_mode_reenabled) {
             prErr("ahci", "Failed to re-enable AHCI mode after HBA reset");
@@ -1009,19 +1155,19 @@ int ahci_init_impl(uint16_t vendor_id, uint16_t device_id, uint16_t bus, uint16_
             hba_memory->ports[i].sctl &= ~0xF; // Clear DET bits
             
             // Wait a bit
-            for (volatile int j = 0; j < 100000; j++) {}
+            udelay(100);
             
             // Set initialization bit
             hba_memory->ports[i].sctl |= AHCI_PORT_SCTL_DET_INIT;
             
-            // Wait a bit longer
-            for (volatile int j = 0; j < 500000; j++) {}
+            // COMRESET has to be held for at least 1ms
+            mdelay(1);
             
             // Clear detection again to start normal operation
             hba_memory->ports[i].sctl &= ~0xF;
             
-            // Wait for detection to complete
-            for (volatile int j = 0; j < 1000000; j++) {}
+            // Wait for detection to complete, an empty port never gets there
+            WaitUntil([&] { return (hba_memory->ports[i].ssts & 0xF) == 3; }, 10 * NSEC_PER_MSEC);
             
             // Refresh the port status
             uint32_t ssts = hba_memory->ports[i].ssts;
@@ -1037,7 +1183,7 @@ int ahci_init_impl(uint16_t vendor_id, uint16_t device_id, uint16_t bus, uint16_
             hba_memory->ports[i].cmd |= (1 << 0); // START bit
             
             // Add a small delay to allow QEMU to initialize the port
-            for (volatile int j = 0; j < 1000000; j++) {}
+            mdelay(1);
             
             // Refresh the port status
             ssts = hba_memory->ports[i].ssts;
@@ -1070,6 +1216,8 @@ int ahci_init_impl(uint16_t vendor_id, uint16_t device_id, uint16_t bus, uint16_
         }
     }
     
+    if (devices_found) ahci_enable_interrupts(bus, device, function);
+
     // prInfo("ahci", "AHCI initialization complete. Found %d SATA devices.", devices_found);
     return devices_found;
 }
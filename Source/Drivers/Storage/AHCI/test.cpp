@@ -7,10 +7,16 @@
 //===================================================================//
 
 #include <Drivers/Storage/AHCI/AHCI.h>
+#include <Interrupts/Clock.hpp>
 #include <Memory/Heap.hpp>
+#include <Memory/Mem_.hpp>
+#include <Sched/Async.hpp>
 #include <Inferno/Log.h>
 #include <Inferno/stdint.h>
 
+// Sectors the async test reads one at a time and then all at once
+#define AHCI_TEST_ASYNC_READS 32
+
 // This function demonstrates how to use the AHCI SATA driver
 void test_ahci_sata() {
     prInfo("test", "Starting SATA driver test...");
@@ -141,4 +147,76 @@ void test_ahci_sata() {
 // This function can be called from main.cpp to test the SATA driver
 extern "C" void test_sata_driver() {
     test_ahci_sata();
-} 
\ No newline at end of file
+} 
+
+static Async::Task<> read_all_async(int port_num, uint8_t* buffer, uint32_t sector_size, int* results) {
+    Async::Task<int> reads[AHCI_TEST_ASYNC_READS];
+    for (int i = 0; i < AHCI_TEST_ASYNC_READS; i++) {
+        reads[i] = ahci_read_sectors_async(port_num, i, 1, buffer + i * sector_size);
+    }
+    co_await Async::WhenAll(reads, AHCI_TEST_ASYNC_READS, results);
+}
+
+// Reads the first sectors of the first disk one after the other, then
+// all submitted at once from a task, and checks both got the same data
+bool test_ahci_async() {
+    int port_num = -1;
+    for (int i = 0; i < AHCI_MAX_PORTS; i++) {
+        ahci_device_t* dev = ahci_get_device_info(i);
+        if (dev && dev->is_present) {
+            port_num = i;
+            break;
+        }
+    }
+    if (port_num < 0) {
+        prErr("test", "No SATA device for the async read test");
+        return false;
+    }
+    if (!Async::IsInitialized()) {
+        prErr("test", "Async reads need the executors");
+        return false;
+    }
+
+    uint32_t sector_size = ahci_get_device_info(port_num)->sector_size;
+    uint32_t bytes = sector_size * AHCI_TEST_ASYNC_READS;
+    uint8_t* sequential = (uint8_t*)Heap::Allocate(bytes);
+    uint8_t* concurrent = (uint8_t*)Heap::Allocate(bytes);
+    if (!sequential || !concurrent) {
+        prErr("test", "Failed to allocate buffers for the async read test");
+        if (sequential) Heap::Free(sequential);
+        if (concurrent) Heap::Free(concurrent);
+        return false;
+    }
+    memset(concurrent, 0xA5, bytes);
+
+    bool passed = true;
+    uint64_t start = ClockMonotonicNs();
+    for (int i = 0; i < AHCI_TEST_ASYNC_READS; i++) {
+        if (ahci_read_sectors(port_num, i, 1, sequential + i * sector_size) != 0) passed = false;
+    }
+    uint64_t sequential_ns = ClockMonotonicNs() - start;
+
+    int results[AHCI_TEST_ASYNC_READS];
+    for (int i = 0; i < AHCI_TEST_ASYNC_READS; i++) results[i] = -1;
+    start = ClockMonotonicNs();
+    Async::RunSync(read_all_async(port_num, concurrent, sector_size, results));
+    uint64_t concurrent_ns = ClockMonotonicNs() - start;
+
+    int failed = 0;
+    for (int i = 0; i < AHCI_TEST_ASYNC_READS; i++) if (results[i] != 0) failed++;
+    if (!passed || failed) {
+        prErr("test", "Async read test: %d of %d concurrent reads failed%s", failed, AHCI_TEST_ASYNC_READS,
+              passed ? "" : ", and some sequential ones");
+        passed = false;
+    } else if (memcmp(sequential, concurrent, bytes) != 0) {
+        prErr("test", "Async read test: concurrent reads got different data");
+        passed = false;
+    } else {
+        prInfo("test", "%d sectors: %dus one at a time, %dus submitted together", AHCI_TEST_ASYNC_READS,
+               (unsigned int)(sequential_ns / 1000), (unsigned int)(concurrent_ns / 1000));
+    }
+
+    Heap::Free(sequential);
+    Heap::Free(concurrent);
+    return passed;
+}
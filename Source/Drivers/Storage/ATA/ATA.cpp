@@ -31,6 +31,7 @@
 
 #include <Inferno/IO.h>
 #include <Inferno/Log.h>
+#include <Interrupts/Delay.hpp>
 
 #include <Drivers/Storage/ATA/ATA.h>
 
@@ -57,26 +58,27 @@ char* readStatusStr(void) {
 	}
 }
 
-void waitNotBusy(void) {
-	while (readStatus() & ATA_STATUS_BSY);
+bool waitNotBusy(void) {
+	if (WaitUntil([] { return !(readStatus() & ATA_STATUS_BSY); }, ATA_BUSY_TIMEOUT_NS)) return true;
+	prErr("ata", "device still busy after %ds", (int)(ATA_BUSY_TIMEOUT_NS / NSEC_PER_SEC));
+	return false;
 }
 
-void waitReady(void) {
-	while (!(readStatus() & ATA_STATUS_DRDY));
+bool waitReady(void) {
+	if (WaitUntil([] { return readStatus() & ATA_STATUS_DRDY; }, ATA_READY_TIMEOUT_NS)) return true;
+	prErr("ata", "device not ready after %dms", (int)(ATA_READY_TIMEOUT_NS / NSEC_PER_MSEC));
+	return false;
 }
 
 void selectDev(uint8_t dev) {
-	int i;
-
 	prDebug("ata", "selectDev()");
 
 	if (dev != lastSelectedDev) {
 		outb(ATA_PRIMARY_DRIVE_PORT, dev);
 		lastSelectedDev = dev;
 
-		for (i = 0; i < 15; i++) {
-			inb(ATA_PRIMARY_ALT_STATUS_PORT);
-		}
+		// Status isn't valid until 400ns after a drive select
+		ndelay(400);
 	}
 }
 
@@ -84,7 +86,7 @@ int identDev(AtaIDDeviceData* devInfo) {
 	int i;
 
 	selectDev(ATA_MASTER_DRIVE);
-	waitNotBusy();
+	if (!waitNotBusy()) return 0;
 
 	outb(ATA_PRIMARY_SECTOR_COUNT_PORT, 0);
 	outb(ATA_PRIMARY_LBA_LOW_PORT, 0);
@@ -97,24 +99,21 @@ int identDev(AtaIDDeviceData* devInfo) {
 		return 0;
 	}
 
-	waitNotBusy();
+	if (!waitNotBusy()) return 0;
 
 	if (inb(ATA_PRIMARY_LBA_MID_PORT) != 0 || inb(ATA_PRIMARY_LBA_HIGH_PORT) != 0) {
 		prErr("ata", "not an ata device");
 		return 0;
 	}
 
-	while (1) {
-		status = readStatus();
-
-		if (status & ATA_STATUS_ERR) {
-			prErr("ata", "error during device identification");
-			return 0;
-		}
-
-		if (status & ATA_STATUS_DRQ) break;
+	if (!WaitUntil([] { return readStatus() & (ATA_STATUS_ERR | ATA_STATUS_DRQ); }, ATA_READY_TIMEOUT_NS)) {
+		prErr("ata", "timed out waiting for identification data");
+		return 0;
+	}
 
-		// TODO: add timeout error
+	if (readStatus() & ATA_STATUS_ERR) {
+		prErr("ata", "error during device identification");
+		return 0;
 	}
 
 	uint16_t* data = (uint16_t*)devInfo;
@@ -152,10 +151,10 @@ int detectDev(void) {
 	return 1; // drive detected
 }
 
-void setupDriveReadWrite(uint8_t dev, uint32_t lba, uint8_t sectorCnt) {
+// False if the drive never got ready, and nothing was written to it
+bool setupDriveReadWrite(uint8_t dev, uint32_t lba, uint8_t sectorCnt) {
 	selectDev(ATA_MASTER_DRIVE);
-	waitNotBusy();
-	waitReady();
+	if (!waitNotBusy() || !waitReady()) return false;
 
 	uint8_t driveByte = (dev == ATA_SLAVE_DRIVE) ? 0xF0 : 0xE0;
 
@@ -164,6 +163,7 @@ void setupDriveReadWrite(uint8_t dev, uint32_t lba, uint8_t sectorCnt) {
 	outb(ATA_PRIMARY_LBA_LOW_PORT, (uint8_t)(lba));
 	outb(ATA_PRIMARY_LBA_MID_PORT, (uint8_t)(lba >> 8));
 	outb(ATA_PRIMARY_LBA_HIGH_PORT, (uint8_t)(lba >> 16));
+	return true;
 }
 
 // TODO: implement read/write sectors
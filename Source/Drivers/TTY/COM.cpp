@@ -12,9 +12,17 @@
 #include <Inferno/string.h>
 #include <Drivers/TTY/COM.h>
 #include <Drivers/Graphics/Framebuffer.h>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sched/Softirq.hpp>
+#include <Sched/Wait.hpp>
+#include <Sync/Spinlock.hpp>
 
 #include <Inferno/Log.h>
 
+#define SERIAL_RING_SIZE 256
+
 Framebuffer* fb_;
 
 bool COM1Active = false;
@@ -41,9 +49,80 @@ void InitializeSerialDevice() {
 
 int SerialRecieveEvent() { return inb(0x3f8 + 5) & 1; }
 
+// Once EnableSerialInterrupts has run the interrupt only empties the UART
+// into the ring, a tasklet wakes a reader waiting for input
+static DEFINE_LOCK_CLASS(serialClass, "serial");
+static spinlock_t serialLock = SPINLOCK_INIT_CLASS(serialClass);
+static char serialRing[SERIAL_RING_SIZE];
+static uint32_t serialHead = 0, serialTail = 0;
+static uint32_t serialDropped = 0;
+static wait_queue_head_t serialWait = WAIT_QUEUE_HEAD_INIT;
+static tasklet_struct serialTasklet;
+static bool serialIRQ = false;
+
+// Caller holds serialLock
+static void SerialDrain() {
+	while (SerialRecieveEvent()) {
+		char c = inb(0x3f8);
+		if (serialHead - serialTail < SERIAL_RING_SIZE) serialRing[serialHead++ % SERIAL_RING_SIZE] = c;
+		else serialDropped++;
+	}
+}
+
+static bool SerialInterrupt(Interrupts::Frame*, void*) {
+	// IIR bit 0 set: not us
+	if (inb(0x3f8 + 2) & 1) return false;
+	spin_lock(&serialLock);
+	SerialDrain();
+	spin_unlock(&serialLock);
+	tasklet_schedule(&serialTasklet);
+	return true;
+}
+
+static void SerialWakeReader(void*) {
+	if (__atomic_load_n(&serialHead, __ATOMIC_RELAXED) != __atomic_load_n(&serialTail, __ATOMIC_RELAXED)) {
+		wake_up(&serialWait);
+	}
+}
+
+bool EnableSerialInterrupts() {
+	if (!COM1Active || !APIC::IsEnabled()) return false;
+	int vector = Interrupts::AllocateVectors(1);
+	if (vector < 0) return false;
+
+	tasklet_init(&serialTasklet, SerialWakeReader, nullptr);
+	Interrupts::RegisterHandler(vector, SerialInterrupt, nullptr);
+	if (!APIC::MapIRQ(4, vector)) {
+		Interrupts::UnregisterHandler(vector, SerialInterrupt, nullptr);
+		Interrupts::FreeVectors(vector, 1);
+		return false;
+	}
+	serialIRQ = true;
+	// Received data available, nothing for the transmit side
+	outb(0x3f8 + 1, 0x01);
+	prInfo("kernel", "serial input by interrupt on vector 0x%x", vector);
+	return true;
+}
+
 char AwaitSerialResponse() {
-	while (SerialRecieveEvent() == 0);
-	return inb(0x3f8);
+	if (!serialIRQ) {
+		while (SerialRecieveEvent() == 0) asm volatile("pause");
+		return inb(0x3f8);
+	}
+
+	// Nobody can wake a caller that mustn't block, wait_event has it spin
+	// and it empties the UART itself
+	bool block = Scheduler::CanBlock();
+	char c = 0;
+	wait_event_exclusive(&serialWait, [&] {
+		uint64_t flags = spin_lock_irqsave(&serialLock);
+		if (!block) SerialDrain();
+		bool got = serialHead != serialTail;
+		if (got) c = serialRing[serialTail++ % SERIAL_RING_SIZE];
+		spin_unlock_irqrestore(&serialLock, flags);
+		return got;
+	});
+	return c;
 }
 
 int SerialWait() { return inb(0x3f8 + 5) & 0x20; }
@@ -0,0 +1,217 @@
+#include <Inferno/StringBench.hpp>
+#include <Inferno/string.h>
+#include <Inferno/Log.h>
+#include <Memory/Heap.hpp>
+#include <Memory/Mem_.hpp>
+
+namespace StringBench {
+    #define FUZZ_ITERATIONS 20000
+    #define FUZZ_MAX_LENGTH 200
+    #define FUZZ_PAGE_SIZE 4096
+
+    // The byte-wise routines the word-at-a-time versions replaced, with
+    // strchr/strrchr following the C semantics for c == 0 and c > 127
+    namespace Reference {
+        static size_t strlen(const char* str) {
+            const char* s = str;
+            while (*s) s++;
+            return s - str;
+        }
+
+        static int strcmp(const char* str1, const char* str2) {
+            while (*str1 && (*str1 == *str2)) {
+                str1++;
+                str2++;
+            }
+            return *(unsigned char*)str1 - *(unsigned char*)str2;
+        }
+
+        static char* strchr(const char* str, int c) {
+            while (*str != (char)c) {
+                if (*str == 0) return NULL;
+                str++;
+            }
+            return (char*)str;
+        }
+
+        static char* strrchr(const char* str, int c) {
+            const char* last = NULL;
+            do {
+                if (*str == (char)c) last = str;
+            } while (*str++);
+            return (char*)last;
+        }
+
+        static int memcmp(const void* ptr1, const void* ptr2, size_t num) {
+            const uint8_t* p1 = (const uint8_t*)ptr1;
+            const uint8_t* p2 = (const uint8_t*)ptr2;
+            for (size_t i = 0; i < num; i++) {
+                if (p1[i] != p2[i]) return p1[i] - p2[i];
+            }
+            return 0;
+        }
+    }
+
+    static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+
+    static inline uint64_t Random() {
+        rngState ^= rngState << 13;
+        rngState ^= rngState >> 7;
+        rngState ^= rngState << 17;
+        return rngState;
+    }
+
+    // Non-zero bytes, biased towards the values that trip up SWAR tricks
+    static inline char RandomChar() {
+        static const unsigned char tricky[] = { 0x01, 0x7F, 0x80, 0x81, 0xFE, 0xFF, 'a', 'b' };
+        uint64_t r = Random();
+        if (r & 1) return (char)tricky[(r >> 1) & 7];
+        unsigned char c = (unsigned char)(r >> 8);
+        return c ? (char)c : 'z';
+    }
+
+    static inline int Sign(int v) {
+        return (v > 0) - (v < 0);
+    }
+
+    static inline uint64_t ReadTSC() {
+        uint32_t low, high;
+        asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high) :: "memory");
+        return ((uint64_t)high << 32) | low;
+    }
+
+    // Places a string of `length` either flush against the end of the page
+    // or at a random small offset into it
+    static char* Place(char* page, uint64_t length, bool atPageEnd) {
+        if (atPageEnd) return page + FUZZ_PAGE_SIZE - (length + 1);
+        return page + 256 + (Random() & 15);
+    }
+
+    bool Verify() {
+        // Two whole pages, so strings can end exactly on a page boundary
+        uint8_t* area = (uint8_t*)malloc(FUZZ_PAGE_SIZE * 3);
+        if (!area) {
+            prErr("strbench", "Failed to allocate fuzz buffers");
+            return false;
+        }
+        char* page1 = (char*)(((uintptr_t)area + FUZZ_PAGE_SIZE - 1) & ~(uintptr_t)(FUZZ_PAGE_SIZE - 1));
+        char* page2 = page1 + FUZZ_PAGE_SIZE;
+
+        int failures = 0;
+        for (int iter = 0; iter < FUZZ_ITERATIONS; iter++) {
+            uint64_t len1 = Random() % (FUZZ_MAX_LENGTH + 1);
+            char* s1 = Place(page1, len1, (iter & 3) == 0);
+            for (uint64_t i = 0; i < len1; i++) s1[i] = RandomChar();
+            s1[len1] = 0;
+
+            if (strlen(s1) != Reference::strlen(s1) && failures++ < 8) {
+                prErr("strbench", "strlen mismatch: len=%d off=%d", (int)len1, (int)((uintptr_t)s1 & 7));
+            }
+
+            // Search for a byte that's in the string, the terminator or anything at all
+            int c;
+            uint64_t pick = Random() % 4;
+            if (pick == 0 && len1) c = (unsigned char)s1[Random() % len1];
+            else if (pick == 1) c = 0;
+            else c = (int)(Random() & 0x1FF) - 0x80;
+
+            if (strchr(s1, c) != Reference::strchr(s1, c) && failures++ < 8) {
+                prErr("strbench", "strchr mismatch: len=%d c=0x%x", (int)len1, c);
+            }
+            if (strrchr(s1, c) != Reference::strrchr(s1, c) && failures++ < 8) {
+                prErr("strbench", "strrchr mismatch: len=%d c=0x%x", (int)len1, c);
+            }
+
+            // A second string that's equal, differs somewhere or has another length
+            uint64_t len2 = len1;
+            uint64_t mutation = Random() % 3;
+            if (mutation == 2) len2 = Random() % (FUZZ_MAX_LENGTH + 1);
+            char* s2 = Place(page2, len2, (iter & 7) == 1);
+            for (uint64_t i = 0; i < len2; i++) s2[i] = i < len1 ? s1[i] : RandomChar();
+            s2[len2] = 0;
+            if (mutation == 1 && len2) s2[Random() % len2] = (char)(Random() & 0xFF);
+
+            if (Sign(strcmp(s1, s2)) != Sign(Reference::strcmp(s1, s2)) && failures++ < 8) {
+                prErr("strbench", "strcmp mismatch: len=%d/%d", (int)len1, (int)len2);
+            }
+
+            uint64_t n = len1 < len2 ? len1 : len2;
+            if (memcmp(s1, s2, n) != Reference::memcmp(s1, s2, n) && failures++ < 8) {
+                prErr("strbench", "memcmp mismatch: n=%d", (int)n);
+            }
+        }
+
+        free(area);
+
+        if (failures) {
+            prErr("strbench", "Fuzzing FAILED with %d mismatches", failures);
+            return false;
+        }
+        prInfo("strbench", "Fuzzing passed (%d iterations)", FUZZ_ITERATIONS);
+        return true;
+    }
+
+    template<typename Op>
+    static uint64_t CyclesPerCall(Op op, uint64_t iterations) {
+        op();
+        uint64_t start = ReadTSC();
+        for (uint64_t i = 0; i < iterations; i++) op();
+        uint64_t end = ReadTSC();
+        return (end - start) / iterations;
+    }
+
+    // Keeps a result alive without letting the compiler reason about it
+    template<typename T>
+    static inline void Consume(T value) {
+        asm volatile("" :: "r"(value));
+    }
+
+    void Run() {
+        if (!Verify()) return;
+
+        static const uint64_t lengths[] = { 7, 16, 64, 256, 1024, 4000 };
+        const uint64_t maxLength = 4000;
+        char* a = (char*)malloc(maxLength + 16);
+        char* b = (char*)malloc(maxLength + 16);
+        if (!a || !b) {
+            prErr("strbench", "Failed to allocate benchmark buffers");
+            free(a);
+            free(b);
+            return;
+        }
+
+        kprintf("String op cost in TSC cycles per call (word-at-a-time / byte-wise)\n");
+        kprintf("  length        strlen          strcmp          strchr         strrchr          memcmp\n");
+
+        for (uint64_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            uint64_t length = lengths[l];
+            // Odd offsets so nothing starts out conveniently aligned
+            char* s1 = a + 3;
+            char* s2 = b + 5;
+            for (uint64_t i = 0; i < length; i++) s1[i] = s2[i] = 'a' + (i % 26);
+            s1[length] = s2[length] = 0;
+
+            uint64_t iterations = 200000 / length + 16;
+            uint64_t results[10];
+            results[0] = CyclesPerCall([&] { Consume(strlen(s1)); }, iterations);
+            results[1] = CyclesPerCall([&] { Consume(Reference::strlen(s1)); }, iterations);
+            results[2] = CyclesPerCall([&] { Consume(strcmp(s1, s2)); }, iterations);
+            results[3] = CyclesPerCall([&] { Consume(Reference::strcmp(s1, s2)); }, iterations);
+            results[4] = CyclesPerCall([&] { Consume(strchr(s1, '#')); }, iterations);
+            results[5] = CyclesPerCall([&] { Consume(Reference::strchr(s1, '#')); }, iterations);
+            results[6] = CyclesPerCall([&] { Consume(strrchr(s1, 'a')); }, iterations);
+            results[7] = CyclesPerCall([&] { Consume(Reference::strrchr(s1, 'a')); }, iterations);
+            results[8] = CyclesPerCall([&] { Consume(memcmp(s1, s2, length)); }, iterations);
+            results[9] = CyclesPerCall([&] { Consume(Reference::memcmp(s1, s2, length)); }, iterations);
+
+            kprintf("%8u", (unsigned int)length);
+            for (int r = 0; r < 10; r += 2) {
+                kprintf("  %6u / %6u", (unsigned int)results[r], (unsigned int)results[r + 1]);
+            }
+            kprintf("\n");
+        }
+
+        free(a);
+        free(b);
+    }
+}
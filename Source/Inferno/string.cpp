@@ -1,11 +1,81 @@
 #include <Inferno/string.h>
 
+#define STRING_PAGE_SIZE 4096
+#define ONE_BYTES  0x0101010101010101ULL
+#define HIGH_BITS  0x8080808080808080ULL
+#define LOW_7_BITS 0x7F7F7F7F7F7F7F7FULL
+
+// Word views for the SWAR routines below
+typedef uint64_t __attribute__((__may_alias__)) AlignedQword;
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) UnalignedQword;
+
+// Sets the high bit of the first zero byte in v. Bytes above it can be
+// flagged spuriously (a 0x01 after a zero borrows), so only the lowest
+// flagged byte is meaningful.
+static inline uint64_t HasZeroByte(uint64_t v) {
+    return (v - ONE_BYTES) & ~v & HIGH_BITS;
+}
+
+// Sets the high bit of every zero byte in v, with no false positives
+static inline uint64_t ZeroBytes(uint64_t v) {
+    return ~(((v & LOW_7_BITS) + LOW_7_BITS) | v | LOW_7_BITS);
+}
+
+static inline unsigned int FirstByteIndex(uint64_t flags) {
+    return __builtin_ctzll(flags) >> 3;
+}
+
+static inline unsigned int LastByteIndex(uint64_t flags) {
+    return (63 - __builtin_clzll(flags)) >> 3;
+}
+
+// All-ones in the bytes of an aligned word that sit in front of addr
+static inline uint64_t LeadingMask(uintptr_t addr) {
+    return (1ULL << ((addr & 7) * 8)) - 1;
+}
+
 int strcmp(const char* str1, const char* str2) {
-    while (*str1 && (*str1 == *str2)) {
-        str1++;
-        str2++;
+    const unsigned char* a = (const unsigned char*)str1;
+    const unsigned char* b = (const unsigned char*)str2;
+
+    // Step bytewise until str1 is word aligned
+    while ((uintptr_t)a & 7) {
+        if (*a != *b || *a == 0) {
+            return *a - *b;
+        }
+        a++;
+        b++;
     }
-    return *(unsigned char*)str1 - *(unsigned char*)str2;
+
+    // a is aligned so its loads never cross a page. b may not be, so near
+    // the end of b's page fall back to bytes instead of loading past it.
+    while (true) {
+        if (((uintptr_t)b & (STRING_PAGE_SIZE - 1)) > STRING_PAGE_SIZE - 8) {
+            for (int i = 0; i < 8; i++) {
+                if (*a != *b || *a == 0) {
+                    return *a - *b;
+                }
+                a++;
+                b++;
+            }
+            continue;
+        }
+
+        uint64_t wa = *(const AlignedQword*)a;
+        uint64_t wb = *(const UnalignedQword*)b;
+        if (HasZeroByte(wa) || wa != wb) {
+            break;
+        }
+        a += 8;
+        b += 8;
+    }
+
+    // The difference or terminator is somewhere in this word
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a - *b;
 }
 
 // Add a strncmp implementation
@@ -22,20 +92,23 @@ int strncmp(const char* str1, const char* str2, size_t n) {
     return *(unsigned char*)str1 - *(unsigned char*)str2;
 }
 
-// Implement strlen if it's not already defined
+// Word-at-a-time strlen. Loads are 8-byte aligned, so they never cross a
+// page boundary even when they read past the terminator.
 size_t strlen(const char* str) {
-    const char* s = str;
-    while (*s) {
-        s++;
+    uintptr_t addr = (uintptr_t)str;
+    const AlignedQword* w = (const AlignedQword*)(addr & ~7UL);
+
+    // Bytes in front of str get forced to 0xFF so they can't look like a terminator
+    uint64_t v = *w | LeadingMask(addr);
+    while (!HasZeroByte(v)) {
+        v = *++w;
     }
-    return s - str;
+    return (const char*)w + FirstByteIndex(HasZeroByte(v)) - str;
 }
 
-// Add static buffer for strtok
-static char* strtok_next = 0;
-
-// Add a strtok implementation
-char* strtok(char* str, const char* delimiters) {
+// Reentrant: the position lives in *saveptr instead of a static, so two
+// CPUs can tokenize at once
+char* strtok_r(char* str, const char* delimiters, char** saveptr) {
     char* token_start;
     
     // Determine start point
@@ -44,7 +117,7 @@ char* strtok(char* str, const char* delimiters) {
         token_start = str;
     } else {
         // Continue from previous
-        token_start = strtok_next;
+        token_start = *saveptr;
     }
     
     // Return NULL if there are no more tokens
@@ -77,14 +150,22 @@ char* strtok(char* str, const char* delimiters) {
     // Terminate the token and set next starting point
     if (*token_end) {
         *token_end = '\0';
-        strtok_next = token_end + 1;
+        *saveptr = token_end + 1;
     } else {
-        strtok_next = 0;
+        *saveptr = 0;
     }
     
     return token_start;
 }
 
+// Add static buffer for strtok
+static char* strtok_next = 0;
+
+// Add a strtok implementation
+char* strtok(char* str, const char* delimiters) {
+    return strtok_r(str, delimiters, &strtok_next);
+}
+
 // Add strcpy implementation if it's not already defined
 char* strcpy(char* dest, const char* src) {
     char* original_dest = dest;
@@ -97,38 +178,60 @@ char* strcpy(char* dest, const char* src) {
 
 // Add strchr implementation
 char* strchr(const char* str, int c) {
-    while (*str != 0) {
-        if (*str == c) {
-            return (char*)str;
-        }
-        str++;
+    uintptr_t addr = (uintptr_t)str;
+    const AlignedQword* w = (const AlignedQword*)(addr & ~7UL);
+    uint64_t pattern = ONE_BYTES * (unsigned char)c;
+    uint64_t lead = LeadingMask(addr);
+
+    // Bytes in front of str can neither terminate nor match
+    uint64_t v = *w;
+    uint64_t found = HasZeroByte(v | lead) | HasZeroByte((v ^ pattern) | lead);
+    while (!found) {
+        v = *++w;
+        found = HasZeroByte(v) | HasZeroByte(v ^ pattern);
     }
-    return 0;
+
+    // The lowest flagged byte is exact, it's either c or the terminator
+    const char* p = (const char*)w + FirstByteIndex(found);
+    return *p == (char)c ? (char*)p : NULL;
 }
 
 // Add strrchr implementation (find last occurrence of character in string)
 char* strrchr(const char* str, int c) {
-    const char* last = NULL;
-    
     // If the string is empty, return NULL
     if (!str) {
         return NULL;
     }
-    
-    // Search for all occurrences and keep track of the last one
-    while (*str) {
-        if (*str == c) {
-            last = str;
+
+    // The terminator itself is the last occurrence of 0
+    if ((char)c == 0) {
+        return (char*)str + strlen(str);
+    }
+
+    uintptr_t addr = (uintptr_t)str;
+    const AlignedQword* w = (const AlignedQword*)(addr & ~7UL);
+    uint64_t pattern = ONE_BYTES * (unsigned char)c;
+    uint64_t lead = LeadingMask(addr);
+    const char* last = NULL;
+
+    // Matches need the exact test here since we want the highest one in a word
+    uint64_t v = *w;
+    uint64_t zero = HasZeroByte(v | lead);
+    uint64_t match = ZeroBytes((v ^ pattern) | lead);
+    while (!zero) {
+        if (match) {
+            last = (const char*)w + LastByteIndex(match);
         }
-        str++;
+        v = *++w;
+        zero = HasZeroByte(v);
+        match = ZeroBytes(v ^ pattern);
     }
-    
-    // Also check the null terminator if c is 0
-    if (c == 0) {
-        return (char*)str;
+
+    // Only matches below the terminator count
+    match &= (zero & -zero) - 1;
+    if (match) {
+        last = (const char*)w + LastByteIndex(match);
     }
-    
-    // Return the last occurrence found (or NULL if none)
     return (char*)last;
 }
 
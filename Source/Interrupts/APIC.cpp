@@ -3,6 +3,8 @@
 #include <CPU/MSR.hpp>
 #include <Inferno/IO.h>
 #include <Inferno/Log.h>
+#include <Interrupts/Interrupts.hpp>
+#include <Interrupts/IOAPIC.hpp>
 
 // APIC Register offsets
 #define APIC_ID                  0x20
@@ -16,42 +18,73 @@
 #define APIC_TIMER_CURRENT      0x390
 #define APIC_TIMER_DIVIDE       0x3E0
 
+#define MSR_APIC_BASE           0x1B
+#define APIC_BASE_BSP           (1 << 8)
+#define APIC_BASE_X2APIC        (1 << 10)
+#define APIC_BASE_ENABLE        (1 << 11)
+
+// x2APIC registers are MSRs at 0x800 + (xAPIC offset >> 4), the ICR is a
+// single 64-bit MSR
+#define X2APIC_MSR_BASE         0x800
+#define X2APIC_MSR_ICR          0x830
+
+#define ICR_DELIVERY_PENDING    (1 << 12)
+
 namespace APIC {
+	// MMIO base, cached so register accesses don't each cost an rdmsr
+	static uint64_t mmioBase = 0;
+	static bool x2apic = false;
+
 	bool Capable() {
 		unsigned long eax, unused, edx;
 		cpuid(1, eax, unused, unused, edx);
 		return edx & 1 << 9;
 	}
 
+	bool X2APICCapable() {
+		unsigned int eax, ebx, ecx, edx;
+		cpuid(1, eax, ebx, ecx, edx);
+		return ecx & 1 << 21;
+	}
+
+	bool IsX2APIC() {
+		return x2apic;
+	}
+
 	void SetBase(unsigned int base) {
-		unsigned int edx = 0;
-		unsigned int eax = (base & 0xfffff0000) | 0x800;
-		#ifdef __PHYSICAL_MEMORY_EXTENSION__
-			edx = (base >> 32) & 0x0f;
-		#endif
-		asm volatile("wrmsr" :: "a"(0x1B), "d"(eax), "c"(edx));
+		// Keep the BSP and x2APIC flags, leaving x2APIC mode without
+		// disabling the APIC first faults
+		uint64_t msr = CPU::ReadMSR(MSR_APIC_BASE) & (APIC_BASE_BSP | APIC_BASE_X2APIC);
+		CPU::WriteMSR(MSR_APIC_BASE, (base & 0xFFFFF000) | msr | APIC_BASE_ENABLE);
+		mmioBase = base & 0xFFFFF000;
 	}
 
 	unsigned int GetBase() {
-		unsigned int eax, edx;
-		asm volatile("wrmsr" :: "a"(0x1B), "d"(eax), "c"(edx));
-		#ifdef __PHYSICAL_MEMORY_EXTENSION__
-			return (eax & 0xfffff000) | ((edx & 0x0f) << 32);
-		#else
-			return (eax & 0xfffff000);
-		#endif
+		return CPU::ReadMSR(MSR_APIC_BASE) & 0xFFFFF000;
 	}
 
+	// Local APIC registers are 32 bits wide, 16-byte aligned in the MMIO
+	// page, or one MSR each in x2APIC mode
 	void Write(unsigned int reg, unsigned int value) {
-		unsigned int volatile* apic = (unsigned int volatile*)GetBase();
-		apic[0] = (reg & 0xff) << 4;
-		apic[4] = value;
+		if (x2apic) {
+			CPU::WriteMSR(X2APIC_MSR_BASE + (reg >> 4), value);
+			return;
+		}
+		if (!mmioBase) mmioBase = GetBase();
+		*(unsigned int volatile*)(mmioBase + reg) = value;
 	}
 
 	unsigned int Read(unsigned int reg) {
-		unsigned int volatile* apic = (unsigned int volatile*)GetBase();
-		apic[0] = (reg & 0xff) << 4;
-		return apic[4];
+		if (x2apic) return (unsigned int)CPU::ReadMSR(X2APIC_MSR_BASE + (reg >> 4));
+		if (!mmioBase) mmioBase = GetBase();
+		return *(unsigned int volatile*)(mmioBase + reg);
+	}
+
+	// Switches an enabled xAPIC over, x2APIC can only be entered from there
+	static void EnableX2APIC() {
+		uint64_t msr = CPU::ReadMSR(MSR_APIC_BASE);
+		if (!(msr & APIC_BASE_X2APIC)) CPU::WriteMSR(MSR_APIC_BASE, msr | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+		x2apic = true;
 	}
 
 	void Enable() {
@@ -86,13 +119,9 @@ namespace APIC {
 
         DisablePIC();
         
-        // Enable APIC in MSR
-		prDebug("apic", "Enabling APIC in MSR");
-        uint64_t msr = CPU::ReadMSR(0x1B);
-        msr |= (1 << 11);    // Enable APIC
-		prDebug("apic", "Writing to MSR");
-        CPU::WriteMSR(0x1B, msr);
-        
+        // Firmware with more than 255 CPUs hands over in x2APIC mode already
+        if (CPU::ReadMSR(MSR_APIC_BASE) & APIC_BASE_X2APIC) x2apic = true;
+
 		prDebug("apic", "Setup LOAPIC");
         // Set up Local APIC
         SetupLocalAPIC();
@@ -100,14 +129,25 @@ namespace APIC {
 		prDebug("apic", "Setup SIPs");
         // Configure spurious interrupts
         ConfigureSpuriousInterrupts();
+
+        // Acknowledge every hardware vector once its handlers have run
+        Interrupts::SetEndOfInterrupt([](uint8_t) { EOI(); });
         
-        prInfo("apic", "APIC initialized successfully");
+        prInfo("apic", "APIC initialized successfully, %s mode, ID %d", x2apic ? "x2APIC" : "xAPIC", GetID());
         return true;
     }
 
+    // Same mode and setup as the BSP, the PIC and EOI hook are shared
+    void InitializeAP() {
+        SetupLocalAPIC();
+        ConfigureSpuriousInterrupts();
+    }
+
     void SetupLocalAPIC() {
-        // Set base address (if not already set by BIOS)
-        SetBase(0xFEE00000);
+        // Set base address (if not already set by BIOS), the MMIO window
+        // goes away in x2APIC mode
+        if (!x2apic) SetBase(0xFEE00000);
+        if (X2APICCapable()) EnableX2APIC();
         
         // Initialize all LVT entries
         Write(0x320, 0x10000);    // Timer
@@ -132,15 +172,104 @@ namespace APIC {
         Write(APIC_TIMER_INITIAL, count);
     }
 
-    void MapIRQ(uint8_t irq, uint8_t vector) {
-        // This would involve I/O APIC configuration
-        // Implementation depends on your I/O APIC setup
+    // Legacy IRQs go to this CPU; drivers wanting another target or a PCI
+    // line use IOAPIC directly
+    bool MapIRQ(uint8_t irq, uint8_t vector) {
+        if (!IOAPIC::IsInitialized()) {
+            prErr("apic", "No I/O APIC to route IRQ %d through", irq);
+            return false;
+        }
+        return IOAPIC::RouteISA(irq, vector, GetID());
+    }
+
+    void EOI() {
+        if (x2apic) CPU::WriteMSR(X2APIC_MSR_BASE + (APIC_EOI >> 4), 0);
+        else *(unsigned int volatile*)(mmioBase + APIC_EOI) = 0;
+    }
+
+    void SendICR(uint32_t apicId, uint32_t command) {
+        if (x2apic) {
+            // x2APIC MSR writes aren't serializing, earlier stores have to be
+            // visible before the target runs its handler
+            asm volatile("mfence; lfence" ::: "memory");
+            CPU::WriteMSR(X2APIC_MSR_ICR, ((uint64_t)apicId << 32) | command);
+            return;
+        }
+
+        // Both halves go out on the low write; wait out the previous IPI
+        // so it isn't overwritten mid-delivery. Interrupts off in between,
+        // handlers send IPIs too.
+        uint64_t flags;
+        asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+        while (Read(APIC_ICR_LOW) & ICR_DELIVERY_PENDING) asm volatile("pause");
+        Write(APIC_ICR_HIGH, (apicId & 0xFF) << 24);
+        Write(APIC_ICR_LOW, command);
+        if (flags & 0x200) asm volatile("sti" ::: "memory");
+    }
+
+    void SendIPI(uint32_t apicId, uint8_t vector) {
+        SendICR(apicId, APIC_ICR_FIXED | vector);
+    }
+
+    void BroadcastIPI(uint8_t vector, bool includeSelf) {
+        SendICR(0, (includeSelf ? APIC_ICR_ALL : APIC_ICR_ALL_BUT_SELF) | APIC_ICR_FIXED | vector);
+    }
+
+    static volatile uint64_t selfTestHits = 0;
+
+    static bool SelfTestIPI(Interrupts::Frame*, void*) {
+        selfTestHits++;
+        return true;
+    }
+
+    bool SelfTest() {
+        int vector = Interrupts::AllocateVectors(1);
+        if (vector < 0) return false;
+        Interrupts::RegisterHandler(vector, SelfTestIPI, nullptr);
+
+        // Self IPIs, timed from the ICR write until the handler has run
+        const int rounds = 1000;
+        uint32_t self = GetID();
+        uint64_t cycles = 0;
+        bool passed = true;
+        for (int i = 0; i < rounds; i++) {
+            uint64_t before = selfTestHits;
+            uint32_t low, high;
+            asm volatile("rdtsc" : "=a"(low), "=d"(high));
+            uint64_t start = ((uint64_t)high << 32) | low;
+
+            SendIPI(self, vector);
+            int spins = 0;
+            while (selfTestHits == before && ++spins < 10000000) asm volatile("pause");
+            if (selfTestHits == before) {
+                prErr("apic", "Self IPI %d on vector 0x%x never arrived", i, vector);
+                passed = false;
+                break;
+            }
+
+            asm volatile("rdtsc" : "=a"(low), "=d"(high));
+            cycles += (((uint64_t)high << 32) | low) - start;
+        }
+
+        Interrupts::UnregisterHandler(vector, SelfTestIPI, nullptr);
+        Interrupts::FreeVectors(vector, 1);
+        if (passed) {
+            prInfo("apic", "%s self IPI round trip: %d cycles", x2apic ? "x2APIC" : "xAPIC",
+                (unsigned int)(cycles / rounds));
+        }
+        return passed;
     }
 
     bool IsEnabled() {
         return (Read(APIC_SPURIOUS) & 0x100) != 0;
     }
 
+    // Full 32-bit ID in x2APIC mode, 8 bits in xAPIC mode
+    uint32_t GetID() {
+        uint32_t id = Read(APIC_ID);
+        return x2apic ? id : id >> 24;
+    }
+
     uint32_t GetVersion() {
         return Read(APIC_VERSION) & 0xFF;
     }
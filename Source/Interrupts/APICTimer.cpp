@@ -0,0 +1,281 @@
+#include <Interrupts/APICTimer.hpp>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/HPET.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <CPU/CPUID.h>
+#include <CPU/MSR.hpp>
+#include <Inferno/Log.h>
+
+#define APIC_LVT_TIMER          0x320
+#define APIC_TIMER_INITIAL      0x380
+#define APIC_TIMER_CURRENT      0x390
+#define APIC_TIMER_DIVIDE       0x3E0
+
+#define LVT_MASKED              (1 << 16)
+#define LVT_ONESHOT             (0 << 17)
+#define LVT_PERIODIC            (1 << 17)
+#define LVT_TSC_DEADLINE        (2 << 17)
+
+#define TIMER_DIVIDE_16         0x3
+#define TIMER_DIVISOR           16
+
+#define MSR_TSC_DEADLINE        0x6E0
+
+#define CALIBRATION_FS          10000000000000ULL   // 10ms in femtoseconds
+#define CALIBRATION_RUNS        3
+
+namespace APICTimer {
+    static bool initialized = false;
+    static bool tscDeadline = false;
+    static uint8_t timerVector = APIC_TIMER_VECTOR;
+    static Mode mode = Mode::OneShot;
+    static bool masked = true;
+    static uint64_t frequency = 0;
+    static uint64_t tscFrequency = 0;
+    static volatile uint64_t ticks = 0;
+
+    // ns -> ticks as (ns * mult) >> 32, so programming an event is a
+    // multiply and a shift instead of a 64-bit division
+    static uint64_t timerMult = 0;
+    static uint64_t tscMult = 0;
+
+    static inline uint64_t ReadTSC() {
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        return ((uint64_t)high << 32) | low;
+    }
+
+    static inline uint64_t Scale(uint64_t ns, uint64_t mult) {
+        return (uint64_t)(((unsigned __int128)ns * mult) >> 32);
+    }
+
+    // Split so nothing needs a 128-bit division
+    static inline uint64_t MultFor(uint64_t hz) {
+        return ((hz / 1000000000ULL) << 32) + ((hz % 1000000000ULL) << 32) / 1000000000ULL;
+    }
+
+    static inline uint32_t ClampCount(uint64_t count) {
+        if (count == 0) return 1;
+        if (count > 0xFFFFFFFF) return 0xFFFFFFFF;
+        return (uint32_t)count;
+    }
+
+    static bool TimerInterrupt(Interrupts::Frame*, void*) {
+        ticks++;
+        return true;
+    }
+
+    // Counts LAPIC timer and TSC ticks across one fixed HPET interval
+    static void CalibrateOnce(uint64_t* timerHz, uint64_t* tscHz) {
+        uint64_t hpetHz = HPET::GetFrequency();
+        uint64_t window = CALIBRATION_FS / (1000000000000000ULL / hpetHz);
+
+        APIC::Write(APIC_LVT_TIMER, LVT_MASKED | timerVector);
+        APIC::Write(APIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+
+        // Line up with an HPET tick edge before starting
+        uint64_t edge = HPET::GetCounterValue();
+        while (HPET::GetCounterValue() == edge) asm volatile("pause");
+
+        uint64_t hpetStart = HPET::GetCounterValue();
+        APIC::Write(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+        uint64_t tscStart = ReadTSC();
+
+        uint64_t hpetNow;
+        do {
+            asm volatile("pause");
+            hpetNow = HPET::GetCounterValue();
+        } while (hpetNow - hpetStart < window);
+
+        uint32_t remaining = APIC::Read(APIC_TIMER_CURRENT);
+        uint64_t tscEnd = ReadTSC();
+        APIC::Write(APIC_TIMER_INITIAL, 0);
+
+        uint64_t elapsed = hpetNow - hpetStart;
+        *timerHz = (uint64_t)(0xFFFFFFFF - remaining) * hpetHz / elapsed;
+        *tscHz = (tscEnd - tscStart) * hpetHz / elapsed;
+    }
+
+    static bool Calibrate() {
+        if (HPET::IsInitialized() && HPET::GetFrequency()) {
+            uint64_t timerRuns[CALIBRATION_RUNS], tscRuns[CALIBRATION_RUNS];
+            for (int i = 0; i < CALIBRATION_RUNS; i++) CalibrateOnce(&timerRuns[i], &tscRuns[i]);
+
+            // Median of the runs, an SMI in one window shouldn't skew it
+            for (int i = 1; i < CALIBRATION_RUNS; i++) {
+                for (int j = i; j > 0 && timerRuns[j] < timerRuns[j - 1]; j--) {
+                    uint64_t t = timerRuns[j]; timerRuns[j] = timerRuns[j - 1]; timerRuns[j - 1] = t;
+                }
+                for (int j = i; j > 0 && tscRuns[j] < tscRuns[j - 1]; j--) {
+                    uint64_t t = tscRuns[j]; tscRuns[j] = tscRuns[j - 1]; tscRuns[j - 1] = t;
+                }
+            }
+            frequency = timerRuns[CALIBRATION_RUNS / 2];
+            tscFrequency = tscRuns[CALIBRATION_RUNS / 2];
+            return frequency != 0;
+        }
+
+        // No HPET, on Intel the LAPIC timer runs off the core crystal clock
+        unsigned int maxLeaf, eax, ebx, ecx, edx;
+        cpuid(0, maxLeaf, ebx, ecx, edx);
+        if (maxLeaf < 0x15) return false;
+        cpuid(0x15, eax, ebx, ecx, edx);
+        if (!ecx) return false;
+        frequency = ecx / TIMER_DIVISOR;
+        if (eax && ebx) tscFrequency = (uint64_t)ecx * ebx / eax;
+        return true;
+    }
+
+    bool Initialize(uint8_t vector) {
+        if (!APIC::IsEnabled()) {
+            prErr("apic", "Local APIC not enabled, can't set up the timer");
+            return false;
+        }
+        timerVector = vector;
+
+        unsigned int eax, ebx, ecx, edx;
+        cpuid(1, eax, ebx, ecx, edx);
+
+        if (!Calibrate()) {
+            prErr("apic", "Timer calibration failed, no HPET or CPUID crystal clock");
+            return false;
+        }
+        tscDeadline = ((ecx >> 24) & 1) && tscFrequency;
+
+        timerMult = MultFor(frequency);
+        tscMult = MultFor(tscFrequency);
+
+        APIC::Write(APIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+        APIC::Write(APIC_LVT_TIMER, LVT_MASKED | timerVector);
+        Interrupts::RegisterHandler(timerVector, TimerInterrupt, nullptr);
+
+        initialized = true;
+        prInfo("apic", "Timer: %d kHz (divide by %d), TSC: %d MHz, TSC-deadline %s",
+            (unsigned int)(frequency / 1000), TIMER_DIVISOR, (unsigned int)(tscFrequency / 1000000),
+            tscDeadline ? "supported" : "not supported");
+        return true;
+    }
+
+    bool IsInitialized() {
+        return initialized;
+    }
+
+    uint64_t GetFrequency() {
+        return frequency;
+    }
+
+    uint64_t GetTSCFrequency() {
+        return tscFrequency;
+    }
+
+    bool HasTSCDeadline() {
+        return tscDeadline;
+    }
+
+    void StartPeriodic(uint64_t ns) {
+        if (!initialized) return;
+        if (mode == Mode::TSCDeadline) CPU::WriteMSR(MSR_TSC_DEADLINE, 0);
+        mode = Mode::Periodic;
+        APIC::Write(APIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+        APIC::Write(APIC_LVT_TIMER, LVT_PERIODIC | timerVector);
+        masked = false;
+        APIC::Write(APIC_TIMER_INITIAL, ClampCount(Scale(ns, timerMult)));
+    }
+
+    void ProgramNextEvent(uint64_t ns) {
+        if (!initialized) return;
+
+        if (tscDeadline) {
+            if (mode != Mode::TSCDeadline || masked) {
+                APIC::Write(APIC_TIMER_INITIAL, 0);
+                APIC::Write(APIC_LVT_TIMER, LVT_TSC_DEADLINE | timerVector);
+                // The LVT write has to land before the deadline MSR is armed
+                asm volatile("mfence" ::: "memory");
+                mode = Mode::TSCDeadline;
+                masked = false;
+            }
+            uint64_t delta = Scale(ns, tscMult);
+            CPU::WriteMSR(MSR_TSC_DEADLINE, ReadTSC() + (delta ? delta : 1));
+            return;
+        }
+
+        if (mode != Mode::OneShot || masked) {
+            APIC::Write(APIC_LVT_TIMER, LVT_ONESHOT | timerVector);
+            mode = Mode::OneShot;
+            masked = false;
+        }
+        APIC::Write(APIC_TIMER_INITIAL, ClampCount(Scale(ns, timerMult)));
+    }
+
+    void Stop() {
+        if (!initialized) return;
+        if (mode == Mode::TSCDeadline) CPU::WriteMSR(MSR_TSC_DEADLINE, 0);
+        APIC::Write(APIC_TIMER_INITIAL, 0);
+        APIC::Write(APIC_LVT_TIMER, LVT_MASKED | timerVector);
+        masked = true;
+    }
+
+    Mode GetMode() {
+        return mode;
+    }
+
+    uint64_t GetTickCount() {
+        return ticks;
+    }
+
+    // Waits for the tick count to reach `target`, giving up after `limitFs`
+    // of HPET time. Returns the HPET ticks waited or 0 on timeout.
+    static uint64_t WaitForTicks(uint64_t target, uint64_t limitFs) {
+        uint64_t hpetHz = HPET::GetFrequency();
+        uint64_t limit = limitFs / (1000000000000000ULL / hpetHz);
+        uint64_t start = HPET::GetCounterValue();
+        while (ticks < target) {
+            uint64_t now = HPET::GetCounterValue();
+            if (now - start > limit) return 0;
+            asm volatile("pause");
+        }
+        uint64_t waited = HPET::GetCounterValue() - start;
+        return waited ? waited : 1;
+    }
+
+    static inline uint64_t HPETTicksToUs(uint64_t hpetTicks) {
+        return hpetTicks * 1000000ULL / HPET::GetFrequency();
+    }
+
+    bool SelfTest() {
+        if (!initialized || !HPET::IsInitialized()) {
+            prErr("apic", "Timer self-test needs the APIC timer and HPET");
+            return false;
+        }
+
+        bool passed = true;
+
+        // One-shot (or TSC-deadline) 5ms from now
+        uint64_t before = ticks;
+        ProgramNextEvent(5000000);
+        uint64_t waited = WaitForTicks(before + 1, 100 * 1000000000000ULL);
+        uint64_t us = HPETTicksToUs(waited);
+        if (!waited || us < 4500 || us > 6000) {
+            prErr("apic", "Single event: expected 5000us, took %dus", (unsigned int)us);
+            passed = false;
+        } else {
+            prInfo("apic", "Single event (%s): 5000us requested, fired after %dus",
+                mode == Mode::TSCDeadline ? "TSC-deadline" : "one-shot", (unsigned int)us);
+        }
+
+        // Ten periods of 1ms
+        before = ticks;
+        StartPeriodic(1000000);
+        waited = WaitForTicks(before + 10, 100 * 1000000000000ULL);
+        Stop();
+        us = HPETTicksToUs(waited);
+        if (!waited || us < 9000 || us > 11500) {
+            prErr("apic", "Periodic: expected 10 ticks in 10000us, took %dus", (unsigned int)us);
+            passed = false;
+        } else {
+            prInfo("apic", "Periodic: 10 x 1000us took %dus", (unsigned int)us);
+        }
+
+        return passed;
+    }
+}
@@ -0,0 +1,210 @@
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/HPET.hpp>
+#include <Interrupts/TimePage.hpp>
+#include <Drivers/RTC/RTC.h>
+#include <CPU/CPUID.h>
+#include <CPU/Features.hpp>
+#include <Inferno/Log.h>
+
+#define CALIBRATION_NS          10000000ULL     // 10ms
+#define CALIBRATION_RUNS        3
+
+namespace Clock {
+    static Source source = Source::None;
+    static bool invariantTSC = false;
+    static uint64_t frequency = 0;
+
+    // ns = ((counter - base) * mult) >> CLOCK_SHIFT, worked out once at
+    // calibration so reading the clock never divides
+    static uint64_t base = 0;
+    static uint64_t mult = 0;
+
+    // CLOCK_REALTIME - CLOCK_MONOTONIC
+    static int64_t realtimeOffset = 0;
+
+    static inline uint64_t ReadTSC() {
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        return ((uint64_t)high << 32) | low;
+    }
+
+    static inline uint64_t ReadCounter() {
+        return source == Source::TSC ? ReadTSC() : HPET::GetCounterValue();
+    }
+
+    static inline uint64_t Scale(uint64_t delta) {
+        return (uint64_t)(((unsigned __int128)delta * mult) >> CLOCK_SHIFT);
+    }
+
+    // 10^9 << CLOCK_SHIFT / hz, split so nothing needs a 128-bit division
+    static inline uint64_t MultFor(uint64_t hz) {
+        uint64_t whole = (1000000000ULL << 16) / hz;
+        uint64_t rest = (1000000000ULL << 16) % hz;
+        return (whole << 16) + (rest << 16) / hz;
+    }
+
+    // TSC ticks across one HPET-timed window
+    static uint64_t CalibrateOnce() {
+        uint64_t hpetHz = HPET::GetFrequency();
+        uint64_t window = hpetHz * CALIBRATION_NS / 1000000000ULL;
+
+        uint64_t edge = HPET::GetCounterValue();
+        while (HPET::GetCounterValue() == edge) asm volatile("pause");
+
+        uint64_t hpetStart = HPET::GetCounterValue();
+        uint64_t tscStart = ReadTSC();
+        uint64_t hpetNow;
+        do {
+            asm volatile("pause");
+            hpetNow = HPET::GetCounterValue();
+        } while (hpetNow - hpetStart < window);
+        uint64_t tscEnd = ReadTSC();
+
+        return (tscEnd - tscStart) * hpetHz / (hpetNow - hpetStart);
+    }
+
+    static uint64_t CalibrateTSC(unsigned int maxLeaf) {
+        if (HPET::IsInitialized() && HPET::GetFrequency()) {
+            uint64_t runs[CALIBRATION_RUNS];
+            for (int i = 0; i < CALIBRATION_RUNS; i++) {
+                runs[i] = CalibrateOnce();
+                for (int j = i; j > 0 && runs[j] < runs[j - 1]; j--) {
+                    uint64_t t = runs[j]; runs[j] = runs[j - 1]; runs[j - 1] = t;
+                }
+            }
+            return runs[CALIBRATION_RUNS / 2];
+        }
+
+        unsigned int eax, ebx, ecx, edx;
+        if (maxLeaf >= 0x15) {
+            cpuid(0x15, eax, ebx, ecx, edx);
+            if (eax && ebx && ecx) return (uint64_t)ecx * ebx / eax;
+        }
+        if (maxLeaf >= 0x16) {
+            cpuid(0x16, eax, ebx, ecx, edx);
+            if (eax & 0xFFFF) return (uint64_t)(eax & 0xFFFF) * 1000000ULL;
+        }
+        return 0;
+    }
+
+    bool Initialize() {
+        unsigned int maxLeaf, ebx, ecx, edx;
+        cpuid(0, maxLeaf, ebx, ecx, edx);
+        invariantTSC = CPU::Has(CPU::Feature::InvariantTSC);
+
+        uint64_t tscHz = invariantTSC ? CalibrateTSC(maxLeaf) : 0;
+        if (tscHz) {
+            source = Source::TSC;
+            frequency = tscHz;
+        } else if (HPET::IsInitialized() && HPET::GetFrequency()) {
+            // Without an invariant TSC the rate can change under us
+            source = Source::HPET;
+            frequency = HPET::GetFrequency();
+        } else {
+            prErr("clock", "No usable clocksource, no invariant TSC or HPET");
+            return false;
+        }
+
+        mult = MultFor(frequency);
+        base = ReadCounter();
+        realtimeOffset = (int64_t)(RTC::getEpochTime() * 1000000000ULL);
+        prInfo("clock", "Using %s at %d kHz%s", GetSourceName(), (unsigned int)(frequency / 1000),
+            invariantTSC ? "" : " (TSC not invariant)");
+        return true;
+    }
+
+    Source GetSource() {
+        return source;
+    }
+
+    const char* GetSourceName() {
+        switch (source) {
+            case Source::TSC: return "TSC";
+            case Source::HPET: return "HPET";
+            default: return "none";
+        }
+    }
+
+    uint64_t GetFrequency() {
+        return frequency;
+    }
+
+    bool HasInvariantTSC() {
+        return invariantTSC;
+    }
+
+    void GetScale(uint64_t* counterBase, uint64_t* counterMult) {
+        *counterBase = base;
+        *counterMult = mult;
+    }
+
+    void SetRealtime(uint64_t ns) {
+        realtimeOffset = (int64_t)(ns - ClockMonotonicNs());
+        TimePage::Update();
+    }
+
+    int64_t GetRealtimeOffset() {
+        return realtimeOffset;
+    }
+
+    bool SelfTest() {
+        if (source == Source::None) {
+            prErr("clock", "No clocksource to test");
+            return false;
+        }
+
+        // Cost per call, timed with the TSC itself
+        const int calls = 10000;
+        uint64_t sink = 0;
+        uint64_t start = ReadTSC();
+        for (int i = 0; i < calls; i++) sink += ClockMonotonicNs();
+        uint64_t clockCycles = (ReadTSC() - start) / calls;
+        start = ReadTSC();
+        for (int i = 0; i < calls; i++) sink += HPET::GetCounterValue();
+        uint64_t hpetCycles = (ReadTSC() - start) / calls;
+        asm volatile("" :: "r"(sink));
+        prInfo("clock", "ClockMonotonicNs: %d cycles/call, HPET read: %d cycles/call",
+            (unsigned int)clockCycles, (unsigned int)hpetCycles);
+
+        // Monotonic over a burst of reads
+        bool passed = true;
+        uint64_t last = ClockMonotonicNs();
+        for (int i = 0; i < 100000; i++) {
+            uint64_t now = ClockMonotonicNs();
+            if (now < last) {
+                prErr("clock", "Went backwards: %d -> %d", (unsigned int)last, (unsigned int)now);
+                passed = false;
+                break;
+            }
+            last = now;
+        }
+
+        // Agrees with the HPET over 100ms
+        if (HPET::IsInitialized() && source != Source::HPET) {
+            uint64_t hpetHz = HPET::GetFrequency();
+            uint64_t hpetStart = HPET::GetCounterValue();
+            uint64_t clockStart = ClockMonotonicNs();
+            HPET::Wait(100000);
+            uint64_t hpetUs = (HPET::GetCounterValue() - hpetStart) * 1000000ULL / hpetHz;
+            uint64_t clockUs = (ClockMonotonicNs() - clockStart) / 1000;
+            uint64_t drift = hpetUs > clockUs ? hpetUs - clockUs : clockUs - hpetUs;
+            prInfo("clock", "100ms wait: HPET %dus, %s %dus", (unsigned int)hpetUs, GetSourceName(),
+                (unsigned int)clockUs);
+            if (drift > hpetUs / 100) {
+                prErr("clock", "Off from the HPET by %dus", (unsigned int)drift);
+                passed = false;
+            }
+        }
+        return passed;
+    }
+}
+
+uint64_t ClockMonotonicNs() {
+    using namespace Clock;
+    if (source == Source::None) return 0;
+    return Scale(ReadCounter() - base);
+}
+
+uint64_t ClockRealtimeNs() {
+    return ClockMonotonicNs() + Clock::realtimeOffset;
+}
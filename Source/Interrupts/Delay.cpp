@@ -0,0 +1,20 @@
+#include <Interrupts/Delay.hpp>
+
+void ndelay(uint64_t ns) {
+    if (Clock::GetSource() == Clock::Source::None) {
+        // Port 0x80 writes take about a microsecond on PC hardware
+        for (uint64_t waited = 0; waited < ns; waited += NSEC_PER_USEC) io_wait();
+        return;
+    }
+
+    uint64_t deadline = ClockMonotonicNs() + ns;
+    while (ClockMonotonicNs() < deadline) asm volatile("pause");
+}
+
+void udelay(uint64_t us) {
+    ndelay(us * NSEC_PER_USEC);
+}
+
+void mdelay(uint64_t ms) {
+    ndelay(ms * NSEC_PER_MSEC);
+}
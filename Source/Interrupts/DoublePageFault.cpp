@@ -9,7 +9,7 @@
 #include <Drivers/TTY/COM.h>
 #include <Interrupts/DoublePageFault.hpp>
 
-void DoublePageFault(void*) {
-	kprintf("\r\e[31m[ERROR] Double Page Fault\e[0m\n\r");
-	asm("hlt");
+bool DoublePageFault(Interrupts::Frame* frame, void*) {
+	kprintf("\r\e[31m[ERROR] Double Page Fault\e[0m (rip %p, rsp %p)\n\r", frame->rip, frame->rsp);
+	while(1) asm("hlt");
 }
@@ -61,10 +61,12 @@ namespace HPET {
     void Wait(uint64_t microseconds) {
         if (!initialized) return;
 
-        uint64_t ticks = (microseconds * 1000000000000ULL) / hpet_period;
-        uint64_t target = GetCounterValue() + ticks;
+        // Split into whole seconds so the multiply can't overflow
+        uint64_t frequency = GetFrequency();
+        uint64_t ticks = (microseconds / 1000000) * frequency + (microseconds % 1000000) * frequency / 1000000;
+        uint64_t start = GetCounterValue();
 
-        while (GetCounterValue() < target) {
+        while (GetCounterValue() - start < ticks) {
             asm volatile("pause");
         }
     }
@@ -0,0 +1,455 @@
+#include <Interrupts/HRTimer.hpp>
+#include <Interrupts/APICTimer.hpp>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/Delay.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <CPU/PerCPU.hpp>
+#include <Sync/Spinlock.hpp>
+#include <Inferno/Log.h>
+
+#define NEVER 0xFFFFFFFFFFFFFFFFULL
+
+namespace HRTimer {
+    static bool initialized = false;
+
+    // Guards both queues. The APIC timer belongs to the CPU that called
+    // Initialize, other CPUs arming an earlier deadline kick it with an
+    // IPI on the timer vector.
+    static DEFINE_LOCK_CLASS(lockClass, "hrtimer");
+    static spinlock_t lock = SPINLOCK_INIT_CLASS(lockClass);
+    static uint32_t ownerCPU = 0;
+    static uint32_t ownerAPIC = 0;
+
+    // Whose callback runs right now, for CancelTimerSync
+    static Timer* volatile runningTimer = nullptr;
+
+    // Wheel ticks count HRTIMER_TICK_NS from wheelBase. wheelClk is the last
+    // tick whose buckets have been run.
+    static uint64_t wheelBase = 0;
+    static uint64_t wheelClk = 0;
+    static Timer* wheel[HRTIMER_LEVELS * HRTIMER_LEVEL_SIZE];
+    static uint64_t wheelPending[HRTIMER_LEVELS];
+    static uint32_t wheelCount = 0;
+
+    static Timer* heap[HRTIMER_MAX_PRECISE];
+    static uint32_t heapCount = 0;
+
+    // Earliest deadline the APIC timer is armed for. Only moved earlier
+    // between interrupts, a stale later interrupt just finds nothing to do.
+    static uint64_t programmed = NEVER;
+    static bool running = false;
+
+    static inline uint64_t ToTick(uint64_t ns) {
+        return ns <= wheelBase ? 0 : (ns - wheelBase) / HRTIMER_TICK_NS;
+    }
+
+    static inline uint64_t ToTickCeil(uint64_t ns) {
+        return ns <= wheelBase ? 0 : (ns - wheelBase + HRTIMER_TICK_NS - 1) / HRTIMER_TICK_NS;
+    }
+
+    static inline uint64_t TickToNs(uint64_t tick) {
+        return wheelBase + tick * HRTIMER_TICK_NS;
+    }
+
+    // First tick after wheelClk at which a non-empty bucket comes due
+    static uint64_t NextWheelTick();
+
+    // wheelClk only moves when buckets run, so an idle wheel leaves it far
+    // behind and a new timer's delta would be measured from the past. It's
+    // brought up to now, but never past a bucket that's still due.
+    static void WheelCatchUp() {
+        uint64_t nowTick = ToTick(ClockMonotonicNs());
+        if (wheelCount) {
+            uint64_t next = NextWheelTick();
+            if (next != NEVER && next - 1 < nowTick) nowTick = next - 1;
+        }
+        if (nowTick > wheelClk) wheelClk = nowTick;
+    }
+
+    // A timer `delta` ticks out goes on the finest level where its rounded
+    // expiry still lands inside that level's 64-bucket window. Buckets are
+    // never cascaded down; the rounding is where the lateness comes from.
+    static void WheelInsert(Timer* timer) {
+        WheelCatchUp();
+        uint64_t expiresTick = ToTickCeil(timer->expires);
+        if (expiresTick <= wheelClk) expiresTick = wheelClk + 1;
+        uint64_t delta = expiresTick - wheelClk;
+
+        int level = 0;
+        while (level < HRTIMER_LEVELS - 1 &&
+               delta >= ((uint64_t)(HRTIMER_LEVEL_SIZE - 1) << (level * HRTIMER_LEVEL_SHIFT))) {
+            level++;
+        }
+
+        uint32_t shift = level * HRTIMER_LEVEL_SHIFT;
+        uint64_t window = (uint64_t)(HRTIMER_LEVEL_SIZE - 1) << shift;
+        if (delta >= window) expiresTick = wheelClk + window - 1;
+
+        uint64_t unit = (expiresTick + (1ULL << shift) - 1) >> shift;
+        uint32_t bucket = unit & (HRTIMER_LEVEL_SIZE - 1);
+        uint32_t slot = level * HRTIMER_LEVEL_SIZE + bucket;
+
+        timer->prev = nullptr;
+        timer->next = wheel[slot];
+        if (timer->next) timer->next->prev = timer;
+        wheel[slot] = timer;
+        wheelPending[level] |= 1ULL << bucket;
+
+        timer->slot = slot;
+        timer->queue = Queue::Wheel;
+        wheelCount++;
+    }
+
+    static void WheelRemove(Timer* timer) {
+        if (timer->prev) timer->prev->next = timer->next;
+        else wheel[timer->slot] = timer->next;
+        if (timer->next) timer->next->prev = timer->prev;
+
+        if (!wheel[timer->slot]) {
+            wheelPending[timer->slot / HRTIMER_LEVEL_SIZE] &= ~(1ULL << (timer->slot % HRTIMER_LEVEL_SIZE));
+        }
+        timer->queue = Queue::None;
+        wheelCount--;
+    }
+
+    static uint64_t NextWheelTick() {
+        uint64_t next = NEVER;
+        for (int level = 0; level < HRTIMER_LEVELS; level++) {
+            uint64_t pending = wheelPending[level];
+            if (!pending) continue;
+
+            uint32_t shift = level * HRTIMER_LEVEL_SHIFT;
+            uint64_t base = (wheelClk >> shift) + 1;
+            uint32_t position = base & (HRTIMER_LEVEL_SIZE - 1);
+            uint64_t rotated = position ? (pending >> position) | (pending << (HRTIMER_LEVEL_SIZE - position)) : pending;
+            uint64_t tick = (base + __builtin_ctzll(rotated)) << shift;
+            if (tick < next) next = tick;
+        }
+        return next;
+    }
+
+    static void HeapSwap(uint32_t a, uint32_t b) {
+        Timer* t = heap[a];
+        heap[a] = heap[b];
+        heap[b] = t;
+        heap[a]->slot = a;
+        heap[b]->slot = b;
+    }
+
+    static void HeapUp(uint32_t i) {
+        while (i > 0) {
+            uint32_t parent = (i - 1) / 2;
+            if (heap[parent]->expires <= heap[i]->expires) break;
+            HeapSwap(i, parent);
+            i = parent;
+        }
+    }
+
+    static void HeapDown(uint32_t i) {
+        while (true) {
+            uint32_t smallest = i;
+            uint32_t left = 2 * i + 1, right = 2 * i + 2;
+            if (left < heapCount && heap[left]->expires < heap[smallest]->expires) smallest = left;
+            if (right < heapCount && heap[right]->expires < heap[smallest]->expires) smallest = right;
+            if (smallest == i) break;
+            HeapSwap(i, smallest);
+            i = smallest;
+        }
+    }
+
+    static void HeapInsert(Timer* timer) {
+        timer->slot = heapCount;
+        timer->queue = Queue::Heap;
+        heap[heapCount++] = timer;
+        HeapUp(timer->slot);
+    }
+
+    static void HeapRemove(Timer* timer) {
+        uint32_t i = timer->slot;
+        heapCount--;
+        if (i != heapCount) {
+            Timer* moved = heap[heapCount];
+            heap[i] = moved;
+            moved->slot = i;
+            HeapUp(i);
+            HeapDown(moved->slot);
+        }
+        timer->queue = Queue::None;
+    }
+
+    static void Enqueue(Timer* timer) {
+        if (timer->precise && heapCount < HRTIMER_MAX_PRECISE) HeapInsert(timer);
+        else WheelInsert(timer);
+    }
+
+    static void Dequeue(Timer* timer) {
+        if (timer->queue == Queue::Heap) HeapRemove(timer);
+        else if (timer->queue == Queue::Wheel) WheelRemove(timer);
+    }
+
+    static uint64_t NextExpiry() {
+        uint64_t next = NEVER;
+        if (heapCount) next = heap[0]->expires;
+        if (wheelCount) {
+            uint64_t tick = NextWheelTick();
+            if (tick != NEVER && TickToNs(tick) < next) next = TickToNs(tick);
+        }
+        return next;
+    }
+
+    // Caller holds the lock
+    static void Program() {
+        if (!initialized || running) return;
+        uint64_t next = NextExpiry();
+        if (this_cpu_id() != ownerCPU) {
+            if (next < programmed) {
+                programmed = next;
+                APIC::SendIPI(ownerAPIC, APIC_TIMER_VECTOR);
+            }
+            return;
+        }
+
+        uint64_t now = ClockMonotonicNs();
+        // A deadline that has already passed has fired or is about to
+        if (next >= programmed && programmed > now) return;
+        if (next == NEVER) {
+            programmed = NEVER;
+            return;
+        }
+
+        programmed = next;
+        APICTimer::ProgramNextEvent(next > now ? next - now : 0);
+    }
+
+    // Caller holds the lock, dropped around each callback so it can arm
+    // timers of its own
+    static void RunCallback(Timer* timer) {
+        runningTimer = timer;
+        spin_unlock(&lock);
+        timer->callback(timer->context);
+        spin_lock(&lock);
+        runningTimer = nullptr;
+    }
+
+    static void RunExpired() {
+        running = true;
+        uint64_t now = ClockMonotonicNs();
+
+        while (heapCount && heap[0]->expires <= now) {
+            Timer* timer = heap[0];
+            HeapRemove(timer);
+            RunCallback(timer);
+        }
+
+        // Jump straight between due buckets instead of walking every tick
+        uint64_t nowTick = ToTick(now);
+        while (wheelCount) {
+            uint64_t tick = NextWheelTick();
+            if (tick > nowTick) break;
+            wheelClk = tick;
+
+            for (int level = 0; level < HRTIMER_LEVELS; level++) {
+                uint32_t shift = level * HRTIMER_LEVEL_SHIFT;
+                if (tick & ((1ULL << shift) - 1)) continue;
+                uint32_t slot = level * HRTIMER_LEVEL_SIZE + ((tick >> shift) & (HRTIMER_LEVEL_SIZE - 1));
+                // One at a time, so a callback can cancel a timer that's
+                // in the same bucket
+                while (wheel[slot]) {
+                    Timer* timer = wheel[slot];
+                    WheelRemove(timer);
+                    RunCallback(timer);
+                }
+            }
+        }
+        if (wheelClk < nowTick) wheelClk = nowTick;
+
+        running = false;
+    }
+
+    static bool TimerInterrupt(Interrupts::Frame*, void*) {
+        // Another CPU's APIC timer, if anything ever arms one
+        if (this_cpu_id() != ownerCPU) return true;
+        spin_lock(&lock);
+        programmed = NEVER;
+        RunExpired();
+        Program();
+        spin_unlock(&lock);
+        return true;
+    }
+
+    bool Initialize() {
+        if (!APICTimer::IsInitialized() || Clock::GetSource() == Clock::Source::None) {
+            prErr("hrtimer", "Needs the APIC timer and a clocksource");
+            return false;
+        }
+
+        wheelBase = ClockMonotonicNs();
+        wheelClk = 0;
+        ownerCPU = this_cpu_id();
+        ownerAPIC = APIC::GetID();
+        Interrupts::RegisterHandler(APIC_TIMER_VECTOR, TimerInterrupt, nullptr);
+        initialized = true;
+
+        prInfo("hrtimer", "%d-level wheel at %dus resolution, %d precise slots",
+            HRTIMER_LEVELS, (int)(HRTIMER_TICK_NS / 1000), HRTIMER_MAX_PRECISE);
+        return true;
+    }
+
+    bool IsInitialized() {
+        return initialized;
+    }
+
+    void InitTimer(Timer* timer, Callback callback, void* context, bool precise) {
+        timer->expires = 0;
+        timer->callback = callback;
+        timer->context = context;
+        timer->precise = precise;
+        timer->queue = Queue::None;
+        timer->slot = 0;
+        timer->next = nullptr;
+        timer->prev = nullptr;
+    }
+
+    void AddTimer(Timer* timer, uint64_t expires) {
+        ModTimer(timer, expires);
+    }
+
+    bool ModTimer(Timer* timer, uint64_t expires) {
+        uint64_t flags = spin_lock_irqsave(&lock);
+        bool pending = timer->queue != Queue::None;
+        Dequeue(timer);
+        timer->expires = expires;
+        Enqueue(timer);
+        Program();
+        spin_unlock_irqrestore(&lock, flags);
+        return pending;
+    }
+
+    bool CancelTimer(Timer* timer) {
+        uint64_t flags = spin_lock_irqsave(&lock);
+        bool pending = timer->queue != Queue::None;
+        Dequeue(timer);
+        spin_unlock_irqrestore(&lock, flags);
+        return pending;
+    }
+
+    bool CancelTimerSync(Timer* timer) {
+        bool pending = false;
+        // A callback that re-arms its timer puts it back after the cancel,
+        // so go again until it's neither running nor queued
+        do {
+            if (CancelTimer(timer)) pending = true;
+            while (__atomic_load_n(&runningTimer, __ATOMIC_ACQUIRE) == timer) asm volatile("pause");
+        } while (__atomic_load_n(&timer->queue, __ATOMIC_ACQUIRE) != Queue::None);
+        return pending;
+    }
+
+    bool IsPending(Timer* timer) {
+        return timer->queue != Queue::None;
+    }
+
+    void Poll() {
+        if (!initialized) return;
+        uint64_t flags = spin_lock_irqsave(&lock);
+        RunExpired();
+        Program();
+        spin_unlock_irqrestore(&lock, flags);
+    }
+
+    void Reprogram() {
+        if (!initialized) return;
+        uint64_t flags = spin_lock_irqsave(&lock);
+        programmed = NEVER;
+        Program();
+        spin_unlock_irqrestore(&lock, flags);
+    }
+
+    uint32_t GetPendingCount() {
+        return heapCount + wheelCount;
+    }
+
+    uint32_t GetCPU() {
+        return ownerCPU;
+    }
+
+    struct TestTimer {
+        Timer timer;
+        uint64_t firedAt;
+        int order;
+        int rearm;
+        uint64_t period;
+    };
+
+    static volatile int firedCount = 0;
+
+    static void TestCallback(void* context) {
+        TestTimer* test = (TestTimer*)context;
+        test->firedAt = ClockMonotonicNs();
+        test->order = firedCount++;
+        if (test->rearm > 0) {
+            test->rearm--;
+            ModTimer(&test->timer, test->timer.expires + test->period);
+        }
+    }
+
+    bool SelfTest() {
+        if (!initialized) {
+            prErr("hrtimer", "Not initialized");
+            return false;
+        }
+
+        static TestTimer tests[7];
+        static const struct { uint64_t delayUs; bool precise; const char* name; } plan[7] = {
+            { 2000, true, "precise 2ms" },
+            { 1000, true, "precise 1ms" },
+            { 5000, true, "precise 5ms, cancelled" },
+            { 10000, false, "wheel 10ms" },
+            { 50000, false, "wheel 50ms, moved to 20ms" },
+            { 300000, false, "wheel 300ms" },
+            { 500, true, "precise 500us, re-armed 4x" },
+        };
+
+        firedCount = 0;
+        uint64_t start = ClockMonotonicNs();
+        for (int i = 0; i < 7; i++) {
+            InitTimer(&tests[i].timer, TestCallback, &tests[i], plan[i].precise);
+            tests[i].firedAt = 0;
+            tests[i].order = -1;
+            tests[i].rearm = 0;
+            AddTimer(&tests[i].timer, start + plan[i].delayUs * NSEC_PER_USEC);
+        }
+        tests[6].rearm = 4;
+        tests[6].period = 500 * NSEC_PER_USEC;
+        bool cancelled = CancelTimer(&tests[2].timer);
+        bool moved = ModTimer(&tests[4].timer, start + 20000 * NSEC_PER_USEC);
+
+        bool done = WaitUntil([&] { return firedCount >= 10; }, 1 * NSEC_PER_SEC);
+        mdelay(10);
+
+        bool passed = cancelled && moved && done && firedCount == 10;
+        for (int i = 0; i < 7; i++) {
+            if (i == 2) {
+                if (tests[i].order != -1) {
+                    prErr("hrtimer", "%s: fired anyway", plan[i].name);
+                    passed = false;
+                }
+                continue;
+            }
+            uint64_t expected = tests[i].timer.expires;
+            int64_t lateUs = ((int64_t)tests[i].firedAt - (int64_t)expected) / 1000;
+            // Wheel timers may round up by 1/8th of their delay plus a tick
+            int64_t allowedUs = plan[i].precise ? 1000 : (int64_t)(plan[i].delayUs / 8 + 2000);
+            bool ok = tests[i].firedAt && lateUs >= 0 && lateUs <= allowedUs;
+            kprintf("  %-28s fired #%d, %d us late %s\n", plan[i].name, tests[i].order, (int)lateUs, ok ? "" : "(FAIL)");
+            if (!ok) passed = false;
+        }
+        if (tests[1].order > tests[0].order) {
+            prErr("hrtimer", "Precise timers fired out of order");
+            passed = false;
+        }
+
+        for (int i = 0; i < 7; i++) CancelTimer(&tests[i].timer);
+        return passed;
+    }
+}
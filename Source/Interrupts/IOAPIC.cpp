@@ -0,0 +1,258 @@
+#include <Interrupts/IOAPIC.hpp>
+#include <Drivers/ACPI/acpi.h>
+#include <Sync/Spinlock.hpp>
+#include <Inferno/Log.h>
+
+#define IOAPIC_REGSEL           0x00
+#define IOAPIC_WINDOW           0x10
+
+#define IOAPIC_REG_ID           0x00
+#define IOAPIC_REG_VERSION      0x01
+#define IOAPIC_REG_REDIRECTION  0x10    // two registers per input
+
+#define REDIR_DELIVERY_FIXED    (0ULL << 8)
+#define REDIR_DEST_PHYSICAL     (0ULL << 11)
+#define REDIR_ACTIVE_LOW        (1ULL << 13)
+#define REDIR_LEVEL             (1ULL << 15)
+#define REDIR_MASKED            (1ULL << 16)
+#define REDIR_VECTOR_MASK       0xFFULL
+#define REDIR_DEST_SHIFT        56
+
+namespace IOAPIC {
+    // IOREGSEL/IOWIN is a select-then-access pair, anyone else selecting
+    // in between, on this CPU or another, would make us hit the wrong
+    // register. `lock` covers every access from select to data.
+    struct Controller {
+        volatile uint32_t* base;
+        spinlock_t lock;
+        uint8_t id;
+        uint32_t gsiBase;
+        uint32_t inputs;
+    };
+
+    struct ISARoute {
+        uint32_t gsi;
+        uint16_t flags;             // MPS INTI flags from the override, 0 if none
+    };
+
+    static Controller controllers[IOAPIC_MAX_CONTROLLERS];
+    static uint32_t controllerCount = 0;
+    static ISARoute isaRoutes[IOAPIC_ISA_IRQS];
+    static bool initialized = false;
+    static DEFINE_LOCK_CLASS(controllerClass, "ioapic");
+
+    static inline uint32_t Read(Controller* c, uint8_t reg) {
+        c->base[IOAPIC_REGSEL / 4] = reg;
+        return c->base[IOAPIC_WINDOW / 4];
+    }
+
+    static inline void Write(Controller* c, uint8_t reg, uint32_t value) {
+        c->base[IOAPIC_REGSEL / 4] = reg;
+        c->base[IOAPIC_WINDOW / 4] = value;
+    }
+
+    static uint64_t ReadEntry(Controller* c, uint32_t pin) {
+        uint64_t low = Read(c, IOAPIC_REG_REDIRECTION + pin * 2);
+        uint64_t high = Read(c, IOAPIC_REG_REDIRECTION + pin * 2 + 1);
+        return (high << 32) | low;
+    }
+
+    // Destination first, low half last: the low half holds the mask bit, so
+    // the entry never goes live half written
+    static void WriteEntry(Controller* c, uint32_t pin, uint64_t entry) {
+        Write(c, IOAPIC_REG_REDIRECTION + pin * 2, (uint32_t)entry | REDIR_MASKED);
+        Write(c, IOAPIC_REG_REDIRECTION + pin * 2 + 1, (uint32_t)(entry >> 32));
+        Write(c, IOAPIC_REG_REDIRECTION + pin * 2, (uint32_t)entry);
+    }
+
+    static Controller* ControllerFor(uint32_t gsi, uint32_t* pin) {
+        for (uint32_t i = 0; i < controllerCount; i++) {
+            Controller* c = &controllers[i];
+            if (gsi >= c->gsiBase && gsi < c->gsiBase + c->inputs) {
+                *pin = gsi - c->gsiBase;
+                return c;
+            }
+        }
+        return nullptr;
+    }
+
+    static void AddController(ACPI::MADTIOAPIC* entry) {
+        if (controllerCount == IOAPIC_MAX_CONTROLLERS) {
+            prWarn("ioapic", "Ignoring I/O APIC %d, only %d supported", entry->IOAPICID, IOAPIC_MAX_CONTROLLERS);
+            return;
+        }
+
+        Controller* c = &controllers[controllerCount++];
+        c->base = (volatile uint32_t*)(uint64_t)entry->Address;
+        spin_lock_init(&c->lock, &controllerClass);
+        c->id = entry->IOAPICID;
+        c->gsiBase = entry->GSIBase;
+
+        // Firmware may have left lines routed, start from a clean slate
+        uint64_t flags = spin_lock_irqsave(&c->lock);
+        c->inputs = ((Read(c, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+        for (uint32_t pin = 0; pin < c->inputs; pin++) WriteEntry(c, pin, REDIR_MASKED);
+        spin_unlock_irqrestore(&c->lock, flags);
+
+        prInfo("ioapic", "I/O APIC %d at 0x%x, GSIs %d-%d", c->id, entry->Address, c->gsiBase,
+            c->gsiBase + c->inputs - 1);
+    }
+
+    bool Initialize() {
+        ACPI::MADT* madt = (ACPI::MADT*)ACPI::FindTable("APIC");
+        if (!madt) {
+            prErr("ioapic", "MADT not found in ACPI");
+            return false;
+        }
+
+        for (int irq = 0; irq < IOAPIC_ISA_IRQS; irq++) isaRoutes[irq] = { (uint32_t)irq, 0 };
+
+        uint8_t* entry = (uint8_t*)madt + sizeof(ACPI::MADT);
+        uint8_t* end = (uint8_t*)madt + madt->header.Length;
+        while (entry + sizeof(ACPI::MADTEntry) <= end) {
+            ACPI::MADTEntry* header = (ACPI::MADTEntry*)entry;
+            if (header->Length < sizeof(ACPI::MADTEntry)) break;
+
+            if (header->Type == MADT_IO_APIC) {
+                AddController((ACPI::MADTIOAPIC*)entry);
+            } else if (header->Type == MADT_INTERRUPT_OVERRIDE) {
+                ACPI::MADTInterruptOverride* iso = (ACPI::MADTInterruptOverride*)entry;
+                if (iso->Bus == 0 && iso->Source < IOAPIC_ISA_IRQS) {
+                    isaRoutes[iso->Source] = { iso->GSI, iso->Flags };
+                    prDebug("ioapic", "ISA IRQ %d -> GSI %d, flags 0x%x", iso->Source, iso->GSI, iso->Flags);
+                }
+            }
+            entry += header->Length;
+        }
+
+        if (!controllerCount) {
+            prErr("ioapic", "No I/O APIC in the MADT");
+            return false;
+        }
+
+        initialized = true;
+        return true;
+    }
+
+    bool IsInitialized() {
+        return initialized;
+    }
+
+    uint32_t GetControllerCount() {
+        return controllerCount;
+    }
+
+    bool Route(uint32_t gsi, uint8_t vector, uint32_t apicId, Trigger trigger, Polarity polarity) {
+        uint32_t pin;
+        Controller* c = ControllerFor(gsi, &pin);
+        if (!c) {
+            prErr("ioapic", "No I/O APIC handles GSI %d", gsi);
+            return false;
+        }
+        if (apicId > 0xFF) {
+            // Needs interrupt remapping, which we don't do
+            prErr("ioapic", "Can't target APIC ID %d from GSI %d, 8-bit destinations only", apicId, gsi);
+            return false;
+        }
+
+        uint64_t entry = vector | REDIR_DELIVERY_FIXED | REDIR_DEST_PHYSICAL |
+            ((uint64_t)(apicId & 0xFF) << REDIR_DEST_SHIFT);
+        if (trigger == Trigger::Level) entry |= REDIR_LEVEL;
+        if (polarity == Polarity::Low) entry |= REDIR_ACTIVE_LOW;
+
+        uint64_t flags = spin_lock_irqsave(&c->lock);
+        WriteEntry(c, pin, entry);
+        spin_unlock_irqrestore(&c->lock, flags);
+        return true;
+    }
+
+    // "Conforms to bus" leaves the bus defaults the caller passed in
+    static void ApplyOverride(uint16_t flags, Trigger* trigger, Polarity* polarity) {
+        if ((flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW) *polarity = Polarity::Low;
+        else if ((flags & MADT_POLARITY_MASK) == MADT_POLARITY_HIGH) *polarity = Polarity::High;
+        if ((flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL) *trigger = Trigger::Level;
+        else if ((flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_EDGE) *trigger = Trigger::Edge;
+    }
+
+    bool RouteISA(uint8_t irq, uint8_t vector, uint32_t apicId) {
+        if (irq >= IOAPIC_ISA_IRQS) return false;
+
+        // ISA defaults, edge and active high
+        Trigger trigger = Trigger::Edge;
+        Polarity polarity = Polarity::High;
+        ApplyOverride(isaRoutes[irq].flags, &trigger, &polarity);
+        return Route(isaRoutes[irq].gsi, vector, apicId, trigger, polarity);
+    }
+
+    bool RoutePCI(uint32_t gsi, uint8_t vector, uint32_t apicId) {
+        // PCI defaults, level and active low, unless the firmware put an
+        // override on this GSI (the SCI often shares one with PCI)
+        Trigger trigger = Trigger::Level;
+        Polarity polarity = Polarity::Low;
+        for (int irq = 0; irq < IOAPIC_ISA_IRQS; irq++) {
+            if (isaRoutes[irq].gsi == gsi && isaRoutes[irq].flags) {
+                ApplyOverride(isaRoutes[irq].flags, &trigger, &polarity);
+                break;
+            }
+        }
+        return Route(gsi, vector, apicId, trigger, polarity);
+    }
+
+    bool SetAffinity(uint32_t gsi, uint32_t apicId) {
+        uint32_t pin;
+        Controller* c = ControllerFor(gsi, &pin);
+        if (!c) return false;
+        if (apicId > 0xFF) {
+            prErr("ioapic", "Can't move GSI %d to APIC ID %d, 8-bit destinations only", gsi, apicId);
+            return false;
+        }
+
+        uint64_t flags = spin_lock_irqsave(&c->lock);
+        uint64_t entry = ReadEntry(c, pin);
+        entry = (entry & ~(0xFFULL << REDIR_DEST_SHIFT)) | ((uint64_t)(apicId & 0xFF) << REDIR_DEST_SHIFT);
+        WriteEntry(c, pin, entry);
+        spin_unlock_irqrestore(&c->lock, flags);
+        return true;
+    }
+
+    static void SetMasked(uint32_t gsi, bool masked) {
+        uint32_t pin;
+        Controller* c = ControllerFor(gsi, &pin);
+        if (!c) return;
+
+        uint64_t flags = spin_lock_irqsave(&c->lock);
+        uint32_t low = Read(c, IOAPIC_REG_REDIRECTION + pin * 2);
+        low = masked ? low | REDIR_MASKED : low & ~REDIR_MASKED;
+        Write(c, IOAPIC_REG_REDIRECTION + pin * 2, low);
+        spin_unlock_irqrestore(&c->lock, flags);
+    }
+
+    void Mask(uint32_t gsi) {
+        SetMasked(gsi, true);
+    }
+
+    void Unmask(uint32_t gsi) {
+        SetMasked(gsi, false);
+    }
+
+    uint32_t ISAToGSI(uint8_t irq) {
+        return irq < IOAPIC_ISA_IRQS ? isaRoutes[irq].gsi : irq;
+    }
+
+    void PrintRoutes() {
+        kprintf("  gsi  ioapic  vector  apic  trigger  polarity\n");
+        for (uint32_t i = 0; i < controllerCount; i++) {
+            Controller* c = &controllers[i];
+            for (uint32_t pin = 0; pin < c->inputs; pin++) {
+                uint64_t flags = spin_lock_irqsave(&c->lock);
+                uint64_t entry = ReadEntry(c, pin);
+                spin_unlock_irqrestore(&c->lock, flags);
+                if (entry & REDIR_MASKED) continue;
+
+                kprintf("  %-4d %-7d 0x%02x    %-5d %-8s %s\n", c->gsiBase + pin, c->id,
+                    (unsigned int)(entry & REDIR_VECTOR_MASK), (unsigned int)(entry >> REDIR_DEST_SHIFT),
+                    entry & REDIR_LEVEL ? "level" : "edge", entry & REDIR_ACTIVE_LOW ? "low" : "high");
+            }
+        }
+    }
+}
@@ -7,16 +7,85 @@
 //===================================================================//
 
 #include <Interrupts/Interrupts.hpp>
+#include <CPU/PerCPU.hpp>
+#include <Sched/Softirq.hpp>
+#include <Sync/Spinlock.hpp>
+#include <Inferno/Log.h>
+
+// Entry points generated in Stubs.s, one per vector
+extern "C" void* InterruptStubs[256];
+
+// InterruptCommon pushes 15 registers on top of vector, error and the CPU frame
+static_assert(sizeof(Interrupts::Frame) == 22 * 8, "Frame must match Stubs.s");
 
 namespace Interrupts {
 	Entry ISR[256];
 	Table IDT;
 
+	typedef struct Action {
+		Handler handler;
+		void* context;
+		struct Action* next;
+	} Action;
+
+	typedef struct {
+		uint64_t count, unhandled, cycles;
+	} Stats;
+
+	static Action actionPool[INTERRUPT_MAX_ACTIONS];
+	static Action* freeActions = nullptr;
+	static Action* actions[256];
+	static DEFINE_PER_CPU(Stats, stats[256]);
+	static void (*endOfInterrupt)(uint8_t vector) = nullptr;
+	static void (*exitHook)(Frame* frame) = nullptr;
+	static uint64_t vectorsUsed[4];
+
+	static const char* exceptionNames[32] = {
+		"Divide Error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound Range Exceeded",
+		"Invalid Opcode", "Device Not Available", "Double Fault", "Coprocessor Segment Overrun",
+		"Invalid TSS", "Segment Not Present", "Stack-Segment Fault", "General Protection Fault",
+		"Page Fault", "Reserved", "x87 Floating-Point Exception", "Alignment Check",
+		"Machine Check", "SIMD Floating-Point Exception", "Virtualization Exception",
+		"Control Protection Exception", "Reserved", "Reserved", "Reserved", "Reserved",
+		"Reserved", "Reserved", "Hypervisor Injection Exception", "VMM Communication Exception",
+		"Security Exception", "Reserved"
+	};
+
+	static inline uint64_t ReadTSC() {
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		return ((uint64_t)high << 32) | low;
+	}
+
+	// Handler lists, the free action pool and the vector bitmap. Taken with
+	// interrupts off so an update can't race the dispatcher on this CPU.
+	static DEFINE_LOCK_CLASS(tableClass, "interrupts");
+	static spinlock_t tableLock = SPINLOCK_INIT_CLASS(tableClass);
+
+	static void SetGate(unsigned char index, void* handler, unsigned char attributes) {
+		Entry* entry = &ISR[index];
+		entry->isrLow = (unsigned long long)handler & 0xFFFF;
+		entry->cs = 0x8;
+		entry->ist = 0;
+		entry->attributes = attributes;
+		entry->isrMid = ((unsigned long long)handler >> 16) & 0xFFFF;
+		entry->isrHigh = ((unsigned long long)handler >> 32) & 0xFFFFFFFF;
+		entry->null = 0;
+	}
+
 	void CreateIDT() {
 		IDT = {
 			(unsigned short)(sizeof(ISR) - 1),
 			(unsigned long)&ISR[0]
 		};
+
+		for (int i = 0; i < 256; i++) SetGate(i, InterruptStubs[i], 0x8E);
+
+		freeActions = nullptr;
+		for (int i = INTERRUPT_MAX_ACTIONS - 1; i >= 0; i--) {
+			actionPool[i].next = freeActions;
+			freeActions = &actionPool[i];
+		}
 	}
 
 	void Enable() {
@@ -33,13 +102,208 @@ namespace Interrupts {
 	}
 
 	void CreateISR(unsigned char index, void* handler) {
-		Entry* entry = &ISR[index];
-		entry->isrLow = (unsigned long long)handler & 0xFFFF;
-		entry->cs = 0x8;
-		entry->ist = 0;
-		entry->attributes = 0x8E;
-		entry->isrMid = ((unsigned long long)handler >> 16) & 0xFFFF;
-		entry->isrHigh = ((unsigned long long)handler >> 32) & 0xFFFFFFFF;
-		entry->null = 0;
+		SetGate(index, handler, 0x8E);
+	}
+
+	bool RegisterHandler(uint8_t vector, Handler handler, void* context) {
+		if (!handler) return false;
+
+		uint64_t flags = spin_lock_irqsave(&tableLock);
+		Action* action = freeActions;
+		if (!action) {
+			spin_unlock_irqrestore(&tableLock, flags);
+			prErr("idt", "Out of handler slots registering vector 0x%x", vector);
+			return false;
+		}
+		freeActions = action->next;
+
+		action->handler = handler;
+		action->context = context;
+		action->next = nullptr;
+
+		// Append so shared handlers run in registration order. Filled in
+		// before it's linked, the dispatcher walks the list without the lock.
+		Action** link = &actions[vector];
+		while (*link) link = &(*link)->next;
+		__atomic_store_n(link, action, __ATOMIC_RELEASE);
+		spin_unlock_irqrestore(&tableLock, flags);
+		return true;
+	}
+
+	// Until every other CPU has been seen outside the dispatcher. One that
+	// was walking a list when we looked has finished that walk by then,
+	// and any later walk starts from the lists as they are now.
+	static void WaitForDispatchers() {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		uint32_t self = this_cpu_id();
+		for (uint32_t i = 0; i < PerCPU::GetCount(); i++) {
+			PerCPU::Area* area = PerCPU::Get(i);
+			if (!area || i == self) continue;
+			while (__atomic_load_n(&area->irqDepth, __ATOMIC_ACQUIRE)) asm volatile("pause");
+		}
+	}
+
+	bool UnregisterHandler(uint8_t vector, Handler handler, void* context) {
+		uint64_t flags = spin_lock_irqsave(&tableLock);
+		Action* action = nullptr;
+		for (Action** link = &actions[vector]; *link; link = &(*link)->next) {
+			if ((*link)->handler == handler && (*link)->context == context) {
+				action = *link;
+				// Its own next stays put for a dispatcher standing on it
+				__atomic_store_n(link, action->next, __ATOMIC_RELEASE);
+				break;
+			}
+		}
+		spin_unlock_irqrestore(&tableLock, flags);
+		if (!action) return false;
+
+		// Another CPU may still be on it, and reused it could lead that
+		// walk into another vector's handlers
+		WaitForDispatchers();
+		flags = spin_lock_irqsave(&tableLock);
+		action->next = freeActions;
+		freeActions = action;
+		spin_unlock_irqrestore(&tableLock, flags);
+		return true;
+	}
+
+	void SetEndOfInterrupt(void (*eoi)(uint8_t vector)) {
+		endOfInterrupt = eoi;
+	}
+
+	void SetExitHook(void (*hook)(Frame* frame)) {
+		exitHook = hook;
+	}
+
+	static inline bool VectorUsed(int vector) {
+		return vectorsUsed[vector / 64] & (1ULL << (vector % 64));
+	}
+
+	int AllocateVectors(uint8_t count) {
+		if (!count) return -1;
+		int align = 1;
+		while (align < count) align <<= 1;
+
+		uint64_t flags = spin_lock_irqsave(&tableLock);
+		int first = (INTERRUPT_DYNAMIC_FIRST + align - 1) & ~(align - 1);
+		for (; first + count - 1 <= INTERRUPT_DYNAMIC_LAST; first += align) {
+			int i = 0;
+			while (i < count && !VectorUsed(first + i)) i++;
+			if (i < count) continue;
+
+			for (i = 0; i < count; i++) vectorsUsed[(first + i) / 64] |= 1ULL << ((first + i) % 64);
+			spin_unlock_irqrestore(&tableLock, flags);
+			return first;
+		}
+		spin_unlock_irqrestore(&tableLock, flags);
+		prErr("idt", "No run of %d free vectors left", count);
+		return -1;
+	}
+
+	void FreeVectors(uint8_t first, uint8_t count) {
+		uint64_t flags = spin_lock_irqsave(&tableLock);
+		for (int v = first; v < first + count && v <= INTERRUPT_DYNAMIC_LAST; v++) {
+			vectorsUsed[v / 64] &= ~(1ULL << (v % 64));
+		}
+		spin_unlock_irqrestore(&tableLock, flags);
+	}
+
+	void SetGatePrivilege(uint8_t vector, uint8_t dpl) {
+		ISR[vector].attributes = (ISR[vector].attributes & ~0x60) | ((dpl & 3) << 5);
+	}
+
+	// Totals over every CPU's copy
+	static Stats SumStats(uint8_t vector) {
+		Stats total = { 0, 0, 0 };
+		for (uint32_t i = 0; i < PerCPU::GetCount(); i++) {
+			if (!PerCPU::Get(i)) continue;
+			Stats* s = &per_cpu_ptr(stats, i)[vector];
+			total.count += s->count;
+			total.unhandled += s->unhandled;
+			total.cycles += s->cycles;
+		}
+		return total;
+	}
+
+	uint64_t GetCount(uint8_t vector) {
+		return SumStats(vector).count;
+	}
+
+	uint64_t GetUnhandledCount(uint8_t vector) {
+		return SumStats(vector).unhandled;
 	}
+
+	uint64_t GetCycles(uint8_t vector) {
+		return SumStats(vector).cycles;
+	}
+
+	static const char* VectorName(uint8_t vector) {
+		if (vector < 32) return exceptionNames[vector];
+		if (vector == INTERRUPT_SYSCALL_VECTOR) return "Syscall";
+		if (vector == INTERRUPT_SPURIOUS_VECTOR) return "Spurious";
+		return "IRQ";
+	}
+
+	void PrintStats() {
+		kprintf("  vector  name                               count  unhandled  cycles/irq\n");
+		for (int i = 0; i < 256; i++) {
+			Stats s = SumStats(i);
+			if (!s.count) continue;
+			kprintf("  0x%02x    %-30s %10u %10u %11u\n", i, VectorName(i), (unsigned int)s.count,
+				(unsigned int)s.unhandled, (unsigned int)(s.cycles / s.count));
+		}
+	}
+
+	[[noreturn]] static void Panic(Frame* frame) {
+		uint64_t cr2;
+		asm volatile("mov %%cr2, %0" : "=r"(cr2));
+		kprintf("\r\e[31m[ERROR] %s (vector %d, error 0x%x)\e[0m\n\r", VectorName(frame->vector),
+			(int)frame->vector, (unsigned int)frame->error);
+		kprintf("  rip=%p cs=%p rflags=%p rsp=%p ss=%p cr2=%p\n\r",
+			frame->rip, frame->cs, frame->rflags, frame->rsp, frame->ss, cr2);
+		kprintf("  rax=%p rbx=%p rcx=%p rdx=%p\n\r", frame->rax, frame->rbx, frame->rcx, frame->rdx);
+		kprintf("  rsi=%p rdi=%p rbp=%p\n\r", frame->rsi, frame->rdi, frame->rbp);
+		kprintf("  r8=%p r9=%p r10=%p r11=%p\n\r", frame->r8, frame->r9, frame->r10, frame->r11);
+		kprintf("  r12=%p r13=%p r14=%p r15=%p\n\r", frame->r12, frame->r13, frame->r14, frame->r15);
+		while (1) asm("cli; hlt");
+	}
+
+	static inline bool IsHardwareVector(uint8_t vector) {
+		return vector >= 32 && vector != INTERRUPT_SYSCALL_VECTOR && vector != INTERRUPT_SPURIOUS_VECTOR;
+	}
+}
+
+// Called from InterruptCommon with interrupts disabled
+extern "C" void InterruptDispatch(Interrupts::Frame* frame) {
+	using namespace Interrupts;
+	uint8_t vector = (uint8_t)frame->vector;
+	uint64_t start = ReadTSC();
+
+	// Locked, so UnregisterHandler can't see a depth of 0 after this
+	// reads the list
+	PerCPU::Area* area = this_cpu();
+	__atomic_fetch_add(&area->irqDepth, 1, __ATOMIC_SEQ_CST);
+	bool handled = false;
+	for (Action* action = __atomic_load_n(&actions[vector], __ATOMIC_ACQUIRE); action;
+		action = __atomic_load_n(&action->next, __ATOMIC_ACQUIRE)) {
+		if (action->handler(frame, action->context)) handled = true;
+	}
+	__atomic_store_n(&area->irqDepth, area->irqDepth - 1, __ATOMIC_RELEASE);
+
+	// This CPU's copy, nobody else writes it and we run with interrupts off
+	Stats* s = &this_cpu_ptr(stats)[vector];
+	s->count++;
+	if (!handled) {
+		s->unhandled++;
+		if (vector < 32) Panic(frame);
+	}
+
+	if (endOfInterrupt && IsHardwareVector(vector)) endOfInterrupt(vector);
+	s->cycles += ReadTSC() - start;
+
+	// What the handlers deferred runs now, with interrupts back on
+	if (area->softirqPending) Softirq::InterruptExit(frame->rflags);
+
+	// May switch threads, and come back here much later on another CPU
+	if (exitHook) exitHook(frame);
 }
@@ -9,7 +9,12 @@
 #include <Drivers/TTY/COM.h>
 #include <Interrupts/PageFault.hpp>
 
-void PageFault(void*) {
-	kprintf("\r\e[31m[ERROR] Page Fault\e[0m\n\r");
+bool PageFault(Interrupts::Frame* frame, void*) {
+	uint64_t address;
+	asm volatile("mov %%cr2, %0" : "=r"(address));
+	kprintf("\r\e[31m[ERROR] Page Fault\e[0m at %p, %s %s (error 0x%x, rip %p)\n\r", address,
+		(frame->error & 1) ? "protection violation" : "page not present",
+		(frame->error & 2) ? "on write" : ((frame->error & 0x10) ? "on fetch" : "on read"),
+		(unsigned int)frame->error, frame->rip);
 	while(1) asm("hlt");
 }
@@ -0,0 +1,79 @@
+; Per-vector interrupt entry stubs. Every vector gets a tiny stub that
+; pushes a dummy error code (unless the CPU pushed one) and the vector
+; number, then joins InterruptCommon which saves the general purpose
+; registers and hands an Interrupts::Frame to InterruptDispatch. Coming
+; from ring 3 it swaps GS to the kernel's per-CPU area and back.
+[bits 64]
+extern InterruptDispatch
+
+section .text
+
+InterruptCommon:
+  ; CS of the interrupted code, above vector, error code and rip
+  test qword [rsp + 24], 3
+  jz .kernel_entry
+  swapgs
+.kernel_entry:
+  push rax
+  push rbx
+  push rcx
+  push rdx
+  push rsi
+  push rdi
+  push rbp
+  push r8
+  push r9
+  push r10
+  push r11
+  push r12
+  push r13
+  push r14
+  push r15
+  cld
+  ; 22 qwords on top of the 16-byte aligned entry rsp, so rsp is aligned here
+  mov rdi, rsp
+  call InterruptDispatch
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop r11
+  pop r10
+  pop r9
+  pop r8
+  pop rbp
+  pop rdi
+  pop rsi
+  pop rdx
+  pop rcx
+  pop rbx
+  pop rax
+  add rsp, 16 ; vector and error code
+  test qword [rsp + 8], 3
+  jz .kernel_exit
+  swapgs
+.kernel_exit:
+  iretq
+
+%assign i 0
+%rep 256
+  align 16
+InterruptStub%+i:
+  %if !(i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30)
+  push qword 0
+  %endif
+  push qword i
+  jmp InterruptCommon
+%assign i i+1
+%endrep
+
+section .rodata
+global InterruptStubs
+InterruptStubs:
+%assign i 0
+%rep 256
+  dq InterruptStub%+i
+%assign i i+1
+%endrep
+
+section .note.GNU-stack noalloc noexec nowrite progbits
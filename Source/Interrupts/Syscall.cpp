@@ -8,10 +8,37 @@
 
 #include <Drivers/TTY/COM.h>
 #include <Interrupts/Syscall.hpp>
+#include <Interrupts/SyscallTrace.hpp>
 #include <Memory/Heap.hpp>
 #include <Memory/Memory.hpp>
 #include <Memory/Paging.hpp>
 #include <Inferno/Log.h>
+#include <Inferno/string.h>
+#include <Sync/Futex.hpp>
+#include <CPU/MSR.hpp>
+#include <CPU/PerCPU.hpp>
+#include <Sched/Preempt.hpp>
+#include <Sched/Scheduler.hpp>
+
+#define MSR_EFER            0xC0000080
+#define MSR_STAR            0xC0000081
+#define MSR_LSTAR           0xC0000082
+#define MSR_FMASK           0xC0000084
+
+#define EFER_SCE            (1 << 0)
+
+// RFLAGS bits cleared on entry: TF, IF, DF, AC
+#define SYSCALL_FMASK       ((1 << 8) | (1 << 9) | (1 << 10) | (1 << 18))
+
+// Where SelfTest maps its ring 3 code and stack, well clear of the
+// identity-mapped low memory
+#define SYSCALL_TEST_CODE   0x40000000000ULL
+#define SYSCALL_TEST_STACK  (SYSCALL_TEST_CODE + 0x1000)
+#define SYSCALL_TEST_ROUNDS 1000
+
+extern "C" void SyscallEntry();
+extern "C" void SyscallEnterUser(uint64_t rip, uint64_t rsp, uint64_t arg0, uint64_t arg1);
+extern "C" char SyscallTestUser[], SyscallTestUserEnd[];
 
 // Program break - used by brk/sbrk syscalls
 static uint64_t current_brk = 0x4000000;  // Initial program break at 4MB
@@ -46,8 +73,6 @@ static uint64_t sys_mmap(uint64_t addr, uint64_t len, uint64_t prot, uint64_t fl
 
 // Linux brk implementation
 static uint64_t sys_brk(uint64_t new_brk, uint64_t unused1, uint64_t unused2, uint64_t unused3, uint64_t unused4, uint64_t unused5) {
-    prInfo("syscall", "brk(0x%x)", new_brk);
-    
     // If new_brk is 0, just return current brk
     if (new_brk == 0) {
         return current_brk;
@@ -75,44 +100,124 @@ static syscall_handler_t syscall_table[] = {
     sys_brk,    // SYS_BRK
 };
 
-// Interrupt handler for syscalls
-__attribute__((interrupt)) void SyscallHandler(void* frame) {
-    // Extract syscall number and arguments from Linux convention registers
-    uint64_t syscall_num, arg1, arg2, arg3, arg4, arg5, arg6;
+// Anything past the dense part of the table
+static syscall_handler_t LookupSyscall(uint64_t syscall_num) {
+    if (syscall_num < sizeof(syscall_table) / sizeof(syscall_handler_t)) return syscall_table[syscall_num];
+    switch (syscall_num) {
+    case SYS_FUTEX: return Futex::Syscall;
+    default: return nullptr;
+    }
+}
 
-    // Get registers following Linux syscall convention:
-    // %rax: syscall number
+// Interrupt handler for syscalls
+bool SyscallHandler(Interrupts::Frame* frame, void*) {
+    // Linux convention: %rax is the syscall number,
     // %rdi: arg1, %rsi: arg2, %rdx: arg3, %r10: arg4, %r8: arg5, %r9: arg6
-    asm volatile(
-        "mov %%rax, %0\n"
-        "mov %%rdi, %1\n"
-        "mov %%rsi, %2\n"
-        "mov %%rdx, %3\n"
-        "mov %%r10, %4\n"
-        "mov %%r8,  %5\n"
-        "mov %%r9,  %6\n"
-        : "=r"(syscall_num), "=r"(arg1), "=r"(arg2), "=r"(arg3), 
-          "=r"(arg4), "=r"(arg5), "=r"(arg6)
-        :
-        : "memory"
-    );
-
-    prInfo("syscall", "Syscall number: %d (args: 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x)",
-           syscall_num, arg1, arg2, arg3, arg4, arg5, arg6);
+    uint64_t syscall_num = frame->rax;
+    uint64_t arg1 = frame->rdi, arg2 = frame->rsi, arg3 = frame->rdx;
+    uint64_t arg4 = frame->r10, arg5 = frame->r8, arg6 = frame->r9;
+
+    uint32_t tracing = SyscallTrace::GetMode();
+    uint64_t start = tracing ? SyscallTrace::Now() : 0;
 
     // Default return value
     uint64_t result = -1;
 
     // Call appropriate handler from syscall table
-    if (syscall_num < sizeof(syscall_table) / sizeof(syscall_handler_t) && 
-        syscall_table[syscall_num] != nullptr) {
-        result = syscall_table[syscall_num](arg1, arg2, arg3, arg4, arg5, arg6);
+    syscall_handler_t handler = LookupSyscall(syscall_num);
+    if (handler != nullptr) {
+        result = handler(arg1, arg2, arg3, arg4, arg5, arg6);
     } else {
         prErr("syscall", "Invalid syscall number: %d", syscall_num);
     }
 
-    // Set return value in RAX per Linux convention
-    asm volatile("mov %0, %%rax" : : "r"(result) : "memory");
+    if (tracing) {
+        uint64_t args[6] = { arg1, arg2, arg3, arg4, arg5, arg6 };
+        SyscallTrace::Record(syscall_num, args, result, SyscallTrace::Now() - start);
+    }
+
+    // Return value goes back in RAX when the stub restores the frame
+    frame->rax = result;
+    return true;
+}
+
+static bool initialized = false;
+static volatile bool testRunning = false;
+static uint64_t testFailures = 0;
+
+// SYSCALL entry, called by SyscallEntry.s with the frame it built
+extern "C" void SyscallDispatch(Interrupts::Frame* frame) {
+    if (testRunning && frame->rax == SYSCALL_TEST_EXIT) {
+        testFailures = frame->rdi;
+        asm volatile("movq $1, %%gs:%c0" :: "i"(__builtin_offsetof(SyscallCPU, leaveUser)) : "memory");
+        return;
+    }
+    SyscallHandler(frame, nullptr);
+}
+
+namespace Syscall {
+    bool Initialize() {
+        // No stack to set up, SyscallEnterUser points the GS block at the
+        // caller's own before it drops to ring 3
+        CPU::WriteMSR(MSR_STAR, ((uint64_t)SYSCALL_USER_BASE << 48) | ((uint64_t)SYSCALL_KERNEL_CS << 32));
+        CPU::WriteMSR(MSR_LSTAR, (uint64_t)SyscallEntry);
+        CPU::WriteMSR(MSR_FMASK, SYSCALL_FMASK);
+        CPU::WriteMSR(MSR_EFER, CPU::ReadMSR(MSR_EFER) | EFER_SCE);
+
+        if (!initialized) prInfo("syscall", "SYSCALL/SYSRET enabled, int 0x80 still available");
+        initialized = true;
+        return true;
+    }
+
+    bool SelfTest() {
+        if (!initialized) {
+            prErr("syscall", "SYSCALL isn't enabled");
+            return false;
+        }
+
+        void* code = Memory::RequestPage();
+        void* stack = Memory::RequestPage();
+        if (!code || !stack) {
+            prErr("syscall", "No memory for the ring 3 test pages");
+            return false;
+        }
+        memcpy(code, SyscallTestUser, SyscallTestUserEnd - SyscallTestUser);
+        Paging::MapUserPage(SYSCALL_TEST_CODE, (uint64_t)code, false);
+        Paging::MapUserPage(SYSCALL_TEST_STACK, (uint64_t)stack, true);
+
+        // Both rdtsc reads on one CPU, and nothing else on it can take the
+        // test exit meant for us
+        Scheduler::Thread* self = Scheduler::IsInitialized() ? Scheduler::Current() : nullptr;
+        uint64_t affinity = self ? self->affinity : 0;
+        if (self) {
+            preempt_disable();
+            Scheduler::SetAffinity(self, 1ULL << this_cpu_id());
+            preempt_enable();
+        }
+
+        uint64_t flags;
+        asm volatile("pushfq; pop %0" : "=r"(flags));
+        testFailures = 0;
+        testRunning = true;
 
-    // The compiler will automatically generate the proper iretq sequence
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        uint64_t start = ((uint64_t)high << 32) | low;
+        SyscallEnterUser(SYSCALL_TEST_CODE, SYSCALL_TEST_STACK + 0x1000, SYSCALL_TEST_ROUNDS, current_brk);
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        uint64_t cycles = (((uint64_t)high << 32) | low) - start;
+
+        testRunning = false;
+        if (flags & 0x200) asm volatile("sti");
+        if (self) Scheduler::SetAffinity(self, affinity);
+
+        Paging::UnmapPage(SYSCALL_TEST_CODE);
+        Paging::UnmapPage(SYSCALL_TEST_STACK);
+        Memory::FreePage(code);
+        Memory::FreePage(stack);
+
+        prInfo("syscall", "%d SYSCALL round trips from ring 3: %d cycles each, %d bad results",
+            SYSCALL_TEST_ROUNDS, (unsigned int)(cycles / (SYSCALL_TEST_ROUNDS + 1)), (unsigned int)testFailures);
+        return testFailures == 0;
+    }
 }
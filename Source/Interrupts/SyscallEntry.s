@@ -0,0 +1,164 @@
+; SYSCALL/SYSRET entry. SYSCALL leaves the user rsp in place and the
+; return rip/rflags in rcx/r11, so the stub swaps to the running thread's
+; kernel stack through GS and lays out an Interrupts::Frame, letting the int 0x80
+; and SYSCALL paths share SyscallHandler. Offsets into the per-CPU block
+; must match SyscallCPU in Syscall.hpp.
+[bits 64]
+extern SyscallDispatch
+
+%define CPU_KERNEL_STACK  0
+%define CPU_USER_STACK    8
+%define CPU_RESUME_STACK  16
+%define CPU_LEAVE_USER    24
+
+%define USER_DATA_SELECTOR (0x18 | 3)
+%define USER_CODE_SELECTOR (0x20 | 3)
+
+section .text
+
+global SyscallEntry
+SyscallEntry:
+  swapgs
+  mov [gs:CPU_USER_STACK], rsp
+  mov rsp, [gs:CPU_KERNEL_STACK]
+
+  ; Same layout the CPU and Stubs.s build for int 0x80
+  push qword USER_DATA_SELECTOR
+  push qword [gs:CPU_USER_STACK]
+  push r11
+  push qword USER_CODE_SELECTOR
+  push rcx
+  push qword 0
+  push qword 0x80
+  push rax
+  push rbx
+  push rcx
+  push rdx
+  push rsi
+  push rdi
+  push rbp
+  push r8
+  push r9
+  push r10
+  push r11
+  push r12
+  push r13
+  push r14
+  push r15
+
+  ; FMASK cleared IF on entry, we're on the kernel stack now
+  sti
+  cld
+  mov rdi, rsp
+  call SyscallDispatch
+  cli
+
+  cmp qword [gs:CPU_LEAVE_USER], 0
+  jne .leave_user
+
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop r11
+  pop r10
+  pop r9
+  pop r8
+  pop rbp
+  pop rdi
+  pop rsi
+  pop rdx
+  pop rcx
+  pop rbx
+  pop rax
+  add rsp, 16 ; vector and error code
+
+  ; SYSRET to a non-canonical rip faults in ring 0 on the user stack,
+  ; take the iretq path for anything outside the lower half
+  mov rcx, [rsp]
+  mov r11, rcx
+  shr r11, 47
+  jnz .iret_return
+
+  mov r11, [rsp + 16]
+  mov rsp, [rsp + 24]
+  swapgs
+  o64 sysret
+
+.iret_return:
+  mov r11, [rsp + 16]
+  swapgs
+  iretq
+
+  ; The ring 3 code SyscallEnterUser started is done, resume its caller
+.leave_user:
+  mov qword [gs:CPU_LEAVE_USER], 0
+  mov rsp, [gs:CPU_RESUME_STACK]
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop rbp
+  pop rbx
+  ret
+
+; void SyscallEnterUser(uint64_t rip, uint64_t rsp, uint64_t arg0, uint64_t arg1)
+; Runs rip in ring 3 with interrupts off until it asks to leave through
+; SyscallDispatch, then returns here. arg0/arg1 arrive in rdi/rsi.
+; Syscalls from there run on this thread's stack below the saved
+; registers, the scheduler carries the GS block along with the thread.
+global SyscallEnterUser
+SyscallEnterUser:
+  push rbx
+  push rbp
+  push r12
+  push r13
+  push r14
+  push r15
+
+  cli
+  mov [gs:CPU_RESUME_STACK], rsp
+  mov rax, rsp
+  and rax, -16
+  mov [gs:CPU_KERNEL_STACK], rax
+  mov r8, rsi
+  mov rax, rdi
+  mov rdi, rdx
+  mov rsi, rcx
+  mov rcx, rax
+  mov r11, 0x2 ; reserved bit only, IF stays clear since there's no TSS yet
+  mov rsp, r8
+  swapgs
+  o64 sysret
+
+; Ring 3 side of Syscall::SelfTest, copied into a user page. Calls brk(0)
+; rdi times, checking the result against rsi and that callee-saved state
+; survives, then exits with the failure count in rdi.
+global SyscallTestUser
+global SyscallTestUserEnd
+SyscallTestUser:
+  mov rbx, rdi
+  mov r15, rsi
+  mov r12, 0x0123456789ABCDEF
+  xor r13, r13
+.loop:
+  mov eax, 12 ; SYS_BRK
+  xor edi, edi
+  syscall
+  cmp rax, r15
+  jne .bad
+  mov r14, 0x0123456789ABCDEF
+  cmp r12, r14
+  je .next
+.bad:
+  inc r13
+.next:
+  dec rbx
+  jnz .loop
+  mov rdi, r13
+  mov rax, 0xFFFFFFFF ; SYSCALL_TEST_EXIT
+  syscall
+  ud2
+SyscallTestUserEnd:
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,126 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: SyscallTrace.cpp
+// Purpose: Opt-in syscall counters, latency histograms and call log
+// Maintainer: FiReLScar
+//
+//===================================================================//
+
+#include <Interrupts/SyscallTrace.hpp>
+#include <Interrupts/Syscall.hpp>
+#include <Memory/Mem_.hpp>
+#include <Inferno/Log.h>
+
+namespace SyscallTrace {
+	typedef struct {
+		uint64_t count, cycles, maxCycles;
+		uint32_t buckets[SYSCALL_TRACE_BUCKETS];
+	} Stats;
+
+	static volatile uint32_t mode = 0;
+	static Stats stats[SYSCALL_TRACE_MAX + 1];
+	static Call ring[SYSCALL_TRACE_RING];
+	static uint64_t ringHead = 0;
+
+	static const char* names[] = {
+		"read", "write", "open", "close", "stat", "fstat", "lstat", "poll", "lseek", "mmap",
+		"mprotect", "munmap", "brk"
+	};
+
+	static const char* Name(uint64_t number) {
+		if (number < sizeof(names) / sizeof(names[0])) return names[number];
+		if (number == SYS_FUTEX) return "futex";
+		return number >= SYSCALL_TRACE_MAX ? "(other)" : "?";
+	}
+
+	void SetMode(uint32_t newMode) {
+		mode = newMode;
+	}
+
+	uint32_t GetMode() {
+		return mode;
+	}
+
+	void Record(uint64_t number, const uint64_t args[6], uint64_t result, uint64_t cycles) {
+		uint32_t current = mode;
+
+		// Every CPU records into the same counters
+		if (current & SYSCALL_TRACE_STATS) {
+			Stats* s = &stats[number < SYSCALL_TRACE_MAX ? number : SYSCALL_TRACE_MAX];
+			__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&s->cycles, cycles, __ATOMIC_RELAXED);
+			uint64_t most = __atomic_load_n(&s->maxCycles, __ATOMIC_RELAXED);
+			while (cycles > most && !__atomic_compare_exchange_n(&s->maxCycles, &most, cycles, true,
+			                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+			int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+			if (bucket >= SYSCALL_TRACE_BUCKETS) bucket = SYSCALL_TRACE_BUCKETS - 1;
+			__atomic_fetch_add(&s->buckets[bucket], 1, __ATOMIC_RELAXED);
+		}
+
+		// `sequence` is 0 while the entry is being written, then its
+		// position in the log plus one
+		if (current & SYSCALL_TRACE_LOG) {
+			uint64_t index = __atomic_fetch_add(&ringHead, 1, __ATOMIC_RELAXED);
+			Call* call = &ring[index % SYSCALL_TRACE_RING];
+			__atomic_store_n(&call->sequence, 0, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			call->number = number;
+			for (int i = 0; i < 6; i++) call->args[i] = args[i];
+			call->result = result;
+			call->cycles = cycles;
+			__atomic_store_n(&call->sequence, index + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	void PrintStats() {
+		kprintf("  nr   name       calls      avg cycles  max cycles\n");
+		for (int nr = 0; nr <= SYSCALL_TRACE_MAX; nr++) {
+			Stats* s = &stats[nr];
+			if (!s->count) continue;
+
+			kprintf("  %-4d %-10s %-10u %-11u %u\n", nr, Name(nr), (unsigned int)s->count,
+				(unsigned int)(s->cycles / s->count), (unsigned int)s->maxCycles);
+
+			// Bars scaled to the fullest bucket
+			uint32_t most = 0;
+			for (int b = 0; b < SYSCALL_TRACE_BUCKETS; b++) if (s->buckets[b] > most) most = s->buckets[b];
+			for (int b = 0; b < SYSCALL_TRACE_BUCKETS; b++) {
+				if (!s->buckets[b]) continue;
+				char bar[41];
+				int length = (int)((uint64_t)s->buckets[b] * 40 / most);
+				if (!length) length = 1;
+				memset(bar, '#', length);
+				bar[length] = '\0';
+				kprintf("         >= 2^%-2d cycles %-10u %s\n", b, s->buckets[b], bar);
+			}
+		}
+	}
+
+	void PrintLog(uint32_t count) {
+		uint64_t head = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+		if (count > SYSCALL_TRACE_RING) count = SYSCALL_TRACE_RING;
+		if (count > head) count = head;
+
+		for (uint64_t i = head - count; i < head; i++) {
+			// A copy, checked afterwards against a writer reusing the entry
+			Call* entry = &ring[i % SYSCALL_TRACE_RING];
+			uint64_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+			Call copy = *entry;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (sequence != i + 1 || __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != sequence) {
+				kprintf("  (being written)\n");
+				continue;
+			}
+			Call* call = &copy;
+			kprintf("  %-4u %s(%p, %p, %p, %p, %p, %p) = %p, %u cycles\n", (unsigned int)call->number, Name(call->number),
+				(void*)call->args[0], (void*)call->args[1], (void*)call->args[2], (void*)call->args[3],
+				(void*)call->args[4], (void*)call->args[5], (void*)call->result, (unsigned int)call->cycles);
+		}
+	}
+
+	void Reset() {
+		memset(stats, 0, sizeof(stats));
+		memset(ring, 0, sizeof(ring));
+		ringHead = 0;
+	}
+}
@@ -0,0 +1,110 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: TimePage.cpp
+// Purpose: Clock parameters published to ring 3
+// Maintainer: FiReLScar
+//
+//===================================================================//
+
+#include <Interrupts/TimePage.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Memory/Memory.hpp>
+#include <Memory/Paging.hpp>
+#include <Memory/Mem_.hpp>
+#include <Inferno/Log.h>
+#include <Sync/Spinlock.hpp>
+
+namespace TimePage {
+    // Kernel writes go through the identity mapping, user reads through
+    // the read-only one at TIMEPAGE_ADDRESS
+    static TimePageData* page = nullptr;
+
+    // Writers only, readers go by the sequence count
+    static DEFINE_LOCK_CLASS(lockClass, "timepage");
+    static spinlock_t lock = SPINLOCK_INIT_CLASS(lockClass);
+
+    bool Initialize() {
+        if (Clock::GetSource() == Clock::Source::None) {
+            prErr("timepage", "No clocksource to publish");
+            return false;
+        }
+
+        page = (TimePageData*)Memory::RequestPage();
+        if (!page) {
+            prErr("timepage", "Out of memory");
+            return false;
+        }
+        memset(page, 0, 0x1000);
+        Paging::MapUserPage(TIMEPAGE_ADDRESS, (uint64_t)page, false);
+
+        Update();
+        prInfo("timepage", "Time page at %p, %s", (void*)TIMEPAGE_ADDRESS,
+            page->tscUsable ? "clocks readable from ring 3" : "HPET clocksource, syscall fallback only");
+        return true;
+    }
+
+    void Update() {
+        if (!page) return;
+
+        // One writer at a time, or two CPUs setting the wall clock could
+        // leave the count even mid-update or publish the older offset last.
+        // Interrupts off so a reader on this CPU never spins on our odd count.
+        uint64_t flags = spin_lock_irqsave(&lock);
+        uint64_t base, mult;
+        Clock::GetScale(&base, &mult);
+        page->sequence++;
+        asm volatile("" ::: "memory");
+        page->tscUsable = Clock::GetSource() == Clock::Source::TSC;
+        page->tscBase = base;
+        page->mult = mult;
+        page->shift = CLOCK_SHIFT;
+        page->realtimeOffset = Clock::GetRealtimeOffset();
+        asm volatile("" ::: "memory");
+        page->sequence++;
+        spin_unlock_irqrestore(&lock, flags);
+    }
+
+    bool SelfTest() {
+        if (!page) {
+            prErr("timepage", "Time page not set up");
+            return false;
+        }
+
+        const TimePageData* user = (const TimePageData*)TIMEPAGE_ADDRESS;
+        uint64_t before = ClockMonotonicNs();
+        uint64_t monotonic, realtime;
+        if (!TimePageGetTime(user, CLOCK_MONOTONIC, &monotonic) || !TimePageGetTime(user, CLOCK_REALTIME, &realtime)) {
+            prInfo("timepage", "Clocksource not exported, userspace takes the syscall");
+            return !page->tscUsable;
+        }
+        uint64_t after = ClockMonotonicNs();
+
+        bool passed = true;
+        if (monotonic < before || monotonic > after) {
+            prErr("timepage", "Monotonic %p outside the kernel's [%p, %p]", (void*)monotonic, (void*)before,
+                (void*)after);
+            passed = false;
+        }
+        uint64_t kernelRealtime = ClockRealtimeNs();
+        if (realtime > kernelRealtime || kernelRealtime - realtime > 1000000ULL) {
+            prErr("timepage", "Realtime %p vs kernel %p", (void*)realtime, (void*)kernelRealtime);
+            passed = false;
+        }
+
+        // Cost per read, timed with the TSC
+        const int calls = 10000;
+        uint64_t sink = 0, ns;
+        uint32_t low, high;
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        uint64_t start = ((uint64_t)high << 32) | low;
+        for (int i = 0; i < calls; i++) {
+            TimePageGetTime(user, CLOCK_MONOTONIC, &ns);
+            sink += ns;
+        }
+        asm volatile("rdtsc" : "=a"(low), "=d"(high));
+        asm volatile("" :: "r"(sink));
+        prInfo("timepage", "clock_gettime through the page: %d cycles/call",
+            (unsigned int)(((((uint64_t)high << 32) | low) - start) / calls));
+        return passed;
+    }
+}
@@ -1,6 +1,7 @@
 #include <Memory/Heap.hpp>
 #include <Memory/Memory.hpp>
 #include <Memory/Mem_.hpp>
+#include <Sync/Spinlock.hpp>
 #include <Inferno/Log.h>
 
 // Global new/delete operators
@@ -72,6 +73,11 @@ namespace Heap {
 	static uint64_t heapStart = 0;
 	static uint64_t heapSize = 0;
 
+	// The whole block list. Allocations come from interrupt handlers too,
+	// so it's taken with interrupts off.
+	static DEFINE_LOCK_CLASS(heapClass, "heap");
+	static spinlock_t heapLock = SPINLOCK_INIT_CLASS(heapClass);
+
 	void Initialize(uint64_t start, uint64_t size) {
 		heapStart = start;
 		heapSize = size;
@@ -86,6 +92,7 @@ namespace Heap {
 	}
 
 	void* Allocate(uint64_t size) {
+		uint64_t flags = spin_lock_irqsave(&heapLock);
 		HeapBlock* current = firstBlock;
 		HeapBlock* best = nullptr;
 		uint64_t smallest = 0xFFFFFFFFFFFFFFFF;
@@ -102,6 +109,7 @@ namespace Heap {
 		}
 
 		if (!best) {
+			spin_unlock_irqrestore(&heapLock, flags);
 			prErr("heap", "allocation failed: no blocks available");
 			return nullptr;
 		}
@@ -118,6 +126,7 @@ namespace Heap {
 		}
 
 		best->used = true;
+		spin_unlock_irqrestore(&heapLock, flags);
 		return (void*)((uint64_t)best + sizeof(HeapBlock));
 	}
 
@@ -125,6 +134,7 @@ namespace Heap {
 		if (!ptr) return;
 
 		HeapBlock* block = (HeapBlock*)((uint64_t)ptr - sizeof(HeapBlock));
+		uint64_t flags = spin_lock_irqsave(&heapLock);
 		block->used = false;
 
 		// Merge with next block if free
@@ -132,5 +142,6 @@ namespace Heap {
 			block->size += sizeof(HeapBlock) + block->next->size;
 			block->next = block->next->next;
 		}
+		spin_unlock_irqrestore(&heapLock, flags);
 	}
 }
@@ -0,0 +1,210 @@
+#include <Memory/MemBench.hpp>
+#include <Memory/Heap.hpp>
+#include <Memory/Mem_.hpp>
+#include <Inferno/Log.h>
+
+namespace MemBench {
+    #define VERIFY_MAX_SIZE 320
+    #define BENCH_MAX_SIZE (256 * 1024)
+    #define BENCH_SLACK 64
+    #define GUARD_BYTE 0xEE
+
+    static inline uint64_t ReadTSC() {
+        uint32_t low, high;
+        asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high) :: "memory");
+        return ((uint64_t)high << 32) | low;
+    }
+
+    static inline uint8_t Pattern(uint64_t i, uint8_t salt) {
+        return (uint8_t)(i * 131 + 7) ^ salt;
+    }
+
+    // Written through a volatile pointer so the compiler can't turn the
+    // reference loops back into calls to the routines under test
+    static void Fill(uint8_t* buffer, uint64_t length, uint8_t salt) {
+        volatile uint8_t* p = buffer;
+        for (uint64_t i = 0; i < length; i++) p[i] = Pattern(i, salt);
+    }
+
+    static void Guard(uint8_t* buffer, uint64_t length) {
+        volatile uint8_t* p = buffer;
+        for (uint64_t i = 0; i < length; i++) p[i] = GUARD_BYTE;
+    }
+
+    // Checks a copy of `size` bytes from src+srcOff into a guarded dst+dstOff
+    static bool CheckCopy(const uint8_t* dst, uint64_t dstOff, const uint8_t* src, uint64_t srcOff, uint64_t size, uint64_t total) {
+        for (uint64_t i = 0; i < total; i++) {
+            uint8_t expected = GUARD_BYTE;
+            if (i >= dstOff && i < dstOff + size) expected = src[srcOff + (i - dstOff)];
+            if (dst[i] != expected) return false;
+        }
+        return true;
+    }
+
+    bool Verify() {
+        const uint64_t total = VERIFY_MAX_SIZE + 2 * BENCH_SLACK;
+        uint8_t* src = (uint8_t*)malloc(total);
+        uint8_t* dst = (uint8_t*)malloc(total);
+        uint8_t* orig = (uint8_t*)malloc(total);
+        if (!src || !dst || !orig) {
+            prErr("membench", "Failed to allocate verification buffers");
+            free(src);
+            free(dst);
+            free(orig);
+            return false;
+        }
+
+        static const Mem::Strategy strategies[] = {
+            Mem::Strategy::Qword, Mem::Strategy::ERMS, Mem::Strategy::NonTemporal
+        };
+        static const char* strategyNames[] = { "qword", "erms", "nontemporal" };
+
+        int failures = 0;
+        Fill(src, total, 0);
+
+        for (uint64_t size = 0; size <= VERIFY_MAX_SIZE; size++) {
+            for (uint64_t da = 0; da < 8; da++) {
+                for (uint64_t sa = 0; sa < 8; sa++) {
+                    uint64_t dstOff = BENCH_SLACK / 2 + da;
+                    uint64_t srcOff = BENCH_SLACK / 2 + sa;
+
+                    Guard(dst, total);
+                    memcpy(dst + dstOff, src + srcOff, size);
+                    if (!CheckCopy(dst, dstOff, src, srcOff, size, total) && failures++ < 8) {
+                        prErr("membench", "memcpy mismatch: size=%d dst+%d src+%d", (int)size, (int)da, (int)sa);
+                    }
+
+                    for (int s = 0; s < 3; s++) {
+                        Guard(dst, total);
+                        Mem::CopyWith(strategies[s], dst + dstOff, src + srcOff, size);
+                        if (!CheckCopy(dst, dstOff, src, srcOff, size, total) && failures++ < 8) {
+                            prErr("membench", "%s copy mismatch: size=%d dst+%d src+%d",
+                                strategyNames[s], (int)size, (int)da, (int)sa);
+                        }
+                    }
+                }
+
+                // memset, the dispatched path and every forced strategy
+                for (int s = -1; s < 3; s++) {
+                    uint64_t dstOff = BENCH_SLACK / 2 + da;
+                    Guard(dst, total);
+                    if (s < 0) memset(dst + dstOff, 0x5A, size);
+                    else Mem::SetWith(strategies[s], dst + dstOff, 0x5A, size);
+                    for (uint64_t i = 0; i < total; i++) {
+                        uint8_t expected = (i >= dstOff && i < dstOff + size) ? 0x5A : GUARD_BYTE;
+                        if (dst[i] != expected) {
+                            if (failures++ < 8) {
+                                prErr("membench", "%s set mismatch: size=%d dst+%d",
+                                    s < 0 ? "memset" : strategyNames[s], (int)size, (int)da);
+                            }
+                            break;
+                        }
+                    }
+                }
+            }
+
+            // memmove with overlap in both directions
+            static const int shifts[] = { 1, 3, 7, 8, 9, 16, 31, 33, 64 };
+            for (int sh = 0; sh < (int)(sizeof(shifts) / sizeof(shifts[0])); sh++) {
+                for (int dir = -1; dir <= 1; dir += 2) {
+                    uint64_t srcOff = BENCH_SLACK / 2 + (dir < 0 ? shifts[sh] : 0);
+                    uint64_t dstOff = BENCH_SLACK / 2 + (dir < 0 ? 0 : shifts[sh]);
+                    if (dstOff + size > total || srcOff + size > total) continue;
+
+                    Fill(dst, total, 0x33);
+                    Fill(orig, total, 0x33);
+                    memmove(dst + dstOff, dst + srcOff, size);
+                    for (uint64_t i = 0; i < total; i++) {
+                        uint8_t expected = orig[i];
+                        if (i >= dstOff && i < dstOff + size) expected = orig[srcOff + (i - dstOff)];
+                        if (dst[i] != expected) {
+                            if (failures++ < 8) {
+                                prErr("membench", "memmove mismatch: size=%d shift=%d%d",
+                                    (int)size, dir, shifts[sh]);
+                            }
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        free(src);
+        free(dst);
+        free(orig);
+
+        if (failures) {
+            prErr("membench", "Verification FAILED with %d mismatches", failures);
+            return false;
+        }
+        prInfo("membench", "Verification passed (sizes 0-%d, all alignments 0-7)", VERIFY_MAX_SIZE);
+        return true;
+    }
+
+    template<typename Op>
+    static uint64_t CyclesPerCall(Op op, uint64_t iterations) {
+        op(); // warm the caches and TLB first
+        uint64_t start = ReadTSC();
+        for (uint64_t i = 0; i < iterations; i++) op();
+        uint64_t end = ReadTSC();
+        return (end - start) / iterations;
+    }
+
+    void Run() {
+        if (!Verify()) return;
+
+        uint8_t* src = (uint8_t*)malloc(BENCH_MAX_SIZE + BENCH_SLACK);
+        uint8_t* dst = (uint8_t*)malloc(BENCH_MAX_SIZE + BENCH_SLACK);
+        if (!src || !dst) {
+            prErr("membench", "Failed to allocate benchmark buffers");
+            free(src);
+            free(dst);
+            return;
+        }
+        Fill(src, BENCH_MAX_SIZE + BENCH_SLACK, 0);
+
+        static const uint64_t sizes[] = {
+            8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536, BENCH_MAX_SIZE
+        };
+        static const uint64_t alignments[][2] = { { 0, 0 }, { 1, 0 }, { 0, 3 }, { 5, 11 } };
+
+        kprintf("String op cost in TSC cycles per call (ERMS=%d FSRM=%d, non-temporal >= %d KiB)\n",
+            Mem::HasERMS(), Mem::HasFSRM(), (int)(Mem::GetNonTemporalThreshold() / 1024));
+        kprintf("    size  d/s   memcpy    qword     erms       nt  memmove   memset bytewise\n");
+
+        for (uint64_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            uint64_t size = sizes[s];
+            uint64_t iterations = (4 * 1024 * 1024) / size;
+            if (iterations > 100000) iterations = 100000;
+            if (iterations < 16) iterations = 16;
+
+            for (uint64_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++) {
+                uint8_t* d = dst + alignments[a][0];
+                uint8_t* sp = src + alignments[a][1];
+
+                uint64_t dispatched = CyclesPerCall([&] { memcpy(d, sp, size); }, iterations);
+                uint64_t qword = CyclesPerCall([&] { Mem::CopyWith(Mem::Strategy::Qword, d, sp, size); }, iterations);
+                uint64_t erms = CyclesPerCall([&] { Mem::CopyWith(Mem::Strategy::ERMS, d, sp, size); }, iterations);
+                uint64_t nt = 0;
+                if (size >= 4096) {
+                    nt = CyclesPerCall([&] { Mem::CopyWith(Mem::Strategy::NonTemporal, d, sp, size); }, iterations);
+                }
+                uint64_t move = CyclesPerCall([&] { memmove(d + 1, d, size - 1); }, iterations);
+                uint64_t set = CyclesPerCall([&] { memset(d, (int)size, size); }, iterations);
+                uint64_t bytewise = CyclesPerCall([&] {
+                    volatile uint8_t* vd = d;
+                    for (uint64_t i = 0; i < size; i++) vd[i] = sp[i];
+                }, iterations < 64 ? iterations : 64);
+
+                kprintf("%8u  %d/%-2d %8u %8u %8u ", (unsigned int)size, (int)alignments[a][0], (int)alignments[a][1],
+                    (unsigned int)dispatched, (unsigned int)qword, (unsigned int)erms);
+                if (nt) kprintf("%8u ", (unsigned int)nt);
+                else kprintf("       - ");
+                kprintf("%8u %8u %8u\n", (unsigned int)move, (unsigned int)set, (unsigned int)bytewise);
+            }
+        }
+
+        free(src);
+        free(dst);
+    }
+}
@@ -1,5 +1,7 @@
 #include <Memory/Mem_.hpp>
 
+#include <CPU/Features.hpp>
+#include <Inferno/Log.h>
 #include <Inferno/stdint.h>
 #include <Inferno/types.h>
 // Stolen from:
@@ -26,33 +28,338 @@ using FlatPtr = Conditional<sizeof(void*) == 8, unsigned long long, unsigned int
 
 static constexpr FlatPtr explode_byte(unsigned char byte) {
 	FlatPtr value = byte;
-	if constexpr (sizeof(FlatPtr) == 4) return value << 24 | value << 16 | value < 8 | value;
+	if constexpr (sizeof(FlatPtr) == 4) return value << 24 | value << 16 | value << 8 | value;
 	else return value << 56 | value << 48 | value << 40 | value << 32 | value << 24 | value << 16 | value << 8 | value;
 }
 
+// Unaligned views of memory. x86 handles misaligned loads and stores in
+// hardware, so these compile down to plain movs of the right width.
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) UnalignedQword;
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) UnalignedDword;
+typedef uint16_t __attribute__((__may_alias__, __aligned__(1))) UnalignedWord;
+
+namespace Mem {
+	static bool erms = false;
+	static bool fsrm = false;
+	static Strategy mediumStrategy = Strategy::Qword;
+
+	// Up to these sizes the inline qword paths beat the rep startup cost
+	static unsigned long int copySmallLimit = 128;
+	static unsigned long int setSmallLimit = 128;
+
+	// Roughly where a copy stops fitting in L2 and starts evicting useful data
+	static unsigned long int nonTemporalThreshold = 256 * 1024;
+
+	// Copies up to 16 bytes. All loads happen before the first store, so
+	// this is also safe for overlapping buffers.
+	static inline void CopyTiny(uint8_t* d, const uint8_t* s, unsigned long int n) {
+		if (n >= 8) {
+			uint64_t head = *(const UnalignedQword*)s;
+			uint64_t tail = *(const UnalignedQword*)(s + n - 8);
+			*(UnalignedQword*)d = head;
+			*(UnalignedQword*)(d + n - 8) = tail;
+		} else if (n >= 4) {
+			uint32_t head = *(const UnalignedDword*)s;
+			uint32_t tail = *(const UnalignedDword*)(s + n - 4);
+			*(UnalignedDword*)d = head;
+			*(UnalignedDword*)(d + n - 4) = tail;
+		} else if (n >= 2) {
+			uint16_t head = *(const UnalignedWord*)s;
+			uint16_t tail = *(const UnalignedWord*)(s + n - 2);
+			*(UnalignedWord*)d = head;
+			*(UnalignedWord*)(d + n - 2) = tail;
+		} else if (n) {
+			*d = *s;
+		}
+	}
+
+	// Copies n > 8 bytes forwards with an unrolled qword loop. The last
+	// qword is loaded up front and stored overlapping, which also makes this
+	// safe for memmove when dest is below src.
+	static inline void CopyForward(uint8_t* d, const uint8_t* s, unsigned long int n) {
+		uint64_t tail = *(const UnalignedQword*)(s + n - 8);
+		unsigned long int i = 0;
+		for (; i + 32 <= n; i += 32) {
+			uint64_t a = *(const UnalignedQword*)(s + i);
+			uint64_t b = *(const UnalignedQword*)(s + i + 8);
+			uint64_t c = *(const UnalignedQword*)(s + i + 16);
+			uint64_t e = *(const UnalignedQword*)(s + i + 24);
+			*(UnalignedQword*)(d + i) = a;
+			*(UnalignedQword*)(d + i + 8) = b;
+			*(UnalignedQword*)(d + i + 16) = c;
+			*(UnalignedQword*)(d + i + 24) = e;
+		}
+		for (; i + 8 <= n; i += 8) {
+			*(UnalignedQword*)(d + i) = *(const UnalignedQword*)(s + i);
+		}
+		*(UnalignedQword*)(d + n - 8) = tail;
+	}
+
+	// Mirror image of CopyForward for memmove when dest is above src
+	static inline void CopyBackward(uint8_t* d, const uint8_t* s, unsigned long int n) {
+		uint64_t head = *(const UnalignedQword*)s;
+		while (n >= 32) {
+			n -= 32;
+			uint64_t a = *(const UnalignedQword*)(s + n + 24);
+			uint64_t b = *(const UnalignedQword*)(s + n + 16);
+			uint64_t c = *(const UnalignedQword*)(s + n + 8);
+			uint64_t e = *(const UnalignedQword*)(s + n);
+			*(UnalignedQword*)(d + n + 24) = a;
+			*(UnalignedQword*)(d + n + 16) = b;
+			*(UnalignedQword*)(d + n + 8) = c;
+			*(UnalignedQword*)(d + n) = e;
+		}
+		while (n >= 8) {
+			n -= 8;
+			*(UnalignedQword*)(d + n) = *(const UnalignedQword*)(s + n);
+		}
+		*(UnalignedQword*)d = head;
+	}
+
+	static inline void CopySmall(uint8_t* d, const uint8_t* s, unsigned long int n) {
+		if (n <= 16) CopyTiny(d, s, n);
+		else CopyForward(d, s, n);
+	}
+
+	static inline void CopyERMS(uint8_t* d, const uint8_t* s, unsigned long int n) {
+		asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) :: "memory");
+	}
+
+	static inline void CopyQwords(uint8_t* d, const uint8_t* s, unsigned long int n) {
+		if (n < 8) {
+			CopyTiny(d, s, n);
+			return;
+		}
+		uint64_t tail = *(const UnalignedQword*)(s + n - 8);
+		uint8_t* end = d + n;
+		unsigned long int count = n / 8;
+		asm volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(count) :: "memory");
+		*(UnalignedQword*)(end - 8) = tail;
+	}
+
+	static inline void StreamQword(uint8_t* d, uint64_t value) {
+		asm volatile("movnti %1, %0" : "=m"(*(UnalignedQword*)d) : "r"(value));
+	}
+
+	// Streams whole cache lines past the cache with movnti. The destination
+	// is brought up to a line boundary first so every line is written in
+	// full and the write-combining buffers flush cleanly.
+	static void CopyNonTemporal(uint8_t* d, const uint8_t* s, unsigned long int n) {
+		if (n < 128) {
+			CopySmall(d, s, n);
+			return;
+		}
+		unsigned long int head = (64 - ((uintptr_t)d & 63)) & 63;
+		if (head) {
+			CopySmall(d, s, head);
+			d += head;
+			s += head;
+			n -= head;
+		}
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__builtin_prefetch(s + 512, 0, 0);
+			uint64_t a = *(const UnalignedQword*)(s);
+			uint64_t b = *(const UnalignedQword*)(s + 8);
+			uint64_t c = *(const UnalignedQword*)(s + 16);
+			uint64_t e = *(const UnalignedQword*)(s + 24);
+			uint64_t f = *(const UnalignedQword*)(s + 32);
+			uint64_t g = *(const UnalignedQword*)(s + 40);
+			uint64_t h = *(const UnalignedQword*)(s + 48);
+			uint64_t k = *(const UnalignedQword*)(s + 56);
+			StreamQword(d, a);
+			StreamQword(d + 8, b);
+			StreamQword(d + 16, c);
+			StreamQword(d + 24, e);
+			StreamQword(d + 32, f);
+			StreamQword(d + 40, g);
+			StreamQword(d + 48, h);
+			StreamQword(d + 56, k);
+		}
+		// movnti is weakly ordered, fence before anyone else looks at the data
+		asm volatile("sfence" ::: "memory");
+		if (n) CopySmall(d, s, n);
+	}
+
+	static inline void SetTiny(uint8_t* d, uint64_t pattern, unsigned long int n) {
+		if (n >= 8) {
+			*(UnalignedQword*)d = pattern;
+			*(UnalignedQword*)(d + n - 8) = pattern;
+		} else if (n >= 4) {
+			*(UnalignedDword*)d = (uint32_t)pattern;
+			*(UnalignedDword*)(d + n - 4) = (uint32_t)pattern;
+		} else if (n >= 2) {
+			*(UnalignedWord*)d = (uint16_t)pattern;
+			*(UnalignedWord*)(d + n - 2) = (uint16_t)pattern;
+		} else if (n) {
+			*d = (uint8_t)pattern;
+		}
+	}
+
+	static inline void SetSmall(uint8_t* d, uint64_t pattern, unsigned long int n) {
+		if (n <= 16) {
+			SetTiny(d, pattern, n);
+			return;
+		}
+		unsigned long int i = 0;
+		for (; i + 32 <= n; i += 32) {
+			*(UnalignedQword*)(d + i) = pattern;
+			*(UnalignedQword*)(d + i + 8) = pattern;
+			*(UnalignedQword*)(d + i + 16) = pattern;
+			*(UnalignedQword*)(d + i + 24) = pattern;
+		}
+		for (; i + 8 <= n; i += 8) {
+			*(UnalignedQword*)(d + i) = pattern;
+		}
+		*(UnalignedQword*)(d + n - 8) = pattern;
+	}
+
+	static inline void SetERMS(uint8_t* d, uint64_t pattern, unsigned long int n) {
+		asm volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(pattern) : "memory");
+	}
+
+	static inline void SetQwords(uint8_t* d, uint64_t pattern, unsigned long int n) {
+		if (n < 8) {
+			SetTiny(d, pattern, n);
+			return;
+		}
+		uint8_t* end = d + n;
+		unsigned long int count = n / 8;
+		asm volatile("rep stosq" : "+D"(d), "+c"(count) : "a"(pattern) : "memory");
+		*(UnalignedQword*)(end - 8) = pattern;
+	}
+
+	static void SetNonTemporal(uint8_t* d, uint64_t pattern, unsigned long int n) {
+		if (n < 128) {
+			SetSmall(d, pattern, n);
+			return;
+		}
+		unsigned long int head = (64 - ((uintptr_t)d & 63)) & 63;
+		if (head) {
+			SetSmall(d, pattern, head);
+			d += head;
+			n -= head;
+		}
+		for (; n >= 64; n -= 64, d += 64) {
+			StreamQword(d, pattern);
+			StreamQword(d + 8, pattern);
+			StreamQword(d + 16, pattern);
+			StreamQword(d + 24, pattern);
+			StreamQword(d + 32, pattern);
+			StreamQword(d + 40, pattern);
+			StreamQword(d + 48, pattern);
+			StreamQword(d + 56, pattern);
+		}
+		asm volatile("sfence" ::: "memory");
+		if (n) SetSmall(d, pattern, n);
+	}
+
+	void Initialize() {
+		erms = CPU::Has(CPU::Feature::ERMS);
+		fsrm = CPU::Has(CPU::Feature::FSRM);
+		// Past this CPU's own L2 where CPUID says how big that is
+		uint32_t l2 = CPU::GetCacheSize(2);
+		if (l2 >= 128 * 1024 && l2 <= 4 * 1024 * 1024) nonTemporalThreshold = l2;
+
+		if (erms) mediumStrategy = Strategy::ERMS;
+		// Fast Short REP MOVSB makes rep movsb worthwhile almost immediately
+		if (fsrm) copySmallLimit = 32;
+
+		prInfo("mem", "string ops: %s copies, %s fills, non-temporal from %d KiB",
+			erms ? (fsrm ? "rep movsb (ERMS+FSRM)" : "rep movsb (ERMS)") : "rep movsq",
+			erms ? "rep stosb" : "rep stosq", nonTemporalThreshold / 1024);
+	}
+
+	unsigned long int GetNonTemporalThreshold() {
+		return nonTemporalThreshold;
+	}
+
+	void SetNonTemporalThreshold(unsigned long int size) {
+		nonTemporalThreshold = size;
+	}
+
+	bool HasERMS() {
+		return erms;
+	}
+
+	bool HasFSRM() {
+		return fsrm;
+	}
+
+	void* CopyWith(Strategy strategy, void* destptr, void const* srcptr, unsigned long int size) {
+		uint8_t* d = (uint8_t*)destptr;
+		const uint8_t* s = (const uint8_t*)srcptr;
+		switch (strategy) {
+			case Strategy::ERMS:
+				CopyERMS(d, s, size);
+				break;
+			case Strategy::NonTemporal:
+				CopyNonTemporal(d, s, size);
+				break;
+			default:
+				CopyQwords(d, s, size);
+				break;
+		}
+		return destptr;
+	}
+
+	void* SetWith(Strategy strategy, void* destptr, int value, unsigned long int size) {
+		uint8_t* d = (uint8_t*)destptr;
+		uint64_t pattern = explode_byte((unsigned char)value);
+		switch (strategy) {
+			case Strategy::ERMS:
+				SetERMS(d, pattern, size);
+				break;
+			case Strategy::NonTemporal:
+				SetNonTemporal(d, pattern, size);
+				break;
+			default:
+				SetQwords(d, pattern, size);
+				break;
+		}
+		return destptr;
+	}
+}
+
 void* memset(void* destptr, int value, unsigned long int size) {
-	unsigned long int dest = (unsigned long int)destptr;
-	if (!(dest & 3) && size >= 12) {
-		unsigned long int a = size / sizeof(unsigned long int);
-		unsigned long int expanded = explode_byte((unsigned char)value);
-		asm volatile("rep stosq" : "=D"(dest) : "D"(dest), "c"(a), "a"(expanded) : "memory");
-		size -= a * sizeof(unsigned long int);
-		if (size == 0) return destptr;
-	}
-	asm volatile("rep stosb" : "=D"(dest), "=c"(size) : "0"(dest), "1"(size), "a"(value) : "memory");
-	unsigned char* pd = (unsigned char*)destptr;
-	for (; size--;) *pd++ = value;
+	uint8_t* d = (uint8_t*)destptr;
+	uint64_t pattern = explode_byte((unsigned char)value);
+	if (size <= Mem::setSmallLimit) Mem::SetSmall(d, pattern, size);
+	else if (size >= Mem::nonTemporalThreshold) Mem::SetNonTemporal(d, pattern, size);
+	else if (Mem::mediumStrategy == Mem::Strategy::ERMS) Mem::SetERMS(d, pattern, size);
+	else Mem::SetQwords(d, pattern, size);
 	return destptr;
 }
 
 void* memcpy(void* destptr, void const* srcptr, unsigned long int size) {
-	unsigned long int dest = (unsigned long int)destptr;
-	unsigned long int src = (unsigned long int)srcptr;
-	if (!(dest & 3) && !(src & 3) && size >= 12) {
-		unsigned long int a = size / sizeof(unsigned long int);
-		asm volatile("rep movsq" : "=S"(src), "=D"(dest) : "S"(src), "D"(dest), "c"(a) : "memory");
-		size -= a * sizeof(unsigned long int);
-		if (size == 0) return destptr;
+	uint8_t* d = (uint8_t*)destptr;
+	const uint8_t* s = (const uint8_t*)srcptr;
+	if (size <= Mem::copySmallLimit) Mem::CopySmall(d, s, size);
+	else if (size >= Mem::nonTemporalThreshold) Mem::CopyNonTemporal(d, s, size);
+	else if (Mem::mediumStrategy == Mem::Strategy::ERMS) Mem::CopyERMS(d, s, size);
+	else Mem::CopyQwords(d, s, size);
+	return destptr;
+}
+
+void* memmove(void* destptr, void const* srcptr, unsigned long int size) {
+	uint8_t* d = (uint8_t*)destptr;
+	const uint8_t* s = (const uint8_t*)srcptr;
+	if (d == s || size == 0) return destptr;
+
+	// CopyTiny loads everything before storing, so it never cares about overlap
+	if (size <= 16) {
+		Mem::CopyTiny(d, s, size);
+		return destptr;
+	}
+
+	// Disjoint buffers can take the regular memcpy paths
+	if (d + size <= s || s + size <= d) return memcpy(destptr, srcptr, size);
+
+	if (d < s) {
+		// Forward copies read ahead of what they write, rep movs included
+		if (size > Mem::copySmallLimit && Mem::mediumStrategy == Mem::Strategy::ERMS) Mem::CopyERMS(d, s, size);
+		else Mem::CopyForward(d, s, size);
+	} else {
+		Mem::CopyBackward(d, s, size);
 	}
 	return destptr;
 }
@@ -61,10 +368,20 @@ int memcmp(const void* ptr1, const void* ptr2, size_t num) {
 	const uint8_t* p1 = (const uint8_t*)ptr1;
 	const uint8_t* p2 = (const uint8_t*)ptr2;
 
+	// Compare a word at a time, only the bytes of the first mismatching
+	// word need to be looked at individually
+	for (; num >= 8; num -= 8, p1 += 8, p2 += 8) {
+		uint64_t diff = *(const UnalignedQword*)p1 ^ *(const UnalignedQword*)p2;
+		if (diff) {
+			unsigned int i = __builtin_ctzll(diff) >> 3;
+			return p1[i] - p2[i];
+		}
+	}
+
 	for (size_t i = 0; i < num; i++) {
 		if (p1[i] != p2[i]) {
 			return p1[i] - p2[i];
 		}
 	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #include <Memory/Memory.hpp>
 #include <Inferno/stdint.h>
 #include <Inferno/Log.h>
+#include <Sync/Spinlock.hpp>
 
 extern unsigned long long _InfernoStart;
 extern unsigned long long _InfernoEnd;
@@ -16,6 +17,11 @@ namespace Memory {
 	static uint64_t totalPages = 0;
 	static uint64_t usedPages = 0;
 
+	// The bitmap and the counters. Zeroing a page happens after it's
+	// been claimed, outside the lock.
+	static DEFINE_LOCK_CLASS(pagesClass, "pages");
+	static spinlock_t pagesLock = SPINLOCK_INIT_CLASS(pagesClass);
+
 	void Initialize(void* bitmap, uint64_t size) {
 		memoryBitmap = (uint8_t*)BITMAP_START;
 		bitmapSize = size;
@@ -60,7 +66,9 @@ namespace Memory {
 	}
 
 	void* RequestPage() {
+		uint64_t flags = spin_lock_irqsave(&pagesLock);
 		if (usedPages >= totalPages) {
+			spin_unlock_irqrestore(&pagesLock, flags);
 			prErr("memory", "OUT OF MEMORY! used=%d total=%d", usedPages, totalPages);
 			return nullptr;
 		}
@@ -75,6 +83,7 @@ namespace Memory {
 				page = (void*)(i * PAGE_SIZE);
 				lastAllocatedPage = i + 1;
 				usedPages++;
+				spin_unlock_irqrestore(&pagesLock, flags);
 
 				// Validate page address
 				if ((uint64_t)page < 0x1000 || (uint64_t)page >= 0x100000000ULL) {
@@ -93,6 +102,7 @@ namespace Memory {
 			}
 		}
 
+		spin_unlock_irqrestore(&pagesLock, flags);
 		prErr("memory", "no free pages! (used=%d/%d)", usedPages, totalPages);
 		return nullptr;
 	}
@@ -102,6 +112,11 @@ namespace Memory {
 		uint64_t byteIndex = pageIndex / 8;
 		uint8_t bitIndex = pageIndex % 8;
 
-		memoryBitmap[byteIndex] &= ~(1 << bitIndex);
+		uint64_t flags = spin_lock_irqsave(&pagesLock);
+		if (memoryBitmap[byteIndex] & (1 << bitIndex)) {
+			memoryBitmap[byteIndex] &= ~(1 << bitIndex);
+			usedPages--;
+		}
+		spin_unlock_irqrestore(&pagesLock, flags);
 	}
 }
@@ -160,7 +160,8 @@ namespace Paging {
 		return (cr0 & (1ULL << 31)) != 0;
 	}
 
-	void MapPage(uint64_t virtual_addr, uint64_t physical_addr) {
+	// User mappings need the U bit on every level, the leaf decides the rest
+	static void Map(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
 		// Align addresses to page boundaries
 		virtual_addr &= ~0xFFF;
 		physical_addr &= ~0xFFF;
@@ -184,6 +185,7 @@ namespace Paging {
 			memset(new_pdp, 0, 4096);
 			pml4->entries[pml4_idx] = (uint64_t)new_pdp | PAGE_DEFAULT;
 		}
+		pml4->entries[pml4_idx] |= flags & PAGE_USER;
 		
 		// Get PDP table and check if entry exists
 		PageTable* pdp_table = (PageTable*)(pml4->entries[pml4_idx] & ~0xFFF);
@@ -196,6 +198,7 @@ namespace Paging {
 			memset(new_pd, 0, 4096);
 			pdp_table->entries[pdp_idx] = (uint64_t)new_pd | PAGE_DEFAULT;
 		}
+		pdp_table->entries[pdp_idx] |= flags & PAGE_USER;
 		
 		// Get PD table and check if entry exists
 		PageTable* pd_table = (PageTable*)(pdp_table->entries[pdp_idx] & ~0xFFF);
@@ -221,10 +224,11 @@ namespace Paging {
 			memset(new_pt, 0, 4096);
 			pd_table->entries[pd_idx] = (uint64_t)new_pt | PAGE_DEFAULT;
 		}
+		pd_table->entries[pd_idx] |= flags & PAGE_USER;
 		
 		// Get PT table and set the entry
 		PageTable* pt_table = (PageTable*)(pd_table->entries[pd_idx] & ~0xFFF);
-		pt_table->entries[pt_idx] = physical_addr | PAGE_DEFAULT;
+		pt_table->entries[pt_idx] = physical_addr | flags;
 		
 		// Flush TLB for this specific address
 		asm volatile("invlpg (%0)" : : "r"(virtual_addr) : "memory");
@@ -239,6 +243,14 @@ namespace Paging {
 		#endif
 	}
 
+	void MapPage(uint64_t virtual_addr, uint64_t physical_addr) {
+		Map(virtual_addr, physical_addr, PAGE_DEFAULT);
+	}
+
+	void MapUserPage(uint64_t virtual_addr, uint64_t physical_addr, bool writable) {
+		Map(virtual_addr, physical_addr, PAGE_PRESENT | PAGE_USER | (writable ? PAGE_WRITABLE : 0));
+	}
+
 	void UnmapPage(uint64_t virtual_addr) {
 		virtual_addr &= ~0xFFF;
 		
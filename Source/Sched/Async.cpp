@@ -0,0 +1,285 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Async.cpp
+// Purpose: Coroutine tasks, per-CPU executors and awaitable I/O
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sched/Async.hpp>
+#include <CPU/PerCPU.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Memory/Mem_.hpp>
+#include <Sched/Preempt.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sched/Wait.hpp>
+#include <Sync/MpscQueue.hpp>
+#include <Inferno/Log.h>
+
+// Ahead of ordinary threads, what they run is mostly I/O finishing
+#define ASYNC_PRIORITY          SCHED_PRIORITY_HIGH
+
+#define ASYNC_TEST_CHAIN        100
+#define ASYNC_TEST_SLEEPERS     64
+#define ASYNC_TEST_SLEEP_NS     2000000ULL
+#define ASYNC_TEST_SPREAD_NS    500000ULL   // added per sleeper, 8 different lengths
+#define ASYNC_TEST_HOPS         8
+
+// One CPU's executor. Anyone pushes, only the thread pops; the counters
+// after `fromIRQ` only change in the thread.
+typedef struct {
+	MpscQueue<Async::Node> ready;
+	wait_queue_head_t wait;
+	Scheduler::Thread* thread;
+	uint32_t cpu;
+
+	volatile uint64_t posted;
+	volatile uint64_t fromIRQ;
+	uint64_t resumed;
+	uint64_t batches;
+	uint64_t largest;
+} Executor;
+
+static DEFINE_LOCK_CLASS(executorClass, "async");
+static Executor* executors[SMP_MAX_CPUS];
+static uint32_t fallback = 0;
+static bool initialized = false;
+
+// Resumes everything queued in one go, then sleeps until more comes.
+// Whatever a task awaits next queues it again, here or elsewhere.
+static void Run(void* arg) {
+	Executor* executor = (Executor*)arg;
+	while (true) {
+		wait_event(&executor->wait, [executor] { return !executor->ready.Empty(); });
+
+		Async::Node* batch = executor->ready.PopAll();
+		uint64_t count = 0;
+		while (batch) {
+			// Read first: the task may queue the same node again, or be gone
+			Async::Node* next = batch->next;
+			batch->handle.resume();
+			batch = next;
+			count++;
+		}
+		executor->resumed += count;
+		executor->batches++;
+		if (count > executor->largest) executor->largest = count;
+	}
+}
+
+static inline Executor* ExecutorFor(uint32_t cpu) {
+	Executor* executor = cpu < SMP_MAX_CPUS ? executors[cpu] : nullptr;
+	return executor ? executor : executors[fallback];
+}
+
+namespace Async {
+	void Post(Node* node, uint32_t cpu) {
+		if (!initialized) {
+			node->handle.resume();
+			return;
+		}
+		Executor* executor = ExecutorFor(cpu);
+		__atomic_fetch_add(&executor->posted, 1, __ATOMIC_RELAXED);
+		if (in_interrupt()) __atomic_fetch_add(&executor->fromIRQ, 1, __ATOMIC_RELAXED);
+		// Only the first one in wakes it, the rest join its batch
+		if (executor->ready.Push(node)) wake_up(&executor->wait);
+	}
+
+	uint32_t CurrentCPU() {
+		return this_cpu_id();
+	}
+
+	void IoRequest::Complete(void* request, int status) {
+		IoRequest* io = (IoRequest*)request;
+		io->status = status;
+		// Whoever is second of the completion and the suspend resumes it.
+		// Until the Post it can't go anywhere, after it it may be gone.
+		if (__atomic_exchange_n(&io->state, Done, __ATOMIC_ACQ_REL) == Waiting) Post(&io->node, io->cpu);
+	}
+
+	bool Sleep::await_suspend(std::coroutine_handle<> awaiter) {
+		// Waiting before the timer goes, it may fire on another CPU at once
+		if (!request.await_suspend(awaiter)) return false;
+		HRTimer::InitTimer(&timer, Expired, this);
+		HRTimer::AddTimer(&timer, ClockMonotonicNs() + ns);
+		return true;
+	}
+
+	// The last thing touching the Sleep: the task may free it as soon as
+	// it's queued, and HRTimer doesn't look at a timer after its callback
+	void Sleep::Expired(void* sleep) {
+		IoRequest::Complete(&((Sleep*)sleep)->request, 0);
+	}
+
+	bool Initialize() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("async", "Needs the scheduler");
+			return false;
+		}
+
+		uint64_t online = Scheduler::OnlineMask();
+		uint32_t count = 0;
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (!(online & (1ULL << cpu))) continue;
+			Executor* executor = (Executor*)Heap::Allocate(sizeof(Executor));
+			if (!executor) break;
+			memset(executor, 0, sizeof(Executor));
+			init_waitqueue_head(&executor->wait, &executorClass);
+			executor->cpu = cpu;
+
+			char name[16] = "async/";
+			uint32_t i = 6;
+			if (cpu >= 10) name[i++] = '0' + cpu / 10;
+			name[i++] = '0' + cpu % 10;
+			name[i] = 0;
+
+			// Visible before the thread, a Post may come from the first task
+			if (!count) fallback = cpu;
+			executors[cpu] = executor;
+			executor->thread = Scheduler::Create(name, Run, executor, ASYNC_PRIORITY, 1ULL << cpu);
+			if (!executor->thread) {
+				executors[cpu] = nullptr;
+				Heap::Free(executor);
+				continue;
+			}
+			count++;
+		}
+		if (!count) {
+			prErr("async", "No executors");
+			return false;
+		}
+		__atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+		prInfo("async", "%d per-CPU executors", count);
+		return true;
+	}
+
+	bool IsInitialized() {
+		return __atomic_load_n(&initialized, __ATOMIC_ACQUIRE);
+	}
+
+	bool OnExecutor() {
+		if (!initialized) return false;
+		// Executors are pinned, if it's ours we can't be moved off the CPU
+		Executor* executor = executors[this_cpu_id()];
+		return executor && Scheduler::Current() == executor->thread;
+	}
+
+	void PrintStats() {
+		kprintf("  cpu  posted    from irq  resumed   batches   largest\n");
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			Executor* executor = executors[cpu];
+			if (!executor) continue;
+			kprintf("  %-4d %-9u %-9u %-9u %-9u %u\n", cpu, (unsigned int)executor->posted,
+				(unsigned int)executor->fromIRQ, (unsigned int)executor->resumed,
+				(unsigned int)executor->batches, (unsigned int)executor->largest);
+		}
+	}
+
+	static volatile uint32_t wrongCPU;
+
+	static Task<uint32_t> Double(uint32_t value) {
+		co_return value * 2;
+	}
+
+	// Each await runs the child to its end and comes straight back
+	static Task<uint32_t> Chain(uint32_t count) {
+		uint32_t total = 0;
+		for (uint32_t i = 0; i < count; i++) total += co_await Double(i);
+		co_return total;
+	}
+
+	static Task<uint32_t> Nap(uint32_t id) {
+		co_await Sleep(ASYNC_TEST_SLEEP_NS + (id % 8) * ASYNC_TEST_SPREAD_NS);
+		co_return id;
+	}
+
+	// The tasks live in this frame, not on the executor's stack
+	static Task<uint64_t> FanOut(uint32_t* results) {
+		Task<uint32_t> tasks[ASYNC_TEST_SLEEPERS];
+		uint64_t start = ClockMonotonicNs();
+		for (uint32_t i = 0; i < ASYNC_TEST_SLEEPERS; i++) {
+			tasks[i] = Nap(i);
+			if (!tasks[i].Valid()) co_return 0;
+		}
+		co_await WhenAll(tasks, ASYNC_TEST_SLEEPERS, results);
+		co_return ClockMonotonicNs() - start;
+	}
+
+	// The timer fires on HRTimer's CPU, the task has to come back here
+	static Task<> StayOn(uint32_t cpu, Join* join) {
+		for (uint32_t hop = 0; hop < ASYNC_TEST_HOPS; hop++) {
+			co_await Sleep(ASYNC_TEST_SLEEP_NS);
+			if (CurrentCPU() != cpu) __atomic_fetch_add(&wrongCPU, 1, __ATOMIC_RELAXED);
+		}
+		join->Finished();
+	}
+
+	static Task<uint32_t> Scatter() {
+		uint32_t count = 0;
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) if (executors[cpu]) count++;
+		Join join(count);
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (executors[cpu] && !Spawn(StayOn(cpu, &join), cpu)) join.Finished();
+		}
+		co_await join;
+		co_return count;
+	}
+
+	bool SelfTest() {
+		if (!initialized || !Scheduler::CanBlock() || OnExecutor()) {
+			prErr("async", "Needs the executors and a thread that can sleep");
+			return false;
+		}
+		bool passed = true;
+
+		uint32_t total = RunSync(Chain(ASYNC_TEST_CHAIN));
+		if (total != ASYNC_TEST_CHAIN * (ASYNC_TEST_CHAIN - 1)) {
+			prErr("async", "chain: %d, wanted %d", total, ASYNC_TEST_CHAIN * (ASYNC_TEST_CHAIN - 1));
+			passed = false;
+		} else {
+			prInfo("async", "chain: %d nested tasks awaited", ASYNC_TEST_CHAIN);
+		}
+
+		if (!HRTimer::IsInitialized()) {
+			prErr("async", "Needs HRTimer for the sleeps");
+			return false;
+		}
+
+		uint32_t results[ASYNC_TEST_SLEEPERS];
+		for (uint32_t i = 0; i < ASYNC_TEST_SLEEPERS; i++) results[i] = 0xFFFFFFFF;
+		uint64_t elapsed = RunSync(FanOut(results));
+		uint64_t sequential = 0;
+		for (uint32_t i = 0; i < ASYNC_TEST_SLEEPERS; i++) sequential += ASYNC_TEST_SLEEP_NS + (i % 8) * ASYNC_TEST_SPREAD_NS;
+		uint32_t wrong = 0;
+		for (uint32_t i = 0; i < ASYNC_TEST_SLEEPERS; i++) if (results[i] != i) wrong++;
+		if (!elapsed || wrong) {
+			prErr("async", "fan out: %d of %d results wrong", elapsed ? wrong : ASYNC_TEST_SLEEPERS, ASYNC_TEST_SLEEPERS);
+			passed = false;
+		} else if (elapsed > sequential / 4) {
+			// All asleep at once it's the longest one and some lateness
+			prErr("async", "fan out: %dus for sleeps adding up to %dus", (unsigned int)(elapsed / 1000),
+				(unsigned int)(sequential / 1000));
+			passed = false;
+		} else {
+			prInfo("async", "fan out: %d sleeps adding up to %dus done in %dus", ASYNC_TEST_SLEEPERS,
+				(unsigned int)(sequential / 1000), (unsigned int)(elapsed / 1000));
+		}
+
+		wrongCPU = 0;
+		uint64_t irqBefore = 0;
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) if (executors[cpu]) irqBefore += executors[cpu]->fromIRQ;
+		uint32_t cpus = RunSync(Scatter());
+		uint64_t irqAfter = 0;
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) if (executors[cpu]) irqAfter += executors[cpu]->fromIRQ;
+		if (wrongCPU || irqAfter - irqBefore < (uint64_t)cpus * ASYNC_TEST_HOPS) {
+			prErr("async", "scatter: %d resumes on the wrong CPU, %d of %d from interrupts", wrongCPU,
+				(unsigned int)(irqAfter - irqBefore), cpus * ASYNC_TEST_HOPS);
+			passed = false;
+		} else {
+			prInfo("async", "scatter: %d tasks on %d CPUs, resumed from the timer interrupt where they slept",
+				cpus, cpus);
+		}
+		return passed;
+	}
+}
@@ -0,0 +1,259 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Idle.cpp
+// Purpose: What a CPU does when it has nothing to run
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sched/Idle.hpp>
+#include <Sched/Scheduler.hpp>
+#include <CPU/CPUID.h>
+#include <CPU/Features.hpp>
+#include <CPU/PerCPU.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/HRTimer.hpp>
+#include <Inferno/Log.h>
+
+// CPUID leaf 5 ECX: MWAIT takes extensions in ECX, and can be woken by an
+// interrupt that's masked
+#define MWAIT_ECX_EXTENSIONS    (1 << 0)
+#define MWAIT_ECX_IRQ_BREAK     (1 << 1)
+
+#define IDLE_TEST_ROUNDS        100
+#define IDLE_TEST_GAP_NS        2000000ULL      // long enough for a deep state
+#define IDLE_TEST_TIMEOUT_NS    100000000ULL
+
+namespace Idle {
+	typedef struct {
+		uint64_t entries[IDLE_MAX_CSTATES];
+		uint64_t residency[IDLE_MAX_CSTATES];   // ns
+		volatile uint64_t storeWakes;           // kicked without an IPI
+		uint64_t predicted;                     // recent idle periods, ns
+	} IdleData;
+
+	static DEFINE_PER_CPU(IdleData, idleData);
+
+	static Method method = Method::Halt;
+	static bool mwait = false;
+	static bool arat = false;                   // the APIC timer keeps going below C1
+	static uint8_t substates[IDLE_MAX_CSTATES]; // per C-state, 0 where MWAIT has none
+
+	// How long a sleep has to be before going below C1 pays for the exit.
+	// Rough figures for the deeper Intel states; nothing here knows the
+	// real ones, and too deep only costs wakeup latency.
+	static const uint64_t targetResidency[IDLE_MAX_CSTATES] = {
+		0, 0, 20000, 100000, 300000, 600000, 1000000, 2000000
+	};
+
+	void Initialize() {
+		uint32_t eax, ebx, ecx, edx, maxLeaf;
+		cpuid(0, maxLeaf, ebx, ecx, edx);
+		bool monitor = CPU::Has(CPU::Feature::Monitor);
+		arat = CPU::Has(CPU::Feature::ARAT);
+
+		// Without the IRQ break the sleep has to start with interrupts on,
+		// and a handler could switch threads before idlePolling is cleared
+		if (monitor && maxLeaf >= 5) {
+			cpuid(5, eax, ebx, ecx, edx);
+			if ((ecx & MWAIT_ECX_EXTENSIONS) && (ecx & MWAIT_ECX_IRQ_BREAK)) {
+				for (uint32_t state = 0; state < IDLE_MAX_CSTATES; state++) substates[state] = (edx >> (state * 4)) & 0xF;
+				// C1 is there even where the leaf leaves it out
+				if (!substates[1]) substates[1] = 1;
+				mwait = true;
+			}
+		}
+		if (mwait) method = Method::Mwait;
+
+		uint32_t deepest = 1;
+		for (uint32_t state = 2; state < IDLE_MAX_CSTATES; state++) {
+			if (substates[state]) deepest = state;
+		}
+		if (mwait) prInfo("idle", "MWAIT down to C%d%s", deepest, arat ? "" : ", C1 on the timer CPU");
+		else prInfo("idle", "HLT%s", monitor ? ", MWAIT can't wake on masked interrupts" : "");
+	}
+
+	Method GetMethod() {
+		return method;
+	}
+
+	const char* GetMethodName() {
+		return method == Method::Mwait ? "MWAIT" : "HLT";
+	}
+
+	bool SetMethod(Method to) {
+		if (to == Method::Mwait && !mwait) return false;
+		method = to;
+		return true;
+	}
+
+	// The deepest state whose residency the recent idle periods cover. The
+	// APIC timer stops below C1 without ARAT, which the CPU HRTimer runs on
+	// can't have.
+	static uint32_t PickState(IdleData* data) {
+		if (!arat && HRTimer::IsInitialized() && this_cpu_id() == HRTimer::GetCPU()) return 1;
+		uint32_t state = 1;
+		for (uint32_t deeper = 2; deeper < IDLE_MAX_CSTATES; deeper++) {
+			if (substates[deeper] && targetResidency[deeper] <= data->predicted) state = deeper;
+		}
+		return state;
+	}
+
+	void Wait() {
+		PerCPU::Area* area = this_cpu();
+		IdleData* data = this_cpu_ptr(&idleData);
+		uint64_t start = ClockMonotonicNs();
+		uint32_t state = 1;
+
+		if (method == Method::Mwait) {
+			state = PickState(data);
+			uint32_t hint = (state - 1) << 4;
+			__atomic_store_n(&area->idlePolling, 1, __ATOMIC_RELAXED);
+			// Pairs with WokenByStore: either the waker sees idlePolling or
+			// this sees its needResched
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			asm volatile("monitor" :: "a"(&area->needResched), "c"(0), "d"(0));
+			if (!area->needResched) {
+				// Interrupts stay masked so nothing runs before idlePolling is
+				// cleared, ECX bit 0 lets a pending one end the wait anyway
+				asm volatile("mwait" :: "a"(hint), "c"(1) : "memory");
+			}
+			__atomic_store_n(&area->idlePolling, 0, __ATOMIC_RELAXED);
+		} else {
+			asm volatile("sti; hlt" ::: "memory");
+		}
+
+		uint64_t slept = ClockMonotonicNs() - start;
+		data->entries[state]++;
+		data->residency[state] += slept;
+		data->predicted = (data->predicted * 7 + slept) / 8;
+		asm volatile("sti" ::: "memory");
+	}
+
+	bool WokenByStore(uint32_t cpu) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&PerCPU::Get(cpu)->idlePolling, __ATOMIC_RELAXED)) return false;
+		__atomic_fetch_add(&per_cpu_ptr(&idleData, cpu)->storeWakes, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	void PrintStats() {
+		kprintf("  idle by %s, ms asleep (times entered) per C-state\n", GetMethodName());
+		kprintf("  cpu  C1                 C2                 C3+                no IPI    predicted\n");
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount(); cpu++) {
+			if (!PerCPU::Get(cpu)) continue;
+			IdleData* data = per_cpu_ptr(&idleData, cpu);
+			uint64_t deepTime = 0, deepEntries = 0;
+			for (uint32_t state = 3; state < IDLE_MAX_CSTATES; state++) {
+				deepTime += data->residency[state];
+				deepEntries += data->entries[state];
+			}
+			kprintf("  %-4d %-8u (%-7u) %-8u (%-7u) %-8u (%-7u) %-9u %uus\n", cpu,
+				(unsigned int)(data->residency[1] / 1000000), (unsigned int)data->entries[1],
+				(unsigned int)(data->residency[2] / 1000000), (unsigned int)data->entries[2],
+				(unsigned int)(deepTime / 1000000), (unsigned int)deepEntries,
+				(unsigned int)data->storeWakes, (unsigned int)(data->predicted / 1000));
+		}
+	}
+
+	static struct {
+		Scheduler::Thread* volatile sleeper;
+		volatile uint32_t round;        // bumped by the waker before each wake
+		volatile uint32_t handled;      // last round the sleeper saw
+		volatile uint64_t kickedAt;
+		volatile uint64_t total;
+		volatile uint64_t worst;
+		volatile uint32_t timeouts;
+		volatile bool done;
+	} test;
+
+	static void Sleeper(void*) {
+		test.sleeper = Scheduler::Current();
+		while (!test.done) {
+			Scheduler::PrepareToBlock();
+			if (test.round == test.handled && !test.done) {
+				if (!Scheduler::BlockTimeout(IDLE_TEST_TIMEOUT_NS)) test.timeouts++;
+			} else {
+				Scheduler::AbortBlock();
+			}
+
+			uint32_t round = test.round;
+			if (round != test.handled) {
+				uint64_t latency = ClockMonotonicNs() - test.kickedAt;
+				test.total += latency;
+				if (latency > test.worst) test.worst = latency;
+				__atomic_store_n(&test.handled, round, __ATOMIC_RELEASE);
+			}
+		}
+		test.sleeper = nullptr;
+	}
+
+	// Returns false if a wakeup went missing
+	static bool RunTest(uint32_t cpu) {
+		test.sleeper = nullptr;
+		test.round = test.handled = 0;
+		test.total = test.worst = 0;
+		test.timeouts = 0;
+		test.done = false;
+
+		Scheduler::Create("test/idle", Sleeper, nullptr, SCHED_PRIORITY_HIGH, 1ULL << cpu);
+		uint64_t deadline = ClockMonotonicNs() + 1000000000ULL;
+		while (!test.sleeper && ClockMonotonicNs() < deadline) Scheduler::Sleep(1000000);
+		if (!test.sleeper) {
+			prErr("idle", "Test thread never started on CPU %d", cpu);
+			return false;
+		}
+
+		uint64_t storeWakes = per_cpu_ptr(&idleData, cpu)->storeWakes;
+		uint32_t missed = 0;
+		for (uint32_t round = 1; round <= IDLE_TEST_ROUNDS; round++) {
+			// Time to go back to sleep, and deep enough to be worth waking
+			Scheduler::Sleep(IDLE_TEST_GAP_NS);
+			test.kickedAt = ClockMonotonicNs();
+			__atomic_store_n(&test.round, round, __ATOMIC_RELEASE);
+			Scheduler::Wake(test.sleeper);
+
+			deadline = ClockMonotonicNs() + IDLE_TEST_TIMEOUT_NS;
+			while (__atomic_load_n(&test.handled, __ATOMIC_ACQUIRE) != round && ClockMonotonicNs() < deadline) Scheduler::Sleep(100000);
+			if (test.handled != round) missed++;
+		}
+		storeWakes = per_cpu_ptr(&idleData, cpu)->storeWakes - storeWakes;
+
+		test.done = true;
+		Scheduler::Thread* sleeper = test.sleeper;
+		if (sleeper) Scheduler::Wake(sleeper);
+		deadline = ClockMonotonicNs() + 1000000000ULL;
+		while (test.sleeper && ClockMonotonicNs() < deadline) Scheduler::Sleep(1000000);
+
+		prInfo("idle", "%s on CPU %d: %dus average wakeup, %dus worst, %d of %d without an IPI", GetMethodName(), cpu,
+			(unsigned int)(test.total / IDLE_TEST_ROUNDS / 1000), (unsigned int)(test.worst / 1000),
+			(unsigned int)storeWakes, IDLE_TEST_ROUNDS);
+		if (missed || test.timeouts) {
+			prErr("idle", "%d wakeups missed, %d only noticed by the timeout", missed, test.timeouts);
+			return false;
+		}
+		return true;
+	}
+
+	bool SelfTest() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("idle", "Needs the scheduler");
+			return false;
+		}
+
+		// Another CPU if there is one, so it really goes idle in between
+		uint64_t online = Scheduler::OnlineMask();
+		uint32_t self = this_cpu_id();
+		uint64_t others = online & ~(1ULL << self);
+		uint32_t cpu = others ? 63 - __builtin_clzll(others) : self;
+
+		Method was = method;
+		bool passed = true;
+		SetMethod(Method::Halt);
+		if (!RunTest(cpu)) passed = false;
+		if (SetMethod(Method::Mwait) && !RunTest(cpu)) passed = false;
+		method = was;
+		return passed;
+	}
+}
@@ -0,0 +1,895 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Scheduler.cpp
+// Purpose: Kernel threads, per-CPU run queues and preemption
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sched/Scheduler.hpp>
+#include <Sched/Idle.hpp>
+#include <CPU/PerCPU.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/Delay.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Memory/Heap.hpp>
+#include <Memory/Memory.hpp>
+#include <Memory/Paging.hpp>
+#include <Memory/Mem_.hpp>
+#include <Sync/Spinlock.hpp>
+#include <Sync/RCU.hpp>
+#include <Inferno/Log.h>
+
+extern "C" void SchedSwitch(uint64_t* prevRsp, uint64_t nextRsp);
+extern "C" void SchedThreadTrampoline();
+
+namespace Scheduler {
+	// Everything here is under `lock` except `ready` and `bitmap`, which
+	// other CPUs peek at without it to decide whether to bother
+	typedef struct {
+		spinlock_t lock;
+		Thread* head[SCHED_PRIORITIES];
+		Thread* tail[SCHED_PRIORITIES];
+		volatile uint32_t bitmap;   // bit per non-empty priority
+		volatile uint32_t ready;    // threads queued
+		bool online;
+		Thread* idle;
+
+		// Left for FinishSwitch by the thread that switched away
+		Thread* prev;
+		bool migrate;
+
+		uint64_t switches;
+		uint64_t steals;
+	} RunQueue;
+
+	static DEFINE_PER_CPU(RunQueue, runqueue);
+	static DEFINE_LOCK_CLASS(runqueueClass, "runqueue");
+
+	static bool initialized = false;
+	static uint8_t tickVector = 0;
+	static uint8_t reschedVector = 0;
+	static HRTimer::Timer tickTimer;
+
+	// Thread list, ids and stack slots
+	static DEFINE_LOCK_CLASS(threadsClass, "threads");
+	static spinlock_t threadsLock = SPINLOCK_INIT_CLASS(threadsClass);
+	static Thread* threads = nullptr;
+	static uint32_t threadCount = 0;
+	static uint32_t nextId = 0;
+	static uint64_t slotsUsed[SCHED_MAX_THREADS / 64];
+	static uint64_t slotsMapped[SCHED_MAX_THREADS / 64];
+
+	static inline uint64_t SaveAndDisable() {
+		uint64_t flags;
+		asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+		return flags;
+	}
+
+	static inline void Restore(uint64_t flags) {
+		if (flags & 0x200) asm volatile("sti" ::: "memory");
+	}
+
+	static inline RunQueue* QueueOf(uint32_t cpu) {
+		return per_cpu_ptr(&runqueue, cpu);
+	}
+
+	static inline bool CPUUsable(uint32_t cpu) {
+		return cpu < PerCPU::GetCount() && PerCPU::Get(cpu) && QueueOf(cpu)->online;
+	}
+
+	static inline bool Allowed(Thread* thread, uint32_t cpu) {
+		return cpu < 64 && (thread->affinity & (1ULL << cpu));
+	}
+
+	static void Enqueue(RunQueue* rq, uint32_t cpu, Thread* thread) {
+		uint8_t priority = thread->priority;
+		thread->next = nullptr;
+		thread->prev = rq->tail[priority];
+		if (rq->tail[priority]) rq->tail[priority]->next = thread;
+		else rq->head[priority] = thread;
+		rq->tail[priority] = thread;
+		rq->bitmap |= 1U << priority;
+		rq->ready++;
+		thread->queued = true;
+		thread->cpu = cpu;
+	}
+
+	static void Remove(RunQueue* rq, Thread* thread) {
+		uint8_t priority = thread->priority;
+		if (thread->prev) thread->prev->next = thread->next;
+		else rq->head[priority] = thread->next;
+		if (thread->next) thread->next->prev = thread->prev;
+		else rq->tail[priority] = thread->prev;
+		if (!rq->head[priority]) rq->bitmap &= ~(1U << priority);
+		rq->ready--;
+		thread->queued = false;
+	}
+
+	static Thread* PickNext(RunQueue* rq) {
+		if (!rq->bitmap) return nullptr;
+		Thread* thread = rq->head[31 - __builtin_clz(rq->bitmap)];
+		Remove(rq, thread);
+		return thread;
+	}
+
+	static inline int HighestQueued(RunQueue* rq) {
+		uint32_t bitmap = rq->bitmap;
+		return bitmap ? 31 - __builtin_clz(bitmap) : -1;
+	}
+
+	// Takes the best thread another CPU has queued that may run here,
+	// looking first where it would find its data still in the shared
+	// cache. trylock only: the victim may be stealing from us at the same
+	// time.
+	static Thread* Steal(RunQueue* rq, uint32_t self) {
+		uint32_t count = PerCPU::GetCount();
+		SMP::CPUInfo* info = SMP::GetCPU(self);
+		uint64_t near = info ? info->cacheMask : 0;
+		for (uint32_t i = 1; i < count * 2; i++) {
+			// Sharing a cache with us the first time round, the rest after
+			uint32_t cpu = (self + i) % count;
+			bool shared = cpu < 64 && (near & (1ULL << cpu));
+			if (cpu == self || shared != (i < count)) continue;
+			if (!CPUUsable(cpu)) continue;
+			RunQueue* victim = QueueOf(cpu);
+			if (!victim->ready || !spin_trylock(&victim->lock)) continue;
+
+			Thread* found = nullptr;
+			for (int priority = SCHED_PRIORITY_MAX; priority >= 0 && !found; priority--) {
+				for (Thread* thread = victim->head[priority]; thread; thread = thread->next) {
+					// Still switching out over there, not worth waiting for
+					if (Allowed(thread, self) && !thread->onCPU) {
+						found = thread;
+						break;
+					}
+				}
+			}
+			if (found) Remove(victim, found);
+			spin_unlock(&victim->lock);
+
+			if (found) {
+				rq->steals++;
+				return found;
+			}
+		}
+		return nullptr;
+	}
+
+	static bool SiblingsBusy(uint32_t cpu) {
+		SMP::CPUInfo* info = SMP::GetCPU(cpu);
+		if (!info) return false;
+		for (uint64_t siblings = info->siblings; siblings; siblings &= siblings - 1) {
+			uint32_t sibling = __builtin_ctzll(siblings);
+			if (CPUUsable(sibling) && PerCPU::Get(sibling)->current != QueueOf(sibling)->idle) return true;
+		}
+		return false;
+	}
+
+	// Where a woken thread goes: back where it ran if that CPU has nothing
+	// waiting, otherwise the allowed CPU with the shortest queue, on an
+	// idle core if there's a choice
+	static uint32_t SelectCPU(Thread* thread) {
+		if (CPUUsable(thread->cpu) && Allowed(thread, thread->cpu) && !QueueOf(thread->cpu)->ready) {
+			return thread->cpu;
+		}
+
+		uint32_t best = thread->cpu;
+		uint32_t bestLoad = 0xFFFFFFFF;
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount(); cpu++) {
+			if (!CPUUsable(cpu) || !Allowed(thread, cpu)) continue;
+			RunQueue* rq = QueueOf(cpu);
+			uint32_t load = rq->ready + (PerCPU::Get(cpu)->current != rq->idle ? 1 : 0);
+			// Between equal loads, a core whose other threads are busy
+			// gives us only what they leave of it
+			load = load * 2 + (SiblingsBusy(cpu) ? 1 : 0);
+			if (load < bestLoad) {
+				best = cpu;
+				bestLoad = load;
+			}
+		}
+		return best;
+	}
+
+	// Asks `cpu` to reschedule. Another CPU gets an IPI unless it's idle in
+	// MWAIT, where the store itself wakes it.
+	static void Kick(uint32_t cpu) {
+		PerCPU::Get(cpu)->needResched = 1;
+		if (cpu != this_cpu_id() && reschedVector && !Idle::WokenByStore(cpu)) {
+			SMP::CPUInfo* info = SMP::GetCPU(cpu);
+			if (info) APIC::SendIPI(info->apicId, reschedVector);
+		}
+	}
+
+	// Queues a ready thread on `cpu` and preempts whatever runs there if
+	// the newcomer outranks it
+	static void EnqueueOn(uint32_t cpu, Thread* thread) {
+		RunQueue* rq = QueueOf(cpu);
+		uint64_t flags = spin_lock_irqsave(&rq->lock);
+		Enqueue(rq, cpu, thread);
+		Thread* current = PerCPU::Get(cpu)->current;
+		bool preempt = current == rq->idle || thread->priority > current->priority;
+		if (preempt) Kick(cpu);
+		spin_unlock_irqrestore(&rq->lock, flags);
+	}
+
+	static void Reap(Thread* thread) {
+		spin_lock(&threadsLock);
+		if (thread->listPrev) thread->listPrev->listNext = thread->listNext;
+		else threads = thread->listNext;
+		if (thread->listNext) thread->listNext->listPrev = thread->listPrev;
+		threadCount--;
+		if (thread->slot != 0xFFFFFFFF) slotsUsed[thread->slot / 64] &= ~(1ULL << (thread->slot % 64));
+		Heap::Free(thread);
+		spin_unlock(&threadsLock);
+	}
+
+	// Second half of a switch, on the new thread: lets go of the run queue
+	// Schedule locked, then deals with the thread it switched away from
+	static void FinishSwitch() {
+		RunQueue* rq = this_cpu_ptr(&runqueue);
+		Thread* prev = rq->prev;
+		bool migrate = rq->migrate;
+		rq->prev = nullptr;
+		rq->migrate = false;
+
+		__atomic_store_n(&prev->onCPU, false, __ATOMIC_RELEASE);
+		spin_unlock(&rq->lock);
+
+		if (prev->state == State::Dead) Reap(prev);
+		else if (migrate) EnqueueOn(SelectCPU(prev), prev);
+	}
+
+	// Picks the next thread for this CPU and switches to it. The current
+	// thread must already be Blocked or Dead if it isn't meant to come back,
+	// unless `preempt`: then it didn't choose to go and always stays queued.
+	static void Schedule(bool preempt = false) {
+		// Readers hold preemption off, so nothing here is one
+		if (!preempt_count()) rcu_note_qs();
+		uint64_t flags = SaveAndDisable();
+		PerCPU::Area* area = this_cpu();
+		RunQueue* rq = this_cpu_ptr(&runqueue);
+		uint32_t self = area->index;
+
+		spin_lock(&rq->lock);
+		area->needResched = 0;
+
+		Thread* prev = area->current;
+		bool migrate = false;
+		// Caught between PrepareToBlock and Block it isn't asleep yet: back
+		// to Running, so Block returns and the caller checks again. If a
+		// waker got there first it's Ready and queued already.
+		if (preempt && prev != rq->idle) {
+			State blocked = State::Blocked;
+			__atomic_compare_exchange_n(&prev->state, &blocked, State::Running, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		}
+		if (prev->state == State::Running && prev != rq->idle) {
+			prev->state = State::Ready;
+			if (Allowed(prev, self)) Enqueue(rq, self, prev);
+			else migrate = true;
+		}
+
+		Thread* next = PickNext(rq);
+		if (!next) next = Steal(rq, self);
+		if (!next) next = rq->idle;
+
+		if (next == prev) {
+			prev->state = State::Running;
+			spin_unlock(&rq->lock);
+			Restore(flags);
+			return;
+		}
+
+		// Woken and picked here before it got off the CPU it blocked on
+		while (__atomic_load_n(&next->onCPU, __ATOMIC_ACQUIRE)) asm volatile("pause");
+
+		uint64_t now = ClockMonotonicNs();
+		prev->runtime += now - prev->sliceStart;
+		next->sliceStart = now;
+		next->state = State::Running;
+		next->cpu = self;
+		next->onCPU = true;
+		next->switches++;
+		rq->switches++;
+		rq->prev = prev;
+		rq->migrate = migrate;
+		area->current = next;
+		// A thread in ring 3 or a syscall comes back on its own stack wherever it runs next
+		prev->syscall = area->syscall;
+		area->syscall = next->syscall;
+
+		SchedSwitch(&prev->rsp, next->rsp);
+
+		// Back on prev, maybe on another CPU
+		FinishSwitch();
+		Restore(flags);
+	}
+
+	static void IdleLoop() {
+		while (true) {
+			asm volatile("cli");
+			RunQueue* rq = this_cpu_ptr(&runqueue);
+			bool local = rq->ready || this_cpu()->needResched;
+			bool remote = false;
+			for (uint32_t cpu = 0; cpu < PerCPU::GetCount() && !local && !remote; cpu++) {
+				if (cpu != this_cpu_id() && CPUUsable(cpu) && QueueOf(cpu)->ready) remote = true;
+			}
+
+			if (local || remote) {
+				uint64_t before = rq->switches;
+				Schedule();
+				// Nothing here could be stolen, wait for the next kick
+				if (local || rq->switches != before) {
+					asm volatile("sti");
+					continue;
+				}
+			}
+			Idle::Wait();
+		}
+	}
+
+	// From every CPU's tick: end the slice if someone at least as important
+	// is waiting
+	static void Tick() {
+		RunQueue* rq = this_cpu_ptr(&runqueue);
+		Thread* current = this_cpu()->current;
+		if (!current) return;
+		if (current == rq->idle) {
+			if (rq->ready) this_cpu()->needResched = 1;
+			return;
+		}
+		if (HighestQueued(rq) >= current->priority &&
+		    ClockMonotonicNs() - current->sliceStart >= SCHED_TIMESLICE_NS) {
+			this_cpu()->needResched = 1;
+		}
+	}
+
+	static bool TickIPI(Interrupts::Frame*, void*) {
+		Tick();
+		return true;
+	}
+
+	// The flag is already set, the interrupt exit does the rest
+	static bool ReschedIPI(Interrupts::Frame*, void*) {
+		return true;
+	}
+
+	// On the boot CPU: tick here, and forward the tick to CPUs that are
+	// running something or could steal something
+	static void TickTimer(void*) {
+		HRTimer::ModTimer(&tickTimer, ClockMonotonicNs() + SCHED_TICK_NS);
+		Tick();
+
+		bool surplus = false;
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount() && !surplus; cpu++) {
+			if (CPUUsable(cpu) && QueueOf(cpu)->ready) surplus = true;
+		}
+
+		uint32_t self = this_cpu_id();
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount(); cpu++) {
+			if (cpu == self || !CPUUsable(cpu)) continue;
+			bool idle = PerCPU::Get(cpu)->current == QueueOf(cpu)->idle;
+			if (idle && !surplus) continue;
+			// An idle CPU only has to look for work to steal, no tick
+			if (idle) {
+				Kick(cpu);
+				continue;
+			}
+			SMP::CPUInfo* info = SMP::GetCPU(cpu);
+			if (info) APIC::SendIPI(info->apicId, tickVector);
+		}
+	}
+
+	// Interrupt exit: switch if asked to and the interrupted code allows it
+	static void InterruptExit(Interrupts::Frame* frame) {
+		if (!this_cpu()->needResched || preempt_count()) return;
+		if (!(frame->rflags & 0x200) || (frame->cs & 3)) return;
+		Schedule(true);
+	}
+
+	void PreemptIfNeeded() {
+		if (!initialized || !this_cpu()->needResched || preempt_count()) return;
+		uint64_t flags;
+		asm volatile("pushfq; pop %0" : "=r"(flags));
+		if (!(flags & 0x200)) return;
+		Schedule(true);
+	}
+
+	// Maps a slot's stack the first time it's used
+	static uint64_t AllocateStack(uint32_t* slot) {
+		for (uint32_t i = 0; i < SCHED_MAX_THREADS; i++) {
+			if (slotsUsed[i / 64] & (1ULL << (i % 64))) continue;
+
+			uint64_t bottom = SCHED_STACK_BASE + (uint64_t)i * (SCHED_STACK_SIZE + 0x1000) + 0x1000;
+			if (!(slotsMapped[i / 64] & (1ULL << (i % 64)))) {
+				for (uint64_t offset = 0; offset < SCHED_STACK_SIZE; offset += 0x1000) {
+					void* page = Memory::RequestPage();
+					if (!page) return 0;
+					Paging::MapPage(bottom + offset, (uint64_t)page);
+				}
+				slotsMapped[i / 64] |= 1ULL << (i % 64);
+			}
+			slotsUsed[i / 64] |= 1ULL << (i % 64);
+			*slot = i;
+			return bottom + SCHED_STACK_SIZE;
+		}
+		return 0;
+	}
+
+	static Thread* NewThread(const char* name, uint8_t priority, uint64_t affinity) {
+		spin_lock(&threadsLock);
+		Thread* thread = (Thread*)Heap::Allocate(sizeof(Thread));
+		spin_unlock(&threadsLock);
+		if (!thread) return nullptr;
+		memset(thread, 0, sizeof(Thread));
+
+		uint32_t i = 0;
+		for (; name[i] && i < sizeof(thread->name) - 1; i++) thread->name[i] = name[i];
+		thread->name[i] = 0;
+		thread->priority = priority > SCHED_PRIORITY_MAX ? SCHED_PRIORITY_MAX : priority;
+		thread->affinity = affinity;
+		thread->slot = 0xFFFFFFFF;
+		HRTimer::InitTimer(&thread->sleepTimer, [](void* context) { Wake((Thread*)context); }, thread, true);
+		return thread;
+	}
+
+	// Caller holds threadsLock
+	static void AddThread(Thread* thread) {
+		thread->id = nextId++;
+		thread->listPrev = nullptr;
+		thread->listNext = threads;
+		if (threads) threads->listPrev = thread;
+		threads = thread;
+		threadCount++;
+	}
+
+	static void InitQueue(uint32_t cpu, Thread* idle) {
+		RunQueue* rq = QueueOf(cpu);
+		spin_lock_init(&rq->lock, &runqueueClass);
+		rq->idle = idle;
+		idle->cpu = cpu;
+		__atomic_store_n(&rq->online, true, __ATOMIC_RELEASE);
+	}
+
+	// Makes the flow that's running on this CPU right now a thread
+	static void Adopt(Thread* thread) {
+		thread->state = State::Running;
+		thread->onCPU = true;
+		thread->cpu = this_cpu_id();
+		thread->sliceStart = ClockMonotonicNs();
+		this_cpu()->current = thread;
+	}
+
+	bool Initialize() {
+		if (!PerCPU::IsInitialized()) {
+			prErr("sched", "Needs the per-CPU areas");
+			return false;
+		}
+
+		// The boot flow keeps its stack and becomes init
+		Thread* init = NewThread("init", SCHED_PRIORITY_NORMAL, 1);
+		Thread* idle = Create("idle/0", nullptr, nullptr, 0, 1);
+		if (!init || !idle) {
+			prErr("sched", "Out of memory");
+			return false;
+		}
+		spin_lock(&threadsLock);
+		AddThread(init);
+		spin_unlock(&threadsLock);
+
+		// idle/0 was made by Create but never queued, the first time this
+		// CPU runs out of work it starts in IdleLoop
+		InitQueue(0, idle);
+		Adopt(init);
+
+		int vectors = Interrupts::AllocateVectors(2);
+		if (vectors >= 0) {
+			tickVector = vectors;
+			reschedVector = vectors + 1;
+			Interrupts::RegisterHandler(tickVector, TickIPI, nullptr);
+			Interrupts::RegisterHandler(reschedVector, ReschedIPI, nullptr);
+		}
+		Interrupts::SetExitHook(InterruptExit);
+		initialized = true;
+
+		if (HRTimer::IsInitialized()) {
+			HRTimer::InitTimer(&tickTimer, TickTimer, nullptr, true);
+			HRTimer::AddTimer(&tickTimer, ClockMonotonicNs() + SCHED_TICK_NS);
+			prInfo("sched", "%d priorities, %dms slices on a %dms tick", SCHED_PRIORITIES,
+				(int)(SCHED_TIMESLICE_NS / 1000000), (int)(SCHED_TICK_NS / 1000000));
+		} else {
+			prWarn("sched", "No HRTimer, threads only switch when they block or yield");
+		}
+		return true;
+	}
+
+	bool IsInitialized() {
+		return initialized;
+	}
+
+	void StartAP() {
+		if (!initialized) while (true) asm volatile("sti; hlt");
+
+		uint32_t cpu = this_cpu_id();
+		char name[16] = "idle/";
+		uint32_t length = 5;
+		if (cpu >= 10) name[length++] = '0' + cpu / 10;
+		name[length++] = '0' + cpu % 10;
+		name[length] = 0;
+
+		Thread* idle = NewThread(name, 0, 1ULL << cpu);
+		if (!idle) while (true) asm volatile("sti; hlt");
+		spin_lock(&threadsLock);
+		AddThread(idle);
+		spin_unlock(&threadsLock);
+
+		InitQueue(cpu, idle);
+		Adopt(idle);
+		IdleLoop();
+		while (true) asm volatile("cli; hlt");
+	}
+
+	uint64_t OnlineMask() {
+		uint64_t mask = 0;
+		uint32_t count = SMP::GetCPUCount() > PerCPU::GetCount() ? SMP::GetCPUCount() : PerCPU::GetCount();
+		for (uint32_t cpu = 0; cpu < count && cpu < 64; cpu++) {
+			SMP::CPUInfo* info = SMP::GetCPU(cpu);
+			bool starting = info && info->online;
+			if (CPUUsable(cpu) || (starting && WaitUntil([cpu] { return CPUUsable(cpu); }, 10 * NSEC_PER_MSEC))) {
+				mask |= 1ULL << cpu;
+			}
+		}
+		return mask;
+	}
+
+	Thread* Create(const char* name, Entry entry, void* arg, uint8_t priority, uint64_t affinity) {
+		Thread* thread = NewThread(name, priority, affinity);
+		if (!thread) return nullptr;
+
+		spin_lock(&threadsLock);
+		uint64_t top = AllocateStack(&thread->slot);
+		if (!top) {
+			Heap::Free(thread);
+			spin_unlock(&threadsLock);
+			prErr("sched", "No stack for thread %s", name);
+			return nullptr;
+		}
+		AddThread(thread);
+		spin_unlock(&threadsLock);
+
+		// What SchedSwitch pops: r15..r12, rbp, rbx = the thread, then the
+		// return into SchedThreadTrampoline, leaving rsp 16-byte aligned
+		uint64_t* stack = (uint64_t*)top;
+		*--stack = (uint64_t)SchedThreadTrampoline;
+		*--stack = (uint64_t)thread;
+		for (int i = 0; i < 5; i++) *--stack = 0;
+		thread->rsp = (uint64_t)stack;
+		thread->entry = entry;
+		thread->arg = arg;
+		thread->state = State::Ready;
+
+		// The boot CPU's idle thread is made before there's a queue for it
+		if (entry) {
+			thread->cpu = this_cpu_id();
+			EnqueueOn(SelectCPU(thread), thread);
+		}
+		return thread;
+	}
+
+	Thread* Current() {
+		return this_cpu()->current;
+	}
+
+	void Yield() {
+		Schedule();
+	}
+
+	void Exit() {
+		asm volatile("cli");
+		Current()->state = State::Dead;
+		Schedule();
+		while (true) asm volatile("cli; hlt");
+	}
+
+	void PrepareToBlock() {
+		__atomic_store_n(&Current()->state, State::Blocked, __ATOMIC_SEQ_CST);
+	}
+
+	void Block() {
+		// Woken from this CPU already. A Ready thread was queued by a waker
+		// elsewhere and has to go through Schedule to come off that queue.
+		if (Current()->state == State::Running) return;
+		Schedule();
+	}
+
+	bool BlockTimeout(uint64_t ns) {
+		uint64_t deadline = ClockMonotonicNs() + ns;
+		Thread* self = Current();
+		if (HRTimer::IsInitialized()) {
+			HRTimer::ModTimer(&self->sleepTimer, deadline);
+			Block();
+			HRTimer::CancelTimerSync(&self->sleepTimer);
+		} else {
+			// Nothing to wake us on time, come back once the others had a go
+			AbortBlock();
+			Yield();
+		}
+		return ClockMonotonicNs() < deadline;
+	}
+
+	void AbortBlock() {
+		// Our own Wake puts us straight back to Running. A waker elsewhere
+		// may have queued us already, then Block takes us off that queue.
+		// No interrupt may preempt in between while we're Ready but not queued.
+		uint64_t flags = SaveAndDisable();
+		Wake(Current());
+		Restore(flags);
+		Block();
+	}
+
+	bool CanBlock() {
+		if (!initialized || preempt_count() || in_interrupt()) return false;
+		uint64_t flags;
+		asm volatile("pushfq; pop %0" : "=r"(flags));
+		return flags & 0x200;
+	}
+
+	bool Wake(Thread* thread) {
+		State expected = State::Blocked;
+		if (!__atomic_compare_exchange_n(&thread->state, &expected, State::Ready, false,
+		    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return false;
+
+		// Still on its CPU between PrepareToBlock and Schedule: Schedule
+		// sees Ready and keeps it running
+		if (thread == Current()) {
+			thread->state = State::Running;
+			return true;
+		}
+		EnqueueOn(SelectCPU(thread), thread);
+		return true;
+	}
+
+	void Sleep(uint64_t ns) {
+		uint64_t deadline = ClockMonotonicNs() + ns;
+		if (!HRTimer::IsInitialized()) {
+			while (ClockMonotonicNs() < deadline) Yield();
+			return;
+		}
+
+		// Anything else may wake us early, go back to sleep until it's time
+		Thread* self = Current();
+		while (ClockMonotonicNs() < deadline) {
+			PrepareToBlock();
+			HRTimer::ModTimer(&self->sleepTimer, deadline);
+			Block();
+		}
+		// No callback left running that could wake a later sleep, or touch
+		// this thread after it's gone
+		HRTimer::CancelTimerSync(&self->sleepTimer);
+	}
+
+	// Locks the queue a thread is on, following it if it moves meanwhile
+	static RunQueue* LockQueueOf(Thread* thread, uint64_t* flags) {
+		while (true) {
+			uint32_t cpu = thread->cpu;
+			RunQueue* rq = QueueOf(cpu);
+			*flags = spin_lock_irqsave(&rq->lock);
+			if (thread->cpu == cpu) return rq;
+			spin_unlock_irqrestore(&rq->lock, *flags);
+		}
+	}
+
+	void SetPriority(Thread* thread, uint8_t priority) {
+		if (priority > SCHED_PRIORITY_MAX) priority = SCHED_PRIORITY_MAX;
+		uint64_t flags;
+		RunQueue* rq = LockQueueOf(thread, &flags);
+		uint32_t cpu = thread->cpu;
+		if (thread->queued) {
+			Remove(rq, thread);
+			thread->priority = priority;
+			Enqueue(rq, cpu, thread);
+			Thread* current = PerCPU::Get(cpu)->current;
+			if (priority > current->priority) Kick(cpu);
+		} else {
+			bool lowered = priority < thread->priority;
+			thread->priority = priority;
+			if (lowered && thread->state == State::Running && HighestQueued(rq) > priority) Kick(cpu);
+		}
+		spin_unlock_irqrestore(&rq->lock, flags);
+	}
+
+	bool SetAffinity(Thread* thread, uint64_t mask) {
+		bool any = false;
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount() && cpu < 64; cpu++) {
+			if ((mask & (1ULL << cpu)) && CPUUsable(cpu)) any = true;
+		}
+		if (!any) return false;
+
+		uint64_t flags;
+		RunQueue* rq = LockQueueOf(thread, &flags);
+		uint32_t cpu = thread->cpu;
+		thread->affinity = mask;
+		bool move = !Allowed(thread, cpu);
+		if (move && thread->queued) {
+			Remove(rq, thread);
+		} else if (move && thread->state == State::Running) {
+			Kick(cpu);
+			move = false;
+		} else {
+			move = false;
+		}
+		spin_unlock_irqrestore(&rq->lock, flags);
+
+		if (move) EnqueueOn(SelectCPU(thread), thread);
+		return true;
+	}
+
+	static const char* StateName(State state) {
+		switch (state) {
+			case State::Ready: return "ready";
+			case State::Running: return "running";
+			case State::Blocked: return "blocked";
+			default: return "dead";
+		}
+	}
+
+	void PrintThreads() {
+		kprintf("  id   name             state    prio  cpu  affinity          runtime(ms)  switches\n");
+		uint64_t flags = spin_lock_irqsave(&threadsLock);
+		for (Thread* thread = threads; thread; thread = thread->listNext) {
+			kprintf("  %-4d %-16s %-8s %-5d %-4d %p %11u %9u\n", thread->id, thread->name,
+				StateName(thread->state), thread->priority, thread->cpu, (void*)thread->affinity,
+				(unsigned int)(thread->runtime / 1000000), (unsigned int)thread->switches);
+		}
+		spin_unlock_irqrestore(&threadsLock, flags);
+	}
+
+	void PrintRunQueues() {
+		kprintf("  cpu  current          ready  switches  steals\n");
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount(); cpu++) {
+			if (!CPUUsable(cpu)) continue;
+			RunQueue* rq = QueueOf(cpu);
+			Thread* current = PerCPU::Get(cpu)->current;
+			kprintf("  %-4d %-16s %-6d %-9u %u\n", cpu, current ? current->name : "-", rq->ready,
+				(unsigned int)rq->switches, (unsigned int)rq->steals);
+		}
+	}
+
+	struct TestWorker {
+		uint64_t until;
+		uint64_t cpusSeen;
+		volatile bool* flag;
+		volatile uint32_t* done;
+	};
+
+	// Busy until the deadline, noting every CPU it was on
+	static void TestSpin(void* context) {
+		TestWorker* worker = (TestWorker*)context;
+		while (ClockMonotonicNs() < worker->until) {
+			__atomic_fetch_or(&worker->cpusSeen, 1ULL << this_cpu_id(), __ATOMIC_RELAXED);
+			for (int i = 0; i < 1000; i++) asm volatile("pause");
+		}
+		__atomic_fetch_add(worker->done, 1, __ATOMIC_RELEASE);
+	}
+
+	static void TestFlag(void* context) {
+		*((TestWorker*)context)->flag = true;
+	}
+
+	static volatile uint32_t testYields = 0;
+
+	static void TestYield(void* context) {
+		uint32_t rounds = (uint32_t)(uint64_t)context;
+		for (uint32_t i = 0; i < rounds; i++) {
+			testYields++;
+			Yield();
+		}
+	}
+
+	static bool WaitDone(volatile uint32_t* done, uint32_t count, uint64_t timeout) {
+		uint64_t deadline = ClockMonotonicNs() + timeout;
+		while (__atomic_load_n(done, __ATOMIC_ACQUIRE) < count) {
+			if (ClockMonotonicNs() > deadline) return false;
+			Sleep(1000000);
+		}
+		return true;
+	}
+
+	bool SelfTest() {
+		if (!initialized) {
+			prErr("sched", "Scheduler not running");
+			return false;
+		}
+
+		bool passed = true;
+		uint32_t online = SMP::GetOnlineCount();
+		uint32_t workers = online * 2 > 16 ? 16 : online * 2;
+
+		// Static, a worker that outlives a timed out wait still writes here
+		static TestWorker spin[16], pinned, high;
+		static volatile uint32_t done;
+		static volatile bool ran;
+
+		// Spread: twice as many busy threads as CPUs
+		done = 0;
+		uint64_t until = ClockMonotonicNs() + 50000000ULL;
+		for (uint32_t i = 0; i < workers; i++) {
+			spin[i] = { until, 0, nullptr, &done };
+			if (!Create("test/spin", TestSpin, &spin[i])) passed = false;
+		}
+		if (!WaitDone(&done, workers, 2000000000ULL)) {
+			prErr("sched", "Only %d of %d busy threads finished", done, workers);
+			return false;
+		}
+		uint64_t used = 0;
+		for (uint32_t i = 0; i < workers; i++) used |= spin[i].cpusSeen;
+		uint32_t spread = 0;
+		for (; used; used &= used - 1) spread++;
+		if (online > 1 && spread < 2) {
+			prErr("sched", "%d busy threads all ran on one CPU", workers);
+			passed = false;
+		}
+
+		// Affinity: pinned to the last CPU, never seen anywhere else
+		uint32_t last = 0;
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount() && cpu < 64; cpu++) if (CPUUsable(cpu)) last = cpu;
+		pinned = { ClockMonotonicNs() + 20000000ULL, 0, nullptr, &done };
+		done = 0;
+		Create("test/pinned", TestSpin, &pinned, SCHED_PRIORITY_NORMAL, 1ULL << last);
+		if (!WaitDone(&done, 1, 1000000000ULL) || pinned.cpusSeen != (1ULL << last)) {
+			prErr("sched", "Thread pinned to CPU %d ran on %p", last, (void*)pinned.cpusSeen);
+			passed = false;
+		}
+
+		// Wakeup preemption: a higher priority thread on this CPU runs
+		// before Create returns
+		ran = false;
+		high = { 0, 0, &ran, nullptr };
+		Create("test/high", TestFlag, &high, SCHED_PRIORITY_HIGH, 1ULL << this_cpu_id());
+		if (!ran) {
+			prErr("sched", "Higher priority thread didn't preempt its creator");
+			passed = false;
+		}
+
+		// Sleep accuracy
+		uint64_t start = ClockMonotonicNs();
+		Sleep(5000000);
+		uint64_t slept = ClockMonotonicNs() - start;
+		if (slept < 5000000 || slept > 7000000) {
+			prErr("sched", "Sleep(5ms) took %dus", (unsigned int)(slept / 1000));
+			passed = false;
+		}
+
+		// Context switch cost: ping-pong with a yielding thread here
+		const uint32_t rounds = 1000;
+		testYields = 0;
+		Create("test/yield", TestYield, (void*)(uint64_t)rounds, SCHED_PRIORITY_NORMAL, 1ULL << this_cpu_id());
+		uint32_t low, high32;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high32));
+		uint64_t tsc = ((uint64_t)high32 << 32) | low;
+		uint32_t yields = 0;
+		while (testYields < rounds) {
+			Yield();
+			yields++;
+		}
+		asm volatile("rdtsc" : "=a"(low), "=d"(high32));
+		uint64_t cycles = (((uint64_t)high32 << 32) | low) - tsc;
+
+		prInfo("sched", "%d threads used %d of %d CPUs, slept %dus for 5ms, %d cycles per switch", workers,
+			spread, online, (unsigned int)(slept / 1000), (unsigned int)(cycles / (yields ? yields * 2 : 1)));
+		return passed;
+	}
+}
+
+// First C code of a new thread, reached through SchedThreadTrampoline with
+// the run queue still locked by the Schedule that switched here
+extern "C" [[noreturn]] void SchedThreadStart(Scheduler::Thread* thread) {
+	Scheduler::FinishSwitch();
+	asm volatile("sti");
+	if (thread->entry) thread->entry(thread->arg);
+	else Scheduler::IdleLoop();
+	Scheduler::Exit();
+}
@@ -0,0 +1,327 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Softirq.cpp
+// Purpose: Softirqs and tasklets, the bottom half of interrupt handling
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sched/Softirq.hpp>
+#include <Sched/Scheduler.hpp>
+#include <CPU/PerCPU.hpp>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/Delay.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Inferno/Log.h>
+
+static void HiAction();
+static void TaskletAction();
+
+// The tasklet actions are in place from the start, drivers schedule
+// tasklets long before Initialize
+static softirq_action_t actions[NR_SOFTIRQS] = { HiAction, TaskletAction };
+
+// Tasklets queued on this CPU, [0] for SOFTIRQ_HI and [1] for SOFTIRQ_TASKLET.
+// Only touched by this CPU with interrupts off.
+typedef struct {
+	tasklet_struct* head;
+	tasklet_struct* tail;
+} TaskletList;
+
+static DEFINE_PER_CPU(TaskletList, tasklets[2]);
+static DEFINE_PER_CPU(Scheduler::Thread*, daemon);
+static DEFINE_PER_CPU(uint64_t, runs[NR_SOFTIRQS]);
+static DEFINE_PER_CPU(uint64_t, taskletRuns);
+static DEFINE_PER_CPU(uint64_t, deferred);
+
+static inline uint64_t SaveAndDisable() {
+	uint64_t flags;
+	asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+	return flags;
+}
+
+static inline void Restore(uint64_t flags) {
+	if (flags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+static void WakeDaemon() {
+	Scheduler::Thread* thread = *this_cpu_ptr(&daemon);
+	if (!thread) return;
+	this_cpu_inc(deferred);
+	Scheduler::Wake(thread);
+}
+
+// Everything pending on this CPU, round after round while handlers raise
+// more, until the budget is gone. Interrupts off on entry and on return.
+static void Run() {
+	PerCPU::Area* area = this_cpu();
+	if (area->inSoftirq) return;
+	area->inSoftirq = 1;
+	preempt_disable();
+
+	uint64_t deadline = ClockMonotonicNs() + SOFTIRQ_MAX_NS;
+	uint32_t rounds = SOFTIRQ_MAX_RESTART;
+	uint32_t pending;
+	while ((pending = area->softirqPending)) {
+		area->softirqPending = 0;
+		asm volatile("sti" ::: "memory");
+		for (uint32_t nr = 0; pending; nr++, pending >>= 1) {
+			if (!(pending & 1) || !actions[nr]) continue;
+			actions[nr]();
+			this_cpu_inc(runs[nr]);
+		}
+		asm volatile("cli" ::: "memory");
+		if (!--rounds || ClockMonotonicNs() >= deadline) break;
+	}
+
+	area->inSoftirq = 0;
+	preempt_enable_no_resched();
+
+	// Probably a flood, the rest waits its turn with the threads
+	if (area->softirqPending) WakeDaemon();
+}
+
+// Caller disabled interrupts, `flags` is what it had before
+static void RaiseAndRestore(uint32_t nr, uint64_t flags) {
+	this_cpu()->softirqPending |= 1U << nr;
+	if (!in_interrupt()) {
+		if (flags & 0x200) Run();
+		else WakeDaemon();
+	}
+	Restore(flags);
+	if ((flags & 0x200) && this_cpu()->needResched) Scheduler::PreemptIfNeeded();
+}
+
+void open_softirq(uint32_t nr, softirq_action_t action) {
+	if (nr < NR_SOFTIRQS) actions[nr] = action;
+}
+
+void raise_softirq(uint32_t nr) {
+	if (nr >= NR_SOFTIRQS) return;
+	RaiseAndRestore(nr, SaveAndDisable());
+}
+
+// Interrupts off
+static void QueueTasklet(uint32_t list, tasklet_struct* tasklet) {
+	TaskletList* queue = &this_cpu_ptr(tasklets)[list];
+	tasklet->next = nullptr;
+	if (queue->tail) queue->tail->next = tasklet;
+	else queue->head = tasklet;
+	queue->tail = tasklet;
+}
+
+static void ScheduleOn(uint32_t list, uint32_t nr, tasklet_struct* tasklet) {
+	if (__atomic_fetch_or(&tasklet->state, TASKLET_STATE_SCHED, __ATOMIC_ACQ_REL) & TASKLET_STATE_SCHED) return;
+	uint64_t flags = SaveAndDisable();
+	QueueTasklet(list, tasklet);
+	RaiseAndRestore(nr, flags);
+}
+
+void tasklet_init(tasklet_struct* tasklet, void (*func)(void* data), void* data) {
+	tasklet->next = nullptr;
+	tasklet->state = 0;
+	tasklet->func = func;
+	tasklet->data = data;
+}
+
+void tasklet_schedule(tasklet_struct* tasklet) {
+	ScheduleOn(1, SOFTIRQ_TASKLET, tasklet);
+}
+
+void tasklet_hi_schedule(tasklet_struct* tasklet) {
+	ScheduleOn(0, SOFTIRQ_HI, tasklet);
+}
+
+void tasklet_kill(tasklet_struct* tasklet) {
+	while (__atomic_load_n(&tasklet->state, __ATOMIC_ACQUIRE) & (TASKLET_STATE_SCHED | TASKLET_STATE_RUN)) {
+		if (Scheduler::CanBlock()) Scheduler::Yield();
+		else asm volatile("pause");
+	}
+}
+
+// Takes the whole list at once, anything scheduled meanwhile is for the
+// next round
+static void RunTasklets(uint32_t list, uint32_t nr) {
+	uint64_t flags = SaveAndDisable();
+	TaskletList* queue = &this_cpu_ptr(tasklets)[list];
+	tasklet_struct* tasklet = queue->head;
+	queue->head = queue->tail = nullptr;
+	Restore(flags);
+
+	while (tasklet) {
+		tasklet_struct* next = tasklet->next;
+		if (!(__atomic_fetch_or(&tasklet->state, TASKLET_STATE_RUN, __ATOMIC_ACQUIRE) & TASKLET_STATE_RUN)) {
+			// Cleared first so it can schedule itself again
+			__atomic_and_fetch(&tasklet->state, ~TASKLET_STATE_SCHED, __ATOMIC_RELEASE);
+			tasklet->func(tasklet->data);
+			__atomic_and_fetch(&tasklet->state, ~TASKLET_STATE_RUN, __ATOMIC_RELEASE);
+			this_cpu_inc(taskletRuns);
+		} else {
+			// Still running on another CPU, try again next round
+			flags = SaveAndDisable();
+			QueueTasklet(list, tasklet);
+			this_cpu()->softirqPending |= 1U << nr;
+			Restore(flags);
+		}
+		tasklet = next;
+	}
+}
+
+static void HiAction() {
+	RunTasklets(0, SOFTIRQ_HI);
+}
+
+static void TaskletAction() {
+	RunTasklets(1, SOFTIRQ_TASKLET);
+}
+
+// ksoftirqd/N: whatever an interrupt exit had to leave, or was raised
+// with interrupts off outside one
+static void Daemon(void*) {
+	while (true) {
+		Scheduler::PrepareToBlock();
+		if (!this_cpu()->softirqPending) {
+			Scheduler::Block();
+			continue;
+		}
+		Scheduler::AbortBlock();
+
+		uint64_t flags = SaveAndDisable();
+		Run();
+		Restore(flags);
+	}
+}
+
+namespace Softirq {
+	bool Initialize() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("softirq", "Needs the scheduler");
+			return false;
+		}
+		uint64_t online = Scheduler::OnlineMask();
+		uint32_t started = 0;
+		for (uint32_t cpu = 0; cpu < 64; cpu++) {
+			if (!(online & (1ULL << cpu))) continue;
+			char name[16] = "ksoftirqd/";
+			uint32_t length = 10;
+			if (cpu >= 10) name[length++] = '0' + cpu / 10;
+			name[length++] = '0' + cpu % 10;
+			name[length] = 0;
+
+			Scheduler::Thread* thread = Scheduler::Create(name, Daemon, nullptr, SCHED_PRIORITY_NORMAL, 1ULL << cpu);
+			if (!thread) {
+				prErr("softirq", "No ksoftirqd for CPU %d", cpu);
+				continue;
+			}
+			*per_cpu_ptr(&daemon, cpu) = thread;
+			started++;
+		}
+		prInfo("softirq", "ksoftirqd on %d CPUs", started);
+		return started != 0;
+	}
+
+	void InterruptExit(uint64_t rflags) {
+		// Interrupted code that had interrupts off, or a softirq we'd
+		// only nest inside, gets to finish first
+		if (!(rflags & 0x200) || in_interrupt()) return;
+		Run();
+	}
+
+	void PrintStats() {
+		kprintf("  cpu  hi        tasklet   tasklets  deferred\n");
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount(); cpu++) {
+			if (!PerCPU::Get(cpu)) continue;
+			uint64_t* counts = per_cpu_ptr(runs, cpu);
+			kprintf("  %-4d %-9u %-9u %-9u %u\n", cpu, (unsigned int)counts[SOFTIRQ_HI],
+				(unsigned int)counts[SOFTIRQ_TASKLET], (unsigned int)*per_cpu_ptr(&taskletRuns, cpu),
+				(unsigned int)*per_cpu_ptr(&deferred, cpu));
+		}
+	}
+
+	static inline uint64_t ReadTSC() {
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		return ((uint64_t)high << 32) | low;
+	}
+
+	static struct {
+		tasklet_struct tasklet;
+		volatile uint32_t runs;
+		volatile uint32_t irqCPU, cpu;
+		volatile bool softirq, interrupts;
+		volatile uint64_t raised, started;
+	} test;
+
+	static bool TestIRQ(Interrupts::Frame*, void*) {
+		test.irqCPU = this_cpu_id();
+		test.raised = ReadTSC();
+		tasklet_schedule(&test.tasklet);
+		return true;
+	}
+
+	static void TestTasklet(void*) {
+		test.started = ReadTSC();
+		test.cpu = this_cpu_id();
+		test.softirq = in_softirq() && !in_irq();
+		uint64_t flags;
+		asm volatile("pushfq; pop %0" : "=r"(flags));
+		test.interrupts = flags & 0x200;
+		test.runs++;
+	}
+
+	bool SelfTest() {
+		bool passed = true;
+		tasklet_init(&test.tasklet, TestTasklet, nullptr);
+		test.runs = 0;
+
+		// From a hard interrupt: runs on its way out, same CPU, interrupts on
+		const uint32_t rounds = 100;
+		uint64_t cycles = 0;
+		uint32_t done = 0;
+		int vector = APIC::IsEnabled() ? Interrupts::AllocateVectors(1) : -1;
+		if (vector >= 0) {
+			Interrupts::RegisterHandler(vector, TestIRQ, nullptr);
+			for (; done < rounds; done++) {
+				uint32_t before = test.runs;
+				preempt_disable();
+				APIC::SendIPI(APIC::GetID(), vector);
+				preempt_enable();
+				if (!WaitUntil([before] { return test.runs != before; }, 10 * NSEC_PER_MSEC)) {
+					prErr("softirq", "Tasklet scheduled from an interrupt never ran");
+					passed = false;
+					break;
+				}
+				if (test.cpu != test.irqCPU || !test.softirq || !test.interrupts) {
+					prErr("softirq", "Tasklet ran on CPU %d for an interrupt on %d, softirq %d, interrupts %d",
+						test.cpu, test.irqCPU, test.softirq, test.interrupts);
+					passed = false;
+					break;
+				}
+				cycles += test.started - test.raised;
+			}
+			Interrupts::UnregisterHandler(vector, TestIRQ, nullptr);
+			Interrupts::FreeVectors(vector, 1);
+		}
+
+		// Scheduled three times before it could run: runs once. Raised with
+		// interrupts off outside an interrupt, so ksoftirqd or the next
+		// interrupt exit picks it up.
+		uint32_t before = test.runs;
+		uint64_t flags = SaveAndDisable();
+		for (int i = 0; i < 3; i++) tasklet_schedule(&test.tasklet);
+		Restore(flags);
+		if (!WaitUntil([before] { return test.runs != before; }, 100 * NSEC_PER_MSEC)) {
+			prErr("softirq", "Tasklet scheduled with interrupts off never ran");
+			passed = false;
+		} else if (WaitUntil([before] { return test.runs > before + 1; }, 5 * NSEC_PER_MSEC)) {
+			prErr("softirq", "Tasklet scheduled 3 times ran %d times", test.runs - before);
+			passed = false;
+		}
+		tasklet_kill(&test.tasklet);
+
+		prInfo("softirq", "%d interrupts, %d cycles from handler to tasklet", done,
+			(unsigned int)(done ? cycles / done : 0));
+		return passed;
+	}
+}
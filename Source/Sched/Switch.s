@@ -0,0 +1,37 @@
+; Kernel thread context switch. Only the callee-saved registers need to
+; survive a call, so that's all a switched-out thread keeps on its stack
+; besides the return address. Everything else was saved by whoever called
+; Schedule, an interrupt stub included.
+[bits 64]
+extern SchedThreadStart
+
+section .text
+
+; void SchedSwitch(uint64_t* prevRsp, uint64_t nextRsp)
+global SchedSwitch
+SchedSwitch:
+  push rbx
+  push rbp
+  push r12
+  push r13
+  push r14
+  push r15
+  mov [rdi], rsp
+  mov rsp, rsi
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop rbp
+  pop rbx
+  ret
+
+; First return of a new thread. Scheduler::Create leaves the Thread in rbx
+; and the stack 16-byte aligned after the ret that lands here.
+global SchedThreadTrampoline
+SchedThreadTrampoline:
+  mov rdi, rbx
+  call SchedThreadStart
+  ud2
+
+section .note.GNU-stack noalloc noexec nowrite progbits
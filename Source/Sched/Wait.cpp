@@ -0,0 +1,82 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Wait.cpp
+// Purpose: Wait queues, sleeping until a condition holds
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sched/Wait.hpp>
+
+void __add_wait_queue(wait_queue_head_t* wq, wait_queue_entry* entry) {
+	entry->next = nullptr;
+	entry->prev = wq->tail;
+	if (wq->tail) wq->tail->next = entry;
+	else wq->head = entry;
+	wq->tail = entry;
+	entry->queued = true;
+}
+
+void __remove_wait_queue(wait_queue_head_t* wq, wait_queue_entry* entry) {
+	if (entry->prev) entry->prev->next = entry->next;
+	else wq->head = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else wq->tail = entry->prev;
+	entry->next = entry->prev = nullptr;
+	entry->queued = false;
+}
+
+uint32_t __wake_up_locked(wait_queue_head_t* wq, const void* key, uint32_t exclusive) {
+	uint32_t woken = 0;
+	wait_queue_entry* next;
+	for (wait_queue_entry* entry = wq->head; entry; entry = next) {
+		next = entry->next;
+		if (key && entry->key != key) continue;
+		if (entry->exclusive && !exclusive) continue;
+
+		// The waiter can't get past finish_wait while we hold the lock, so
+		// its thread and the entry stay put until we're done
+		__remove_wait_queue(wq, entry);
+		__atomic_store_n(&entry->woken, true, __ATOMIC_RELEASE);
+		Scheduler::Wake(entry->thread);
+		woken++;
+		if (entry->exclusive) exclusive--;
+	}
+	return woken;
+}
+
+void prepare_to_wait(wait_queue_head_t* wq, wait_queue_entry* entry) {
+	uint64_t flags = spin_lock_irqsave(&wq->lock);
+	if (!entry->queued) {
+		entry->woken = false;
+		__add_wait_queue(wq, entry);
+	}
+	// Under the lock, a waker that comes after us sees the entry and finds
+	// the thread blocked
+	Scheduler::PrepareToBlock();
+	spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+bool finish_wait(wait_queue_head_t* wq, wait_queue_entry* entry) {
+	if (entry->thread->state != Scheduler::State::Running) Scheduler::AbortBlock();
+	uint64_t flags = spin_lock_irqsave(&wq->lock);
+	if (entry->queued) __remove_wait_queue(wq, entry);
+	bool woken = entry->woken;
+	spin_unlock_irqrestore(&wq->lock, flags);
+	return woken;
+}
+
+uint32_t wake_up_nr(wait_queue_head_t* wq, uint32_t exclusive) {
+	return wake_up_key(wq, nullptr, exclusive);
+}
+
+uint32_t wake_up_key(wait_queue_head_t* wq, const void* key, uint32_t exclusive) {
+	// Orders the caller's store to the condition before the look at the
+	// queue, prepare_to_wait does the opposite
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!waitqueue_active(wq)) return 0;
+	uint64_t flags = spin_lock_irqsave(&wq->lock);
+	uint32_t woken = __wake_up_locked(wq, key, exclusive);
+	spin_unlock_irqrestore(&wq->lock, flags);
+	return woken;
+}
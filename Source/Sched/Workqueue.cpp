@@ -0,0 +1,316 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Workqueue.cpp
+// Purpose: Per-CPU worker threads for deferred work that may block
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sched/Workqueue.hpp>
+#include <CPU/PerCPU.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Memory/Heap.hpp>
+#include <Memory/Mem_.hpp>
+#include <Sync/Completion.hpp>
+#include <Sync/Spinlock.hpp>
+#include <Inferno/Log.h>
+
+#define WORKQUEUE_TEST_WORKS    64
+
+// One CPU's share of a queue. The list and `sleeping` are under `lock`,
+// the counters after `queued` only change in the worker.
+typedef struct {
+	spinlock_t lock;
+	work_struct* head;
+	work_struct* tail;
+	Scheduler::Thread* worker;
+	bool sleeping;
+	uint32_t cpu;
+
+	uint64_t queued;
+	uint64_t executed;
+	uint64_t batches;
+	uint64_t largest;
+} Pool;
+
+struct workqueue_struct {
+	char name[16];
+	uint8_t priority;
+	uint32_t fallback;              // a CPU with a pool, for CPUs without one
+	Pool* pools[SMP_MAX_CPUS];
+	workqueue_struct* next;
+};
+
+workqueue_struct* system_wq = nullptr;
+
+static DEFINE_LOCK_CLASS(poolClass, "workqueue");
+static DEFINE_LOCK_CLASS(queuesClass, "workqueues");
+static spinlock_t queuesLock = SPINLOCK_INIT_CLASS(queuesClass);
+static workqueue_struct* queues = nullptr;
+
+// Sleeps until there's something, then takes all of it in one go
+static void Worker(void* arg) {
+	Pool* pool = (Pool*)arg;
+	while (true) {
+		uint64_t flags = spin_lock_irqsave(&pool->lock);
+		work_struct* batch = pool->head;
+		if (!batch) {
+			Scheduler::PrepareToBlock();
+			pool->sleeping = true;
+			spin_unlock_irqrestore(&pool->lock, flags);
+			Scheduler::Block();
+			continue;
+		}
+		pool->head = pool->tail = nullptr;
+		spin_unlock_irqrestore(&pool->lock, flags);
+
+		uint64_t count = 0;
+		while (batch) {
+			work_struct* next = batch->next;
+			// Cleared first so the function can queue itself again
+			__atomic_store_n(&batch->pending, 0, __ATOMIC_RELEASE);
+			batch->func(batch);
+			batch = next;
+			count++;
+		}
+		pool->executed += count;
+		pool->batches++;
+		if (count > pool->largest) pool->largest = count;
+	}
+}
+
+static void Append(Pool* pool, work_struct* work) {
+	uint64_t flags = spin_lock_irqsave(&pool->lock);
+	work->next = nullptr;
+	if (pool->tail) pool->tail->next = work;
+	else pool->head = work;
+	pool->tail = work;
+	pool->queued++;
+
+	// Only the first one in wakes the worker, the rest join its batch
+	if (pool->sleeping) {
+		pool->sleeping = false;
+		Scheduler::Wake(pool->worker);
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+static inline Pool* PoolFor(workqueue_struct* wq, uint32_t cpu) {
+	Pool* pool = cpu < SMP_MAX_CPUS ? wq->pools[cpu] : nullptr;
+	return pool ? pool : wq->pools[wq->fallback];
+}
+
+workqueue_struct* alloc_workqueue(const char* name, uint8_t priority) {
+	if (!Scheduler::IsInitialized()) {
+		prErr("workqueue", "Needs the scheduler for %s", name);
+		return nullptr;
+	}
+
+	workqueue_struct* wq = (workqueue_struct*)Heap::Allocate(sizeof(workqueue_struct));
+	if (!wq) return nullptr;
+	memset(wq, 0, sizeof(workqueue_struct));
+	uint32_t length = 0;
+	for (; name[length] && length < sizeof(wq->name) - 1; length++) wq->name[length] = name[length];
+	wq->name[length] = 0;
+	wq->priority = priority;
+
+	uint64_t online = Scheduler::OnlineMask();
+	uint32_t workers = 0;
+	for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (!(online & (1ULL << cpu))) continue;
+		Pool* pool = (Pool*)Heap::Allocate(sizeof(Pool));
+		if (!pool) break;
+		memset(pool, 0, sizeof(Pool));
+		spin_lock_init(&pool->lock, &poolClass);
+		pool->cpu = cpu;
+
+		// "name/cpu", cut short to fit
+		char thread[16];
+		uint32_t i = 0;
+		for (; wq->name[i] && i < sizeof(thread) - 4; i++) thread[i] = wq->name[i];
+		thread[i++] = '/';
+		if (cpu >= 10) thread[i++] = '0' + cpu / 10;
+		thread[i++] = '0' + cpu % 10;
+		thread[i] = 0;
+
+		pool->worker = Scheduler::Create(thread, Worker, pool, priority, 1ULL << cpu);
+		if (!pool->worker) {
+			Heap::Free(pool);
+			continue;
+		}
+		if (!workers) wq->fallback = cpu;
+		wq->pools[cpu] = pool;
+		workers++;
+	}
+	if (!workers) {
+		prErr("workqueue", "No workers for %s", wq->name);
+		Heap::Free(wq);
+		return nullptr;
+	}
+
+	uint64_t flags = spin_lock_irqsave(&queuesLock);
+	wq->next = queues;
+	queues = wq;
+	spin_unlock_irqrestore(&queuesLock, flags);
+	return wq;
+}
+
+bool queue_work_on(uint32_t cpu, workqueue_struct* wq, work_struct* work) {
+	if (!wq) return false;
+	if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL)) return false;
+	Append(PoolFor(wq, cpu), work);
+	return true;
+}
+
+bool queue_work(workqueue_struct* wq, work_struct* work) {
+	return queue_work_on(this_cpu_id(), wq, work);
+}
+
+// Goes in behind everything already queued on a pool. On the flusher's
+// stack, complete() is finished with it by the time the flusher returns.
+typedef struct {
+	work_struct work;
+	completion_t done;
+} Barrier;
+
+static void BarrierReached(work_struct* work) {
+	complete(&((Barrier*)work)->done);
+}
+
+void flush_workqueue(workqueue_struct* wq) {
+	if (!wq) return;
+	for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		Pool* pool = wq->pools[cpu];
+		if (!pool) continue;
+
+		Barrier barrier;
+		init_work(&barrier.work, BarrierReached);
+		init_completion(&barrier.done);
+		barrier.work.pending = 1;
+		Append(pool, &barrier.work);
+		wait_for_completion(&barrier.done);
+	}
+}
+
+namespace Workqueue {
+	bool Initialize() {
+		system_wq = alloc_workqueue("events");
+		if (!system_wq) return false;
+		uint32_t workers = 0;
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) if (system_wq->pools[cpu]) workers++;
+		prInfo("workqueue", "events: %d per-CPU workers", workers);
+		return true;
+	}
+
+	void PrintStats() {
+		kprintf("  queue            cpu  queued    run       batches   largest\n");
+		uint64_t flags = spin_lock_irqsave(&queuesLock);
+		for (workqueue_struct* wq = queues; wq; wq = wq->next) {
+			for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+				Pool* pool = wq->pools[cpu];
+				if (!pool) continue;
+				kprintf("  %-16s %-4d %-9u %-9u %-9u %u\n", wq->name, cpu, (unsigned int)pool->queued,
+					(unsigned int)pool->executed, (unsigned int)pool->batches, (unsigned int)pool->largest);
+			}
+		}
+		spin_unlock_irqrestore(&queuesLock, flags);
+	}
+
+	struct TestWork {
+		work_struct work;
+		uint32_t index;
+		uint32_t target;
+		volatile uint32_t cpu;
+		uint64_t queuedAt;
+	};
+
+	static TestWork works[WORKQUEUE_TEST_WORKS];
+	static volatile uint32_t ran;
+	static volatile uint32_t outOfOrder;
+	static volatile uint64_t latency;
+	static uint32_t lastIndex[SMP_MAX_CPUS];
+
+	static void TestFunc(work_struct* work) {
+		TestWork* test = (TestWork*)work;
+		uint32_t cpu = this_cpu_id();
+		test->cpu = cpu;
+		// Each CPU's share was queued in index order
+		if (cpu < SMP_MAX_CPUS) {
+			if (lastIndex[cpu] != 0xFFFFFFFF && test->index < lastIndex[cpu]) outOfOrder++;
+			lastIndex[cpu] = test->index;
+		}
+		__atomic_fetch_add(&latency, ClockMonotonicNs() - test->queuedAt, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ran, 1, __ATOMIC_RELEASE);
+	}
+
+	bool SelfTest() {
+		if (!system_wq) {
+			prErr("workqueue", "No system workqueue");
+			return false;
+		}
+
+		bool passed = true;
+		uint32_t cpus[SMP_MAX_CPUS];
+		uint32_t count = 0;
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			lastIndex[cpu] = 0xFFFFFFFF;
+			if (system_wq->pools[cpu]) cpus[count++] = cpu;
+		}
+		ran = 0;
+		outOfOrder = 0;
+		latency = 0;
+
+		// Queued with interrupts off, so this CPU's worker can't start
+		// before its whole share is in: that share has to run as one batch
+		uint64_t flags;
+		asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+		uint32_t self = this_cpu_id();
+		Pool* local = system_wq->pools[self];
+		uint64_t localBatches = local ? local->batches : 0;
+		uint32_t localWorks = 0;
+		for (uint32_t i = 0; i < WORKQUEUE_TEST_WORKS; i++) {
+			TestWork* test = &works[i];
+			init_work(&test->work, TestFunc);
+			test->index = i;
+			test->target = cpus[i % count];
+			test->cpu = 0xFFFFFFFF;
+			test->queuedAt = ClockMonotonicNs();
+			if (!queue_work_on(test->target, system_wq, &test->work)) passed = false;
+			if (test->target == self) localWorks++;
+		}
+		bool requeued = queue_work_on(works[0].target, system_wq, &works[0].work);
+		if (flags & 0x200) asm volatile("sti" ::: "memory");
+		if (requeued) {
+			prErr("workqueue", "Pending work was queued twice");
+			passed = false;
+		}
+
+		flush_workqueue(system_wq);
+		if (ran != WORKQUEUE_TEST_WORKS) {
+			prErr("workqueue", "%d of %d works ran by the flush", ran, WORKQUEUE_TEST_WORKS);
+			return false;
+		}
+		for (uint32_t i = 0; i < WORKQUEUE_TEST_WORKS; i++) {
+			if (works[i].cpu != works[i].target) {
+				prErr("workqueue", "Work for CPU %d ran on %d", works[i].target, works[i].cpu);
+				passed = false;
+				break;
+			}
+		}
+		if (outOfOrder) {
+			prErr("workqueue", "%d works ran ahead of earlier ones", outOfOrder);
+			passed = false;
+		}
+		// The flush's barrier may have made a batch of its own
+		uint64_t batches = local ? local->batches - localBatches : 0;
+		if (localWorks && batches > 2) {
+			prErr("workqueue", "%d works queued together took %d batches", localWorks, (unsigned int)batches);
+			passed = false;
+		}
+
+		prInfo("workqueue", "%d works on %d CPUs, %d batches here, %dus queue to run", WORKQUEUE_TEST_WORKS,
+			count, (unsigned int)batches, (unsigned int)(latency / WORKQUEUE_TEST_WORKS / 1000));
+		return passed;
+	}
+}
@@ -0,0 +1,163 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Futex.cpp
+// Purpose: Sleeping on a word in memory, for userland locks
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sync/Futex.hpp>
+#include <Memory/Paging.hpp>
+#include <Inferno/errno.h>
+#include <Inferno/Log.h>
+
+// Everything below this is the lower half ring 3 may hand us
+#define FUTEX_USER_TOP          0x0000800000000000ULL
+
+typedef struct {
+	int64_t seconds;
+	int64_t nanoseconds;
+} futex_timespec;
+
+// Waiters hash by the word's physical address, so every mapping of a
+// page meets on the same futex. Each entry is keyed by it too, a wake
+// only takes the waiters on its own word out of a shared bucket.
+static wait_queue_head_t buckets[FUTEX_HASH_BUCKETS];
+
+static volatile uint64_t waits = 0;
+static volatile uint64_t wakes = 0;
+static volatile uint64_t woken = 0;
+static volatile uint64_t timeouts = 0;
+static volatile uint64_t mismatches = 0;
+
+static uint64_t KeyOf(volatile uint32_t* addr) {
+	if (!Paging::IsEnabled()) return (uint64_t)addr;
+	return Paging::GetPhysicalAddress((uint64_t)addr);
+}
+
+static inline wait_queue_head_t* BucketOf(uint64_t key) {
+	return &buckets[((key >> 2) * 0x9E3779B97F4A7C15ULL) >> (64 - 6)];
+}
+
+static_assert(FUTEX_HASH_BUCKETS == 64, "BucketOf takes the top 6 bits");
+
+namespace Futex {
+	int64_t Wait(volatile uint32_t* addr, uint32_t value, uint64_t ns) {
+		uint64_t key = KeyOf(addr);
+		if (!key) return -EFAULT;
+		__atomic_fetch_add(&waits, 1, __ATOMIC_RELAXED);
+		// Saturating, a deadline past the end of the clock is no deadline
+		uint64_t now = ClockMonotonicNs();
+		uint64_t deadline = ns >= WAIT_FOREVER - now ? WAIT_FOREVER : now + ns;
+
+		if (!Scheduler::CanBlock()) {
+			// Nobody can wake us, go by the word alone
+			if (*addr != value) {
+				__atomic_fetch_add(&mismatches, 1, __ATOMIC_RELAXED);
+				return -EAGAIN;
+			}
+			while (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == value) {
+				if (deadline != WAIT_FOREVER && ClockMonotonicNs() >= deadline) {
+					__atomic_fetch_add(&timeouts, 1, __ATOMIC_RELAXED);
+					return -ETIMEDOUT;
+				}
+				asm volatile("pause");
+			}
+			return 0;
+		}
+
+		wait_queue_head_t* bucket = BucketOf(key);
+		wait_queue_entry entry;
+		init_wait_entry(&entry, true, (const void*)key);
+
+		// The value is checked with the bucket locked, so a waker that
+		// changed it either came before and we don't sleep, or comes after
+		// and finds us queued and counts us
+		uint64_t flags = spin_lock_irqsave(&bucket->lock);
+		if (__atomic_load_n(addr, __ATOMIC_RELAXED) != value) {
+			spin_unlock_irqrestore(&bucket->lock, flags);
+			__atomic_fetch_add(&mismatches, 1, __ATOMIC_RELAXED);
+			return -EAGAIN;
+		}
+		__add_wait_queue(bucket, &entry);
+		Scheduler::PrepareToBlock();
+		spin_unlock_irqrestore(&bucket->lock, flags);
+
+		// Only a Wake on this word ends it, anything else that woke the
+		// thread puts it back to sleep
+		while (!__atomic_load_n(&entry.woken, __ATOMIC_ACQUIRE)) {
+			if (deadline == WAIT_FOREVER) {
+				Scheduler::Block();
+			} else {
+				uint64_t now = ClockMonotonicNs();
+				if (now >= deadline) break;
+				Scheduler::BlockTimeout(deadline - now);
+			}
+			if (__atomic_load_n(&entry.woken, __ATOMIC_ACQUIRE)) break;
+			Scheduler::PrepareToBlock();
+		}
+
+		if (finish_wait(bucket, &entry)) return 0;
+		__atomic_fetch_add(&timeouts, 1, __ATOMIC_RELAXED);
+		return -ETIMEDOUT;
+	}
+
+	int64_t Wake(volatile uint32_t* addr, uint32_t count) {
+		uint64_t key = KeyOf(addr);
+		if (!key) return -EFAULT;
+		__atomic_fetch_add(&wakes, 1, __ATOMIC_RELAXED);
+		if (!count) return 0;
+		// Always through the lock: a waiter reads the word before it queues,
+		// so an empty bucket seen without it proves nothing
+		wait_queue_head_t* bucket = BucketOf(key);
+		uint64_t flags = spin_lock_irqsave(&bucket->lock);
+		uint32_t wokenNow = __wake_up_locked(bucket, (const void*)key, count);
+		spin_unlock_irqrestore(&bucket->lock, flags);
+		__atomic_fetch_add(&woken, wokenNow, __ATOMIC_RELAXED);
+		return wokenNow;
+	}
+
+	uint64_t Syscall(uint64_t uaddr, uint64_t op, uint64_t value, uint64_t timeout, uint64_t, uint64_t) {
+		if (uaddr & 3) return -EINVAL;
+		if (!uaddr || uaddr >= FUTEX_USER_TOP || !KeyOf((volatile uint32_t*)uaddr)) return -EFAULT;
+
+		switch (op & FUTEX_CMD_MASK) {
+		case FUTEX_WAIT: {
+			uint64_t ns = WAIT_FOREVER;
+			if (timeout) {
+				if (timeout >= FUTEX_USER_TOP || !Paging::GetPhysicalAddress(timeout)) return -EFAULT;
+				futex_timespec* ts = (futex_timespec*)timeout;
+				if (ts->seconds < 0 || ts->nanoseconds < 0 || ts->nanoseconds >= 1000000000) return -EINVAL;
+				// Anything that would run past the end of the clock waits forever
+				if ((uint64_t)ts->seconds <= (WAIT_FOREVER - ClockMonotonicNs()) / 1000000000ULL) {
+					ns = (uint64_t)ts->seconds * 1000000000ULL;
+					ns = (uint64_t)ts->nanoseconds >= WAIT_FOREVER - ns ? WAIT_FOREVER : ns + ts->nanoseconds;
+				}
+			}
+
+			// The syscall frame is on the thread's own stack and the
+			// scheduler carries its SYSCALL state, it can wake anywhere
+			return Wait((volatile uint32_t*)uaddr, (uint32_t)value, ns);
+		}
+		case FUTEX_WAKE:
+			return Wake((volatile uint32_t*)uaddr, (uint32_t)value);
+		default:
+			return -ENOSYS;
+		}
+	}
+
+	void PrintStats() {
+		kprintf("  %u waits, %u wakes waking %u, %u timed out, %u found the value changed\n",
+			(unsigned int)waits, (unsigned int)wakes, (unsigned int)woken, (unsigned int)timeouts,
+			(unsigned int)mismatches);
+		for (uint32_t i = 0; i < FUTEX_HASH_BUCKETS; i++) {
+			wait_queue_head_t* bucket = &buckets[i];
+			if (!waitqueue_active(bucket)) continue;
+			uint32_t sleepers = 0;
+			uint64_t flags = spin_lock_irqsave(&bucket->lock);
+			for (wait_queue_entry* entry = bucket->head; entry; entry = entry->next) sleepers++;
+			spin_unlock_irqrestore(&bucket->lock, flags);
+			kprintf("  bucket %-3d %d asleep\n", i, sleepers);
+		}
+	}
+}
@@ -0,0 +1,284 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: LockStat.cpp
+// Purpose: Per-class lock contention statistics
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sync/LockStat.hpp>
+#include <Sync/Spinlock.hpp>
+#include <Sync/MCSLock.hpp>
+#include <Sync/RWLock.hpp>
+#include <CPU/PerCPU.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/APICTimer.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Inferno/Log.h>
+
+#define LOCKSTAT_MAX_PRINT      64
+#define LOCKTEST_ROUNDS         20000
+
+namespace LockStat {
+	volatile bool enabled = false;
+
+	// Pushed on first use and never taken off, so walking it needs no lock
+	static lock_class_t* volatile classes = nullptr;
+
+	static void Register(lock_class_t* cls) {
+		if (__atomic_exchange_n(&cls->registered, 1, __ATOMIC_ACQ_REL)) return;
+		lock_class_t* head = __atomic_load_n(&classes, __ATOMIC_RELAXED);
+		do {
+			cls->next = head;
+		} while (!__atomic_compare_exchange_n(&classes, &head, cls, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	static inline void StoreMax(volatile uint64_t* max, uint64_t value) {
+		uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+		while (value > current &&
+		       !__atomic_compare_exchange_n(max, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	uint64_t Acquired(lock_class_t* cls, bool contended, uint64_t waitStart) {
+		uint64_t now = Now();
+		if (!cls->registered) Register(cls);
+		__atomic_fetch_add(&cls->acquisitions, 1, __ATOMIC_RELAXED);
+		if (contended) {
+			uint64_t wait = now - waitStart;
+			__atomic_fetch_add(&cls->contentions, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&cls->waitCycles, wait, __ATOMIC_RELAXED);
+			StoreMax(&cls->maxWait, wait);
+		}
+		return now ? now : 1;
+	}
+
+	void Released(lock_class_t* cls, uint64_t acquiredAt) {
+		uint64_t hold = Now() - acquiredAt;
+		__atomic_fetch_add(&cls->holdCycles, hold, __ATOMIC_RELAXED);
+		StoreMax(&cls->maxHold, hold);
+	}
+
+	void SetEnabled(bool on) {
+		__atomic_store_n(&enabled, on, __ATOMIC_RELEASE);
+	}
+
+	bool IsEnabled() {
+		return enabled;
+	}
+
+	// Racing acquisitions on other CPUs may land either side of it
+	void Reset() {
+		for (lock_class_t* cls = classes; cls; cls = cls->next) {
+			cls->acquisitions = 0;
+			cls->contentions = 0;
+			cls->waitCycles = 0;
+			cls->maxWait = 0;
+			cls->holdCycles = 0;
+			cls->maxHold = 0;
+		}
+	}
+
+	static uint64_t CyclesPerUs() {
+		uint64_t frequency = APICTimer::GetTSCFrequency();
+		if (!frequency && Clock::GetSource() == Clock::Source::TSC) frequency = Clock::GetFrequency();
+		return frequency / 1000000;
+	}
+
+	void Print() {
+		lock_class_t* sorted[LOCKSTAT_MAX_PRINT];
+		uint32_t count = 0;
+		for (lock_class_t* cls = classes; cls && count < LOCKSTAT_MAX_PRINT; cls = cls->next) {
+			uint32_t i = count++;
+			for (; i > 0 && sorted[i - 1]->contentions < cls->contentions; i--) sorted[i] = sorted[i - 1];
+			sorted[i] = cls;
+		}
+
+		uint64_t perUs = CyclesPerUs();
+		const char* unit = perUs ? "ns" : "cycles";
+		kprintf("  lockstat is %s, times in %s\n", enabled ? "on" : "off", unit);
+		kprintf("  class            acquired   contended  %%     avg wait  max wait   avg hold  max hold\n");
+		for (uint32_t i = 0; i < count; i++) {
+			lock_class_t* cls = sorted[i];
+			uint64_t acquisitions = cls->acquisitions;
+			uint64_t contentions = cls->contentions;
+			uint64_t avgWait = contentions ? cls->waitCycles / contentions : 0;
+			uint64_t avgHold = acquisitions ? cls->holdCycles / acquisitions : 0;
+			uint64_t maxWait = cls->maxWait;
+			uint64_t maxHold = cls->maxHold;
+			if (perUs) {
+				avgWait = avgWait * 1000 / perUs;
+				maxWait = maxWait * 1000 / perUs;
+				avgHold = avgHold * 1000 / perUs;
+				maxHold = maxHold * 1000 / perUs;
+			}
+			uint32_t percent = acquisitions ? (uint32_t)(contentions * 100 / acquisitions) : 0;
+			kprintf("  %-16s %-10u %-10u %-5u %-9u %-10u %-9u %u\n", cls->name, (unsigned int)acquisitions,
+				(unsigned int)contentions, percent, (unsigned int)avgWait, (unsigned int)maxWait,
+				(unsigned int)avgHold, (unsigned int)maxHold);
+		}
+		if (!count) kprintf("  no lock has been taken with lockstat on\n");
+	}
+
+	// Every online CPU runs one pinned thread through the same critical
+	// section. `inside` catches two holders at once, `counter` is bumped
+	// with a plain read and write that a lost update would show up in.
+	enum class TestKind { Ticket, MCS, RW };
+
+	static DEFINE_LOCK_CLASS(testTicketClass, "test/ticket");
+	static DEFINE_LOCK_CLASS(testMCSClass, "test/mcs");
+	static DEFINE_LOCK_CLASS(testRWClass, "test/rwlock");
+
+	static spinlock_t testTicket = SPINLOCK_INIT_CLASS(testTicketClass);
+	static mcs_lock_t testMCS = MCS_LOCK_INIT_CLASS(testMCSClass);
+	static rwlock_t testRW = RWLOCK_INIT_CLASS(testRWClass);
+
+	static TestKind testKind;
+	static volatile uint64_t counter;
+	static volatile uint32_t inside;
+	static volatile uint32_t readers;
+	static volatile uint32_t overlaps;
+	static volatile uint32_t started;
+	static volatile uint32_t done;
+	static volatile bool go;
+
+	static inline void Critical() {
+		if (__atomic_fetch_add(&inside, 1, __ATOMIC_RELAXED)) __atomic_fetch_add(&overlaps, 1, __ATOMIC_RELAXED);
+		uint64_t value = counter;
+		for (int i = 0; i < 8; i++) asm volatile("pause");
+		counter = value + 1;
+		__atomic_fetch_sub(&inside, 1, __ATOMIC_RELAXED);
+	}
+
+	static void TestWorker(void*) {
+		__atomic_fetch_add(&started, 1, __ATOMIC_RELEASE);
+		while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE)) asm volatile("pause");
+
+		for (uint32_t round = 0; round < LOCKTEST_ROUNDS; round++) {
+			switch (testKind) {
+				case TestKind::Ticket: {
+					spin_lock(&testTicket);
+					Critical();
+					spin_unlock(&testTicket);
+					break;
+				}
+				case TestKind::MCS: {
+					mcs_node_t node;
+					mcs_lock(&testMCS, &node);
+					Critical();
+					mcs_unlock(&testMCS, &node);
+					break;
+				}
+				case TestKind::RW: {
+					// One write in eight, readers check none is in progress
+					if (round % 8 == 0) {
+						write_lock(&testRW);
+						if (readers) __atomic_fetch_add(&overlaps, 1, __ATOMIC_RELAXED);
+						Critical();
+						write_unlock(&testRW);
+					} else {
+						read_lock(&testRW);
+						__atomic_fetch_add(&readers, 1, __ATOMIC_RELAXED);
+						if (inside) __atomic_fetch_add(&overlaps, 1, __ATOMIC_RELAXED);
+						for (int i = 0; i < 8; i++) asm volatile("pause");
+						__atomic_fetch_sub(&readers, 1, __ATOMIC_RELAXED);
+						read_unlock(&testRW);
+					}
+					break;
+				}
+			}
+		}
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	static bool RunTest(TestKind kind, const char* name, lock_class_t* cls, uint64_t online, uint32_t cpus) {
+		testKind = kind;
+		counter = 0;
+		inside = 0;
+		readers = 0;
+		overlaps = 0;
+		started = 0;
+		done = 0;
+		go = false;
+
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (online & (1ULL << cpu)) Scheduler::Create("test/lock", TestWorker, nullptr, SCHED_PRIORITY_NORMAL, 1ULL << cpu);
+		}
+		uint64_t deadline = ClockMonotonicNs() + 1000000000ULL;
+		while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < cpus && ClockMonotonicNs() < deadline) Scheduler::Sleep(1000000);
+
+		uint64_t start = ClockMonotonicNs();
+		__atomic_store_n(&go, true, __ATOMIC_RELEASE);
+		deadline = start + 10000000000ULL;
+		while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < started && ClockMonotonicNs() < deadline) Scheduler::Sleep(1000000);
+		uint64_t elapsed = ClockMonotonicNs() - start;
+
+		bool passed = true;
+		uint32_t threads = started;
+		uint64_t writes = kind == TestKind::RW ? (uint64_t)threads * ((LOCKTEST_ROUNDS + 7) / 8)
+		                                       : (uint64_t)threads * LOCKTEST_ROUNDS;
+		if (done != threads) {
+			prErr("lock", "%s: %d of %d threads finished", name, done, threads);
+			return false;
+		}
+		if (overlaps || counter != writes) {
+			prErr("lock", "%s: %d overlapping holders, %d of %d updates", name, overlaps,
+				(unsigned int)counter, (unsigned int)writes);
+			passed = false;
+		}
+		uint64_t acquisitions = (uint64_t)threads * LOCKTEST_ROUNDS;
+		if (cls->acquisitions != acquisitions) {
+			prErr("lock", "%s: lockstat counted %d of %d acquisitions", name,
+				(unsigned int)cls->acquisitions, (unsigned int)acquisitions);
+			passed = false;
+		}
+		prInfo("lock", "%s: %d CPUs, %dns per acquisition, %d%% contended", name, threads,
+			(unsigned int)(elapsed / acquisitions), (unsigned int)(cls->contentions * 100 / acquisitions));
+		return passed;
+	}
+
+	bool SelfTest() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("lock", "Needs the scheduler");
+			return false;
+		}
+
+		bool wasEnabled = enabled;
+		SetEnabled(true);
+		lock_class_t* tests[] = { &testTicketClass, &testMCSClass, &testRWClass };
+		for (lock_class_t* cls : tests) {
+			cls->acquisitions = cls->contentions = cls->waitCycles = 0;
+			cls->maxWait = cls->holdCycles = cls->maxHold = 0;
+		}
+
+		uint64_t online = Scheduler::OnlineMask();
+		uint32_t cpus = 0;
+		for (uint64_t mask = online; mask; mask &= mask - 1) cpus++;
+
+		bool passed = true;
+		if (!RunTest(TestKind::Ticket, "ticket", &testTicketClass, online, cpus)) passed = false;
+		if (!RunTest(TestKind::MCS, "mcs", &testMCSClass, online, cpus)) passed = false;
+		if (!RunTest(TestKind::RW, "rwlock", &testRWClass, online, cpus)) passed = false;
+
+		// The trylocks fail while held and leave the lock as it was
+		spin_lock(&testTicket);
+		if (spin_trylock(&testTicket)) passed = false;
+		spin_unlock(&testTicket);
+		if (spin_is_locked(&testTicket)) passed = false;
+		mcs_node_t node, other;
+		mcs_lock(&testMCS, &node);
+		if (mcs_trylock(&testMCS, &other)) passed = false;
+		mcs_unlock(&testMCS, &node);
+		read_lock(&testRW);
+		if (write_trylock(&testRW) || !read_trylock(&testRW)) passed = false;
+		read_unlock(&testRW);
+		read_unlock(&testRW);
+		bool written = write_trylock(&testRW);
+		if (!written || read_trylock(&testRW)) passed = false;
+		if (written) write_unlock(&testRW);
+		if (testRW.value || mcs_is_locked(&testMCS)) passed = false;
+
+		SetEnabled(wasEnabled);
+		return passed;
+	}
+}
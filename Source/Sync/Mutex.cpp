@@ -0,0 +1,63 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: Mutex.cpp
+// Purpose: Sleeping locks for threads
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sync/Mutex.hpp>
+
+// How long a waiter spins on a holder that's running before it sleeps.
+// Most holds are short, and a switch costs more than this.
+#define MUTEX_SPIN_LOOPS        512
+
+// Takes the lock as the last owner lets go, unless the owner stops
+// running. The owner may be gone by the time we look, its Thread is only
+// heap memory that stays mapped, and the state is checked again anyway.
+static bool SpinOnOwner(mutex_t* mutex) {
+	for (uint32_t i = 0; i < MUTEX_SPIN_LOOPS; i++) {
+		uint32_t state = __atomic_load_n(&mutex->state, __ATOMIC_RELAXED);
+		if (state == MUTEX_UNLOCKED) {
+			if (__atomic_compare_exchange_n(&mutex->state, &state, MUTEX_LOCKED, false,
+			                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+		} else if (state == MUTEX_CONTENDED) {
+			// Others are asleep on it already, don't jump the queue
+			return false;
+		} else {
+			Scheduler::Thread* owner = mutex->owner;
+			if (owner && !owner->onCPU) return false;
+		}
+		asm volatile("pause");
+	}
+	return false;
+}
+
+// Marks the lock contended whether or not it gets it, so the unlock that
+// lets go of it next knows to wake someone
+static inline bool TakeContended(mutex_t* mutex) {
+	return __atomic_exchange_n(&mutex->state, MUTEX_CONTENDED, __ATOMIC_ACQUIRE) == MUTEX_UNLOCKED;
+}
+
+static inline void Acquired(mutex_t* mutex, uint64_t waitStart) {
+	mutex->owner = Scheduler::Current();
+	if (waitStart) mutex->acquiredAt = LockStat::Acquired(mutex->lockClass, true, waitStart);
+}
+
+void mutex_lock_slow(mutex_t* mutex) {
+	uint64_t waitStart = LockStat::enabled && mutex->lockClass ? LockStat::Now() : 0;
+	if (!SpinOnOwner(mutex)) wait_event_exclusive(&mutex->wait, [mutex] { return TakeContended(mutex); });
+	Acquired(mutex, waitStart);
+}
+
+bool mutex_lock_timeout_slow(mutex_t* mutex, uint64_t ns) {
+	uint64_t waitStart = LockStat::enabled && mutex->lockClass ? LockStat::Now() : 0;
+	if (!SpinOnOwner(mutex) &&
+	    !wait_event_exclusive_timeout(&mutex->wait, [mutex] { return TakeContended(mutex); }, ns)) return false;
+	Acquired(mutex, waitStart);
+	return true;
+}
+
+void mutex_wake(mutex_t* mutex) {
+	wake_up(&mutex->wait);
+}
@@ -0,0 +1,448 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: QueueTest.cpp
+// Purpose: Stress tests and benchmarks for SpscRing and MpscQueue
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sync/QueueTest.hpp>
+#include <Sync/SpscRing.hpp>
+#include <Sync/MpscQueue.hpp>
+#include <Sync/Spinlock.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Inferno/Log.h>
+
+#define QUEUETEST_SPSC_ITEMS    1000000
+#define QUEUETEST_SPSC_SLOTS    256
+#define QUEUETEST_MPSC_ITEMS    200000      // per producer
+#define QUEUETEST_PRODUCERS     16
+#define QUEUETEST_NODES         128         // per producer, handed back by the consumer
+#define QUEUETEST_MAX_BATCH     32
+#define QUEUETEST_TIMEOUT_NS    10000000000ULL
+
+namespace QueueTest {
+	typedef struct TestItem {
+		struct TestItem* next;
+		uint32_t producer;
+		uint32_t sequence;
+	} TestItem;
+
+	// Each MPSC producer owns a fixed set of items. The consumer returns
+	// them through a ring of their own, so the stress test runs both kinds
+	// of queue at once and nothing is allocated while it does.
+	typedef struct {
+		SpscRing<TestItem*, QUEUETEST_NODES> free;
+		TestItem items[QUEUETEST_NODES];
+		uint32_t expected;          // next sequence the consumer should see
+	} Producer;
+
+	enum class MpscMode { Single, Batch, Mixed, Spinlock };
+
+	static SpscRing<uint64_t, QUEUETEST_SPSC_SLOTS> ring;
+	static uint32_t spscBatch;      // 0 varies it
+	static uint64_t spscReceived;
+
+	static MpscQueue<TestItem> mpsc;
+	static Producer producers[QUEUETEST_PRODUCERS];
+	static uint32_t producerCount;
+	static MpscMode mpscMode;
+	static uint64_t mpscReceived;
+
+	// What the lock-free queue is up against in the benchmark
+	static spinlock_t listLock = SPINLOCK_INIT;
+	static TestItem* listHead;
+	static TestItem* listTail;
+
+	static volatile uint32_t errors;
+	static volatile uint32_t started;
+	static volatile uint32_t done;
+	static volatile uint64_t finishedAt;
+	static volatile bool go;
+	static volatile bool stop;
+
+	static void WaitForGo() {
+		__atomic_fetch_add(&started, 1, __ATOMIC_RELEASE);
+		while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE)) asm volatile("pause");
+	}
+
+	static void Finish() {
+		uint64_t now = ClockMonotonicNs();
+		uint64_t seen = __atomic_load_n(&finishedAt, __ATOMIC_RELAXED);
+		while (now > seen && !__atomic_compare_exchange_n(&finishedAt, &seen, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	// Spinning on a full or empty queue. Every so often give the CPU up
+	// in case the other side is waiting for it.
+	static inline void Backoff(uint32_t* idle) {
+		if (++*idle % 256 == 0) Scheduler::Yield();
+		else asm volatile("pause");
+	}
+
+	// Starts thread i on CPU cpus[i], lets them all go at once and waits.
+	// Returns ns from the start to the last one finishing, 0 if they ran
+	// out of time.
+	static uint64_t RunThreads(uint32_t count, const Scheduler::Entry* entries, void* const* args, const uint32_t* cpus) {
+		errors = 0;
+		started = 0;
+		done = 0;
+		finishedAt = 0;
+		go = false;
+		stop = false;
+
+		for (uint32_t i = 0; i < count; i++) Scheduler::Create("test/queue", entries[i], args[i], SCHED_PRIORITY_NORMAL, 1ULL << cpus[i]);
+		uint64_t deadline = ClockMonotonicNs() + 1000000000ULL;
+		while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < count && ClockMonotonicNs() < deadline) Scheduler::Sleep(1000000);
+
+		uint64_t start = ClockMonotonicNs();
+		__atomic_store_n(&go, true, __ATOMIC_RELEASE);
+		deadline = start + QUEUETEST_TIMEOUT_NS;
+		while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < count && ClockMonotonicNs() < deadline) Scheduler::Sleep(1000000);
+		if (done == count) return finishedAt > start ? finishedAt - start : 1;
+
+		// The next run reuses everything they touch, so they have to be gone
+		__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < __atomic_load_n(&started, __ATOMIC_ACQUIRE)) Scheduler::Sleep(1000000);
+		prErr("queue", "%d of %d threads finished in time", done, count);
+		return 0;
+	}
+
+	// The first online CPU consumes, producers go round the rest, or share
+	// it when it's the only one
+	static uint32_t PickCPUs(uint32_t* cpus, uint32_t producersWanted) {
+		uint64_t online = Scheduler::OnlineMask();
+		uint32_t consumer = __builtin_ctzll(online);
+		uint64_t others = online & ~(1ULL << consumer);
+		cpus[0] = consumer;
+		uint64_t mask = others;
+		for (uint32_t i = 1; i <= producersWanted; i++) {
+			if (!others) {
+				cpus[i] = consumer;
+				continue;
+			}
+			if (!mask) mask = others;
+			cpus[i] = __builtin_ctzll(mask);
+			mask &= mask - 1;
+		}
+		return producersWanted + 1;
+	}
+
+	static void SpscProducer(void*) {
+		WaitForGo();
+		uint64_t values[QUEUETEST_MAX_BATCH];
+		uint64_t next = 0;
+		uint32_t idle = 0, round = 0;
+		while (next < QUEUETEST_SPSC_ITEMS && !stop) {
+			uint32_t want = spscBatch ? spscBatch : round++ % 13 + 1;
+			if (want > QUEUETEST_SPSC_ITEMS - next) want = QUEUETEST_SPSC_ITEMS - next;
+			for (uint32_t i = 0; i < want; i++) values[i] = next + i;
+			uint32_t pushed = want == 1 ? ring.Push(values[0]) : ring.PushBatch(values, want);
+			if (!pushed) {
+				Backoff(&idle);
+				continue;
+			}
+			next += pushed;
+		}
+		Finish();
+	}
+
+	static void SpscConsumer(void*) {
+		WaitForGo();
+		uint64_t values[QUEUETEST_MAX_BATCH];
+		uint64_t expected = 0, received = 0;
+		uint32_t idle = 0, round = 0;
+		while (received < QUEUETEST_SPSC_ITEMS && !stop) {
+			uint32_t want = spscBatch ? spscBatch : round++ % 17 + 1;
+			uint32_t popped = want == 1 ? ring.Pop(values[0]) : ring.PopBatch(values, want);
+			if (!popped) {
+				Backoff(&idle);
+				continue;
+			}
+			for (uint32_t i = 0; i < popped; i++) {
+				if (values[i] != expected) __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+				expected = values[i] + 1;
+			}
+			received += popped;
+		}
+		spscReceived = received;
+		Finish();
+	}
+
+	// 0 on failure
+	static uint64_t RunSpsc(uint32_t batch, const char* name) {
+		ring.Reset();
+		spscBatch = batch;
+		spscReceived = 0;
+
+		uint32_t cpus[2];
+		PickCPUs(cpus, 1);
+		Scheduler::Entry entries[2] = { SpscConsumer, SpscProducer };
+		void* args[2] = { nullptr, nullptr };
+		uint64_t elapsed = RunThreads(2, entries, args, cpus);
+		if (!elapsed) return 0;
+		if (errors || spscReceived != QUEUETEST_SPSC_ITEMS || !ring.Empty()) {
+			prErr("queue", "spsc %s: %d out of order, %d of %d received", name, errors,
+				(unsigned int)spscReceived, QUEUETEST_SPSC_ITEMS);
+			return 0;
+		}
+		return elapsed;
+	}
+
+	static void MpscProducer(void* arg) {
+		Producer* self = &producers[(uint64_t)arg];
+		WaitForGo();
+		TestItem* batch[8];
+		uint32_t sequence = 0, idle = 0;
+		while (sequence < QUEUETEST_MPSC_ITEMS && !stop) {
+			uint32_t want = 1;
+			if (mpscMode == MpscMode::Batch) want = 8;
+			else if (mpscMode == MpscMode::Mixed) want = sequence % 7 + 1;
+			if (want > QUEUETEST_MPSC_ITEMS - sequence) want = QUEUETEST_MPSC_ITEMS - sequence;
+
+			uint32_t got = self->free.PopBatch(batch, want);
+			if (!got) {
+				Backoff(&idle);
+				continue;
+			}
+			for (uint32_t i = 0; i < got; i++) batch[i]->sequence = sequence++;
+
+			if (mpscMode == MpscMode::Spinlock) {
+				spin_lock(&listLock);
+				for (uint32_t i = 0; i < got; i++) {
+					batch[i]->next = nullptr;
+					if (listTail) listTail->next = batch[i];
+					else listHead = batch[i];
+					listTail = batch[i];
+				}
+				spin_unlock(&listLock);
+			} else if (got == 1) {
+				mpsc.Push(batch[0]);
+			} else {
+				mpsc.PushBatch(batch, got);
+			}
+		}
+		Finish();
+	}
+
+	// Checks the item is next from its producer and gives it back. Its
+	// link belongs to the producer again after this.
+	static inline void Consume(TestItem* item) {
+		Producer* from = &producers[item->producer];
+		if (item->sequence != from->expected) __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+		from->expected = item->sequence + 1;
+		from->free.Push(item);
+	}
+
+	static void MpscConsumer(void*) {
+		WaitForGo();
+		uint64_t total = (uint64_t)producerCount * QUEUETEST_MPSC_ITEMS;
+		TestItem* items[QUEUETEST_MAX_BATCH];
+		uint64_t received = 0;
+		uint32_t idle = 0, round = 0;
+		while (received < total && !stop) {
+			uint32_t count = 0;
+			if (mpscMode == MpscMode::Spinlock) {
+				spin_lock(&listLock);
+				while (listHead && count < QUEUETEST_MAX_BATCH) {
+					items[count++] = listHead;
+					listHead = listHead->next;
+				}
+				if (!listHead) listTail = nullptr;
+				spin_unlock(&listLock);
+			} else if (mpscMode == MpscMode::Single) {
+				if ((items[0] = mpsc.Pop())) count = 1;
+			} else if (mpscMode == MpscMode::Batch) {
+				count = mpsc.PopBatch(items, QUEUETEST_MAX_BATCH);
+			} else {
+				// Mixed goes round all three ways of taking items
+				switch (round++ % 3) {
+					case 0:
+						if ((items[0] = mpsc.Pop())) count = 1;
+						break;
+					case 1:
+						count = mpsc.PopBatch(items, round % QUEUETEST_MAX_BATCH + 1);
+						break;
+					case 2: {
+						// Read the link first, the producer may reuse the item
+						// as soon as it's back
+						TestItem* item = mpsc.PopAll();
+						if (!item) break;
+						while (item) {
+							TestItem* next = item->next;
+							Consume(item);
+							item = next;
+							received++;
+						}
+						continue;
+					}
+				}
+			}
+
+			if (!count) {
+				Backoff(&idle);
+				continue;
+			}
+			for (uint32_t i = 0; i < count; i++) Consume(items[i]);
+			received += count;
+		}
+		mpscReceived = received;
+		Finish();
+	}
+
+	// 0 on failure
+	static uint64_t RunMpsc(MpscMode mode, const char* name, uint32_t* threads) {
+		uint32_t cpus[QUEUETEST_PRODUCERS + 1];
+		uint32_t online = SMP::GetOnlineCount();
+		uint32_t wanted = online > 1 ? online - 1 : 2;
+		if (wanted > QUEUETEST_PRODUCERS) wanted = QUEUETEST_PRODUCERS;
+		uint32_t count = PickCPUs(cpus, wanted);
+
+		producerCount = wanted;
+		mpscMode = mode;
+		mpscReceived = 0;
+		mpsc.Reset();
+		listHead = listTail = nullptr;
+		for (uint32_t p = 0; p < producerCount; p++) {
+			Producer* producer = &producers[p];
+			producer->free.Reset();
+			producer->expected = 0;
+			for (uint32_t i = 0; i < QUEUETEST_NODES; i++) {
+				producer->items[i].producer = p;
+				producer->free.Push(&producer->items[i]);
+			}
+		}
+
+		Scheduler::Entry entries[QUEUETEST_PRODUCERS + 1];
+		void* args[QUEUETEST_PRODUCERS + 1];
+		entries[0] = MpscConsumer;
+		args[0] = nullptr;
+		for (uint32_t i = 1; i < count; i++) {
+			entries[i] = MpscProducer;
+			args[i] = (void*)(uint64_t)(i - 1);
+		}
+		*threads = producerCount;
+		uint64_t elapsed = RunThreads(count, entries, args, cpus);
+		if (!elapsed) return 0;
+
+		uint64_t total = (uint64_t)producerCount * QUEUETEST_MPSC_ITEMS;
+		bool lost = false;
+		for (uint32_t p = 0; p < producerCount; p++) {
+			if (producers[p].expected != QUEUETEST_MPSC_ITEMS || producers[p].free.Size() != QUEUETEST_NODES) lost = true;
+		}
+		if (errors || lost || mpscReceived != total || !mpsc.Empty()) {
+			prErr("queue", "mpsc %s: %d out of order, %d of %d received", name, errors,
+				(unsigned int)mpscReceived, (unsigned int)total);
+			return 0;
+		}
+		return elapsed;
+	}
+
+	// The corners one thread can reach: full, empty, short batches,
+	// wrapping round the slots and the order batches come out in
+	static bool CheckSingleThreaded() {
+		static SpscRing<uint32_t, 8> small;
+		bool passed = true;
+		uint32_t values[16];
+		uint32_t value;
+
+		small.Reset();
+		if (!small.Empty() || small.Pop(value) || small.PopBatch(values, 4)) passed = false;
+		for (uint32_t i = 0; i < 10; i++) values[i] = i;
+		if (small.PushBatch(values, 10) != 8 || small.Push(8) || small.Size() != 8) passed = false;
+		if (small.PopBatch(values, 3) != 3 || values[0] != 0 || values[2] != 2) passed = false;
+		for (uint32_t i = 0; i < 5; i++) values[i] = 8 + i;
+		if (small.PushBatch(values, 5) != 3) passed = false;
+		if (small.PopBatch(values, 16) != 8) passed = false;
+		for (uint32_t i = 0; i < 8; i++) {
+			if (values[i] != 3 + i) passed = false;
+		}
+		for (uint32_t round = 0, next = 0, expected = 0; round < 1000; round++) {
+			for (uint32_t i = 0; i < 5; i++) values[i] = next++;
+			if (small.PushBatch(values, 5) != 5) passed = false;
+			for (uint32_t i = 0; i < 5; i++) {
+				if (!small.Pop(value) || value != expected++) passed = false;
+			}
+		}
+		if (!small.Empty()) passed = false;
+		if (!passed) prErr("queue", "spsc ring failed on one CPU");
+
+		static MpscQueue<TestItem> queue;
+		TestItem items[6];
+		for (uint32_t i = 0; i < 6; i++) items[i].sequence = i;
+		TestItem* batch[3] = { &items[1], &items[2], &items[3] };
+		TestItem* out[4];
+		bool order = true;
+
+		queue.Reset();
+		if (!queue.Empty() || queue.Pop() || queue.PopAll()) order = false;
+		if (!queue.Push(&items[0]) || queue.PushBatch(batch, 3) || queue.Push(&items[4])) order = false;
+		if (queue.Pop() != &items[0]) order = false;
+		if (queue.PopBatch(out, 2) != 2 || out[0] != &items[1] || out[1] != &items[2]) order = false;
+		queue.Push(&items[5]);
+		uint32_t expected = 3;
+		for (TestItem* item = queue.PopAll(); item; item = item->next) {
+			if (item->sequence != expected++) order = false;
+		}
+		if (expected != 6 || !queue.Empty()) order = false;
+		if (!order) {
+			prErr("queue", "mpsc queue failed on one CPU");
+			passed = false;
+		}
+		return passed;
+	}
+
+	// Tenths of a ns per item
+	static void PrintRate(const char* name, uint64_t elapsed, uint64_t items) {
+		if (!elapsed) {
+			kprintf("  %-26s failed\n", name);
+			return;
+		}
+		uint64_t tenths = elapsed * 10 / items;
+		kprintf("  %-26s %u.%u ns per item, %u items/s\n", name, (unsigned int)(tenths / 10),
+			(unsigned int)(tenths % 10), (unsigned int)(items * 1000000000ULL / elapsed));
+	}
+
+	bool SelfTest() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("queue", "Needs the scheduler");
+			return false;
+		}
+
+		bool passed = CheckSingleThreaded();
+
+		uint64_t elapsed = RunSpsc(0, "mixed batches");
+		if (!elapsed) passed = false;
+		else prInfo("queue", "spsc: %d items across CPUs in %dus", QUEUETEST_SPSC_ITEMS, (unsigned int)(elapsed / 1000));
+
+		uint32_t threads;
+		elapsed = RunMpsc(MpscMode::Mixed, "mixed batches", &threads);
+		if (!elapsed) passed = false;
+		else prInfo("queue", "mpsc: %d producers, %d items each in %dus", threads, QUEUETEST_MPSC_ITEMS,
+			(unsigned int)(elapsed / 1000));
+		return passed;
+	}
+
+	void Benchmark() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("queue", "Needs the scheduler");
+			return;
+		}
+
+		kprintf("  SpscRing<%d>, one producer CPU to one consumer CPU:\n", QUEUETEST_SPSC_SLOTS);
+		PrintRate("one at a time", RunSpsc(1, "one at a time"), QUEUETEST_SPSC_ITEMS);
+		PrintRate("batches of 32", RunSpsc(32, "batches of 32"), QUEUETEST_SPSC_ITEMS);
+
+		uint32_t threads = 0;
+		uint64_t single = RunMpsc(MpscMode::Single, "one at a time", &threads);
+		uint64_t batch = RunMpsc(MpscMode::Batch, "batches of 8", &threads);
+		uint64_t locked = RunMpsc(MpscMode::Spinlock, "spinlock", &threads);
+		uint64_t items = (uint64_t)threads * QUEUETEST_MPSC_ITEMS;
+		kprintf("  MpscQueue, %d producers into one consumer:\n", threads);
+		PrintRate("one at a time", single, items);
+		PrintRate("batches of 8", batch, items);
+		PrintRate("spinlocked list", locked, items);
+	}
+}
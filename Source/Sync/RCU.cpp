@@ -0,0 +1,409 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: RCU.cpp
+// Purpose: Read-copy-update for read-mostly data
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sync/RCU.hpp>
+#include <Sync/Completion.hpp>
+#include <Sync/Spinlock.hpp>
+#include <CPU/PerCPU.hpp>
+#include <CPU/SMP.hpp>
+#include <Interrupts/APIC.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/Interrupts.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Inferno/Log.h>
+
+// How long a grace period leaves busy CPUs to switch on their own before
+// it interrupts them, and how often it looks again after that
+#define RCU_FORCE_QS_NS         1000000ULL
+#define RCU_POLL_NS             200000ULL
+
+#define RCU_TEST_OBJECTS        4
+#define RCU_TEST_ROUNDS         50
+#define RCU_TEST_CALLBACKS      16
+#define RCU_TEST_ALIVE          0x52435521
+#define RCU_TEST_DEAD           0xDEADDEAD
+
+// Callbacks queued on one CPU, oldest first, so `gp` never goes down
+// along the list. The grace period thread takes them off other CPUs, hence
+// the lock.
+typedef struct {
+	spinlock_t lock;
+	rcu_head* head;
+	rcu_head* tail;
+	uint64_t queued;
+	uint64_t forced;                // quiescent state IPIs taken here
+} RcuData;
+
+static DEFINE_LOCK_CLASS(callbacksClass, "rcu_callbacks");
+static DEFINE_PER_CPU(RcuData, rcuData) = { SPINLOCK_INIT_CLASS(callbacksClass), nullptr, nullptr, 0, 0 };
+
+// Grace periods are numbered. `gpStarted` is the last one begun, a
+// callback queued now needs the one after it: the current one may have
+// started before the object was unlinked.
+static volatile uint64_t gpStarted = 0;
+static volatile uint64_t gpCompleted = 0;
+static volatile uint64_t gpRequested = 0;
+static volatile uint64_t gpInvoked = 0;         // callbacks run through this one
+static Scheduler::Thread* gpThread = nullptr;
+static uint8_t qsVector = 0;
+
+static uint64_t gpTotalNs = 0;
+static uint64_t gpMaxNs = 0;
+static uint64_t forcedIPIs = 0;
+static uint64_t invoked = 0;
+
+// The interrupted code had interrupts on, so it's either outside every
+// read-side section or holding preemption off in one. In that case its
+// preempt_enable switches and Schedule notes the quiescent state.
+static bool QuiescentIPI(Interrupts::Frame* frame, void*) {
+	this_cpu_ptr(&rcuData)->forced++;
+	if (!preempt_count() || (frame->cs & 3)) rcu_note_qs();
+	else this_cpu()->needResched = 1;
+	return true;
+}
+
+static void RequestGracePeriod(uint64_t gp) {
+	uint64_t requested = __atomic_load_n(&gpRequested, __ATOMIC_RELAXED);
+	while (requested < gp &&
+	       !__atomic_compare_exchange_n(&gpRequested, &requested, gp, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (gpThread) Scheduler::Wake(gpThread);
+}
+
+// Every online CPU but the one running this has to note a quiescent state
+// after the new number is out. This one is running a thread, not a reader.
+static void RunGracePeriod() {
+	uint64_t start = ClockMonotonicNs();
+	uint64_t gp = gpStarted + 1;
+	__atomic_store_n(&gpStarted, gp, __ATOMIC_RELEASE);
+	// Whatever the updaters unlinked is visible before the snapshot
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint64_t online = Scheduler::OnlineMask();
+	uint64_t snapshot[SMP_MAX_CPUS];
+	uint64_t pending = 0;
+	preempt_disable();
+	uint32_t self = this_cpu_id();
+	preempt_enable();
+	for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (cpu == self || !(online & (1ULL << cpu))) continue;
+		snapshot[cpu] = __atomic_load_n(&PerCPU::Get(cpu)->rcuQs, __ATOMIC_ACQUIRE);
+		pending |= 1ULL << cpu;
+	}
+
+	uint64_t forceAt = start + RCU_FORCE_QS_NS;
+	while (pending) {
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (!(pending & (1ULL << cpu))) continue;
+			if (__atomic_load_n(&PerCPU::Get(cpu)->rcuQs, __ATOMIC_ACQUIRE) != snapshot[cpu]) pending &= ~(1ULL << cpu);
+		}
+		if (!pending) break;
+
+		uint64_t now = ClockMonotonicNs();
+		if (now < forceAt) {
+			Scheduler::Sleep(forceAt - now);
+			continue;
+		}
+		// Idle CPUs and ones that haven't switched in a while
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (!(pending & (1ULL << cpu))) continue;
+			SMP::CPUInfo* info = SMP::GetCPU(cpu);
+			if (!info || !qsVector) continue;
+			APIC::SendIPI(info->apicId, qsVector);
+			forcedIPIs++;
+		}
+		forceAt = now + RCU_FORCE_QS_NS;
+		Scheduler::Sleep(RCU_POLL_NS);
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&gpCompleted, gp, __ATOMIC_RELEASE);
+
+	uint64_t took = ClockMonotonicNs() - start;
+	gpTotalNs += took;
+	if (took > gpMaxNs) gpMaxNs = took;
+}
+
+// Takes everything that's done waiting off every CPU, then runs it
+static void InvokeCallbacks() {
+	uint64_t completed = gpCompleted;
+	for (uint32_t cpu = 0; cpu < PerCPU::GetCount(); cpu++) {
+		if (!PerCPU::Get(cpu)) continue;
+		RcuData* data = per_cpu_ptr(&rcuData, cpu);
+
+		uint64_t flags = spin_lock_irqsave(&data->lock);
+		rcu_head* ready = data->head;
+		rcu_head* last = nullptr;
+		for (rcu_head* head = data->head; head && head->gp <= completed; head = head->next) last = head;
+		if (last) {
+			data->head = last->next;
+			if (!data->head) data->tail = nullptr;
+			last->next = nullptr;
+		} else {
+			ready = nullptr;
+		}
+		spin_unlock_irqrestore(&data->lock, flags);
+
+		while (ready) {
+			rcu_head* next = ready->next;
+			ready->func(ready);
+			ready = next;
+			invoked++;
+		}
+	}
+	__atomic_store_n(&gpInvoked, completed, __ATOMIC_RELEASE);
+}
+
+static void GracePeriodThread(void*) {
+	while (true) {
+		Scheduler::PrepareToBlock();
+		if (__atomic_load_n(&gpRequested, __ATOMIC_ACQUIRE) <= gpCompleted) {
+			Scheduler::Block();
+			continue;
+		}
+		Scheduler::AbortBlock();
+		RunGracePeriod();
+		InvokeCallbacks();
+	}
+}
+
+void call_rcu(rcu_head* head, rcu_callback_t func) {
+	head->next = nullptr;
+	head->func = func;
+	// The unlink before this is visible before gpStarted is read
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint64_t flags = local_irq_save();
+	RcuData* data = this_cpu_ptr(&rcuData);
+	spin_lock(&data->lock);
+	head->gp = __atomic_load_n(&gpStarted, __ATOMIC_ACQUIRE) + 1;
+	if (data->tail) data->tail->next = head;
+	else data->head = head;
+	data->tail = head;
+	data->queued++;
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	RequestGracePeriod(head->gp);
+}
+
+// On the waiter's stack, complete() is finished with it by the time the
+// waiter returns
+typedef struct {
+	rcu_head head;
+	completion_t done;
+} Waiter;
+
+static void WakeWaiter(rcu_head* head) {
+	complete(&((Waiter*)head)->done);
+}
+
+void synchronize_rcu() {
+	if (!gpThread) return;
+
+	Waiter waiter;
+	init_completion(&waiter.done);
+	call_rcu(&waiter.head, WakeWaiter);
+	wait_for_completion(&waiter.done);
+}
+
+// Everything queued so far needs at most the grace period after the
+// current one, and the thread runs all of them before moving gpInvoked
+void rcu_barrier() {
+	if (!gpThread) return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t target = __atomic_load_n(&gpStarted, __ATOMIC_ACQUIRE) + 1;
+	RequestGracePeriod(target);
+	while (__atomic_load_n(&gpInvoked, __ATOMIC_ACQUIRE) < target) Scheduler::Sleep(RCU_POLL_NS);
+}
+
+namespace Rcu {
+	bool Initialize() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("rcu", "Needs the scheduler");
+			return false;
+		}
+		if (APIC::IsEnabled()) {
+			int vector = Interrupts::AllocateVectors(1);
+			if (vector >= 0 && Interrupts::RegisterHandler(vector, QuiescentIPI, nullptr)) qsVector = vector;
+		}
+		if (!qsVector) prWarn("rcu", "No IPI vector, grace periods wait for CPUs to switch");
+
+		// Above the normal threads so a CPU full of readers doesn't hold
+		// up the grace periods they're waiting on
+		gpThread = Scheduler::Create("rcu_gp", GracePeriodThread, nullptr, SCHED_PRIORITY_HIGH);
+		if (!gpThread) {
+			prErr("rcu", "No grace period thread");
+			return false;
+		}
+		prInfo("rcu", "Grace period thread started, quiescent state IPI on 0x%x", qsVector);
+		return true;
+	}
+
+	void PrintStats() {
+		uint64_t gps = gpCompleted;
+		kprintf("  %d grace periods, %dus average, %dus longest, %d forcing IPIs, %d callbacks run\n",
+			(unsigned int)gps, (unsigned int)(gps ? gpTotalNs / gps / 1000 : 0), (unsigned int)(gpMaxNs / 1000),
+			(unsigned int)forcedIPIs, (unsigned int)invoked);
+		kprintf("  cpu  quiescent  callbacks  forced\n");
+		for (uint32_t cpu = 0; cpu < PerCPU::GetCount(); cpu++) {
+			PerCPU::Area* area = PerCPU::Get(cpu);
+			if (!area) continue;
+			RcuData* data = per_cpu_ptr(&rcuData, cpu);
+			kprintf("  %-4d %-10u %-10u %u\n", cpu, (unsigned int)area->rcuQs, (unsigned int)data->queued,
+				(unsigned int)data->forced);
+		}
+	}
+
+	static inline uint64_t ReadTSC() {
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		return ((uint64_t)high << 32) | low;
+	}
+
+	typedef struct {
+		volatile uint32_t magic;
+		uint32_t version;
+	} TestObject;
+
+	static TestObject objects[RCU_TEST_OBJECTS];
+	static TestObject* volatile published;
+	static volatile bool stop;
+	static volatile uint32_t started, finished, corrupt;
+	static volatile uint64_t reads;
+	static volatile uint32_t callbacks;
+	static rcu_head testHeads[RCU_TEST_CALLBACKS];
+
+	// Checks whatever it found twice, with a pause in between for the
+	// writer to get at it if the grace period were too short
+	static void TestReader(void*) {
+		__atomic_fetch_add(&started, 1, __ATOMIC_RELEASE);
+		uint64_t count = 0;
+		while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+			rcu_read_lock();
+			TestObject* object = rcu_dereference(published);
+			if (object->magic != RCU_TEST_ALIVE) __atomic_fetch_add(&corrupt, 1, __ATOMIC_RELAXED);
+			for (int i = 0; i < 64; i++) asm volatile("pause");
+			if (object->magic != RCU_TEST_ALIVE) __atomic_fetch_add(&corrupt, 1, __ATOMIC_RELAXED);
+			rcu_read_unlock();
+			count++;
+		}
+		__atomic_fetch_add(&reads, count, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+	}
+
+	static void TestCallback(rcu_head*) {
+		__atomic_fetch_add(&callbacks, 1, __ATOMIC_RELEASE);
+	}
+
+	static bool WaitFor(volatile uint32_t* value, uint32_t count, uint64_t timeout) {
+		uint64_t deadline = ClockMonotonicNs() + timeout;
+		while (__atomic_load_n(value, __ATOMIC_ACQUIRE) < count) {
+			if (ClockMonotonicNs() > deadline) return false;
+			Scheduler::Sleep(1000000);
+		}
+		return true;
+	}
+
+	bool SelfTest() {
+		if (!gpThread) {
+			prErr("rcu", "Not initialized");
+			return false;
+		}
+		bool passed = true;
+
+		// Readers everywhere while the writer swaps the object and poisons
+		// the old one as soon as synchronize_rcu says nobody can have it
+		for (uint32_t i = 0; i < RCU_TEST_OBJECTS; i++) objects[i] = { RCU_TEST_DEAD, 0 };
+		objects[0] = { RCU_TEST_ALIVE, 0 };
+		published = &objects[0];
+		stop = false;
+		started = finished = corrupt = 0;
+		reads = 0;
+
+		uint64_t online = Scheduler::OnlineMask();
+		uint32_t readers = 0;
+		for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			if (!(online & (1ULL << cpu))) continue;
+			if (Scheduler::Create("test/rcu", TestReader, nullptr, SCHED_PRIORITY_NORMAL, 1ULL << cpu)) readers++;
+		}
+		WaitFor(&started, readers, 1000000000ULL);
+
+		uint64_t total = 0, longest = 0;
+		for (uint32_t round = 1; round <= RCU_TEST_ROUNDS; round++) {
+			TestObject* old = published;
+			TestObject* next = &objects[round % RCU_TEST_OBJECTS];
+			next->version = round;
+			next->magic = RCU_TEST_ALIVE;
+			rcu_assign_pointer(published, next);
+
+			uint64_t start = ClockMonotonicNs();
+			synchronize_rcu();
+			uint64_t took = ClockMonotonicNs() - start;
+			total += took;
+			if (took > longest) longest = took;
+			old->magic = RCU_TEST_DEAD;
+		}
+		__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+		if (!WaitFor(&finished, started, 2000000000ULL)) {
+			prErr("rcu", "%d of %d readers stopped", finished, started);
+			return false;
+		}
+		if (corrupt) {
+			prErr("rcu", "Readers saw %d freed objects", corrupt);
+			passed = false;
+		}
+
+		// A callback can't run while a reader from before it is inside
+		callbacks = 0;
+		rcu_read_lock();
+		call_rcu(&testHeads[0], TestCallback);
+		uint64_t until = ClockMonotonicNs() + 5000000ULL;
+		while (ClockMonotonicNs() < until) asm volatile("pause");
+		bool early = callbacks != 0;
+		rcu_read_unlock();
+		if (early) {
+			prErr("rcu", "call_rcu ran its callback inside a reader from before it");
+			passed = false;
+		}
+		if (!WaitFor(&callbacks, 1, 1000000000ULL)) {
+			prErr("rcu", "call_rcu never ran its callback");
+			passed = false;
+		}
+
+		// rcu_barrier waits for everything queued before it
+		callbacks = 0;
+		for (uint32_t i = 0; i < RCU_TEST_CALLBACKS; i++) call_rcu(&testHeads[i], TestCallback);
+		rcu_barrier();
+		if (callbacks != RCU_TEST_CALLBACKS) {
+			prErr("rcu", "rcu_barrier returned with %d of %d callbacks run", callbacks, RCU_TEST_CALLBACKS);
+			passed = false;
+		}
+
+		// Read side against an uncontended spinlock
+		const uint32_t pairs = 100000;
+		spinlock_t lock = SPINLOCK_INIT;
+		uint64_t begin = ReadTSC();
+		for (uint32_t i = 0; i < pairs; i++) {
+			rcu_read_lock();
+			asm volatile("" ::: "memory");
+			rcu_read_unlock();
+		}
+		uint64_t rcuCycles = ReadTSC() - begin;
+		begin = ReadTSC();
+		for (uint32_t i = 0; i < pairs; i++) {
+			spin_lock(&lock);
+			spin_unlock(&lock);
+		}
+		uint64_t lockCycles = ReadTSC() - begin;
+
+		prInfo("rcu", "%d readers, %d reads, synchronize %dus average %dus longest", started, (unsigned int)reads,
+			(unsigned int)(total / RCU_TEST_ROUNDS / 1000), (unsigned int)(longest / 1000));
+		prInfo("rcu", "Read side %d cycles, spinlock %d cycles", (unsigned int)(rcuCycles / pairs),
+			(unsigned int)(lockCycles / pairs));
+		return passed;
+	}
+}
@@ -0,0 +1,333 @@
+//========= Copyright N11 Software, All rights reserved. ============//
+//
+// File: WaitTest.cpp
+// Purpose: Tests for wait queues and the sleeping locks built on them
+// Maintainer: atl
+//
+//===================================================================//
+
+#include <Sync/WaitTest.hpp>
+#include <Sync/Completion.hpp>
+#include <Sync/CondVar.hpp>
+#include <Sync/Futex.hpp>
+#include <Sync/Mutex.hpp>
+#include <Sync/Semaphore.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sched/Wait.hpp>
+#include <Inferno/errno.h>
+#include <Inferno/Log.h>
+
+#define WAITTEST_THREADS        4
+#define WAITTEST_MUTEX_ROUNDS   20000
+#define WAITTEST_HOLD_EVERY     1024        // rounds between holds long enough to sleep on
+#define WAITTEST_HOLD_NS        100000ULL
+#define WAITTEST_ITEMS          20000
+#define WAITTEST_SLOTS          8
+#define WAITTEST_ASLEEP_NS      50000000ULL // how long the CPU time check leaves waiters asleep
+#define WAITTEST_SETTLE_NS      20000000ULL // for a wakeup that shouldn't happen to show up
+#define WAITTEST_TIMEOUT_NS     5000000ULL
+#define WAITTEST_LATE_NS        20000000ULL
+#define WAITTEST_DEADLINE_NS    10000000000ULL
+
+namespace WaitTest {
+	static volatile uint32_t errors;
+	static volatile uint32_t done;
+	static Scheduler::Thread* threads[WAITTEST_THREADS];
+
+	static mutex_t mutex = MUTEX_INIT;
+	static volatile uint32_t holders;
+	static uint64_t counter;
+
+	static semaphore_t slotsFree;
+	static semaphore_t slotsFull;
+	static uint32_t slots[WAITTEST_SLOTS];
+
+	static completion_t gate;
+	static condvar_t cond;
+	static uint32_t generation;
+
+	static volatile uint32_t futexWord;
+	static volatile uint32_t futexOther;
+	static volatile int64_t futexResults[WAITTEST_THREADS];
+
+	// Thread i goes on the i-th online CPU other than ours, round again if
+	// there aren't enough
+	static void Start(const char* name, Scheduler::Entry entry, uint32_t count) {
+		uint64_t online = Scheduler::OnlineMask();
+		uint64_t others = online & ~(1ULL << Scheduler::Current()->cpu);
+		if (!others) others = online;
+		uint64_t mask = others;
+		errors = 0;
+		done = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			if (!mask) mask = others;
+			uint32_t cpu = __builtin_ctzll(mask);
+			mask &= mask - 1;
+			threads[i] = Scheduler::Create(name, entry, (void*)(uint64_t)i, SCHED_PRIORITY_NORMAL, 1ULL << cpu);
+		}
+	}
+
+	static bool WaitDone(uint32_t count, uint64_t timeout = WAITTEST_DEADLINE_NS) {
+		uint64_t deadline = ClockMonotonicNs() + timeout;
+		while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < count && ClockMonotonicNs() < deadline) Scheduler::Sleep(1000000);
+		return done >= count;
+	}
+
+	// Until every thread Start made is asleep. They can't finish before
+	// the test lets them, so the pointers are still good.
+	static bool WaitBlocked(uint32_t count) {
+		uint64_t deadline = ClockMonotonicNs() + 1000000000ULL;
+		while (ClockMonotonicNs() < deadline) {
+			uint32_t blocked = 0;
+			for (uint32_t i = 0; i < count; i++) {
+				if (threads[i]->state == Scheduler::State::Blocked && !threads[i]->onCPU) blocked++;
+			}
+			if (blocked == count) return true;
+			Scheduler::Sleep(1000000);
+		}
+		return false;
+	}
+
+	static uint64_t Runtime(uint32_t count) {
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < count; i++) total += threads[i]->runtime;
+		return total;
+	}
+
+	static void MutexWorker(void*) {
+		for (uint32_t round = 0; round < WAITTEST_MUTEX_ROUNDS; round++) {
+			mutex_lock(&mutex);
+			if (__atomic_add_fetch(&holders, 1, __ATOMIC_RELAXED) != 1) __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+			counter++;
+			// Off the CPU holding it now and then, so waiters stop spinning
+			// and go to sleep
+			if (round % WAITTEST_HOLD_EVERY == 0) Scheduler::Sleep(WAITTEST_HOLD_NS);
+			__atomic_sub_fetch(&holders, 1, __ATOMIC_RELAXED);
+			mutex_unlock(&mutex);
+		}
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	static bool TestMutex() {
+		holders = 0;
+		counter = 0;
+		uint64_t start = ClockMonotonicNs();
+		Start("test/mutex", MutexWorker, WAITTEST_THREADS);
+		if (!WaitDone(WAITTEST_THREADS)) {
+			prErr("wait", "mutex: %d of %d threads finished", done, WAITTEST_THREADS);
+			return false;
+		}
+		uint64_t elapsed = ClockMonotonicNs() - start;
+
+		bool passed = true;
+		if (errors || counter != (uint64_t)WAITTEST_THREADS * WAITTEST_MUTEX_ROUNDS) {
+			prErr("wait", "mutex: %d overlapping holders, counted %d of %d", errors, (unsigned int)counter,
+				WAITTEST_THREADS * WAITTEST_MUTEX_ROUNDS);
+			passed = false;
+		}
+
+		// Ours now, so a timed lock has to give up
+		mutex_lock(&mutex);
+		if (mutex_lock_timeout(&mutex, WAITTEST_TIMEOUT_NS)) {
+			prErr("wait", "mutex: taken twice");
+			passed = false;
+		}
+		mutex_unlock(&mutex);
+		if (mutex_is_locked(&mutex)) {
+			prErr("wait", "mutex: still locked after the last unlock");
+			passed = false;
+		}
+		if (passed) prInfo("wait", "mutex: %d threads, %d rounds each in %dus", WAITTEST_THREADS, WAITTEST_MUTEX_ROUNDS,
+			(unsigned int)(elapsed / 1000));
+		return passed;
+	}
+
+	static void Producer(void*) {
+		for (uint32_t item = 1; item <= WAITTEST_ITEMS; item++) {
+			down(&slotsFree);
+			slots[item % WAITTEST_SLOTS] = item;
+			up(&slotsFull);
+		}
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	static void Consumer(void*) {
+		for (uint32_t item = 1; item <= WAITTEST_ITEMS; item++) {
+			down(&slotsFull);
+			if (slots[item % WAITTEST_SLOTS] != item) __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+			up(&slotsFree);
+		}
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	static void SemaphoreWorker(void* arg) {
+		if (arg) Consumer(arg);
+		else Producer(arg);
+	}
+
+	static bool TestSemaphore() {
+		sema_init(&slotsFree, WAITTEST_SLOTS);
+		sema_init(&slotsFull, 0);
+		uint64_t start = ClockMonotonicNs();
+		Start("test/sema", SemaphoreWorker, 2);
+		if (!WaitDone(2)) {
+			prErr("wait", "semaphore: %d of 2 threads finished", done);
+			return false;
+		}
+		uint64_t elapsed = ClockMonotonicNs() - start;
+
+		if (errors || slotsFree.count != WAITTEST_SLOTS || slotsFull.count != 0) {
+			prErr("wait", "semaphore: %d items out of order, counts %d and %d left", errors, slotsFree.count, slotsFull.count);
+			return false;
+		}
+		if (down_timeout(&slotsFull, WAITTEST_TIMEOUT_NS)) {
+			prErr("wait", "semaphore: took a count nobody gave");
+			return false;
+		}
+		prInfo("wait", "semaphore: %d items through %d slots in %dus", WAITTEST_ITEMS, WAITTEST_SLOTS,
+			(unsigned int)(elapsed / 1000));
+		return true;
+	}
+
+	static void CompletionWaiter(void*) {
+		wait_for_completion(&gate);
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	static void CondWaiter(void*) {
+		mutex_lock(&mutex);
+		while (!generation) cond_wait(&cond, &mutex);
+		mutex_unlock(&mutex);
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	static void FutexWaiter(void* arg) {
+		futexResults[(uint64_t)arg] = Futex::Wait(&futexWord, 0, WAITTEST_DEADLINE_NS);
+		__atomic_fetch_add(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	// Starts the waiters, checks they sleep without using the CPU, that
+	// `one` lets exactly one through and `all` the rest
+	static bool TestWakeups(const char* what, Scheduler::Entry waiter, void (*one)(), void (*all)()) {
+		Start("test/waiter", waiter, WAITTEST_THREADS);
+		if (!WaitBlocked(WAITTEST_THREADS)) {
+			prErr("wait", "%s: waiters never went to sleep", what);
+			all();
+			WaitDone(WAITTEST_THREADS);
+			return false;
+		}
+
+		bool passed = true;
+		uint64_t runtime = Runtime(WAITTEST_THREADS);
+		Scheduler::Sleep(WAITTEST_ASLEEP_NS);
+		uint64_t used = Runtime(WAITTEST_THREADS) - runtime;
+		if (used > WAITTEST_ASLEEP_NS / 100) {
+			prErr("wait", "%s: waiters ran %dus while asleep", what, (unsigned int)(used / 1000));
+			passed = false;
+		}
+
+		one();
+		WaitDone(1, WAITTEST_SETTLE_NS);
+		Scheduler::Sleep(WAITTEST_SETTLE_NS);
+		if (done != 1) {
+			prErr("wait", "%s: waking one let %d through", what, done);
+			passed = false;
+		}
+
+		all();
+		if (!WaitDone(WAITTEST_THREADS)) {
+			prErr("wait", "%s: waking all let %d of %d through", what, done, WAITTEST_THREADS);
+			passed = false;
+		}
+		return passed;
+	}
+
+	static bool TestTimeout() {
+		wait_queue_head_t wq = WAIT_QUEUE_HEAD_INIT;
+		uint64_t start = ClockMonotonicNs();
+		bool met = wait_event_timeout(&wq, [] { return false; }, WAITTEST_TIMEOUT_NS);
+		uint64_t waited = ClockMonotonicNs() - start;
+		if (met || waited < WAITTEST_TIMEOUT_NS || waited > WAITTEST_TIMEOUT_NS + WAITTEST_LATE_NS) {
+			prErr("wait", "timeout: %dus for a %dus wait", (unsigned int)(waited / 1000),
+				(unsigned int)(WAITTEST_TIMEOUT_NS / 1000));
+			return false;
+		}
+		return true;
+	}
+
+	static bool TestFutexErrors() {
+		futexWord = 0;
+		bool passed = true;
+		if (Futex::Wait(&futexWord, 1) != -EAGAIN) {
+			prErr("wait", "futex: slept on a value that had changed");
+			passed = false;
+		}
+		if (Futex::Wait(&futexWord, 0, WAITTEST_TIMEOUT_NS) != -ETIMEDOUT) {
+			prErr("wait", "futex: a wait nobody woke didn't time out");
+			passed = false;
+		}
+		if (Futex::Syscall((uint64_t)&futexWord + 1, FUTEX_WAKE, 1, 0, 0, 0) != (uint64_t)-EINVAL ||
+		    Futex::Syscall((uint64_t)&futexWord, 99, 1, 0, 0, 0) != (uint64_t)-ENOSYS) {
+			prErr("wait", "futex: bad syscall arguments taken");
+			passed = false;
+		}
+		return passed;
+	}
+
+	bool SelfTest() {
+		if (!Scheduler::IsInitialized()) {
+			prErr("wait", "Needs the scheduler");
+			return false;
+		}
+
+		bool passed = TestTimeout();
+		if (!TestMutex()) passed = false;
+		if (!TestSemaphore()) passed = false;
+
+		init_completion(&gate);
+		if (!TestWakeups("completion", CompletionWaiter, [] { complete(&gate); }, [] { complete_all(&gate); })) passed = false;
+
+		cond_init(&cond);
+		generation = 0;
+		auto signal = [] {
+			mutex_lock(&mutex);
+			generation++;
+			cond_signal(&cond);
+			mutex_unlock(&mutex);
+		};
+		auto broadcast = [] {
+			mutex_lock(&mutex);
+			generation++;
+			cond_broadcast(&cond);
+			mutex_unlock(&mutex);
+		};
+		if (!TestWakeups("condvar", CondWaiter, signal, broadcast)) passed = false;
+
+		if (!TestFutexErrors()) passed = false;
+		futexWord = 0;
+		for (uint32_t i = 0; i < WAITTEST_THREADS; i++) futexResults[i] = 1;
+		// A wake on another word doesn't count, the rest go through the
+		// syscall the way ring 3 would ask
+		auto wakeOne = [] {
+			if (Futex::Wake(&futexOther, WAITTEST_THREADS) != 0) __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+			futexWord = 1;
+			if (Futex::Wake(&futexWord, 1) != 1) __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+		};
+		auto wakeAll = [] {
+			uint64_t woken = Futex::Syscall((uint64_t)&futexWord, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, WAITTEST_THREADS, 0, 0, 0);
+			if (woken != WAITTEST_THREADS - 1) __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+		};
+		if (!TestWakeups("futex", FutexWaiter, wakeOne, wakeAll)) passed = false;
+		for (uint32_t i = 0; i < WAITTEST_THREADS; i++) {
+			if (futexResults[i] != 0) errors++;
+		}
+		if (errors) {
+			prErr("wait", "futex: %d wakes woke the wrong number of waiters", errors);
+			passed = false;
+		}
+
+		if (passed) prInfo("wait", "completion, condvar and futex waiters slept, woke one and then all");
+		return passed;
+	}
+}
@@ -6,6 +6,9 @@
 #include <stdint.h>
 #include <Inferno/Log.h>
 #include <Memory/Mem_.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sync/RWSem.hpp>
+#include <Sync/RCUList.hpp>
 #include <stdarg.h> // For va_list
 
 #define DEBUG false
@@ -135,6 +138,145 @@ static uint32_t sectors_per_block = 0;
 static int active_port = -1;
 static uint32_t sector_size = 512; // Default sector size
 
+// Guards everything above
+static DEFINE_LOCK_CLASS(mountClass, "ext2");
+static rw_semaphore mountLock = RWSEM_INIT_CLASS(mountClass);
+
+// Directory entries already looked up: (port, directory inode, name) to
+// inode. Lookups walk it under rcu_read_lock without mountLock and only
+// go to disk on a miss. Changes are under dcache_lock; entries are freed
+// a grace period after they're unhashed.
+#define EXT2_DCACHE_BUCKETS     64
+#define EXT2_DCACHE_MAX         1024
+#define EXT2_DCACHE_NAME_MAX    59
+#define EXT2_MAX_PORTS          32
+
+typedef struct {
+    hlist_node link;
+    rcu_head rcu;
+    int port;
+    uint32_t parent;
+    uint32_t inode;
+    uint8_t name_len;
+    char name[EXT2_DCACHE_NAME_MAX + 1];
+} ext2_dentry_t;
+
+static hlist_head dcache[EXT2_DCACHE_BUCKETS];
+static uint32_t dcache_entries = 0;
+static DEFINE_LOCK_CLASS(dcacheClass, "ext2_dcache");
+static spinlock_t dcache_lock = SPINLOCK_INIT_CLASS(dcacheClass);
+
+// What each port's entries were read from, to notice a different or
+// modified filesystem on remount
+static uint32_t dcache_wtime[EXT2_MAX_PORTS];
+static uint8_t dcache_uuid[EXT2_MAX_PORTS][16];
+
+static uint32_t DcacheHash(int port, uint32_t parent, const char* name, uint32_t len) {
+    uint32_t hash = 2166136261u ^ (uint32_t)port;
+    hash = (hash ^ parent) * 16777619u;
+    for (uint32_t i = 0; i < len; i++) hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash % EXT2_DCACHE_BUCKETS;
+}
+
+// 0 on a miss
+static uint32_t DcacheLookup(int port, uint32_t parent, const char* name, uint32_t len) {
+    if (len > EXT2_DCACHE_NAME_MAX) return 0;
+    uint32_t inode = 0;
+    ext2_dentry_t* dentry;
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(dentry, &dcache[DcacheHash(port, parent, name, len)], ext2_dentry_t, link) {
+        if (dentry->port == port && dentry->parent == parent && dentry->name_len == len &&
+            memcmp(dentry->name, name, len) == 0) {
+            inode = dentry->inode;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return inode;
+}
+
+static void DcacheInsert(int port, uint32_t parent, const char* name, uint32_t len, uint32_t inode) {
+    if (len > EXT2_DCACHE_NAME_MAX || !inode) return;
+    ext2_dentry_t* dentry = (ext2_dentry_t*)malloc(sizeof(ext2_dentry_t));
+    if (!dentry) return;
+    dentry->port = port;
+    dentry->parent = parent;
+    dentry->inode = inode;
+    dentry->name_len = len;
+    memcpy(dentry->name, name, len);
+    dentry->name[len] = 0;
+
+    hlist_head* bucket = &dcache[DcacheHash(port, parent, name, len)];
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    ext2_dentry_t* existing;
+    bool present = false;
+    hlist_for_each_entry_rcu(existing, bucket, ext2_dentry_t, link) {
+        if (existing->port == port && existing->parent == parent && existing->name_len == len &&
+            memcmp(existing->name, name, len) == 0) {
+            present = true;
+            break;
+        }
+    }
+    if (!present && dcache_entries < EXT2_DCACHE_MAX) {
+        hlist_add_head_rcu(&dentry->link, bucket);
+        dcache_entries++;
+        dentry = nullptr;
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    if (dentry) free(dentry);
+}
+
+static void DcacheFree(rcu_head* head) {
+    free(container_of(head, ext2_dentry_t, rcu));
+}
+
+// Forgets a port's entries if the filesystem on it isn't the one they
+// came from. Under mountLock for writing, with the new superblock read.
+static void DcacheRevalidate(int port) {
+    if (port < 0 || port >= EXT2_MAX_PORTS) return;
+    if (dcache_wtime[port] == superblock.wtime && memcmp(dcache_uuid[port], superblock.uuid, 16) == 0) return;
+
+    uint32_t dropped = 0;
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    for (uint32_t i = 0; i < EXT2_DCACHE_BUCKETS; i++) {
+        ext2_dentry_t* dentry;
+        hlist_for_each_entry_safe(dentry, &dcache[i], ext2_dentry_t, link) {
+            if (dentry->port != port) continue;
+            hlist_del_rcu(&dentry->link);
+            call_rcu(&dentry->rcu, DcacheFree);
+            dcache_entries--;
+            dropped++;
+        }
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+
+    dcache_wtime[port] = superblock.wtime;
+    memcpy(dcache_uuid[port], superblock.uuid, 16);
+    if (dropped) prDebug("ext2", "Dropped %u cached names for port %d", dropped, port);
+}
+
+// Resolves every component of `path` from the cache alone. False on the
+// first miss, and for anything the disk walk has to report on.
+static bool DcacheWalk(int port, const char* path, uint32_t* out_inode) {
+    uint32_t inode = EXT2_ROOT_INO;
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        const char* end = p;
+        while (*end && *end != '/') end++;
+        uint32_t len = end - p;
+        if (len == 2 && p[0] == '.' && p[1] == '.') return false;
+        if (!(len == 1 && p[0] == '.')) {
+            inode = DcacheLookup(port, inode, p, len);
+            if (!inode) return false;
+        }
+        p = end;
+    }
+    *out_inode = inode;
+    return true;
+}
+
 // Helper functions
 static uint32_t GetBlockSize() {
     return block_size;
@@ -208,7 +350,7 @@ static void* ReadBlock(int port_num, uint32_t block_num) {
 }
 
 // Reads the superblock from the disk
-bool ReadSuperblock(int port_num, uint32_t sector_offset) {
+static bool ReadSuperblockLocked(int port_num, uint32_t sector_offset) {
     // prInfo("ext2", "Reading superblock from port %d at sector %u", port_num, sector_offset);
     
     // Get device info
@@ -334,7 +476,7 @@ bool ReadSuperblock(int port_num, uint32_t sector_offset) {
 }
 
 // Reads the block group descriptors
-bool ReadBlockGroupDescriptors(int port_num) {
+static bool ReadBlockGroupDescriptorsLocked(int port_num) {
     uint32_t num_groups = (superblock.blocks_count + blocks_per_group - 1) / blocks_per_group;
     uint32_t desc_table_size = num_groups * sizeof(ext2_group_desc_t);
     uint32_t desc_per_block = block_size / sizeof(ext2_group_desc_t);
@@ -455,7 +597,7 @@ static void* ReadInodeData(int port_num, ext2_inode_t* inode, uint32_t block_ind
 }
 
 // Lists files in a directory
-bool ListDirectory(int port_num, uint32_t inode_num) {
+static bool ListDirectoryLocked(int port_num, uint32_t inode_num) {
     ext2_inode_t* inode = ReadInode(port_num, inode_num);
     if (!inode) {
         return false;
@@ -597,7 +739,7 @@ bool ListDirectory(int port_num, uint32_t inode_num) {
 }
 
 // Initialize the EXT2 driver
-bool Initialize(int port_num) {
+static bool InitializeLocked(int port_num) {
     // Check if the given port is valid
     // prInfo("ext2", "Initializing EXT2 driver for port %d", port_num);
     
@@ -625,7 +767,7 @@ bool Initialize(int port_num) {
     
     // Try standard initialization from sector 2
     // prInfo("ext2", "Reading superblock at sector %u, count: 2", 2);
-    bool result = ReadSuperblock(port_num, 2);
+    bool result = ReadSuperblockLocked(port_num, 2);
 
     // If standard initialization fails, try other offsets
     if (!result) {
@@ -644,7 +786,7 @@ bool Initialize(int port_num) {
         
         for (size_t i = 0; i < sizeof(alt_offsets) / sizeof(alt_offsets[0]); i++) {
             prInfo("ext2", "Trying alternate superblock at sector %u", alt_offsets[i]);
-            result = ReadSuperblock(port_num, alt_offsets[i]);
+            result = ReadSuperblockLocked(port_num, alt_offsets[i]);
             if (result) {
                 prInfo("ext2", "Found valid superblock at sector %u", alt_offsets[i]);
                 break;
@@ -659,11 +801,12 @@ bool Initialize(int port_num) {
     }
     
     // Read block group descriptors
-    result = ReadBlockGroupDescriptors(port_num);
+    result = ReadBlockGroupDescriptorsLocked(port_num);
     if (!result) {
         prErr("ext2", "Failed to read block group descriptors");
         return false;
     }
+    DcacheRevalidate(port_num);
     
     // Try to read the root inode to validate our configuration
     ext2_inode_t* root_inode = ReadInode(port_num, EXT2_ROOT_INO);
@@ -688,7 +831,7 @@ bool Initialize(int port_num) {
     free(root_inode);
     
     // List the root directory to test the driver
-    result = ListDirectory(port_num, EXT2_ROOT_INO);
+    result = ListDirectoryLocked(port_num, EXT2_ROOT_INO);
     if (!result) {
         prErr("ext2", "Failed to list root directory");
     }
@@ -697,8 +840,8 @@ bool Initialize(int port_num) {
 }
 
 // Read root directory
-bool ReadRootDirectory(int port_num) {
-    return ListDirectory(port_num, EXT2_ROOT_INO);
+static bool ReadRootDirectoryLocked(int port_num) {
+    return ListDirectoryLocked(port_num, EXT2_ROOT_INO);
 }
 
 // Get a human-readable file type string
@@ -716,7 +859,7 @@ char* GetFileType(uint8_t type) {
 }
 
 // Find the inode number of a directory by its path
-uint32_t FindDirectoryInode(int port_num, const char* path) {
+static uint32_t FindDirectoryInodeLocked(int port_num, const char* path) {
     // Start at the root directory inode
     uint32_t current_inode = EXT2_ROOT_INO;
     
@@ -736,11 +879,12 @@ uint32_t FindDirectoryInode(int port_num, const char* path) {
     }
     
     // Process each path component
-    char* next_component = strtok(current_path, "/");
+    char* saveptr = nullptr;
+    char* next_component = strtok_r(current_path, "/", &saveptr);
     while (next_component) {
         // Special case: ignore "." (current directory)
         if (strcmp(next_component, ".") == 0) {
-            next_component = strtok(NULL, "/");
+            next_component = strtok_r(NULL, "/", &saveptr);
             continue;
         }
         
@@ -749,6 +893,14 @@ uint32_t FindDirectoryInode(int port_num, const char* path) {
             prErr("ext2", "'..' navigation not implemented yet");
             return 0;
         }
+
+        uint32_t component_len = strlen(next_component);
+        uint32_t cached = DcacheLookup(port_num, current_inode, next_component, component_len);
+        if (cached) {
+            current_inode = cached;
+            next_component = strtok_r(NULL, "/", &saveptr);
+            continue;
+        }
         
         // Read the current directory inode
         ext2_inode_t* inode = ReadInode(port_num, current_inode);
@@ -815,22 +967,23 @@ uint32_t FindDirectoryInode(int port_num, const char* path) {
             prErr("ext2", "Directory entry '%s' not found", next_component);
             return 0;
         }
+        DcacheInsert(port_num, current_inode, next_component, component_len, next_inode);
         
         // Update current inode and move to next component
         current_inode = next_inode;
-        next_component = strtok(NULL, "/");
+        next_component = strtok_r(NULL, "/", &saveptr);
     }
     
     return current_inode;
 }
 
 // Check if a directory exists and get its inode if it does
-bool GetDirectoryInode(int port_num, const char* path, uint32_t* out_inode) {
+static bool GetDirectoryInodeLocked(int port_num, const char* path, uint32_t* out_inode) {
     if (!path || !out_inode) {
         return false;
     }
     
-    uint32_t inode = FindDirectoryInode(port_num, path);
+    uint32_t inode = FindDirectoryInodeLocked(port_num, path);
     if (inode == 0) {
         return false;
     }
@@ -854,7 +1007,7 @@ bool GetDirectoryInode(int port_num, const char* path, uint32_t* out_inode) {
 }
 
 // Find the inode number of a file by its path
-uint32_t FindFileInode(int port_num, const char* path) {
+static uint32_t FindFileInodeLocked(int port_num, const char* path) {
     if (!path || !*path) {
         return 0;
     }
@@ -889,13 +1042,18 @@ uint32_t FindFileInode(int port_num, const char* path) {
         // Root directory
         dir_inode = EXT2_ROOT_INO;
     } else {
-        dir_inode = FindDirectoryInode(port_num, dir_path);
+        dir_inode = FindDirectoryInodeLocked(port_num, dir_path);
     }
     
     if (dir_inode == 0) {
         prErr("ext2", "Parent directory '%s' not found", dir_path);
         return 0;
     }
+
+    uint32_t cached = DcacheLookup(port_num, dir_inode, filename, strlen(filename));
+    if (cached) {
+        return cached;
+    }
     
     // Read the directory inode
     ext2_inode_t* inode = ReadInode(port_num, dir_inode);
@@ -956,13 +1114,15 @@ uint32_t FindFileInode(int port_num, const char* path) {
     
     if (file_inode == 0) {
         prErr("ext2", "File '%s' not found", filename);
+    } else {
+        DcacheInsert(port_num, dir_inode, filename, strlen(filename), file_inode);
     }
     
     return file_inode;
 }
 
 // Read the contents of a file
-bool ReadFileContents(int port_num, uint32_t inode_num, char* buffer, uint32_t buffer_size, uint32_t* bytes_read) {
+static bool ReadFileContentsLocked(int port_num, uint32_t inode_num, char* buffer, uint32_t buffer_size, uint32_t* bytes_read) {
     if (!buffer || buffer_size == 0 || !bytes_read) {
         return false;
     }
@@ -1045,5 +1205,155 @@ bool ReadFileContents(int port_num, uint32_t inode_num, char* buffer, uint32_t b
     return true;
 }
 
+// The direct blocks are all submitted before any is waited on, so the
+// disk has them queued at once. The block numbers and geometry are
+// copied out under mountLock first and the reads go without it, a mount
+// doesn't wait on a task's I/O.
+Async::Task<bool> ReadFileContentsAsync(int port_num, uint32_t inode_num, char* buffer, uint32_t buffer_size,
+    uint32_t* bytes_read) {
+    if (!buffer || buffer_size == 0 || !bytes_read) co_return false;
+    *bytes_read = 0;
+
+    down_read(&mountLock);
+    ext2_inode_t* inode = ReadInode(port_num, inode_num);
+    if (!inode) {
+        up_read(&mountLock);
+        prErr("ext2", "Failed to read file inode %u", inode_num);
+        co_return false;
+    }
+    if (!(inode->mode & EXT2_S_IFREG)) {
+        up_read(&mountLock);
+        prErr("ext2", "Inode %u is not a regular file", inode_num);
+        free(inode);
+        co_return false;
+    }
+
+    uint32_t bytes_per_block = block_size;
+    uint32_t sectors = sectors_per_block;
+    uint32_t size_to_read = (inode->size < buffer_size) ? inode->size : buffer_size;
+    uint32_t blocks[12];
+    uint32_t count = 0;
+    // Stops at the first hole like ReadInodeData does, an inode without
+    // blocks has nothing to read
+    while (inode->blocks && count < 12 && count * bytes_per_block < size_to_read && inode->block[count]) {
+        blocks[count] = inode->block[count];
+        count++;
+    }
+    if (count * bytes_per_block < size_to_read && count == 12 && inode->block[12] != 0) {
+        prErr("ext2", "Indirect blocks not implemented yet");
+    }
+    free(inode);
+    up_read(&mountLock);
+
+    if (size_to_read == 0) co_return true;
+    if (count == 0) {
+        prErr("ext2", "Failed to read block 0 of file inode %u", inode_num);
+        co_return false;
+    }
+
+    void* block_data[12] = {};
+    Async::Task<int> reads[12];
+    int results[12];
+    for (uint32_t i = 0; i < count; i++) {
+        block_data[i] = malloc(bytes_per_block);
+        results[i] = 4096;
+        if (block_data[i]) reads[i] = ahci_read_sectors_async(port_num, BlockToSector(blocks[i]), sectors, block_data[i]);
+    }
+    co_await Async::WhenAll(reads, count, results);
+
+    // In order up to the first block that failed, like the blocking read
+    uint32_t bytes_read_so_far = 0;
+    for (uint32_t i = 0; i < count && bytes_read_so_far < size_to_read; i++) {
+        if (!block_data[i] || results[i] != 0) {
+            prErr("ext2", "Failed to read block %u of file inode %u", i, inode_num);
+            break;
+        }
+        uint32_t remaining = size_to_read - bytes_read_so_far;
+        uint32_t block_bytes_to_read = (remaining < bytes_per_block) ? remaining : bytes_per_block;
+        memcpy(buffer + bytes_read_so_far, block_data[i], block_bytes_to_read);
+        bytes_read_so_far += block_bytes_to_read;
+    }
+    for (uint32_t i = 0; i < count; i++) if (block_data[i]) free(block_data[i]);
+
+    *bytes_read = bytes_read_so_far;
+    co_return bytes_read_so_far > 0;
+}
+
+// Entry points. Mounting replaces the superblock and group descriptors
+// so it takes mountLock for writing; lookups and reads only use them and
+// run side by side. mountLock sleeps, so disk reads under it sleep in the
+// AHCI waits like any other. A lookup the dcache can answer takes no lock.
+bool Initialize(int port_num) {
+    down_write(&mountLock);
+    bool result = InitializeLocked(port_num);
+    up_write(&mountLock);
+    return result;
+}
+
+bool ReadSuperblock(int port_num, uint32_t sector_offset) {
+    down_write(&mountLock);
+    bool result = ReadSuperblockLocked(port_num, sector_offset);
+    up_write(&mountLock);
+    return result;
+}
+
+bool ReadBlockGroupDescriptors(int port_num) {
+    down_write(&mountLock);
+    bool result = ReadBlockGroupDescriptorsLocked(port_num);
+    up_write(&mountLock);
+    return result;
+}
+
+bool ReadRootDirectory(int port_num) {
+    down_read(&mountLock);
+    bool result = ReadRootDirectoryLocked(port_num);
+    up_read(&mountLock);
+    return result;
+}
+
+bool ListDirectory(int port_num, uint32_t inode_num) {
+    down_read(&mountLock);
+    bool result = ListDirectoryLocked(port_num, inode_num);
+    up_read(&mountLock);
+    return result;
+}
+
+uint32_t FindDirectoryInode(int port_num, const char* path) {
+    uint32_t cached;
+    if (path && DcacheWalk(port_num, path, &cached)) return cached;
+    down_read(&mountLock);
+    uint32_t inode = FindDirectoryInodeLocked(port_num, path);
+    up_read(&mountLock);
+    return inode;
+}
+
+bool GetDirectoryInode(int port_num, const char* path, uint32_t* out_inode) {
+    down_read(&mountLock);
+    bool result = GetDirectoryInodeLocked(port_num, path, out_inode);
+    up_read(&mountLock);
+    return result;
+}
+
+uint32_t FindFileInode(int port_num, const char* path) {
+    uint32_t cached;
+    if (path && strchr(path, '/') && path[strlen(path) - 1] != '/' && DcacheWalk(port_num, path, &cached)) return cached;
+    down_read(&mountLock);
+    uint32_t inode = FindFileInodeLocked(port_num, path);
+    up_read(&mountLock);
+    return inode;
+}
+
+bool ReadFileContents(int port_num, uint32_t inode_num, char* buffer, uint32_t buffer_size, uint32_t* bytes_read) {
+    // A thread that can sleep waits for the task; an executor would be
+    // waiting on itself
+    if (Async::IsInitialized() && Scheduler::CanBlock() && !Async::OnExecutor()) {
+        return Async::RunSync(ReadFileContentsAsync(port_num, inode_num, buffer, buffer_size, bytes_read));
+    }
+    down_read(&mountLock);
+    bool result = ReadFileContentsLocked(port_num, inode_num, buffer, buffer_size, bytes_read);
+    up_read(&mountLock);
+    return result;
+}
+
 } // namespace EXT2
 } // namespace FS 
\ No newline at end of file
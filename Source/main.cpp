@@ -21,8 +21,23 @@
 #include <Interrupts/Interrupts.hpp>
 #include <Interrupts/PageFault.hpp>
 #include <Interrupts/Syscall.hpp>
+#include <Interrupts/SyscallTrace.hpp>
 #include <Memory/Mem_.hpp>
 #include <CPU/CPUID.h>
+#include <CPU/FPU.h>
+#include <CPU/SMP.hpp>
+#include <CPU/Features.hpp>
+#include <CPU/PerCPU.hpp>
+#include <Sched/Scheduler.hpp>
+#include <Sched/Softirq.hpp>
+#include <Sched/Workqueue.hpp>
+#include <Sched/Async.hpp>
+#include <Sched/Idle.hpp>
+#include <Sync/LockStat.hpp>
+#include <Sync/RCU.hpp>
+#include <Sync/QueueTest.hpp>
+#include <Sync/WaitTest.hpp>
+#include <Sync/Futex.hpp>
 #include <Inferno/Log.h>
 #include <Drivers/TTY/TTY.h>
 #include <Memory/Memory.hpp>
@@ -31,7 +46,14 @@
 #include <Memory/DirectVirtTest.hpp>
 #include <Memory/VMAliasTest.hpp>
 #include <Memory/SimpleVMAliasTest.hpp>
+#include <Memory/MemBench.hpp>
+#include <Inferno/StringBench.hpp>
 #include <Interrupts/HPET.hpp>
+#include <Interrupts/APICTimer.hpp>
+#include <Interrupts/Clock.hpp>
+#include <Interrupts/HRTimer.hpp>
+#include <Interrupts/IOAPIC.hpp>
+#include <Interrupts/TimePage.hpp>
 
 // Drivers
 #include <Drivers/ACPI/acpi.h>
@@ -48,6 +70,7 @@ bool DirectCreateMapping(uint64_t cr3, uint64_t virtAddr, uint64_t physAddr);
 
 // Forward declaration for SATA driver test function
 extern "C" void test_sata_driver();
+bool test_ahci_async();
 
 extern unsigned long long _InfernoEnd;
 extern unsigned long long _InfernoStart;
@@ -58,6 +81,9 @@ extern "C" {
 }
 
 __attribute__((sysv_abi)) void Inferno(BOB* bob) {
+	// GS has to be usable before anything takes a lock
+	PerCPU::EarlyInitialize();
+
 	// init fb
 	initFB(bob->framebuffer);
 	// test color red
@@ -68,6 +94,8 @@ __attribute__((sysv_abi)) void Inferno(BOB* bob) {
 
 	// CPU
 	CPU::CPUDetect();
+	Mem::Initialize();
+	FPU::Initialize();
 
 	// Memory initialization
 	uint64_t kernelStart = (uint64_t)&_InfernoStart;
@@ -116,26 +144,26 @@ current_position:
 	// Initialize heap at 4MB with 1MB size initially
 	Heap::Initialize(0x4000000, 0x100000);
 
+	// Before the IDT, the dispatcher counts into this CPU's area
+	PerCPU::Initialize();
+
 	// Create IDT
 	Interrupts::CreateIDT();
 	// Load IDT
 	Interrupts::LoadIDT();
 	prInfo("idt", "initialized IDT");
 
-	// Create a test ISR
-	Interrupts::CreateISR(0x80, (void*)SyscallHandler);
-	Interrupts::CreateISR(0x0E, (void*)PageFault);
-	Interrupts::CreateISR(0x08, (void*)DoublePageFault);
+	// Exception and syscall handlers
+	Interrupts::RegisterHandler(INTERRUPT_SYSCALL_VECTOR, SyscallHandler, nullptr);
+	Interrupts::SetGatePrivilege(INTERRUPT_SYSCALL_VECTOR, 3);
+	Interrupts::RegisterHandler(0x0E, PageFault, nullptr);
+	Interrupts::RegisterHandler(0x08, DoublePageFault, nullptr);
 
 	// Replace the existing APIC initialization with:
     if (APIC::Capable()) {
         if (APIC::Initialize()) {
             prInfo("kernel", "APIC initialized successfully");
             
-            // Configure timer (optional)
-            APIC::ConfigureTimer(0x3);    // Divide by 16
-            APIC::SetTimerCount(10000000);// Set initial count
-            
             uint32_t version = APIC::GetVersion();
             prInfo("apic", "APIC Version: 0x%x", version);
         } else {
@@ -151,6 +179,13 @@ current_position:
 		} else {
 			prErr("kernel", "HPET init failed...");
 		}
+
+		// Everything stays masked until a driver routes its line
+		if (APIC::Capable() && APIC::IsEnabled()) IOAPIC::Initialize();
+
+		// Both calibrate against the HPET, fall back to CPUID when it's missing
+		if (Clock::Initialize()) TimePage::Initialize();
+		if (APIC::Capable() && APICTimer::Initialize()) HRTimer::Initialize();
         
         // Initialize PCI devices first - this will automatically detect AHCI controllers
         PCI::init();
@@ -162,19 +197,47 @@ current_position:
 
 	// Usermode
 	#if EnableGDT == true
-		GDT::Table GDT = {
+		// Static, the CPU keeps using the table after this function returns
+		static GDT::Table GDT = {
 			{ 0, 0, 0, 0x00, 0x00, 0 },
 			{ 0, 0, 0, 0x9a, 0xa0, 0 },
 			{ 0, 0, 0, 0x92, 0xa0, 0 },
-			{ 0, 0, 0, 0xfa, 0xa0, 0 },
 			{ 0, 0, 0, 0xf2, 0xa0, 0 },
+			{ 0, 0, 0, 0xfa, 0xa0, 0 },
 		};
 		GDT::Descriptor descriptor;
 		descriptor.size = sizeof(GDT) - 1;
 		descriptor.offset = (unsigned long long)&GDT;
+		// Reloading GS clears its base, put it back before an IRQ looks
+		asm volatile("cli");
 		LoadGDT(&descriptor);
+		PerCPU::Load(0);
+		asm volatile("sti");
 		prInfo("kernel", "initalized GDT");
+
+		// STAR depends on the selector layout above
+		Syscall::Initialize();
 	#endif
+
+	// From here on this is the init thread. APs join as they come up.
+	Scheduler::Initialize();
+
+	// Before the APs start: until then synchronize_rcu has nobody to wait for
+	Rcu::Initialize();
+
+	// Idle CPUs sleep in MWAIT where they can, the APs go by what the boot CPU finds
+	Idle::Initialize();
+
+	// APs load the GDT above and share the IDT and page tables
+	if (APIC::Capable() && APIC::IsEnabled()) SMP::Initialize();
+
+	// Per-CPU threads for deferred work, now that every CPU takes threads
+	Softirq::Initialize();
+	Workqueue::Initialize();
+	Async::Initialize();
+
+	// The shell sleeps for input instead of polling
+	if (APIC::Capable() && APIC::IsEnabled()) EnableSerialInterrupts();
 }
 
 // Create a much simpler test with an isolated physical page
@@ -369,6 +432,148 @@ void processCommand(const char* command) {
     } else if (strcmp(command, "sata") == 0 || strcmp(command, "ahci") == 0) {
         kprintf("\nRunning SATA driver test...\n");
         test_sata_driver();
+    } else if (strcmp(command, "membench") == 0) {
+        kprintf("\nRunning string op benchmarks...\n");
+        MemBench::Run();
+    } else if (strcmp(command, "strbench") == 0) {
+        kprintf("\nRunning string routine fuzzing and benchmarks...\n");
+        StringBench::Run();
+    } else if (strcmp(command, "irqstat") == 0) {
+        kprintf("\nInterrupt counts since boot:\n");
+        Interrupts::PrintStats();
+    } else if (strcmp(command, "ioapic") == 0) {
+        kprintf("\n%d I/O APIC(s), routed lines:\n", IOAPIC::GetControllerCount());
+        IOAPIC::PrintRoutes();
+    } else if (strcmp(command, "pciirq") == 0) {
+        kprintf("\nPCI interrupt capabilities:\n");
+        PCI::print_irq_capabilities();
+    } else if (strcmp(command, "ipi") == 0) {
+        kprintf("\nSending self IPIs...\n");
+        if (APIC::SelfTest()) kprintf("IPI test passed\n");
+        else kprintf("IPI test FAILED\n");
+    } else if (strcmp(command, "syscall") == 0) {
+        kprintf("\nCalling into the kernel from ring 3...\n");
+        if (Syscall::SelfTest()) kprintf("Syscall test passed\n");
+        else kprintf("Syscall test FAILED\n");
+    } else if (strcmp(command, "timepage") == 0) {
+        kprintf("\nReading the clocks through the user time page...\n");
+        if (TimePage::SelfTest()) kprintf("Time page test passed\n");
+        else kprintf("Time page test FAILED\n");
+    } else if (strncmp(command, "strace", 6) == 0 && (command[6] == '\0' || command[6] == ' ')) {
+        char option[16] = {0};
+        getCommandPart(command, 1, option, sizeof(option));
+        if (strcmp(option, "on") == 0) {
+            SyscallTrace::SetMode(SYSCALL_TRACE_STATS | SYSCALL_TRACE_LOG);
+            kprintf("\nTracing syscall stats and calls\n");
+        } else if (strcmp(option, "stats") == 0) {
+            SyscallTrace::SetMode(SYSCALL_TRACE_STATS);
+            kprintf("\nTracing syscall stats\n");
+        } else if (strcmp(option, "off") == 0) {
+            SyscallTrace::SetMode(0);
+            kprintf("\nSyscall tracing off\n");
+        } else if (strcmp(option, "reset") == 0) {
+            SyscallTrace::Reset();
+            kprintf("\nSyscall trace cleared\n");
+        } else {
+            kprintf("\nSyscall latency (tracing %s):\n", SyscallTrace::GetMode() ? "on" : "off, 'strace on|stats|off|reset'");
+            SyscallTrace::PrintStats();
+            kprintf("Recent calls:\n");
+            SyscallTrace::PrintLog(16);
+        }
+    } else if (strcmp(command, "cpus") == 0) {
+        kprintf("\n%d of %d CPUs online:\n", SMP::GetOnlineCount(), SMP::GetCPUCount());
+        SMP::PrintCPUs();
+        kprintf("\n");
+        CPU::PrintTopology();
+        CPU::PrintFeatures();
+    } else if (strcmp(command, "threads") == 0) {
+        kprintf("\n");
+        Scheduler::PrintThreads();
+        kprintf("\n");
+        Scheduler::PrintRunQueues();
+    } else if (strcmp(command, "sched") == 0) {
+        kprintf("\nTesting the scheduler...\n");
+        if (Scheduler::SelfTest()) kprintf("Scheduler test passed\n");
+        else kprintf("Scheduler test FAILED\n");
+    } else if (strcmp(command, "softirq") == 0) {
+        kprintf("\nTesting softirqs, tasklets and workqueues...\n");
+        bool passed = Softirq::SelfTest();
+        if (!Workqueue::SelfTest()) passed = false;
+        if (passed) kprintf("Deferred work test passed\n");
+        else kprintf("Deferred work test FAILED\n");
+        kprintf("\n");
+        Softirq::PrintStats();
+        kprintf("\n");
+        Workqueue::PrintStats();
+    } else if (strcmp(command, "idle") == 0) {
+        kprintf("\nWaking idle CPUs...\n");
+        if (Idle::SelfTest()) kprintf("Idle test passed\n");
+        else kprintf("Idle test FAILED\n");
+        kprintf("\n");
+        Idle::PrintStats();
+    } else if (strcmp(command, "rcu") == 0) {
+        kprintf("\nTesting RCU grace periods...\n");
+        if (Rcu::SelfTest()) kprintf("RCU test passed\n");
+        else kprintf("RCU test FAILED\n");
+        kprintf("\n");
+        Rcu::PrintStats();
+    } else if (strcmp(command, "locks") == 0) {
+        kprintf("\nTesting ticket, MCS and reader-writer spinlocks...\n");
+        if (LockStat::SelfTest()) kprintf("Lock test passed\n");
+        else kprintf("Lock test FAILED\n");
+    } else if (strcmp(command, "queues") == 0) {
+        kprintf("\nTesting lock-free SPSC and MPSC queues...\n");
+        if (QueueTest::SelfTest()) kprintf("Queue test passed\n");
+        else kprintf("Queue test FAILED\n");
+        kprintf("\n");
+        QueueTest::Benchmark();
+    } else if (strcmp(command, "waits") == 0) {
+        kprintf("\nTesting wait queues, mutexes, semaphores, completions, condvars and futexes...\n");
+        if (WaitTest::SelfTest()) kprintf("Wait test passed\n");
+        else kprintf("Wait test FAILED\n");
+        kprintf("\n");
+        Futex::PrintStats();
+    } else if (strcmp(command, "async") == 0) {
+        kprintf("\nTesting coroutine tasks and asynchronous disk reads...\n");
+        bool passed = Async::SelfTest();
+        if (!test_ahci_async()) passed = false;
+        if (passed) kprintf("Async test passed\n");
+        else kprintf("Async test FAILED\n");
+        kprintf("\n");
+        Async::PrintStats();
+    } else if (strncmp(command, "lockstat", 8) == 0 && (command[8] == '\0' || command[8] == ' ')) {
+        char option[16] = {0};
+        getCommandPart(command, 1, option, sizeof(option));
+        if (strcmp(option, "on") == 0) {
+            LockStat::SetEnabled(true);
+            kprintf("\nCounting lock contention\n");
+        } else if (strcmp(option, "off") == 0) {
+            LockStat::SetEnabled(false);
+            kprintf("\nLock statistics off\n");
+        } else if (strcmp(option, "reset") == 0) {
+            LockStat::Reset();
+            kprintf("\nLock statistics cleared\n");
+        } else {
+            kprintf("\nLock contention by class%s:\n", LockStat::IsEnabled() ? "" : " ('lockstat on|off|reset')");
+            LockStat::Print();
+        }
+    } else if (strcmp(command, "percpu") == 0) {
+        kprintf("\nTesting per-CPU areas...\n");
+        if (PerCPU::SelfTest()) kprintf("Per-CPU test passed\n");
+        else kprintf("Per-CPU test FAILED\n");
+    } else if (strcmp(command, "apictimer") == 0) {
+        kprintf("\nTesting APIC timer against the HPET...\n");
+        if (APICTimer::SelfTest()) kprintf("APIC timer test passed\n");
+        else kprintf("APIC timer test FAILED\n");
+        HRTimer::Reprogram();
+    } else if (strcmp(command, "timers") == 0) {
+        kprintf("\nTesting timer wheel and precise timers...\n");
+        if (HRTimer::SelfTest()) kprintf("Timer test passed\n");
+        else kprintf("Timer test FAILED\n");
+    } else if (strcmp(command, "clock") == 0) {
+        kprintf("\nTesting the %s clocksource...\n", Clock::GetSourceName());
+        if (Clock::SelfTest()) kprintf("Clock test passed\n");
+        else kprintf("Clock test FAILED\n");
     } else if (strcmp(command, "fs") == 0) {
         kprintf("\nDetecting filesystem on SATA device...\n");
         